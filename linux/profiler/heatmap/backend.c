@@ -6,6 +6,9 @@
 static const struct profiler_backend *all_backends[] = {
     &pebs_backend,
     &ibs_backend,
+    &fault_backend,
+    &scan_backend,
+    &synth_backend,
 };
 
 const char *detect_cpu_vendor(void) {
@@ -44,6 +47,21 @@ const char *detect_cpu_vendor(void) {
     return vendor[0] ? vendor : "unknown";
 }
 
+/*
+ * Look a backend up by name without probing the PMU, for replaying a
+ * recording on a machine that may not have the hardware it was taken on.
+ */
+const struct profiler_backend *profiler_find_backend(const char *name) {
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(all_backends); i++) {
+        if (strcasecmp(all_backends[i]->name, name) == 0) {
+            return all_backends[i];
+        }
+    }
+    return NULL;
+}
+
 const struct profiler_backend *profiler_select_backend(const char *name,
                                                        char *reason,
                                                        size_t reason_len) {
@@ -66,7 +84,7 @@ const struct profiler_backend *profiler_select_backend(const char *name,
         }
 
         snprintf(reason, reason_len,
-                 "unknown backend '%s', expected auto|pebs|ibs", name);
+                 "unknown backend '%s', expected auto|pebs|ibs|faults|scan|synth", name);
         return NULL;
     }
 
@@ -81,7 +99,8 @@ const struct profiler_backend *profiler_select_backend(const char *name,
     }
 
     for (i = 0; i < ARRAY_SIZE(all_backends); i++) {
-        if (all_backends[i]->supported(backend_reason, sizeof(backend_reason))) {
+        if (!all_backends[i]->explicit_only &&
+            all_backends[i]->supported(backend_reason, sizeof(backend_reason))) {
             return all_backends[i];
         }
     }
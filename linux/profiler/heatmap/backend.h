@@ -6,5 +6,8 @@
 
 extern const struct profiler_backend pebs_backend;
 extern const struct profiler_backend ibs_backend;
+extern const struct profiler_backend fault_backend;
+extern const struct profiler_backend scan_backend;
+extern const struct profiler_backend synth_backend;
 
 #endif
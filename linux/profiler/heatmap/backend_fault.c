@@ -0,0 +1,93 @@
+#include "backend.h"
+
+
+static uint64_t fault_event_config(enum fault_type type) {
+    switch (type) {
+    case FAULT_MINOR:
+        return PERF_COUNT_SW_PAGE_FAULTS_MIN;
+    case FAULT_MAJOR:
+        return PERF_COUNT_SW_PAGE_FAULTS_MAJ;
+    case FAULT_ALL:
+    default:
+        return PERF_COUNT_SW_PAGE_FAULTS;
+    }
+}
+
+/*
+ * Software events need no PMU, but perf_event_paranoid or a seccomp
+ * profile can still forbid them, so try to open one on ourselves.
+ */
+static bool fault_supported(char *reason, size_t reason_len) {
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    fd = perf_event_open_syscall(&attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        snprintf(reason, reason_len,
+                 "software page-fault event not available: %s",
+                 strerror(errno));
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static int fault_prepare_attr(const struct profiler_options *options,
+                              struct perf_event_attr *attr,
+                              char *reason,
+                              size_t reason_len) {
+    (void)reason;
+    (void)reason_len;
+
+    memset(attr, 0, sizeof(*attr));
+    /*
+     * A software event counted by the kernel's fault handler, so it works
+     * on hosts and containers without a hardware PMU. The fields mean the
+     * same as for PEBS, except:
+     * - precise_ip stays 0: the fault is reported at the faulting
+     *   instruction anyway, and software events reject a precise request.
+     * - PERF_SAMPLE_ADDR carries the faulting address. The page is not
+     *   mapped yet when the event fires, so no PHYS_ADDR is requested;
+     *   physical keys come from the pagemap lookup after the fault.
+     * - there is no WEIGHT or DATA_SRC, so no tiers or latencies.
+     */
+    attr->size = sizeof(*attr);
+    attr->type = PERF_TYPE_SOFTWARE;
+    attr->config = fault_event_config(options->fault_type);
+    attr->disabled = 1;
+    attr->inherit = 0;
+    attr->exclude_guest = 1;
+    attr->exclude_hv = 1;
+    attr->exclude_kernel = options->user_only ? 1 : 0;
+    attr->exclude_callchain_kernel = options->user_only ? 1 : 0;
+    attr->sample_id_all = 1;
+    profiler_set_wakeup(attr, options);
+    attr->sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                        PERF_SAMPLE_ADDR | PERF_SAMPLE_CPU;
+    profiler_set_period(attr, options);
+    return 0;
+}
+
+static uint64_t fault_page_key(const struct sample_record *sample,
+                               size_t page_shift,
+                               enum address_kind *kind) {
+    if (!sample->has_addr) {
+        return UINT64_MAX;
+    }
+    *kind = ADDR_KIND_VIRTUAL;
+    return sample->addr >> page_shift;
+}
+
+const struct profiler_backend fault_backend = {
+    .name = "faults",
+    .pmu_name = "software",
+    .supported = fault_supported,
+    .prepare_attr = fault_prepare_attr,
+    .page_key = fault_page_key,
+};
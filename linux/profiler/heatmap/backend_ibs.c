@@ -47,12 +47,11 @@ static int ibs_prepare_attr(const struct profiler_options *options,
      * - exclude_guest/exclude_hv ignore guest/hypervisor execution.
      * - exclude_kernel is enabled only for --user-only.
      * - precise_ip=2 asks perf for a more precise instruction pointer.
-     * - sample_id_all and wakeup_events help produce uniform records and make
-     *   ring draining responsive.
+     * - sample_id_all produces uniform records; the wakeup policy comes from
+     *   profiler_set_wakeup().
      */
     attr->size = sizeof(*attr);
     attr->type = pmu_type;
-    attr->sample_period = options->sample_period;
     attr->disabled = 1;
     attr->inherit = 0;
     attr->exclude_guest = 1;
@@ -61,7 +60,7 @@ static int ibs_prepare_attr(const struct profiler_options *options,
     attr->exclude_callchain_kernel = options->user_only ? 1 : 0;
     attr->precise_ip = 2;
     attr->sample_id_all = 1;
-    attr->wakeup_events = 1;
+    profiler_set_wakeup(attr, options);
     /*
      * Request the same logical sample fields as PEBS so the rest of the
      * profiler can treat IBS and PEBS samples with a shared parsing/reporting
@@ -73,6 +72,7 @@ static int ibs_prepare_attr(const struct profiler_options *options,
 #ifdef PERF_SAMPLE_PHYS_ADDR
     attr->sample_type |= PERF_SAMPLE_PHYS_ADDR;
 #endif
+    profiler_set_period(attr, options);
 
     /*
      * IBS often works even if a friendly alias is not exposed or not required
@@ -114,4 +114,5 @@ const struct profiler_backend ibs_backend = {
     .supported = ibs_supported,
     .prepare_attr = ibs_prepare_attr,
     .page_key = ibs_page_key,
+    .mem_info = true,
 };
@@ -44,6 +44,8 @@ static int pebs_prepare_attr(const struct profiler_options *options,
      * Key fields used here:
      * - type/config/config1/config2: identify the PEBS-capable PMU event.
      * - sample_period: overflow period; each overflow can generate one sample.
+     *   Set by profiler_set_period(), which also asks for PERF_SAMPLE_PERIOD
+     *   when --adaptive-period may change it at run time.
      * - disabled=1: create the event in disabled state and enable it later in a
      *   controlled way after mmap/poll setup is complete.
      * - inherit=0: do not auto-clone this event to future child tasks; this
@@ -53,12 +55,11 @@ static int pebs_prepare_attr(const struct profiler_options *options,
      * - precise_ip=2: request a more precise PEBS sample IP/address.
      * - sample_id_all=1: keep sample-identification fields consistently
      *   available on all record types emitted by perf.
-     * - wakeup_events=1: ask perf to wake the consumer after every sample so
-     *   the ring can be drained promptly.
+     * - wakeup_events/watermark: wake the consumer after every sample, or
+     *   once --wakeup-bytes are pending (see profiler_set_wakeup()).
      */
     attr->size = sizeof(*attr);
     attr->type = pmu_type;
-    attr->sample_period = options->sample_period;
     attr->disabled = 1;
     attr->inherit = 0;
     attr->exclude_guest = 1;
@@ -67,7 +68,7 @@ static int pebs_prepare_attr(const struct profiler_options *options,
     attr->exclude_callchain_kernel = options->user_only ? 1 : 0;
     attr->precise_ip = 2;
     attr->sample_id_all = 1;
-    attr->wakeup_events = 1;
+    profiler_set_wakeup(attr, options);
     /*
      * sample_type controls which payload fields perf writes into each SAMPLE
      * record. The heatmap later consumes these fields as follows:
@@ -75,6 +76,7 @@ static int pebs_prepare_attr(const struct profiler_options *options,
      * - ADDR: sampled data virtual address when the PMU provides it.
      * - CPU: source CPU in system-wide mode.
      * - WEIGHT/DATA_SRC: optional PMU metadata used for richer reporting.
+     * - PERIOD (adaptive mode only): the period in effect, to normalize heat.
      * - PHYS_ADDR: best case, the hardware/kernel directly exposes a physical
      *   address so no pagemap translation is required.
      */
@@ -84,6 +86,7 @@ static int pebs_prepare_attr(const struct profiler_options *options,
 #ifdef PERF_SAMPLE_PHYS_ADDR
     attr->sample_type |= PERF_SAMPLE_PHYS_ADDR;
 #endif
+    profiler_set_period(attr, options);
 
     /*
      * Prefer the symbolic mem-loads event when the platform exposes it in
@@ -145,4 +148,5 @@ const struct profiler_backend pebs_backend = {
     .supported = pebs_supported,
     .prepare_attr = pebs_prepare_attr,
     .page_key = pebs_page_key,
+    .mem_info = true,
 };
@@ -0,0 +1,664 @@
+#include "backend.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+
+#define SCAN_IDLE_BITMAP "/sys/kernel/mm/page_idle/bitmap"
+
+/*
+ * The address space is scanned in aligned regions, each on its own
+ * schedule: 2M ones, or larger ones when the mappings would need more than
+ * SCAN_MAX_REGIONS of them, so that reserved-but-sparse address spaces of
+ * terabytes stay cheap to track. Adjacent due regions are read with pagemap
+ * preads of up to SCAN_BATCH_PAGES entries, and the idle bitmap in runs of
+ * up to SCAN_WORD_RUN words (SCAN_WORD_RUN * 64 page frames).
+ */
+#define SCAN_REGION_SHIFT 21
+#define SCAN_MAX_REGIONS 65536
+#define SCAN_BATCH_PAGES 8192
+#define SCAN_WORD_RUN 512
+/* A region that stays idle backs off to 2^SCAN_MAX_BACKOFF scan intervals. */
+#define SCAN_MAX_BACKOFF 5
+/* /proc/<pid>/maps is re-read every SCAN_MAPS_PASSES passes. */
+#define SCAN_MAPS_PASSES 16
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_PFN_MASK ((1ULL << 55) - 1)
+
+/*
+ * One scan region. `marked_ns` is when its pages were last marked idle (0
+ * before the first visit), `interval_ns` its current rescan interval.
+ */
+struct scan_region {
+    uint64_t start;
+    uint64_t end;
+    uint64_t marked_ns;
+    uint64_t due_ns;
+    uint64_t interval_ns;
+    uint32_t accessed;
+};
+
+/* A present page of the current batch. */
+struct scan_entry {
+    uint64_t pfn;
+    uint64_t vaddr;
+    uint32_t region;
+};
+
+struct scan_stats {
+    uint64_t pages;
+    uint64_t present;
+    uint64_t hidden;
+    uint64_t accessed;
+    uint64_t reads;
+    uint64_t mark_failures;
+    uint64_t untracked;
+    uint64_t deferred;
+};
+
+struct page_scanner {
+    const struct profiler_options *options;
+    const struct profiler_backend *backend;
+    struct heatmap *heatmap;
+    pid_t pid;
+    int pagemap_fd;
+    int idle_fd;
+    size_t page_shift;
+    uint64_t min_interval_ns;
+    uint64_t max_interval_ns;
+    struct scan_region *regions;
+    size_t nr_regions;
+    size_t cursor;
+    uint64_t pagemap[SCAN_BATCH_PAGES];
+    struct scan_entry entries[SCAN_BATCH_PAGES];
+    uint64_t words[SCAN_WORD_RUN];
+    uint64_t masks[SCAN_WORD_RUN];
+    struct scan_stats stats;
+    bool exited;
+};
+
+static uint64_t scan_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static bool scan_supported(char *reason, size_t reason_len) {
+    if (access(SCAN_IDLE_BITMAP, F_OK) != 0) {
+        snprintf(reason, reason_len,
+                 "%s is not available (CONFIG_IDLE_PAGE_TRACKING)",
+                 SCAN_IDLE_BITMAP);
+        return false;
+    }
+    return true;
+}
+
+static uint64_t scan_page_key(const struct sample_record *sample,
+                              size_t page_shift,
+                              enum address_kind *kind) {
+    if (!sample->has_addr) {
+        return UINT64_MAX;
+    }
+    *kind = ADDR_KIND_VIRTUAL;
+    return sample->addr >> page_shift;
+}
+
+/* Region whose start is `start` in a sorted region array, else NULL. */
+static const struct scan_region *scan_region_find(const struct scan_region *regions,
+                                                  size_t count,
+                                                  uint64_t start) {
+    size_t lo = 0;
+    size_t hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (regions[mid].start < start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < count && regions[lo].start == start ? &regions[lo] : NULL;
+}
+
+static int scan_region_append(struct scan_region **regions, size_t *count,
+                              size_t *capacity, uint64_t start, uint64_t end) {
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 1024;
+        struct scan_region *array = realloc(*regions, grown * sizeof(*array));
+
+        if (!array) {
+            return -ENOMEM;
+        }
+        *regions = array;
+        *capacity = grown;
+    }
+    memset(&(*regions)[*count], 0, sizeof(**regions));
+    (*regions)[*count].start = start;
+    (*regions)[*count].end = end;
+    (*count)++;
+    return 0;
+}
+
+/*
+ * Rebuild the region list from /proc/<pid>/maps: every accessible mapping,
+ * cut at region boundaries. Regions that survive keep their schedule, so a
+ * refresh does not make the whole address space due at once.
+ */
+static int scan_load_regions(struct page_scanner *scanner, uint64_t now_ns) {
+    char path[PATH_BUFFER_SIZE];
+    char line[PATH_BUFFER_SIZE + 128];
+    struct scan_region *mappings = NULL;
+    struct scan_region *regions = NULL;
+    size_t nr_mappings = 0;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint64_t mapped = 0;
+    unsigned shift = SCAN_REGION_SHIFT;
+    size_t i;
+    FILE *fp;
+    int ret = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", scanner->pid);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return -errno;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), fp)) {
+        unsigned long long start;
+        unsigned long long end;
+        char perms[8];
+
+        if (sscanf(line, "%llx-%llx %7s", &start, &end, perms) != 3 ||
+            strncmp(perms, "---", 3) == 0 || strstr(line, "[vsyscall]")) {
+            continue;
+        }
+        ret = scan_region_append(&mappings, &nr_mappings, &capacity, start,
+                                 end);
+        mapped += end - start;
+    }
+    fclose(fp);
+
+    while ((mapped >> shift) > SCAN_MAX_REGIONS) {
+        shift++;
+    }
+    capacity = 0;
+    for (i = 0; ret == 0 && i < nr_mappings; i++) {
+        uint64_t addr = mappings[i].start;
+
+        while (ret == 0 && addr < mappings[i].end) {
+            uint64_t next = ((addr >> shift) + 1) << shift;
+
+            if (next > mappings[i].end) {
+                next = mappings[i].end;
+            }
+            ret = scan_region_append(&regions, &count, &capacity, addr, next);
+            addr = next;
+        }
+    }
+    free(mappings);
+    if (ret != 0) {
+        free(regions);
+        return ret;
+    }
+
+    for (i = 0; i < count; i++) {
+        const struct scan_region *before =
+            scan_region_find(scanner->regions, scanner->nr_regions,
+                             regions[i].start);
+
+        if (before) {
+            regions[i].marked_ns = before->marked_ns;
+            regions[i].due_ns = before->due_ns;
+            regions[i].interval_ns = before->interval_ns;
+        } else {
+            regions[i].due_ns = now_ns;
+            regions[i].interval_ns = scanner->min_interval_ns;
+        }
+    }
+
+    free(scanner->regions);
+    scanner->regions = regions;
+    scanner->nr_regions = count;
+    if (scanner->cursor >= count) {
+        scanner->cursor = 0;
+    }
+    return 0;
+}
+
+static int compare_scan_entry_pfn(const void *lhs, const void *rhs) {
+    const struct scan_entry *a = lhs;
+    const struct scan_entry *b = rhs;
+
+    return a->pfn < b->pfn ? -1 : a->pfn > b->pfn;
+}
+
+/*
+ * An access seen by the scanner, as a sample of the page. Its period
+ * stretches with the time since the page was marked, so a region that
+ * backed off to a longer interval is not undercounted.
+ */
+static void scan_record_access(struct page_scanner *scanner,
+                               const struct scan_entry *entry,
+                               uint64_t now_ns) {
+    const struct scan_region *region = &scanner->regions[entry->region];
+    uint64_t intervals = (now_ns - region->marked_ns +
+                          scanner->min_interval_ns / 2) /
+                         scanner->min_interval_ns;
+    struct sample_record sample;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.addr = entry->vaddr;
+    sample.has_addr = true;
+    sample.phys_addr = entry->pfn << scanner->page_shift;
+    sample.has_phys_addr = true;
+    sample.time_ns = now_ns;
+    sample.period = scanner->options->sample_period *
+                    (intervals ? intervals : 1);
+    sample.pid = (uint32_t)scanner->pid;
+    sample.tid = (uint32_t)scanner->pid;
+    sample.cpu = UINT32_MAX;
+    heatmap_record(scanner->heatmap, scanner->options, scanner->backend,
+                   &sample);
+}
+
+/*
+ * Check and re-mark the idle bits of a batch of pages: entries are sorted
+ * by frame, each run of bitmap words is read once, and every page is marked
+ * idle again with one write of the run. Writing a 0 bit leaves that frame
+ * alone. The kernel ignores the mark on frames it cannot track (THP tails,
+ * pages off the LRU), whose bit then always reads clear, so the run is read
+ * back: a clear bit on a page of a region marked before is an access only
+ * if the new mark stuck.
+ */
+static void scan_idle_bits(struct page_scanner *scanner, size_t count,
+                           uint64_t now_ns) {
+    size_t first = 0;
+
+    qsort(scanner->entries, count, sizeof(*scanner->entries),
+          compare_scan_entry_pfn);
+    while (first < count) {
+        uint64_t base = scanner->entries[first].pfn / 64;
+        size_t end = first;
+        size_t words;
+        off_t offset = (off_t)(base * sizeof(uint64_t));
+        size_t i;
+
+        while (end < count &&
+               scanner->entries[end].pfn / 64 - base < SCAN_WORD_RUN) {
+            end++;
+        }
+        words = (size_t)(scanner->entries[end - 1].pfn / 64 - base + 1);
+
+        scanner->stats.reads++;
+        if (pread(scanner->idle_fd, scanner->words, words * sizeof(uint64_t),
+                  offset) != (ssize_t)(words * sizeof(uint64_t))) {
+            first = end;
+            continue;
+        }
+        memset(scanner->masks, 0, words * sizeof(uint64_t));
+        for (i = first; i < end; i++) {
+            const struct scan_entry *entry = &scanner->entries[i];
+
+            scanner->masks[entry->pfn / 64 - base] |= 1ULL << (entry->pfn % 64);
+        }
+        if (pwrite(scanner->idle_fd, scanner->masks, words * sizeof(uint64_t),
+                   offset) < 0) {
+            scanner->stats.mark_failures += end - first;
+        } else {
+            scanner->stats.reads++;
+            if (pread(scanner->idle_fd, scanner->masks,
+                      words * sizeof(uint64_t),
+                      offset) != (ssize_t)(words * sizeof(uint64_t))) {
+                memset(scanner->masks, 0xff, words * sizeof(uint64_t));
+            }
+        }
+
+        for (i = first; i < end; i++) {
+            const struct scan_entry *entry = &scanner->entries[i];
+            uint64_t bit = 1ULL << (entry->pfn % 64);
+            size_t word = (size_t)(entry->pfn / 64 - base);
+            struct scan_region *region = &scanner->regions[entry->region];
+
+            if (!(scanner->masks[word] & bit)) {
+                scanner->stats.untracked++;
+                continue;
+            }
+            if (region->marked_ns && !(scanner->words[word] & bit)) {
+                region->accessed++;
+                scanner->stats.accessed++;
+                scan_record_access(scanner, entry, now_ns);
+            }
+        }
+        first = end;
+    }
+}
+
+/*
+ * Read the pagemap entries of [start, end), at most SCAN_BATCH_PAGES, and
+ * check and re-mark the present pages. `region` is the index of the region
+ * holding `start`. Returns the pages read, 0 at the end of the target.
+ */
+static size_t scan_chunk(struct page_scanner *scanner, size_t region,
+                         uint64_t start, uint64_t end, uint64_t now_ns) {
+    size_t pages = (size_t)((end - start) >> scanner->page_shift);
+    size_t count = 0;
+    ssize_t got;
+    size_t i;
+
+    if (pages > SCAN_BATCH_PAGES) {
+        pages = SCAN_BATCH_PAGES;
+    }
+    scanner->stats.reads++;
+    got = pread(scanner->pagemap_fd, scanner->pagemap,
+                pages * sizeof(uint64_t),
+                (off_t)((start >> scanner->page_shift) * sizeof(uint64_t)));
+    if (got <= 0) {
+        if (got < 0 && errno == ESRCH) {
+            scanner->exited = true;
+        }
+        return 0;
+    }
+    pages = (size_t)got / sizeof(uint64_t);
+    scanner->stats.pages += pages;
+
+    for (i = 0; i < pages; i++) {
+        uint64_t vaddr = start + ((uint64_t)i << scanner->page_shift);
+        uint64_t entry = scanner->pagemap[i];
+
+        while (vaddr >= scanner->regions[region].end) {
+            region++;
+        }
+        if (!(entry & PAGEMAP_PRESENT)) {
+            continue;
+        }
+        scanner->stats.present++;
+        if ((entry & PAGEMAP_PFN_MASK) == 0) {
+            scanner->stats.hidden++;
+            continue;
+        }
+        scanner->entries[count].pfn = entry & PAGEMAP_PFN_MASK;
+        scanner->entries[count].vaddr = vaddr;
+        scanner->entries[count].region = (uint32_t)region;
+        count++;
+    }
+    scan_idle_bits(scanner, count, now_ns);
+    return pages;
+}
+
+/*
+ * Scan regions [first, last], which are adjacent, in chunks. Each region's
+ * interval halves when it saw an access and doubles when it did not,
+ * between --scan-interval and 2^SCAN_MAX_BACKOFF times that.
+ */
+static void scan_batch(struct page_scanner *scanner, size_t first,
+                       size_t last, uint64_t now_ns) {
+    uint64_t addr = scanner->regions[first].start;
+    uint64_t end = scanner->regions[last].end;
+    size_t region = first;
+    size_t i;
+
+    for (i = first; i <= last; i++) {
+        scanner->regions[i].accessed = 0;
+    }
+    while (addr < end) {
+        size_t pages;
+
+        while (addr >= scanner->regions[region].end) {
+            region++;
+        }
+        pages = scan_chunk(scanner, region, addr, end, now_ns);
+        if (pages == 0) {
+            break;
+        }
+        addr += (uint64_t)pages << scanner->page_shift;
+    }
+
+    for (i = first; i <= last; i++) {
+        struct scan_region *region_state = &scanner->regions[i];
+
+        if (region_state->marked_ns) {
+            if (region_state->accessed) {
+                region_state->interval_ns /= 2;
+            } else {
+                region_state->interval_ns *= 2;
+            }
+            if (region_state->interval_ns < scanner->min_interval_ns) {
+                region_state->interval_ns = scanner->min_interval_ns;
+            }
+            if (region_state->interval_ns > scanner->max_interval_ns) {
+                region_state->interval_ns = scanner->max_interval_ns;
+            }
+        }
+        region_state->marked_ns = now_ns;
+        region_state->due_ns = now_ns + region_state->interval_ns;
+    }
+}
+
+/*
+ * One pass: walk the regions round-robin from where the last pass stopped
+ * and scan the due ones, batching neighbours, until --scan-budget pages
+ * have been read. The pass stops at the first due region over budget, which
+ * then comes first in the next pass; the due regions left are counted as
+ * deferred. A pass always scans at least one due region, however large.
+ */
+static void scan_pass(struct page_scanner *scanner, uint64_t now_ns) {
+    const struct scan_region *regions = scanner->regions;
+    size_t nr_regions = scanner->nr_regions;
+    uint64_t budget = scanner->options->scan_budget ?
+                      scanner->options->scan_budget : UINT64_MAX;
+    bool scanned = false;
+    size_t batch_first = 0;
+    size_t batch_last = 0;
+    size_t batch_pages = 0;
+    size_t visited;
+    size_t i = scanner->cursor;
+
+    heatmap_advance_time(scanner->heatmap, scanner->options, now_ns);
+    for (visited = 0; visited < nr_regions;
+         visited++, i = (i + 1) % nr_regions) {
+        size_t pages = (size_t)((regions[i].end - regions[i].start) >>
+                                scanner->page_shift);
+
+        if (regions[i].due_ns > now_ns) {
+            if (batch_pages) {
+                scan_batch(scanner, batch_first, batch_last, now_ns);
+                batch_pages = 0;
+            }
+            continue;
+        }
+        if (budget < pages && scanned) {
+            break;
+        }
+        if (batch_pages &&
+            (i == 0 || regions[batch_last].end != regions[i].start ||
+             batch_pages + pages > SCAN_BATCH_PAGES)) {
+            scan_batch(scanner, batch_first, batch_last, now_ns);
+            batch_pages = 0;
+        }
+        if (!batch_pages) {
+            batch_first = i;
+        }
+        batch_last = i;
+        batch_pages += pages;
+        budget = budget > pages ? budget - pages : 0;
+        scanned = true;
+    }
+    if (batch_pages) {
+        scan_batch(scanner, batch_first, batch_last, now_ns);
+    }
+
+    scanner->cursor = i;
+    for (; visited < nr_regions; visited++, i = (i + 1) % nr_regions) {
+        if (regions[i].due_ns <= now_ns) {
+            scanner->stats.deferred++;
+        }
+    }
+}
+
+static int scan_session_open(struct perf_session *session,
+                             const struct profiler_options *options,
+                             char *reason, size_t reason_len) {
+    char path[PATH_BUFFER_SIZE];
+    int fd;
+
+    if (options->system_wide || options->pid <= 0) {
+        snprintf(reason, reason_len, "the scan backend needs a target --pid");
+        return -EINVAL;
+    }
+    if (options->record_path) {
+        snprintf(reason, reason_len,
+                 "the scan backend takes no perf samples to --record");
+        return -EINVAL;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", options->pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(reason, reason_len, "open %s failed: %s", path,
+                 strerror(errno));
+        return -errno;
+    }
+    close(fd);
+    fd = open(SCAN_IDLE_BITMAP, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(reason, reason_len, "open %s failed: %s", SCAN_IDLE_BITMAP,
+                 strerror(errno));
+        return -errno;
+    }
+    close(fd);
+
+    session->scope = "scan";
+    session->filter_pid = options->pid;
+    return 0;
+}
+
+/*
+ * Scan until --duration is up or the target exits. Between passes the
+ * scanner sleeps on the --interval reporter's wake fd, so it answers a
+ * snapshot request at once, like a drain worker.
+ */
+static int scan_session_run(struct perf_session *session,
+                            const struct profiler_options *options,
+                            const struct profiler_backend *backend,
+                            struct heatmap *heatmap,
+                            char *reason, size_t reason_len) {
+    struct page_scanner *scanner;
+    struct interval_reporter *reporter = NULL;
+    char path[PATH_BUFFER_SIZE];
+    uint64_t start_ns = scan_now_ns();
+    uint64_t end_ns = start_ns + (uint64_t)options->duration_sec * 1000000000ULL;
+    uint64_t next_ns = start_ns;
+    uint64_t passes = 0;
+    int ret = 0;
+
+    scanner = calloc(1, sizeof(*scanner));
+    if (!scanner) {
+        snprintf(reason, reason_len, "failed to allocate page scanner");
+        return -ENOMEM;
+    }
+    scanner->options = options;
+    scanner->backend = backend;
+    scanner->heatmap = heatmap;
+    scanner->pid = options->pid;
+    scanner->page_shift = heatmap->page_shift;
+    scanner->min_interval_ns = (uint64_t)(options->scan_interval_ms ?
+                                          options->scan_interval_ms : 1) *
+                               1000000ULL;
+    scanner->max_interval_ns = scanner->min_interval_ns << SCAN_MAX_BACKOFF;
+
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", options->pid);
+    scanner->pagemap_fd = open(path, O_RDONLY | O_CLOEXEC);
+    scanner->idle_fd = open(SCAN_IDLE_BITMAP, O_RDWR | O_CLOEXEC);
+    if (scanner->pagemap_fd < 0 || scanner->idle_fd < 0) {
+        ret = -errno;
+        snprintf(reason, reason_len, "failed to open %s: %s",
+                 scanner->pagemap_fd < 0 ? path : SCAN_IDLE_BITMAP,
+                 strerror(errno));
+        goto out;
+    }
+
+    if (options->report_interval_ms > 0 && session->interval_out) {
+        ret = interval_reporter_start(&reporter, options, backend, 1,
+                                      session->interval_out, session->tier,
+                                      reason, reason_len);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+
+    while (!scanner->exited) {
+        uint64_t now_ns = scan_now_ns();
+        struct pollfd wake;
+        uint64_t wait_ns;
+
+        if (now_ns >= end_ns) {
+            break;
+        }
+        if (now_ns >= next_ns) {
+            if (passes % SCAN_MAPS_PASSES == 0 &&
+                scan_load_regions(scanner, now_ns) != 0) {
+                break;
+            }
+            scan_pass(scanner, now_ns);
+            passes++;
+            next_ns += scanner->min_interval_ns;
+            if (next_ns <= now_ns) {
+                next_ns = now_ns + scanner->min_interval_ns;
+            }
+            continue;
+        }
+
+        wait_ns = (next_ns < end_ns ? next_ns : end_ns) - now_ns;
+        wake.fd = reporter ? interval_reporter_wake_fd(reporter, 0) : -1;
+        wake.events = POLLIN;
+        wake.revents = 0;
+        if (poll(&wake, 1, (int)((wait_ns + 999999ULL) / 1000000ULL)) > 0 &&
+            (wake.revents & POLLIN)) {
+            interval_reporter_snapshot(reporter, 0, heatmap, 0);
+        }
+    }
+
+    interval_reporter_stop(reporter, &session->interval_reports,
+                           &session->interval_skipped);
+    session->wakeups = passes;
+    fprintf(stderr,
+            "scan passes=%" PRIu64 " regions=%zu pages=%" PRIu64
+            " present=%" PRIu64 " accessed=%" PRIu64 " reads=%" PRIu64
+            " mark_failures=%" PRIu64 " untracked=%" PRIu64
+            " deferred=%" PRIu64 "\n",
+            passes, scanner->nr_regions, scanner->stats.pages,
+            scanner->stats.present, scanner->stats.accessed,
+            scanner->stats.reads, scanner->stats.mark_failures,
+            scanner->stats.untracked, scanner->stats.deferred);
+    if (scanner->stats.hidden) {
+        fprintf(stderr,
+                "warning: %" PRIu64 " present pages had no frame number in "
+                "pagemap, scanning needs CAP_SYS_ADMIN\n",
+                scanner->stats.hidden);
+    }
+
+out:
+    if (scanner->pagemap_fd >= 0) {
+        close(scanner->pagemap_fd);
+    }
+    if (scanner->idle_fd >= 0) {
+        close(scanner->idle_fd);
+    }
+    free(scanner->regions);
+    free(scanner);
+    return ret;
+}
+
+const struct profiler_backend scan_backend = {
+    .name = "scan",
+    .pmu_name = NULL,
+    .supported = scan_supported,
+    .page_key = scan_page_key,
+    .session_open = scan_session_open,
+    .session_run = scan_session_run,
+};
@@ -0,0 +1,160 @@
+#include "backend.h"
+
+#include <poll.h>
+#include <time.h>
+
+
+/* Samples are generated in slices of SYNTH_SLICE_NS worth of --synth-rate. */
+#define SYNTH_SLICE_NS 1000000ULL
+#define SYNTH_BUFFER_SAMPLES 4096
+
+static uint64_t synth_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static bool synth_supported(char *reason, size_t reason_len) {
+    (void)reason;
+    (void)reason_len;
+    return true;
+}
+
+static uint64_t synth_page_key(const struct sample_record *sample,
+                               size_t page_shift,
+                               enum address_kind *kind) {
+    if (!sample->has_addr) {
+        return UINT64_MAX;
+    }
+    *kind = ADDR_KIND_VIRTUAL;
+    return sample->addr >> page_shift;
+}
+
+static void synth_spec_from_options(struct synth_spec *spec,
+                                    const struct profiler_options *options) {
+    synth_spec_init(spec);
+    spec->dist = options->synth_dist;
+    spec->pages = options->synth_pages;
+    spec->period = options->sample_period;
+}
+
+static int synth_session_open(struct perf_session *session,
+                              const struct profiler_options *options,
+                              char *reason, size_t reason_len) {
+    if (options->record_path) {
+        snprintf(reason, reason_len,
+                 "the synth backend takes no perf samples to --record");
+        return -EINVAL;
+    }
+    if (options->synth_pages == 0) {
+        snprintf(reason, reason_len, "--synth-pages must be at least 1");
+        return -EINVAL;
+    }
+
+    session->scope = "synthetic";
+    return 0;
+}
+
+/*
+ * Generate --synth-rate samples per second until --duration is up, stamped
+ * with the monotonic clock like perf samples are, and feed them to the
+ * heatmap in batches. A rate of 0 generates as fast as the heatmap takes
+ * them. Between slices the generator sleeps on the --interval reporter's
+ * wake fd, like the scan backend.
+ */
+static int synth_session_run(struct perf_session *session,
+                             const struct profiler_options *options,
+                             const struct profiler_backend *backend,
+                             struct heatmap *heatmap,
+                             char *reason, size_t reason_len) {
+    struct interval_reporter *reporter = NULL;
+    struct synth_generator gen;
+    struct synth_spec spec;
+    struct sample_record *buffer;
+    uint64_t start_ns = synth_now_ns();
+    uint64_t end_ns = start_ns + (uint64_t)options->duration_sec * 1000000000ULL;
+    uint64_t slices = 0;
+    int ret;
+
+    synth_spec_from_options(&spec, options);
+    ret = synth_generator_init(&gen, &spec, heatmap->page_shift, reason,
+                               reason_len);
+    if (ret != 0) {
+        return ret;
+    }
+
+    buffer = calloc(SYNTH_BUFFER_SAMPLES, sizeof(*buffer));
+    if (!buffer) {
+        snprintf(reason, reason_len, "failed to allocate sample buffer");
+        return -ENOMEM;
+    }
+
+    if (options->report_interval_ms > 0 && session->interval_out) {
+        ret = interval_reporter_start(&reporter, options, backend, 1,
+                                      session->interval_out, session->tier,
+                                      reason, reason_len);
+        if (ret != 0) {
+            free(buffer);
+            return ret;
+        }
+    }
+
+    for (;;) {
+        uint64_t now_ns = synth_now_ns();
+        uint64_t due;
+        struct pollfd wake;
+
+        if (now_ns >= end_ns) {
+            break;
+        }
+        due = options->synth_rate ?
+              (uint64_t)((double)(now_ns - start_ns) *
+                         (double)options->synth_rate / 1e9) - gen.emitted :
+              SYNTH_BUFFER_SAMPLES;
+        while (due > 0) {
+            size_t n = due < SYNTH_BUFFER_SAMPLES ? (size_t)due :
+                       SYNTH_BUFFER_SAMPLES;
+            size_t i;
+
+            for (i = 0; i < n; i++) {
+                synth_generator_next(&gen, now_ns, &buffer[i]);
+            }
+            heatmap_record_batch(heatmap, options, backend, buffer, n);
+            due -= n;
+        }
+        slices++;
+
+        wake.fd = reporter ? interval_reporter_wake_fd(reporter, 0) : -1;
+        wake.events = POLLIN;
+        wake.revents = 0;
+        if (poll(&wake, 1, options->synth_rate ?
+                           (int)(SYNTH_SLICE_NS / 1000000ULL) : 0) > 0 &&
+            (wake.revents & POLLIN)) {
+            interval_reporter_snapshot(reporter, 0, heatmap, 0);
+        }
+    }
+
+    interval_reporter_stop(reporter, &session->interval_reports,
+                           &session->interval_skipped);
+    session->wakeups = slices;
+    fprintf(stderr,
+            "synth dist=%s pages=%" PRIu64 " pids=%u samples=%" PRIu64
+            " rate=%.0f/s\n",
+            synth_dist_name(gen.spec.dist), gen.spec.pages, gen.spec.pids,
+            gen.emitted,
+            (double)gen.emitted * 1e9 / (double)(synth_now_ns() - start_ns));
+    free(buffer);
+    return 0;
+}
+
+const struct profiler_backend synth_backend = {
+    .name = "synth",
+    .pmu_name = NULL,
+    .explicit_only = true,
+    .mem_info = true,
+    .supported = synth_supported,
+    .page_key = synth_page_key,
+    .session_open = synth_session_open,
+    .session_run = synth_session_run,
+};
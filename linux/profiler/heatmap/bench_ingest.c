@@ -0,0 +1,206 @@
+#include "profiler.h"
+
+#include <time.h>
+
+
+/*
+ * Ingestion and report benchmark on synthetic sample streams.
+ *
+ * For every combination of table size (max_pages), cooling mode, address
+ * mode and page distribution, a synthetic stream over a working set of
+ * max_pages pages is fed through heatmap_record_batch(), the path the drain
+ * threads use, and the resulting table is reported once in text to
+ * /dev/null. Samples are stamped 1us apart, so with the default 500ms
+ * cooling interval cooling runs every 500000 samples.
+ *
+ * Columns: samples/s and ns/sample of the ingestion, the pages tracked at
+ * the end, table bytes (control byte plus heat_page payload of every slot)
+ * per tracked page, and the time of the report.
+ *
+ * Usage: bench_ingest [samples [max_pages ...]]
+ *        (default: 2000000 samples, 65536 and 1048576 max_pages)
+ */
+
+#define BENCH_BATCH 1024
+#define BENCH_SAMPLE_STEP_NS 1000ULL
+
+static uint64_t bench_time_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t bench_page_key(const struct sample_record *sample,
+                               size_t page_shift, enum address_kind *kind) {
+    *kind = ADDR_KIND_VIRTUAL;
+    return sample->addr >> page_shift;
+}
+
+static const struct profiler_backend bench_backend = {
+    .name = "synth",
+    .page_key = bench_page_key,
+    .mem_info = true,
+};
+
+/* The tool's defaults for everything the heatmap and the report look at. */
+static void bench_options(struct profiler_options *options, size_t max_pages,
+                          enum cooling_mode cooling,
+                          enum stats_address_mode addr_mode) {
+    memset(options, 0, sizeof(*options));
+    options->sample_period = 1;
+    options->max_pages = max_pages;
+    options->evict_policy = EVICT_NONE;
+    options->top_n = 20;
+    options->process_top_n = 10;
+    options->group_by = GROUP_BY_PID;
+    options->report_mode = REPORT_BOTH;
+    options->summary_metric = SUMMARY_PAGES;
+    options->cooling_mode = cooling;
+    options->cooling_decay = 0.80;
+    options->cooling_step = 1.0;
+    options->cooling_interval_ns = 500ULL * 1000ULL * 1000ULL;
+    options->hot_threshold = 20.0;
+    options->cold_threshold = 3.0;
+    options->hot_percent = 10.0;
+    options->cold_percent = 50.0;
+    options->heat_policy = HEAT_POLICY_ABSOLUTE;
+    options->stats_address_mode = addr_mode;
+    options->output_format = OUTPUT_TEXT;
+    options->sort_by = PAGE_SORT_HEAT;
+    options->heat_score = HEAT_SCORE_SAMPLES;
+    options->latency_unit = 100;
+    options->tier_node = -1;
+}
+
+static void bench_one(size_t max_pages, uint64_t samples,
+                      enum cooling_mode cooling,
+                      enum stats_address_mode addr_mode,
+                      enum synth_dist dist, FILE *sink) {
+    static struct sample_record buffer[BENCH_BATCH];
+    char reason[REASON_BUFFER_SIZE];
+    struct profiler_options options;
+    struct synth_generator gen;
+    struct synth_spec spec;
+    struct heatmap heatmap;
+    uint64_t time_ns = BENCH_SAMPLE_STEP_NS;
+    uint64_t ingest_ns = 0;
+    uint64_t report_ns;
+    uint64_t done = 0;
+    uint64_t start;
+    size_t tracked;
+    double table_bytes;
+
+    bench_options(&options, max_pages, cooling, addr_mode);
+    synth_spec_init(&spec);
+    spec.dist = dist;
+    spec.pages = max_pages;
+    if (synth_generator_init(&gen, &spec, 12, reason, sizeof(reason)) != 0) {
+        fprintf(stderr, "max_pages=%zu: %s\n", max_pages, reason);
+        return;
+    }
+    heatmap_init(&heatmap, max_pages, 12);
+    heatmap.mem_info = bench_backend.mem_info;
+    if (!heatmap.pages) {
+        fprintf(stderr, "max_pages=%zu: out of memory\n", max_pages);
+        return;
+    }
+
+    while (done < samples) {
+        size_t n = samples - done < BENCH_BATCH ? (size_t)(samples - done) :
+                   BENCH_BATCH;
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+            synth_generator_next(&gen, time_ns, &buffer[i]);
+            time_ns += BENCH_SAMPLE_STEP_NS;
+        }
+        start = bench_time_ns();
+        heatmap_record_batch(&heatmap, &options, &bench_backend, buffer, n);
+        ingest_ns += bench_time_ns() - start;
+        done += n;
+    }
+
+    heatmap_finish_resize(&heatmap);
+    tracked = heatmap.count;
+    table_bytes = (double)heatmap.capacity * (double)(sizeof(*heatmap.pages) + 1);
+
+    start = bench_time_ns();
+    heatmap_report(&heatmap, &options, &bench_backend, 0, sink);
+    fflush(sink);
+    report_ns = bench_time_ns() - start;
+
+    printf("%-10zu %-9s %-8s %-8s %-12.2f %-10.1f %-10zu %-11.1f %-10.2f\n",
+           max_pages, synth_dist_name(dist), cooling_mode_name(cooling),
+           stats_address_mode_name(addr_mode),
+           (double)samples * 1e3 / (double)ingest_ns,
+           (double)ingest_ns / (double)samples, tracked,
+           tracked ? table_bytes / (double)tracked : 0.0,
+           (double)report_ns / 1e6);
+    heatmap_destroy(&heatmap);
+}
+
+int main(int argc, char **argv) {
+    static const size_t default_sizes[] = {65536, 1048576};
+    static const enum cooling_mode coolings[] = {
+        COOLING_NONE, COOLING_STEP, COOLING_EXP,
+    };
+    static const enum stats_address_mode addr_modes[] = {
+        STATS_ADDR_VIRTUAL, STATS_ADDR_PHYSICAL,
+    };
+    static const enum synth_dist dists[] = {
+        SYNTH_UNIFORM, SYNTH_ZIPF, SYNTH_HOTSET, SYNTH_PHASE, SYNTH_MULTIPID,
+    };
+    const size_t *sizes = default_sizes;
+    size_t nr_sizes = ARRAY_SIZE(default_sizes);
+    size_t *arg_sizes = NULL;
+    uint64_t samples = 2000000;
+    size_t s, c, a, d;
+    FILE *sink;
+
+    if (argc > 1) {
+        samples = strtoull(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        arg_sizes = calloc((size_t)argc - 2, sizeof(*arg_sizes));
+        if (!arg_sizes) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        for (s = 0; s < (size_t)argc - 2; s++) {
+            arg_sizes[s] = (size_t)strtoull(argv[s + 2], NULL, 0);
+        }
+        sizes = arg_sizes;
+        nr_sizes = (size_t)argc - 2;
+    }
+    if (samples == 0) {
+        fprintf(stderr, "samples must be at least 1\n");
+        free(arg_sizes);
+        return 1;
+    }
+
+    sink = fopen("/dev/null", "w");
+    if (!sink) {
+        fprintf(stderr, "open /dev/null failed: %s\n", strerror(errno));
+        free(arg_sizes);
+        return 1;
+    }
+
+    printf("%-10s %-9s %-8s %-8s %-12s %-10s %-10s %-11s %-10s\n",
+           "max_pages", "dist", "cooling", "addr", "msamples/s", "ns/sample",
+           "pages", "bytes/page", "report_ms");
+    for (s = 0; s < nr_sizes; s++) {
+        for (c = 0; c < ARRAY_SIZE(coolings); c++) {
+            for (a = 0; a < ARRAY_SIZE(addr_modes); a++) {
+                for (d = 0; d < ARRAY_SIZE(dists); d++) {
+                    bench_one(sizes[s], samples, coolings[c], addr_modes[a],
+                              dists[d], sink);
+                }
+            }
+        }
+    }
+
+    fclose(sink);
+    free(arg_sizes);
+    return 0;
+}
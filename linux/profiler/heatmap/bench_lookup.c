@@ -0,0 +1,224 @@
+#include "profiler.h"
+
+#include <time.h>
+
+
+/*
+ * Page-table lookup microbenchmark.
+ *
+ * Compares heatmap_lookup() (Swiss table: control bytes probed a group at a
+ * time, payloads in a separate array) against the previous design, where
+ * linear probing walked the heat_page payload slots directly. Both tables
+ * are filled with the same distinct pages and then hit with the same random
+ * lookup stream.
+ *
+ * Usage: bench_lookup [distinct_pages ...]   (default: 100000 1000000 10000000)
+ */
+
+struct linear_slot {
+    struct heat_page page;
+    bool used;
+};
+
+struct linear_table {
+    struct linear_slot *slots;
+    size_t capacity;
+    size_t count;
+};
+
+static uint64_t bench_time_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Same mixer as heatmap.c so both tables see the same key distribution. */
+static uint64_t linear_hash(uint64_t page, enum address_kind kind) {
+    uint64_t x = page ^ ((uint64_t)kind << 61);
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static int linear_init(struct linear_table *table, size_t max_pages) {
+    size_t capacity = 1;
+
+    while (capacity < max_pages * 2) {
+        capacity <<= 1;
+    }
+    table->capacity = capacity < 1024 ? 1024 : capacity;
+    table->count = 0;
+    table->slots = calloc(table->capacity, sizeof(*table->slots));
+    return table->slots ? 0 : -ENOMEM;
+}
+
+static struct heat_page *linear_lookup(struct linear_table *table,
+                                       uint64_t page, enum address_kind kind) {
+    size_t index = (size_t)linear_hash(page, kind) & (table->capacity - 1);
+    size_t start = index;
+
+    do {
+        struct linear_slot *slot = &table->slots[index];
+
+        if (!slot->used) {
+            slot->used = true;
+            slot->page.page = page;
+            slot->page.kind = kind;
+            table->count++;
+            return &slot->page;
+        }
+        if (slot->page.page == page && slot->page.kind == kind) {
+            return &slot->page;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    } while (index != start);
+
+    return NULL;
+}
+
+static struct heat_page *linear_find(struct linear_table *table,
+                                     uint64_t page, enum address_kind kind) {
+    size_t index = (size_t)linear_hash(page, kind) & (table->capacity - 1);
+    size_t start = index;
+
+    do {
+        struct linear_slot *slot = &table->slots[index];
+
+        if (!slot->used) {
+            return NULL;
+        }
+        if (slot->page.page == page && slot->page.kind == kind) {
+            return &slot->page;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    } while (index != start);
+
+    return NULL;
+}
+
+static void bench_one(size_t distinct) {
+    struct profiler_options options;
+    struct linear_table linear;
+    struct heatmap heatmap;
+    uint64_t *keys;
+    uint64_t seed = 42;
+    size_t lookups = distinct < 4000000 ? 4000000 : distinct;
+    uint64_t checksum = 0;
+    uint64_t start;
+    double linear_ns;
+    double swiss_ns;
+    double linear_miss_ns;
+    double swiss_miss_ns;
+    size_t i;
+
+    memset(&options, 0, sizeof(options));
+    options.max_pages = distinct;
+
+    keys = malloc(distinct * sizeof(*keys));
+    if (!keys || linear_init(&linear, distinct) != 0) {
+        fprintf(stderr, "distinct=%zu: out of memory\n", distinct);
+        free(keys);
+        return;
+    }
+    heatmap_init(&heatmap, distinct, 12);
+    if (!heatmap.pages) {
+        fprintf(stderr, "distinct=%zu: out of memory\n", distinct);
+        free(linear.slots);
+        free(keys);
+        return;
+    }
+
+    for (i = 0; i < distinct; i++) {
+        keys[i] = splitmix64(&seed) >> 12;
+        linear_lookup(&linear, keys[i], ADDR_KIND_VIRTUAL);
+        heatmap_lookup(&heatmap, keys[i], ADDR_KIND_VIRTUAL, &options);
+    }
+
+    seed = 7;
+    start = bench_time_ns();
+    for (i = 0; i < lookups; i++) {
+        uint64_t key = keys[splitmix64(&seed) % distinct];
+
+        checksum += linear_lookup(&linear, key, ADDR_KIND_VIRTUAL)->page;
+    }
+    linear_ns = (double)(bench_time_ns() - start) / (double)lookups;
+
+    seed = 7;
+    start = bench_time_ns();
+    for (i = 0; i < lookups; i++) {
+        uint64_t key = keys[splitmix64(&seed) % distinct];
+
+        checksum -= heatmap_lookup(&heatmap, key, ADDR_KIND_VIRTUAL,
+                                   &options)->page;
+    }
+    swiss_ns = (double)(bench_time_ns() - start) / (double)lookups;
+
+    /*
+     * Absent pages with the table at max_pages: the linear table walks
+     * payload slots up to the next hole, the Swiss table only reads control
+     * bytes before giving up.
+     */
+    options.max_pages = linear.count = heatmap.count;
+    seed = 11;
+    start = bench_time_ns();
+    for (i = 0; i < lookups; i++) {
+        uint64_t key = splitmix64(&seed) | (1ULL << 60);
+
+        checksum += linear_find(&linear, key, ADDR_KIND_VIRTUAL) != NULL;
+    }
+    linear_miss_ns = (double)(bench_time_ns() - start) / (double)lookups;
+
+    seed = 11;
+    start = bench_time_ns();
+    for (i = 0; i < lookups; i++) {
+        uint64_t key = splitmix64(&seed) | (1ULL << 60);
+
+        checksum -= heatmap_lookup(&heatmap, key, ADDR_KIND_VIRTUAL,
+                                   &options) != NULL;
+    }
+    swiss_miss_ns = (double)(bench_time_ns() - start) / (double)lookups;
+
+    printf("%-12zu %-10s %-14.1f %-12.2f %-14.2f %-10.1f\n", distinct,
+           "linear", 1000.0 / linear_ns, linear_ns, linear_miss_ns,
+           (double)(linear.capacity * sizeof(*linear.slots)) / (1 << 20));
+    printf("%-12zu %-10s %-14.1f %-12.2f %-14.2f %-10.1f%s\n", distinct,
+           "swiss", 1000.0 / swiss_ns, swiss_ns, swiss_miss_ns,
+           (double)(heatmap.capacity * (sizeof(*heatmap.pages) + 1)) / (1 << 20),
+           checksum == 0 ? "" : " (checksum mismatch)");
+
+    heatmap_destroy(&heatmap);
+    free(linear.slots);
+    free(keys);
+}
+
+int main(int argc, char **argv) {
+    static const size_t default_sizes[] = {100000, 1000000, 10000000};
+    int i;
+
+    printf("%-12s %-10s %-14s %-12s %-14s %-10s\n", "distinct", "table",
+           "mlookups/s", "ns/lookup", "ns/miss", "table_mb");
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            bench_one((size_t)strtoull(argv[i], NULL, 0));
+        }
+        return 0;
+    }
+
+    for (i = 0; i < (int)ARRAY_SIZE(default_sizes); i++) {
+        bench_one(default_sizes[i]);
+    }
+    return 0;
+}
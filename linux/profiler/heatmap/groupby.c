@@ -0,0 +1,172 @@
+#include "profiler.h"
+
+
+#define GROUP_INITIAL_CAPACITY 64
+
+static uint64_t group_hash_at(const void *entries, size_t i) {
+    const struct group_summary *groups = entries;
+
+    return hash_u64(groups[i].key);
+}
+
+int group_table_init(struct group_table *table,
+                     enum group_dimension dimension) {
+    int ret;
+
+    memset(table, 0, sizeof(*table));
+    table->dimension = dimension;
+    table->groups = calloc(GROUP_INITIAL_CAPACITY, sizeof(*table->groups));
+    if (!table->groups) {
+        return -ENOMEM;
+    }
+    table->groups_capacity = GROUP_INITIAL_CAPACITY;
+
+    ret = hash_index_resize(&table->index, GROUP_INITIAL_CAPACITY * 2, 0,
+                            group_hash_at, table->groups);
+    if (ret == 0 && dimension == GROUP_BY_NODE) {
+        ret = cpu_node_map_load(&table->cpu_node, &table->nr_cpu_node);
+    }
+    if (ret != 0) {
+        group_table_destroy(table);
+    }
+    return ret;
+}
+
+void group_table_destroy(struct group_table *table) {
+    free(table->groups);
+    hash_index_destroy(&table->index);
+    free(table->cpu_node);
+    memset(table, 0, sizeof(*table));
+}
+
+uint64_t group_table_key(const struct group_table *table,
+                         const struct heat_page *page) {
+    switch (table->dimension) {
+    case GROUP_BY_TID:
+        return page->owner_tid;
+    case GROUP_BY_CPU:
+        return page->last_cpu;
+    case GROUP_BY_NODE:
+        if (page->last_cpu < table->nr_cpu_node &&
+            table->cpu_node[page->last_cpu] >= 0) {
+            return (uint64_t)table->cpu_node[page->last_cpu];
+        }
+        return GROUP_KEY_UNKNOWN;
+    case GROUP_BY_KIND:
+        return (uint64_t)page->kind;
+    case GROUP_BY_PID:
+    default:
+        return page->owner_pid;
+    }
+}
+
+static struct group_summary *group_table_get(struct group_table *table,
+                                             uint64_t key) {
+    size_t slot = hash_index_slot(&table->index, hash_u64(key));
+    struct group_summary *group;
+
+    while (table->index.slots[slot] != HASH_INDEX_EMPTY) {
+        group = &table->groups[table->index.slots[slot]];
+        if (group->key == key) {
+            return group;
+        }
+        slot = hash_index_next(&table->index, slot);
+    }
+
+    if (table->count == table->groups_capacity) {
+        size_t capacity = table->groups_capacity * 2;
+        struct group_summary *groups = realloc(table->groups,
+                                               capacity * sizeof(*groups));
+
+        if (!groups) {
+            return NULL;
+        }
+        memset(groups + table->count, 0,
+               (capacity - table->count) * sizeof(*groups));
+        table->groups = groups;
+        table->groups_capacity = capacity;
+        if (hash_index_resize(&table->index, capacity * 2, table->count,
+                              group_hash_at, groups) != 0) {
+            return NULL;
+        }
+        return group_table_get(table, key);
+    }
+
+    table->index.slots[slot] = (uint32_t)table->count;
+    group = &table->groups[table->count++];
+    group->key = key;
+    return group;
+}
+
+int group_table_add(struct group_table *table, const struct heatmap *heatmap,
+                    const struct heat_page *page, enum page_state state) {
+    struct group_summary *group = group_table_get(table,
+                                                  group_table_key(table, page));
+    const struct heat_page_numa *numa = heatmap_page_numa(heatmap, page);
+
+    if (!group) {
+        return -ENOMEM;
+    }
+
+    group->heat += page->heat;
+    group->total_weight += page->total_weight;
+    if (numa) {
+        group->local_heat += numa->local_heat;
+        group->remote_heat += numa->remote_heat;
+    }
+    group->samples += page->samples;
+    group->pages++;
+    if (state == PAGE_HOT) {
+        group->hot_pages++;
+    } else if (state == PAGE_COLD) {
+        group->cold_pages++;
+    } else {
+        group->warm_pages++;
+    }
+    return 0;
+}
+
+static int compare_group_summary_desc(const void *lhs, const void *rhs) {
+    const struct group_summary *a = lhs;
+    const struct group_summary *b = rhs;
+
+    if (a->heat < b->heat) {
+        return 1;
+    }
+    if (a->heat > b->heat) {
+        return -1;
+    }
+    if (a->samples < b->samples) {
+        return 1;
+    }
+    if (a->samples > b->samples) {
+        return -1;
+    }
+    if (a->key < b->key) {
+        return -1;
+    }
+    if (a->key > b->key) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Sort groups by descending heat. The key index is stale afterwards. */
+void group_table_sort(struct group_table *table) {
+    qsort(table->groups, table->count, sizeof(*table->groups),
+          compare_group_summary_desc);
+}
+
+void group_key_format(enum group_dimension dimension, uint64_t key,
+                      char *buf, size_t len) {
+    if (dimension == GROUP_BY_KIND) {
+        snprintf(buf, len, "%s",
+                 key == ADDR_KIND_PHYSICAL ? "physical" : "virtual");
+        return;
+    }
+    if (key == GROUP_KEY_UNKNOWN) {
+        snprintf(buf, len, "-1");
+        return;
+    }
+    snprintf(buf, len, "%" PRIu64, key);
+}
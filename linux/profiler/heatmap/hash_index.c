@@ -0,0 +1,63 @@
+#include "profiler.h"
+
+
+/*
+ * Rebuild the index with `size` slots (a power of two) over the first
+ * `count` entries of its array. hash_at() gives the hash of entry i.
+ */
+int hash_index_resize(struct hash_index *index, size_t size, size_t count,
+                      uint64_t (*hash_at)(const void *entries, size_t i),
+                      const void *entries) {
+    struct hash_index resized;
+    size_t i;
+
+    resized.slots = malloc(size * sizeof(*resized.slots));
+    resized.mask = size - 1;
+    if (!resized.slots) {
+        return -ENOMEM;
+    }
+    memset(resized.slots, 0xff, size * sizeof(*resized.slots));
+    for (i = 0; i < count; i++) {
+        hash_index_insert(&resized, hash_at(entries, i), (uint32_t)i);
+    }
+
+    free(index->slots);
+    *index = resized;
+    return 0;
+}
+
+void hash_index_insert(struct hash_index *index, uint64_t hash,
+                       uint32_t position) {
+    size_t slot = hash_index_slot(index, hash);
+
+    while (index->slots[slot] != HASH_INDEX_EMPTY) {
+        slot = hash_index_next(index, slot);
+    }
+    index->slots[slot] = position;
+}
+
+/* Make dst an independent copy of src, reusing dst's slots when they fit. */
+int hash_index_copy(struct hash_index *dst, const struct hash_index *src) {
+    if (!src->slots) {
+        hash_index_destroy(dst);
+        return 0;
+    }
+    if (!dst->slots || dst->mask != src->mask) {
+        uint32_t *slots = realloc(dst->slots,
+                                  (src->mask + 1) * sizeof(*slots));
+
+        if (!slots) {
+            return -ENOMEM;
+        }
+        dst->slots = slots;
+        dst->mask = src->mask;
+    }
+    memcpy(dst->slots, src->slots, (src->mask + 1) * sizeof(*dst->slots));
+    return 0;
+}
+
+void hash_index_destroy(struct hash_index *index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->mask = 0;
+}
@@ -3,6 +3,9 @@
 #include <math.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 static size_t next_power_of_two(size_t value) {
@@ -15,191 +18,193 @@ static size_t next_power_of_two(size_t value) {
 }
 
 static uint64_t hash_page(uint64_t page, enum address_kind kind) {
-    uint64_t x = page ^ ((uint64_t)kind << 61);
-
-    x ^= x >> 33;
-    x *= 0xff51afd7ed558ccdULL;
-    x ^= x >> 33;
-    x *= 0xc4ceb9fe1a85ec53ULL;
-    x ^= x >> 33;
-    return x;
-}
-
-static const char *page_state_name(const struct heat_page *page,
-                                   const struct profiler_options *options) {
-    if (page->heat >= options->hot_threshold) {
-        return "hot";
-    }
-    if (page->heat < options->cold_threshold) {
-        return "cold";
-    }
-    return "warm";
-}
-
-struct process_summary {
-    uint32_t pid;
-    double heat;
-    double total_weight;
-    uint64_t samples;
-    uint64_t pages;
-    uint64_t hot_pages;
-    uint64_t warm_pages;
-    uint64_t cold_pages;
-};
-
-struct overall_summary {
-    uint64_t total_pages;
-    uint64_t hot_pages;
-    uint64_t warm_pages;
-    uint64_t cold_pages;
-    uint64_t total_bytes;
-    uint64_t hot_bytes;
-    uint64_t warm_bytes;
-    uint64_t cold_bytes;
-    double total_heat;
-    double hot_heat;
-    double warm_heat;
-    double cold_heat;
-    uint64_t total_samples;
-    uint64_t hot_samples;
-    uint64_t warm_samples;
-    uint64_t cold_samples;
-};
-
-static double summary_metric_total(const struct overall_summary *summary,
-                                   enum summary_metric metric) {
-    switch (metric) {
-    case SUMMARY_HEAT:
-        return summary->total_heat;
-    case SUMMARY_SAMPLES:
-        return (double)summary->total_samples;
-    case SUMMARY_PAGES:
-    default:
-        return (double)summary->total_pages;
-    }
+    return hash_u64(page ^ ((uint64_t)kind << 61));
 }
 
-static double summary_metric_value(const struct overall_summary *summary,
-                                   enum summary_metric metric,
-                                   const char *state) {
-    if (metric == SUMMARY_HEAT) {
-        if (strcmp(state, "hot") == 0) {
-            return summary->hot_heat;
-        }
-        if (strcmp(state, "cold") == 0) {
-            return summary->cold_heat;
-        }
-        return summary->warm_heat;
-    }
+static int heatmap_alloc_table(struct heatmap *heatmap, size_t capacity) {
+    uint8_t *ctrl = malloc(capacity);
+    struct heat_page *pages = malloc(capacity * sizeof(*pages));
+
+    if (!ctrl || !pages) {
+        free(ctrl);
+        free(pages);
+        return -ENOMEM;
+    }
+
+    /*
+     * Only the control bytes need initialising: a payload slot is cleared
+     * when a page is inserted into it, so the large payload array is never
+     * zeroed up front.
+     */
+    memset(ctrl, HEATMAP_CTRL_EMPTY, capacity);
+    heatmap->ctrl = ctrl;
+    heatmap->pages = pages;
+    heatmap->capacity = capacity;
+    heatmap->tombstones = 0;
+    return 0;
+}
 
-    if (metric == SUMMARY_SAMPLES) {
-        if (strcmp(state, "hot") == 0) {
-            return (double)summary->hot_samples;
-        }
-        if (strcmp(state, "cold") == 0) {
-            return (double)summary->cold_samples;
-        }
-        return (double)summary->warm_samples;
-    }
+static bool heatmap_wants_ext(const struct heatmap *heatmap,
+                              const struct profiler_options *options) {
+    return (options->track_numa && heatmap->numa) || options->track_sites ||
+           heatmap->mem_info;
+}
+
+static int page_ext_grow(struct heatmap *heatmap,
+                         const struct profiler_options *options) {
+    struct page_ext_pool *pool = &heatmap->ext;
+    size_t capacity = pool->capacity ? pool->capacity * 2 :
+                      HEATMAP_INITIAL_CAPACITY;
+    uint32_t *free_ids;
 
-    if (strcmp(state, "hot") == 0) {
-        return (double)summary->hot_pages;
+    if (capacity > UINT32_MAX) {
+        return -ENOMEM;
     }
-    if (strcmp(state, "cold") == 0) {
-        return (double)summary->cold_pages;
+    free_ids = realloc(pool->free_ids, capacity * sizeof(*free_ids));
+    if (!free_ids) {
+        return -ENOMEM;
     }
-    return (double)summary->warm_pages;
-}
+    pool->free_ids = free_ids;
+    if (options->track_numa) {
+        struct heat_page_numa *numa = realloc(pool->numa,
+                                              capacity * sizeof(*numa));
 
-static const char *classify_page_state(const struct heat_page *page,
-                                       const struct profiler_options *options,
-                                       size_t rank,
-                                       size_t total_count) {
-    if (options->heat_policy == HEAT_POLICY_PERCENTILE) {
-        size_t hot_cutoff;
-        size_t cold_cutoff;
-        size_t cold_start;
-
-        hot_cutoff = (size_t)((options->hot_percent / 100.0) * (double)total_count);
-        cold_cutoff = (size_t)((options->cold_percent / 100.0) * (double)total_count);
-        if (options->hot_percent > 0.0 && hot_cutoff == 0 && total_count > 0) {
-            hot_cutoff = 1;
-        }
-        if (options->cold_percent > 0.0 && cold_cutoff == 0 && total_count > 0) {
-            cold_cutoff = 1;
-        }
-        if (hot_cutoff > total_count) {
-            hot_cutoff = total_count;
-        }
-        if (cold_cutoff > total_count) {
-            cold_cutoff = total_count;
+        if (!numa) {
+            return -ENOMEM;
         }
+        pool->numa = numa;
+    }
+    if (options->track_sites) {
+        struct heat_page_sites *sites = realloc(pool->sites,
+                                                capacity * sizeof(*sites));
 
-        if (rank < hot_cutoff) {
-            return "hot";
+        if (!sites) {
+            return -ENOMEM;
         }
+        pool->sites = sites;
+    }
+    if (heatmap->mem_info) {
+        struct heat_page_mem *mem = realloc(pool->mem,
+                                            capacity * sizeof(*mem));
 
-        cold_start = cold_cutoff >= total_count ? 0 : total_count - cold_cutoff;
-        if (cold_start < hot_cutoff) {
-            cold_start = hot_cutoff;
-        }
-        if (rank >= cold_start) {
-            return "cold";
+        if (!mem) {
+            return -ENOMEM;
         }
-        return "warm";
+        pool->mem = mem;
     }
-
-    return page_state_name(page, options);
+    if (pool->count == 0) {
+        /* Id 0 stands for "no entry". */
+        pool->count = 1;
+    }
+    pool->capacity = capacity;
+    return 0;
 }
 
-static struct overall_summary build_overall_summary(
-    struct heat_page **ordered,
-    size_t count,
-    const struct profiler_options *options,
-    size_t page_shift) {
-    struct overall_summary summary;
-    size_t i;
-    uint64_t page_bytes = 1ULL << page_shift;
+/* A cleared entry for a new page, or 0 when there is no memory for one. */
+static uint32_t page_ext_alloc(struct heatmap *heatmap,
+                               const struct profiler_options *options) {
+    struct page_ext_pool *pool = &heatmap->ext;
+    uint32_t id;
 
-    memset(&summary, 0, sizeof(summary));
-    summary.total_pages = count;
-    summary.total_bytes = count * page_bytes;
+    if (pool->nr_free > 0) {
+        id = pool->free_ids[--pool->nr_free];
+    } else {
+        if (pool->count == pool->capacity &&
+            page_ext_grow(heatmap, options) != 0) {
+            return 0;
+        }
+        id = (uint32_t)pool->count++;
+    }
+    if (pool->numa) {
+        memset(&pool->numa[id], 0, sizeof(pool->numa[id]));
+    }
+    if (pool->sites) {
+        memset(&pool->sites[id], 0, sizeof(pool->sites[id]));
+    }
+    if (pool->mem) {
+        memset(&pool->mem[id], 0, sizeof(pool->mem[id]));
+    }
+    return id;
+}
 
-    for (i = 0; i < count; i++) {
-        const struct heat_page *page = ordered[i];
-        const char *state = classify_page_state(ordered[i], options, i, count);
+static void page_ext_release(struct page_ext_pool *pool, uint32_t id) {
+    if (id != 0) {
+        pool->free_ids[pool->nr_free++] = id;
+    }
+}
 
-        summary.total_heat += page->heat;
-        summary.total_samples += page->samples;
+static void page_ext_destroy(struct page_ext_pool *pool) {
+    free(pool->numa);
+    free(pool->sites);
+    free(pool->mem);
+    free(pool->free_ids);
+    memset(pool, 0, sizeof(*pool));
+}
 
-        if (strcmp(state, "hot") == 0) {
-            summary.hot_pages++;
-            summary.hot_bytes += page_bytes;
-            summary.hot_heat += page->heat;
-            summary.hot_samples += page->samples;
-        } else if (strcmp(state, "cold") == 0) {
-            summary.cold_pages++;
-            summary.cold_bytes += page_bytes;
-            summary.cold_heat += page->heat;
-            summary.cold_samples += page->samples;
-        } else {
-            summary.warm_pages++;
-            summary.warm_bytes += page_bytes;
-            summary.warm_heat += page->heat;
-            summary.warm_samples += page->samples;
+static int page_ext_copy(struct page_ext_pool *dst,
+                         const struct page_ext_pool *src) {
+    if (dst->capacity != src->capacity ||
+        (dst->numa == NULL) != (src->numa == NULL) ||
+        (dst->sites == NULL) != (src->sites == NULL) ||
+        (dst->mem == NULL) != (src->mem == NULL)) {
+        page_ext_destroy(dst);
+        if (src->capacity) {
+            dst->free_ids = malloc(src->capacity * sizeof(*dst->free_ids));
+            if (src->numa) {
+                dst->numa = malloc(src->capacity * sizeof(*dst->numa));
+            }
+            if (src->sites) {
+                dst->sites = malloc(src->capacity * sizeof(*dst->sites));
+            }
+            if (src->mem) {
+                dst->mem = malloc(src->capacity * sizeof(*dst->mem));
+            }
+            if (!dst->free_ids || (src->numa && !dst->numa) ||
+                (src->sites && !dst->sites) || (src->mem && !dst->mem)) {
+                page_ext_destroy(dst);
+                return -ENOMEM;
+            }
         }
     }
 
-    return summary;
+    if (src->numa) {
+        memcpy(dst->numa, src->numa, src->count * sizeof(*dst->numa));
+    }
+    if (src->sites) {
+        memcpy(dst->sites, src->sites, src->count * sizeof(*dst->sites));
+    }
+    if (src->mem) {
+        memcpy(dst->mem, src->mem, src->count * sizeof(*dst->mem));
+    }
+    if (src->nr_free) {
+        memcpy(dst->free_ids, src->free_ids,
+               src->nr_free * sizeof(*dst->free_ids));
+    }
+    dst->nr_free = src->nr_free;
+    dst->count = src->count;
+    dst->capacity = src->capacity;
+    return 0;
 }
 
 void heatmap_init(struct heatmap *heatmap, size_t max_pages, size_t page_shift) {
-    size_t capacity = next_power_of_two(max_pages * 2);
+    size_t max_capacity = next_power_of_two(max_pages * 2);
 
     memset(heatmap, 0, sizeof(*heatmap));
-    heatmap->capacity = capacity < 1024 ? 1024 : capacity;
-    heatmap->pages = calloc(heatmap->capacity, sizeof(*heatmap->pages));
+    if (max_capacity < HEATMAP_INITIAL_CAPACITY) {
+        max_capacity = HEATMAP_INITIAL_CAPACITY;
+    }
+    /*
+     * Start small and let the table double on demand; max_pages only sets
+     * the ceiling, so memory follows the working set actually observed.
+     */
+    if (heatmap_alloc_table(heatmap, HEATMAP_INITIAL_CAPACITY) != 0) {
+        heatmap->capacity = 0;
+    }
+    heatmap->max_capacity = max_capacity;
     heatmap->page_shift = page_shift;
+    region_table_init(&heatmap->regions[0], REGION_2M_SHIFT,
+                      (unsigned)page_shift);
+    region_table_init(&heatmap->regions[1], REGION_1G_SHIFT, REGION_2M_SHIFT);
 }
 
 void heatmap_destroy(struct heatmap *heatmap) {
@@ -210,7 +215,15 @@ void heatmap_destroy(struct heatmap *heatmap) {
             close(heatmap->pagemap_cache[i].fd);
         }
     }
+    free(heatmap->old_ctrl);
+    free(heatmap->old_pages);
+    free(heatmap->ctrl);
     free(heatmap->pages);
+    for (i = 0; i < REGION_LEVELS; i++) {
+        region_table_destroy(&heatmap->regions[i]);
+    }
+    site_table_destroy(&heatmap->sites);
+    page_ext_destroy(&heatmap->ext);
     memset(heatmap, 0, sizeof(*heatmap));
 }
 
@@ -311,7 +324,7 @@ static uint64_t resolve_page_key(struct heatmap *heatmap,
             *kind = ADDR_KIND_PHYSICAL;
             return sample->phys_addr >> heatmap->page_shift;
         }
-        if (sample->has_addr &&
+        if (sample->has_addr && !heatmap->replay &&
             translate_user_vaddr_to_phys_page(heatmap, (pid_t)sample->pid,
                                               sample->addr, &phys_page)) {
             *kind = ADDR_KIND_PHYSICAL;
@@ -327,7 +340,7 @@ static uint64_t resolve_page_key(struct heatmap *heatmap,
         return sample->phys_addr >> heatmap->page_shift;
     }
 
-    if (sample->has_addr &&
+    if (sample->has_addr && !heatmap->replay &&
         translate_user_vaddr_to_phys_page(heatmap, (pid_t)sample->pid,
                                           sample->addr, &phys_page)) {
         heatmap->phys_translate_attempts++;
@@ -335,7 +348,7 @@ static uint64_t resolve_page_key(struct heatmap *heatmap,
         return phys_page;
     }
 
-    if (sample->has_addr) {
+    if (sample->has_addr && !heatmap->replay) {
         heatmap->phys_translate_attempts++;
         heatmap->phys_translate_failures++;
     }
@@ -401,10 +414,33 @@ static void heat_page_track_owner(struct heat_page *page,
     heat_page_refresh_owner(page);
 }
 
+static double heatmap_cooling_factor(struct heatmap *heatmap,
+                                     const struct profiler_options *options,
+                                     uint64_t intervals) {
+    size_t i;
+
+    if (heatmap->cooling_factor_decay != options->cooling_decay ||
+        heatmap->cooling_factors[0] != 1.0) {
+        for (i = 0; i < ARRAY_SIZE(heatmap->cooling_factors); i++) {
+            heatmap->cooling_factors[i] = pow(options->cooling_decay, (double)i);
+        }
+        heatmap->cooling_factor_decay = options->cooling_decay;
+    }
+
+    if (intervals < ARRAY_SIZE(heatmap->cooling_factors)) {
+        return heatmap->cooling_factors[intervals];
+    }
+    return pow(options->cooling_decay, (double)intervals);
+}
+
+/*
+ * Advance the cooling clock only. Individual pages are decayed lazily by
+ * heat_page_cool() when they are touched, merged or reported, so crossing an
+ * interval boundary costs O(1) instead of a sweep over the whole table.
+ */
 static void heatmap_apply_cooling(struct heatmap *heatmap,
                                   const struct profiler_options *options,
                                   uint64_t now_ns) {
-    size_t i;
     uint64_t elapsed_intervals;
 
     if (options->cooling_mode == COOLING_NONE ||
@@ -427,564 +463,1329 @@ static void heatmap_apply_cooling(struct heatmap *heatmap,
         return;
     }
 
+    heatmap->cooling_epoch += elapsed_intervals;
+    heatmap->last_cooling_ns += elapsed_intervals * options->cooling_interval_ns;
+}
+
+/* Bring one heat value, last cooled at *cool_epoch, up to the current epoch. */
+static void heat_value_cool(struct heatmap *heatmap,
+                            const struct profiler_options *options,
+                            double *heat, uint64_t *cool_epoch) {
+    uint64_t intervals = heatmap->cooling_epoch - *cool_epoch;
+
+    *cool_epoch = heatmap->cooling_epoch;
+    if (intervals == 0 || *heat <= 0.0) {
+        return;
+    }
+
+    if (options->cooling_mode == COOLING_STEP) {
+        double delta = options->cooling_step * (double)intervals;
+        *heat = *heat > delta ? *heat - delta : 0.0;
+    } else if (options->cooling_mode == COOLING_EXP) {
+        *heat *= heatmap_cooling_factor(heatmap, options, intervals);
+    }
+}
+
+/*
+ * The --numa local and remote shares and the --sites slots are scaled along
+ * with the heat, which keeps their ratios under step cooling as well as
+ * under exp cooling.
+ */
+static void heat_page_cool(struct heatmap *heatmap,
+                           const struct profiler_options *options,
+                           struct heat_page *page) {
+    struct heat_page_numa *numa;
+    struct heat_page_sites *sites;
+    double heat = page->heat;
+    double scale;
+    size_t i;
+
+    heat_value_cool(heatmap, options, &page->heat, &page->cool_epoch);
+    if (page->heat == heat) {
+        return;
+    }
+    scale = heat > 0.0 ? page->heat / heat : 0.0;
+    numa = heatmap_page_numa(heatmap, page);
+    if (numa) {
+        numa->local_heat *= scale;
+        numa->remote_heat *= scale;
+    }
+    sites = heatmap_page_sites(heatmap, page);
+    if (sites) {
+        for (i = 0; i < PAGE_SITE_SLOTS; i++) {
+            sites->slots[i].heat *= scale;
+        }
+    }
+}
+
+void heatmap_settle_cooling(struct heatmap *heatmap,
+                            const struct profiler_options *options) {
+    size_t i;
+    size_t level;
+
     for (i = 0; i < heatmap->capacity; i++) {
-        struct heat_page *page = &heatmap->pages[i];
+        if (heatmap_slot_used(heatmap, i)) {
+            heat_page_cool(heatmap, options, &heatmap->pages[i]);
+        }
+    }
+    for (level = 0; level < REGION_LEVELS; level++) {
+        struct region_table *table = &heatmap->regions[level];
+
+        for (i = 0; i < table->count; i++) {
+            heat_value_cool(heatmap, options, &table->regions[i].heat,
+                            &table->regions[i].cool_epoch);
+        }
+    }
+    for (i = 0; i < heatmap->sites.count; i++) {
+        heat_value_cool(heatmap, options, &heatmap->sites.sites[i].heat,
+                        &heatmap->sites.sites[i].cool_epoch);
+    }
+}
+
+static uint16_t ctrl_group_match(const uint8_t *group, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl,
+                                                      _mm_set1_epi8((char)tag)));
+#else
+    uint16_t mask = 0;
+    size_t i;
+
+    for (i = 0; i < HEATMAP_GROUP_WIDTH; i++) {
+        if (group[i] == tag) {
+            mask |= (uint16_t)(1U << i);
+        }
+    }
+    return mask;
+#endif
+}
+
+static uint16_t ctrl_group_match_free(const uint8_t *group) {
+#ifdef __SSE2__
+    /* EMPTY and DELETED are the only control values with the top bit set. */
+    return (uint16_t)_mm_movemask_epi8(
+        _mm_loadu_si128((const __m128i *)group));
+#else
+    uint16_t mask = 0;
+    size_t i;
+
+    for (i = 0; i < HEATMAP_GROUP_WIDTH; i++) {
+        if (group[i] & 0x80) {
+            mask |= (uint16_t)(1U << i);
+        }
+    }
+    return mask;
+#endif
+}
+
+static void heatmap_remove_slot(struct heatmap *heatmap, size_t index) {
+    const uint8_t *group = heatmap->ctrl +
+                           (index & ~(size_t)(HEATMAP_GROUP_WIDTH - 1));
+
+    /*
+     * Probing stops at the first group that still has an EMPTY slot. Such a
+     * group has never been full, so no probe chain runs through it and the
+     * slot can go straight back to EMPTY. Otherwise leave a tombstone.
+     */
+    if (ctrl_group_match(group, HEATMAP_CTRL_EMPTY) != 0) {
+        heatmap->ctrl[index] = HEATMAP_CTRL_EMPTY;
+    } else {
+        heatmap->ctrl[index] = HEATMAP_CTRL_DELETED;
+        heatmap->tombstones++;
+    }
+    heatmap->count--;
+}
+
+static bool heatmap_pick_victim_clock(struct heatmap *heatmap, size_t *victim) {
+    size_t mask = heatmap->capacity - 1;
+    size_t steps;
+
+    /*
+     * Two full turns are enough: the first one clears every reference bit,
+     * the second one is then guaranteed to find an unreferenced page.
+     */
+    for (steps = 0; steps < 2 * heatmap->capacity; steps++) {
+        struct heat_page *page = &heatmap->pages[heatmap->evict_hand];
+        size_t index = heatmap->evict_hand;
 
-        if (!page->used || page->heat <= 0.0) {
+        heatmap->evict_hand = (heatmap->evict_hand + 1) & mask;
+        if (!heatmap_slot_used(heatmap, index)) {
             continue;
         }
+        if (page->referenced) {
+            page->referenced = false;
+            continue;
+        }
+        *victim = index;
+        return true;
+    }
+    return false;
+}
 
-        if (options->cooling_mode == COOLING_STEP) {
-            double delta = options->cooling_step * (double)elapsed_intervals;
-            page->heat = page->heat > delta ? page->heat - delta : 0.0;
-        } else if (options->cooling_mode == COOLING_EXP) {
-            page->heat *= pow(options->cooling_decay, (double)elapsed_intervals);
+static bool heatmap_pick_victim_coldest(struct heatmap *heatmap,
+                                        const struct profiler_options *options,
+                                        size_t *victim) {
+    size_t mask = heatmap->capacity - 1;
+    size_t seen = 0;
+    size_t steps;
+    struct heat_page *coldest = NULL;
+
+    /*
+     * Sampled LFU: look at the next EVICT_SAMPLE_PAGES tracked pages after the
+     * hand and evict the one with the lowest cooled heat. Sampling keeps the
+     * eviction cost bounded while still steering away from the hot set.
+     */
+    for (steps = 0; steps < heatmap->capacity && seen < EVICT_SAMPLE_PAGES;
+         steps++) {
+        struct heat_page *page = &heatmap->pages[heatmap->evict_hand];
+        size_t index = heatmap->evict_hand;
+
+        heatmap->evict_hand = (heatmap->evict_hand + 1) & mask;
+        if (!heatmap_slot_used(heatmap, index)) {
+            continue;
+        }
+        heat_page_cool(heatmap, options, page);
+        seen++;
+        if (!coldest || page->heat < coldest->heat ||
+            (page->heat == coldest->heat && page->samples < coldest->samples)) {
+            coldest = page;
+            *victim = index;
         }
     }
+    return coldest != NULL;
+}
 
-    heatmap->last_cooling_ns += elapsed_intervals * options->cooling_interval_ns;
+/*
+ * While the table is being migrated, the pages still waiting in the retired
+ * table are out of reach of the hands above. Look for a victim among the
+ * next HEATMAP_MIGRATE_SLOTS retired slots after the migration cursor,
+ * with the same policy: the first unreferenced page for clock, the coldest
+ * of at most EVICT_SAMPLE_PAGES pages for coldest.
+ */
+static bool heatmap_pick_victim_retired(struct heatmap *heatmap,
+                                        const struct profiler_options *options,
+                                        size_t *victim) {
+    size_t end = heatmap->migrate_cursor + HEATMAP_MIGRATE_SLOTS;
+    size_t seen = 0;
+    size_t i;
+    struct heat_page *coldest = NULL;
+
+    if (end > heatmap->old_capacity) {
+        end = heatmap->old_capacity;
+    }
+    for (i = heatmap->migrate_cursor; i < end && seen < EVICT_SAMPLE_PAGES;
+         i++) {
+        struct heat_page *page = &heatmap->old_pages[i];
+
+        if (heatmap->old_ctrl[i] >= HEATMAP_CTRL_EMPTY) {
+            continue;
+        }
+        if (options->evict_policy == EVICT_CLOCK) {
+            if (page->referenced) {
+                page->referenced = false;
+                continue;
+            }
+            *victim = i;
+            return true;
+        }
+        heat_page_cool(heatmap, options, page);
+        seen++;
+        if (!coldest || page->heat < coldest->heat ||
+            (page->heat == coldest->heat && page->samples < coldest->samples)) {
+            coldest = page;
+            *victim = i;
+        }
+    }
+    return coldest != NULL;
 }
 
-static struct heat_page *heatmap_lookup(struct heatmap *heatmap, uint64_t page,
-                                        enum address_kind kind,
-                                        size_t max_pages) {
-    size_t index = (size_t)hash_page(page, kind) & (heatmap->capacity - 1);
-    size_t start = index;
+static bool heatmap_evict_one(struct heatmap *heatmap,
+                              const struct profiler_options *options) {
+    size_t victim = 0;
+    bool found;
+
+    if (options->evict_policy == EVICT_NONE) {
+        return false;
+    }
+    if (heatmap->old_ctrl &&
+        heatmap_pick_victim_retired(heatmap, options, &victim)) {
+        page_ext_release(&heatmap->ext, heatmap->old_pages[victim].ext);
+        heatmap->old_ctrl[victim] = HEATMAP_CTRL_DELETED;
+        heatmap->old_count--;
+        heatmap->count--;
+        heatmap->evicted_pages++;
+        return true;
+    }
+
+    switch (options->evict_policy) {
+    case EVICT_CLOCK:
+        found = heatmap_pick_victim_clock(heatmap, &victim);
+        break;
+    case EVICT_COLDEST:
+        found = heatmap_pick_victim_coldest(heatmap, options, &victim);
+        break;
+    case EVICT_NONE:
+    default:
+        return false;
+    }
+
+    if (!found) {
+        return false;
+    }
 
-    do {
-        struct heat_page *slot = &heatmap->pages[index];
+    page_ext_release(&heatmap->ext, heatmap->pages[victim].ext);
+    heatmap_remove_slot(heatmap, victim);
+    heatmap->evicted_pages++;
+    return true;
+}
 
-        if (!slot->used) {
-            if (heatmap->count >= max_pages) {
-                heatmap->dropped_pages++;
-                return NULL;
+static size_t table_find_slot(const uint8_t *ctrl_base,
+                              const struct heat_page *pages, size_t capacity,
+                              uint64_t hash, uint64_t page,
+                              enum address_kind kind, size_t *free_slot) {
+    size_t group_mask = capacity / HEATMAP_GROUP_WIDTH - 1;
+    size_t group = (size_t)(hash >> 7) & group_mask;
+    uint8_t tag = (uint8_t)(hash & 0x7f);
+    size_t probe;
+
+    *free_slot = SIZE_MAX;
+
+    /*
+     * Triangular probing over groups visits every group exactly once when
+     * the group count is a power of two.
+     */
+    for (probe = 0; probe <= group_mask; probe++) {
+        size_t base = group * HEATMAP_GROUP_WIDTH;
+        const uint8_t *ctrl = ctrl_base + base;
+        uint16_t match = ctrl_group_match(ctrl, tag);
+
+        while (match) {
+            size_t index = base + (size_t)__builtin_ctz(match);
+            const struct heat_page *slot = &pages[index];
+
+            if (slot->page == page && slot->kind == kind) {
+                return index;
             }
+            match &= (uint16_t)(match - 1);
+        }
 
-            slot->used = true;
-            slot->page = page;
-            slot->kind = kind;
-            heatmap->count++;
-            return slot;
+        if (*free_slot == SIZE_MAX) {
+            uint16_t free_mask = ctrl_group_match_free(ctrl);
+
+            if (free_mask) {
+                *free_slot = base + (size_t)__builtin_ctz(free_mask);
+            }
+        }
+        if (ctrl_group_match(ctrl, HEATMAP_CTRL_EMPTY)) {
+            break;
         }
+        group = (group + probe + 1) & group_mask;
+    }
+
+    return SIZE_MAX;
+}
 
-        if (slot->page == page && slot->kind == kind) {
-            return slot;
+static size_t heatmap_find_slot(const struct heatmap *heatmap, uint64_t hash,
+                                uint64_t page, enum address_kind kind,
+                                size_t *free_slot) {
+    return table_find_slot(heatmap->ctrl, heatmap->pages, heatmap->capacity,
+                           hash, page, kind, free_slot);
+}
+
+static void heatmap_claim_slot(struct heatmap *heatmap, size_t index,
+                               uint64_t hash) {
+    if (heatmap->ctrl[index] == HEATMAP_CTRL_DELETED) {
+        heatmap->tombstones--;
+    }
+    heatmap->ctrl[index] = (uint8_t)(hash & 0x7f);
+}
+
+static void heatmap_migrate_page(struct heatmap *heatmap,
+                                 const struct heat_page *page) {
+    uint64_t hash = hash_page(page->page, page->kind);
+    size_t free_slot;
+
+    table_find_slot(heatmap->ctrl, heatmap->pages, heatmap->capacity, hash,
+                    page->page, page->kind, &free_slot);
+    heatmap->pages[free_slot] = *page;
+    heatmap_claim_slot(heatmap, free_slot, hash);
+    heatmap->old_count--;
+}
+
+/*
+ * Move up to HEATMAP_MIGRATE_SLOTS slots from the retired table into the
+ * current one. Called on every insert, so a resize is spread over many
+ * samples instead of stalling ring draining with a full rehash.
+ */
+static void heatmap_step_resize(struct heatmap *heatmap) {
+    size_t end;
+
+    if (!heatmap->old_ctrl) {
+        return;
+    }
+
+    end = heatmap->migrate_cursor + HEATMAP_MIGRATE_SLOTS;
+    if (end > heatmap->old_capacity) {
+        end = heatmap->old_capacity;
+    }
+    for (; heatmap->migrate_cursor < end; heatmap->migrate_cursor++) {
+        size_t i = heatmap->migrate_cursor;
+
+        /*
+         * Leave a tombstone: once evicted from the current table, a
+         * migrated page must not be found again in the retired one.
+         */
+        if (heatmap->old_ctrl[i] < HEATMAP_CTRL_EMPTY) {
+            heatmap_migrate_page(heatmap, &heatmap->old_pages[i]);
+            heatmap->old_ctrl[i] = HEATMAP_CTRL_DELETED;
         }
+    }
+
+    if (heatmap->migrate_cursor == heatmap->old_capacity) {
+        free(heatmap->old_ctrl);
+        free(heatmap->old_pages);
+        heatmap->old_ctrl = NULL;
+        heatmap->old_pages = NULL;
+        heatmap->old_capacity = 0;
+        heatmap->old_count = 0;
+        heatmap->migrate_cursor = 0;
+    }
+}
+
+void heatmap_finish_resize(struct heatmap *heatmap) {
+    while (heatmap->old_ctrl) {
+        heatmap_step_resize(heatmap);
+    }
+}
+
+static bool heatmap_start_resize(struct heatmap *heatmap, size_t capacity) {
+    struct heatmap fresh;
+
+    heatmap_finish_resize(heatmap);
+
+    fresh = *heatmap;
+    if (heatmap_alloc_table(&fresh, capacity) != 0) {
+        return false;
+    }
 
-        index = (index + 1) & (heatmap->capacity - 1);
-    } while (index != start);
+    fresh.old_ctrl = heatmap->ctrl;
+    fresh.old_pages = heatmap->pages;
+    fresh.old_capacity = heatmap->capacity;
+    fresh.old_count = heatmap->count;
+    fresh.migrate_cursor = 0;
+    fresh.evict_hand = 0;
+    *heatmap = fresh;
+    return true;
+}
+
+/*
+ * Make sure the current table can take one more page. Grows by doubling up to
+ * max_capacity; at the ceiling, a same-size resize sheds the tombstones left
+ * by eviction. Returns true when the current table was replaced.
+ */
+static bool heatmap_reserve_slot(struct heatmap *heatmap) {
+    size_t live = heatmap->count - heatmap->old_count;
+    size_t limit = heatmap->capacity - heatmap->capacity / 8;
+
+    if (live + heatmap->tombstones + 1 < limit) {
+        return false;
+    }
+    /*
+     * A resize still in flight is driven to its end one step per insert,
+     * never all at once; the current table has the slack to wait for it.
+     */
+    if (heatmap->old_ctrl) {
+        return false;
+    }
+
+    if (heatmap->capacity < heatmap->max_capacity &&
+        live >= heatmap->capacity / 2) {
+        return heatmap_start_resize(heatmap, heatmap->capacity * 2);
+    }
+    return heatmap_start_resize(heatmap, heatmap->capacity);
+}
+
+static struct heat_page *heatmap_lookup_hashed(
+    struct heatmap *heatmap, uint64_t hash, uint64_t page,
+    enum address_kind kind, const struct profiler_options *options) {
+    size_t free_slot;
+    size_t index;
+    size_t old_index = SIZE_MAX;
+    struct heat_page *slot;
+
+    index = heatmap_find_slot(heatmap, hash, page, kind, &free_slot);
+    if (index != SIZE_MAX) {
+        return &heatmap->pages[index];
+    }
 
-    heatmap->dropped_pages++;
+    if (heatmap->old_ctrl) {
+        size_t unused;
+
+        old_index = table_find_slot(heatmap->old_ctrl, heatmap->old_pages,
+                                    heatmap->old_capacity, hash, page, kind,
+                                    &unused);
+    }
+
+    if (old_index == SIZE_MAX && heatmap->count >= options->max_pages) {
+        if (!heatmap_evict_one(heatmap, options)) {
+            heatmap->dropped_pages++;
+            return NULL;
+        }
+        heatmap_find_slot(heatmap, hash, page, kind, &free_slot);
+    }
+
+    if (heatmap_reserve_slot(heatmap)) {
+        /* The table moved under us, including any not-yet-migrated hit. */
+        return heatmap_lookup_hashed(heatmap, hash, page, kind, options);
+    }
+
+    if (free_slot == SIZE_MAX) {
+        heatmap->dropped_pages++;
+        return NULL;
+    }
+
+    slot = &heatmap->pages[free_slot];
+    if (old_index != SIZE_MAX) {
+        /* Touched before its turn came: migrate it now. */
+        *slot = heatmap->old_pages[old_index];
+        heatmap->old_ctrl[old_index] = HEATMAP_CTRL_DELETED;
+        heatmap->old_count--;
+        heatmap_claim_slot(heatmap, free_slot, hash);
+    } else {
+        memset(slot, 0, sizeof(*slot));
+        slot->page = page;
+        slot->kind = kind;
+        slot->cool_epoch = heatmap->cooling_epoch;
+        if (heatmap_wants_ext(heatmap, options)) {
+            slot->ext = page_ext_alloc(heatmap, options);
+        }
+        heatmap_claim_slot(heatmap, free_slot, hash);
+        heatmap->count++;
+    }
+
+    heatmap_step_resize(heatmap);
+    return slot;
+}
+
+struct heat_page *heatmap_lookup(struct heatmap *heatmap, uint64_t page,
+                                 enum address_kind kind,
+                                 const struct profiler_options *options) {
+    return heatmap_lookup_hashed(heatmap, hash_page(page, kind), page, kind,
+                                 options);
+}
+
+/* Non-inserting lookup; NULL when the page is not tracked. */
+struct heat_page *heatmap_find(const struct heatmap *heatmap, uint64_t page,
+                               enum address_kind kind) {
+    uint64_t hash = hash_page(page, kind);
+    size_t unused;
+    size_t index = heatmap_find_slot(heatmap, hash, page, kind, &unused);
+
+    if (index != SIZE_MAX) {
+        return &heatmap->pages[index];
+    }
+    if (heatmap->old_ctrl) {
+        index = table_find_slot(heatmap->old_ctrl, heatmap->old_pages,
+                                heatmap->old_capacity, hash, page, kind,
+                                &unused);
+        if (index != SIZE_MAX) {
+            return &heatmap->old_pages[index];
+        }
+    }
     return NULL;
 }
 
-void heatmap_record(struct heatmap *heatmap,
-                    const struct profiler_options *options,
-                    const struct profiler_backend *backend,
-                    const struct sample_record *sample) {
-    struct heat_page *page;
-    enum address_kind kind = ADDR_KIND_VIRTUAL;
-    uint64_t page_key;
-    double weight;
+void heatmap_advance_time(struct heatmap *heatmap,
+                          const struct profiler_options *options,
+                          uint64_t time_ns) {
+    heatmap_apply_cooling(heatmap, options, time_ns);
+    if (time_ns > heatmap->last_time_ns) {
+        heatmap->last_time_ns = time_ns;
+    }
+}
+
+/* UINT64_MAX, counted as a dropped sample, when there is no usable address. */
+uint64_t heatmap_sample_key(struct heatmap *heatmap,
+                            const struct profiler_options *options,
+                            const struct profiler_backend *backend,
+                            const struct sample_record *sample,
+                            enum address_kind *kind) {
+    uint64_t page_key = resolve_page_key(heatmap, options, backend, sample,
+                                         kind);
 
-    heatmap_apply_cooling(heatmap, options, sample->time_ns);
-    page_key = resolve_page_key(heatmap, options, backend, sample, &kind);
     if (page_key == UINT64_MAX) {
         heatmap->dropped_samples++;
+    }
+    return page_key;
+}
+
+/*
+ * Decode the generic perf_mem_data_src encoding that both PEBS and IBS
+ * (since Linux 6.1) report. mem_lvl_num is preferred when the kernel sets
+ * it; older kernels only fill the mem_lvl bit mask.
+ */
+static enum mem_tier data_src_tier(uint64_t data_src) {
+    union perf_mem_data_src src = { .val = data_src };
+    bool remote = src.mem_remote == PERF_MEM_REMOTE_REMOTE;
+
+    /* "Missed L3" says where the access was not served, not where it was. */
+    if ((src.mem_lvl & PERF_MEM_LVL_MISS) && !(src.mem_lvl & PERF_MEM_LVL_HIT) &&
+        src.mem_lvl_num != PERF_MEM_LVLNUM_RAM) {
+        return MEM_TIER_OTHER;
+    }
+
+    switch (src.mem_lvl_num) {
+    case PERF_MEM_LVLNUM_L1:
+        return MEM_TIER_L1;
+    case PERF_MEM_LVLNUM_L2:
+        return remote ? MEM_TIER_REMOTE_CACHE : MEM_TIER_L2;
+    case PERF_MEM_LVLNUM_L3:
+    case PERF_MEM_LVLNUM_L4:
+    case PERF_MEM_LVLNUM_ANY_CACHE:
+        return remote ? MEM_TIER_REMOTE_CACHE : MEM_TIER_LLC;
+    case PERF_MEM_LVLNUM_RAM:
+        return remote ? MEM_TIER_REMOTE_DRAM : MEM_TIER_DRAM;
+    case 0:
+        break;
+    default:
+        return MEM_TIER_OTHER;
+    }
+
+    if (src.mem_lvl & PERF_MEM_LVL_L1) {
+        return MEM_TIER_L1;
+    }
+    if (src.mem_lvl & PERF_MEM_LVL_L2) {
+        return MEM_TIER_L2;
+    }
+    if (src.mem_lvl & PERF_MEM_LVL_L3) {
+        return MEM_TIER_LLC;
+    }
+    if (src.mem_lvl & PERF_MEM_LVL_LOC_RAM) {
+        return MEM_TIER_DRAM;
+    }
+    if (src.mem_lvl & (PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2)) {
+        return MEM_TIER_REMOTE_DRAM;
+    }
+    if (src.mem_lvl & (PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2)) {
+        return MEM_TIER_REMOTE_CACHE;
+    }
+    return MEM_TIER_OTHER;
+}
+
+/*
+ * --vma: attribute a page to the mapping of the process that first touched
+ * it. Physical keys need the sample's virtual address; virtual keys fall
+ * back to the page itself.
+ */
+static void heat_page_resolve_vma(struct heatmap *heatmap,
+                                  struct heat_page *page,
+                                  const struct sample_record *sample) {
+    uint64_t vaddr;
+
+    if (sample->has_addr) {
+        vaddr = sample->addr;
+    } else if (page->kind == ADDR_KIND_VIRTUAL) {
+        vaddr = page->page << heatmap->page_shift;
+    } else {
         return;
     }
+    if ((int64_t)vaddr <= 0) {
+        return;
+    }
+    page->vma = vma_index_resolve(heatmap->vmas, (pid_t)sample->pid, vaddr);
+}
 
-    page = heatmap_lookup(heatmap, page_key, kind, options->max_pages);
-    if (!page) {
+/*
+ * --numa: the memory node of a page, resolved when it is first sampled.
+ * Physical addresses map through the memory blocks; virtual ones are looked
+ * up with move_pages(), which may fail for other users' processes.
+ */
+static void heat_page_resolve_node(struct heatmap *heatmap,
+                                   const struct heat_page *page,
+                                   struct heat_page_numa *numa,
+                                   const struct sample_record *sample) {
+    int node = -1;
+
+    if (page->kind == ADDR_KIND_PHYSICAL) {
+        node = numa_phys_node(heatmap->numa, page->page << heatmap->page_shift);
+    } else if (sample->has_phys_addr && sample->phys_addr != 0) {
+        node = numa_phys_node(heatmap->numa, sample->phys_addr);
+    } else if ((int64_t)sample->addr > 0) {
+        node = numa_vaddr_node((pid_t)sample->pid, sample->addr);
+    }
+    numa->node = node >= 0 ? (uint16_t)(node + 1) : 0;
+}
+
+/*
+ * Split a sample's heat into local and remote by the node of the CPU that
+ * took it, and vote for that node as the page's main accessor.
+ */
+static void heat_page_apply_numa(struct heatmap *heatmap,
+                                 struct heat_page *page,
+                                 const struct sample_record *sample,
+                                 double heat) {
+    struct heat_page_numa *numa = heatmap_page_numa(heatmap, page);
+    int cpu_node = numa_cpu_node(heatmap->numa, sample->cpu);
+    uint16_t node;
+
+    if (!numa) {
+        return;
+    }
+    if (page->samples == 0) {
+        heat_page_resolve_node(heatmap, page, numa, sample);
+    }
+    if (cpu_node < 0) {
+        return;
+    }
+    node = (uint16_t)(cpu_node + 1);
+    if (numa->access_node == node) {
+        numa->access_votes++;
+    } else if (numa->access_votes == 0) {
+        numa->access_node = node;
+        numa->access_votes = 1;
+    } else {
+        numa->access_votes--;
+    }
+
+    if (numa->node == 0) {
         return;
     }
+    if (numa->node == node) {
+        numa->local_heat += heat;
+    } else {
+        numa->remote_heat += heat;
+        numa->remote_samples++;
+    }
+}
 
+/*
+ * --sites: add a sample's heat to the page's slot for its (pid, ip). A new
+ * site takes a free slot, else the coldest one.
+ */
+static void heat_page_track_site(struct heatmap *heatmap,
+                                 struct heat_page *page,
+                                 const struct sample_record *sample,
+                                 double heat) {
+    struct heat_page_sites *sites = heatmap_page_sites(heatmap, page);
+    struct heat_page_site *slot;
+    size_t i;
+
+    if (!sites) {
+        return;
+    }
+    for (i = 0; i < PAGE_SITE_SLOTS; i++) {
+        slot = &sites->slots[i];
+        if (slot->samples && slot->pid == sample->pid &&
+            slot->ip == sample->ip) {
+            slot->heat += heat;
+            slot->samples++;
+            return;
+        }
+    }
+
+    slot = &sites->slots[0];
+    for (i = 1; i < PAGE_SITE_SLOTS && slot->samples; i++) {
+        if (!sites->slots[i].samples || sites->slots[i].heat < slot->heat) {
+            slot = &sites->slots[i];
+        }
+    }
+    slot->ip = sample->ip;
+    slot->pid = sample->pid;
+    slot->samples = 1;
+    slot->heat = heat;
+}
+
+static void heat_page_apply_sample(struct heatmap *heatmap,
+                                   const struct profiler_options *options,
+                                   struct heat_page *page,
+                                   const struct sample_record *sample) {
+    double heat = sample_heat(options, sample);
+    struct heat_page_mem *mem;
+    double weight;
+
+    if (options->track_vmas && heatmap->vmas && page->samples == 0) {
+        heat_page_resolve_vma(heatmap, page, sample);
+    }
+    heat_page_cool(heatmap, options, page);
+    if (options->track_numa && heatmap->numa) {
+        heat_page_apply_numa(heatmap, page, sample, heat);
+    }
+    if (options->track_sites) {
+        heat_page_track_site(heatmap, page, sample, heat);
+    }
+    page->referenced = true;
     weight = sample->has_weight && sample->weight != 0 ?
              (double)sample->weight : 0.0;
-    page->heat += 1.0;
+    page->heat += heat;
     page->total_weight += weight;
     page->samples++;
     page->last_ip = sample->ip;
     page->last_time_ns = sample->time_ns;
     page->last_data_src = sample->has_data_src ? sample->data_src : 0;
+    mem = heatmap_page_mem(heatmap, page);
+    if (mem && sample->has_data_src) {
+        mem->tier_samples[data_src_tier(sample->data_src)]++;
+    }
+    if (mem && weight != 0.0) {
+        latency_hist_add(&mem->latency, sample->weight);
+    }
+    page->last_cpu = sample->cpu;
     heat_page_track_owner(page, sample);
 }
 
-static int compare_heat_page_desc(const void *lhs, const void *rhs) {
-    const struct heat_page *const *a = lhs;
-    const struct heat_page *const *b = rhs;
-
-    if ((*a)->heat < (*b)->heat) {
-        return 1;
-    }
-    if ((*a)->heat > (*b)->heat) {
-        return -1;
+/*
+ * --regions: fold a sample into its 2M and 1G regions. This runs whether or
+ * not the base page found room in the page table.
+ */
+static void heatmap_record_regions(struct heatmap *heatmap,
+                                   const struct profiler_options *options,
+                                   uint64_t page_key, enum address_kind kind,
+                                   const struct sample_record *sample) {
+    uint64_t addr = page_key << heatmap->page_shift;
+    size_t level;
+
+    for (level = 0; level < REGION_LEVELS; level++) {
+        struct region_table *table = &heatmap->regions[level];
+        struct heat_region *region;
+
+        if (!table->shift) {
+            continue;
+        }
+        region = region_table_get(table, addr >> table->shift, kind,
+                                  options->max_pages);
+        if (!region) {
+            table->dropped_samples++;
+            continue;
+        }
+        if (region->samples == 0) {
+            region->cool_epoch = heatmap->cooling_epoch;
+        }
+        heat_value_cool(heatmap, options, &region->heat, &region->cool_epoch);
+        region->heat += sample_heat(options, sample);
+        region->samples++;
+        if (sample->has_weight && sample->weight != 0) {
+            latency_hist_add(&region->latency, sample->weight);
+        }
+        region_mark_child(region, table, addr);
     }
-    if ((*a)->samples < (*b)->samples) {
-        return 1;
+}
+
+/*
+ * --sites: fold a sample into its (pid, ip) site. Like regions this runs
+ * whether or not the page found room. Kernel addresses are never in a
+ * process' maps, so they are not looked up.
+ */
+static void heatmap_record_site(struct heatmap *heatmap,
+                                const struct profiler_options *options,
+                                const struct sample_record *sample) {
+    struct heat_site *site = site_table_get(&heatmap->sites, sample->pid,
+                                            sample->ip, options->max_pages);
+
+    if (!site) {
+        heatmap->sites.dropped_samples++;
+        return;
     }
-    if ((*a)->samples > (*b)->samples) {
-        return -1;
+    if (site->samples == 0) {
+        site->cool_epoch = heatmap->cooling_epoch;
+        if (heatmap->vmas && (int64_t)sample->ip > 0) {
+            site->vma = vma_index_resolve(heatmap->vmas, (pid_t)sample->pid,
+                                          sample->ip);
+        }
     }
-    return 0;
+    heat_value_cool(heatmap, options, &site->heat, &site->cool_epoch);
+    site->heat += sample_heat(options, sample);
+    site->samples++;
 }
 
-static struct heat_page **heatmap_build_sorted_pages(const struct heatmap *heatmap,
-                                                     size_t *count_out) {
-    struct heat_page **ordered;
-    size_t i;
-    size_t count = 0;
+void heatmap_record(struct heatmap *heatmap,
+                    const struct profiler_options *options,
+                    const struct profiler_backend *backend,
+                    const struct sample_record *sample) {
+    struct heat_page *page;
+    enum address_kind kind = ADDR_KIND_VIRTUAL;
+    uint64_t page_key;
 
-    ordered = calloc(heatmap->count ? heatmap->count : 1, sizeof(*ordered));
-    if (!ordered) {
-        return NULL;
+    heatmap_advance_time(heatmap, options, sample->time_ns);
+    page_key = heatmap_sample_key(heatmap, options, backend, sample, &kind);
+    if (page_key == UINT64_MAX) {
+        return;
+    }
+    if (options->track_regions) {
+        heatmap_record_regions(heatmap, options, page_key, kind, sample);
+    }
+    if (options->track_sites) {
+        heatmap_record_site(heatmap, options, sample);
     }
 
-    for (i = 0; i < heatmap->capacity; i++) {
-        if (heatmap->pages[i].used) {
-            ordered[count++] = &heatmap->pages[i];
-        }
+    page = heatmap_lookup(heatmap, page_key, kind, options);
+    if (!page) {
+        return;
     }
 
-    qsort(ordered, count, sizeof(*ordered), compare_heat_page_desc);
-    *count_out = count;
-    return ordered;
+    heat_page_apply_sample(heatmap, options, page, sample);
 }
 
-static int compare_process_summary_desc(const void *lhs, const void *rhs) {
-    const struct process_summary *a = lhs;
-    const struct process_summary *b = rhs;
+/*
+ * Apply up to HEATMAP_RECORD_BATCH samples whose page keys are already
+ * resolved, in three passes so the cache misses of one sample overlap with
+ * work on the others:
+ *
+ * 1. hash every page key and prefetch its control group;
+ * 2. match the (now cached) control groups and prefetch the candidate
+ *    payload slot;
+ * 3. apply the samples in their original order with the normal lookup, which
+ *    by now mostly hits cache.
+ *
+ * Cooling, insertion and last_* updates are order dependent and all happen in
+ * pass 3, so the heatmap ends up exactly as with per-sample heatmap_record().
+ * The cooling clock advances to clocks[i] (the sample time if NULL) before
+ * sample i is applied.
+ */
+static void heatmap_apply_batch(struct heatmap *heatmap,
+                                const struct profiler_options *options,
+                                const struct sample_record *const *samples,
+                                const uint64_t *clocks,
+                                const uint64_t *keys,
+                                const enum address_kind *kinds,
+                                size_t n) {
+    uint64_t hashes[HEATMAP_RECORD_BATCH];
+    size_t group_mask = heatmap->capacity / HEATMAP_GROUP_WIDTH - 1;
+    size_t i;
 
-    if (a->heat < b->heat) {
-        return 1;
-    }
-    if (a->heat > b->heat) {
-        return -1;
+    for (i = 0; i < n; i++) {
+        if (keys[i] == UINT64_MAX) {
+            continue;
+        }
+        hashes[i] = hash_page(keys[i], kinds[i]);
+        __builtin_prefetch(heatmap->ctrl +
+                           ((size_t)(hashes[i] >> 7) & group_mask) *
+                           HEATMAP_GROUP_WIDTH);
     }
-    if (a->samples < b->samples) {
-        return 1;
+
+    for (i = 0; i < n; i++) {
+        size_t base;
+        uint16_t match;
+
+        if (keys[i] == UINT64_MAX) {
+            continue;
+        }
+        base = ((size_t)(hashes[i] >> 7) & group_mask) * HEATMAP_GROUP_WIDTH;
+        match = ctrl_group_match(heatmap->ctrl + base,
+                                 (uint8_t)(hashes[i] & 0x7f));
+        if (match) {
+            __builtin_prefetch(&heatmap->pages[base +
+                                               (size_t)__builtin_ctz(match)],
+                               1);
+        }
     }
-    if (a->samples > b->samples) {
-        return -1;
+
+    for (i = 0; i < n; i++) {
+        struct heat_page *page;
+
+        heatmap_advance_time(heatmap, options,
+                             clocks ? clocks[i] : samples[i]->time_ns);
+        if (keys[i] == UINT64_MAX) {
+            continue;
+        }
+        if (options->track_regions) {
+            heatmap_record_regions(heatmap, options, keys[i], kinds[i],
+                                   samples[i]);
+        }
+        if (options->track_sites) {
+            heatmap_record_site(heatmap, options, samples[i]);
+        }
+        page = heatmap_lookup_hashed(heatmap, hashes[i], keys[i], kinds[i],
+                                     options);
+        if (page) {
+            heat_page_apply_sample(heatmap, options, page, samples[i]);
+        }
     }
-    if (a->pid < b->pid) {
-        return -1;
+}
+
+/* Record a drain pass worth of samples, HEATMAP_RECORD_BATCH at a time. */
+void heatmap_record_batch(struct heatmap *heatmap,
+                          const struct profiler_options *options,
+                          const struct profiler_backend *backend,
+                          const struct sample_record *samples,
+                          size_t count) {
+    const struct sample_record *batch[HEATMAP_RECORD_BATCH];
+    uint64_t keys[HEATMAP_RECORD_BATCH];
+    enum address_kind kinds[HEATMAP_RECORD_BATCH];
+    size_t start;
+
+    for (start = 0; start < count; start += HEATMAP_RECORD_BATCH) {
+        size_t n = count - start < HEATMAP_RECORD_BATCH ?
+                   count - start : HEATMAP_RECORD_BATCH;
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+            batch[i] = &samples[start + i];
+            kinds[i] = ADDR_KIND_VIRTUAL;
+            keys[i] = heatmap_sample_key(heatmap, options, backend, batch[i],
+                                         &kinds[i]);
+        }
+        heatmap_apply_batch(heatmap, options, batch, NULL, keys, kinds, n);
     }
-    if (a->pid > b->pid) {
-        return 1;
+}
+
+/*
+ * Apply samples whose keys were resolved with heatmap_sample_key() ahead of
+ * time, possibly against another heatmap, at an explicit cooling clock. This
+ * lets the parallel replay route every sample of a page to one partition
+ * while cooling still follows the order of the whole recording.
+ */
+void heatmap_record_keyed(struct heatmap *heatmap,
+                          const struct profiler_options *options,
+                          const struct keyed_sample *samples,
+                          size_t count) {
+    const struct sample_record *batch[HEATMAP_RECORD_BATCH];
+    uint64_t clocks[HEATMAP_RECORD_BATCH];
+    uint64_t keys[HEATMAP_RECORD_BATCH];
+    enum address_kind kinds[HEATMAP_RECORD_BATCH];
+    size_t start;
+
+    for (start = 0; start < count; start += HEATMAP_RECORD_BATCH) {
+        size_t n = count - start < HEATMAP_RECORD_BATCH ?
+                   count - start : HEATMAP_RECORD_BATCH;
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+            batch[i] = &samples[start + i].sample;
+            clocks[i] = samples[start + i].clock_ns;
+            keys[i] = samples[start + i].page;
+            kinds[i] = samples[start + i].kind;
+        }
+        heatmap_apply_batch(heatmap, options, batch, clocks, keys, kinds, n);
     }
-    return 0;
 }
 
-static struct process_summary *build_process_summaries(
-    struct heat_page **ordered,
-    size_t count,
-    const struct profiler_options *options,
-    size_t *summary_count_out) {
-    struct process_summary *summaries;
-    size_t summary_count = 0;
+static void heat_page_merge_owner(struct heat_page *page,
+                                  const struct heat_owner *owner) {
     size_t i;
+    size_t min_index = 0;
+    uint64_t min_samples = UINT64_MAX;
 
-    summaries = calloc(count ? count : 1, sizeof(*summaries));
-    if (!summaries) {
-        return NULL;
+    for (i = 0; i < ARRAY_SIZE(page->owners); i++) {
+        if (page->owners[i].used && page->owners[i].pid == owner->pid &&
+            page->owners[i].tid == owner->tid) {
+            page->owners[i].samples += owner->samples;
+            return;
+        }
     }
 
-    for (i = 0; i < count; i++) {
-        const struct heat_page *page = ordered[i];
-        size_t j;
-        const char *state;
-
-        for (j = 0; j < summary_count; j++) {
-            if (summaries[j].pid == page->owner_pid) {
-                break;
-            }
+    for (i = 0; i < ARRAY_SIZE(page->owners); i++) {
+        if (!page->owners[i].used) {
+            page->owners[i] = *owner;
+            return;
         }
-        if (j == summary_count) {
-            summaries[j].pid = page->owner_pid;
-            summary_count++;
+        if (page->owners[i].samples < min_samples) {
+            min_samples = page->owners[i].samples;
+            min_index = i;
         }
+    }
+
+    if (owner->samples > min_samples) {
+        page->owners[min_index] = *owner;
+    }
+}
 
-        summaries[j].heat += page->heat;
-        summaries[j].total_weight += page->total_weight;
-        summaries[j].samples += page->samples;
-        summaries[j].pages++;
+static void heat_page_merge_site(struct heat_page_sites *page,
+                                 const struct heat_page_site *site) {
+    size_t i;
+    size_t min_index = 0;
+    double min_heat = INFINITY;
 
-        state = classify_page_state(page, options, i, count);
-        if (strcmp(state, "hot") == 0) {
-            summaries[j].hot_pages++;
-        } else if (strcmp(state, "cold") == 0) {
-            summaries[j].cold_pages++;
-        } else {
-            summaries[j].warm_pages++;
+    for (i = 0; i < PAGE_SITE_SLOTS; i++) {
+        if (page->slots[i].samples && page->slots[i].pid == site->pid &&
+            page->slots[i].ip == site->ip) {
+            page->slots[i].heat += site->heat;
+            page->slots[i].samples += site->samples;
+            return;
+        }
+    }
+
+    for (i = 0; i < PAGE_SITE_SLOTS; i++) {
+        if (!page->slots[i].samples) {
+            page->slots[i] = *site;
+            return;
+        }
+        if (page->slots[i].heat < min_heat) {
+            min_heat = page->slots[i].heat;
+            min_index = i;
         }
     }
 
-    qsort(summaries, summary_count, sizeof(*summaries), compare_process_summary_desc);
-    *summary_count_out = summary_count;
-    return summaries;
+    if (site->heat > min_heat) {
+        page->slots[min_index] = *site;
+    }
 }
 
-static void report_text_summary(const struct overall_summary *summary,
-                                const struct profiler_options *options,
-                                FILE *out) {
-    double metric_total = summary_metric_total(summary, options->summary_metric);
-    double hot_metric = summary_metric_value(summary, options->summary_metric, "hot");
-    double warm_metric = summary_metric_value(summary, options->summary_metric, "warm");
-    double cold_metric = summary_metric_value(summary, options->summary_metric, "cold");
-
-    fprintf(out,
-            "summary policy=%s metric=%s total_pages=%" PRIu64
-            " total_bytes=%" PRIu64 " total_heat=%.2f total_samples=%" PRIu64 "\n",
-            heat_policy_name(options->heat_policy),
-            summary_metric_name(options->summary_metric), summary->total_pages,
-            summary->total_bytes, summary->total_heat, summary->total_samples);
-    if (options->heat_policy == HEAT_POLICY_ABSOLUTE) {
-        fprintf(out,
-                "summary thresholds hot>=%.2f cold<%.2f\n",
-                options->hot_threshold, options->cold_threshold);
+/* Sum the --numa shares and combine the two majority votes. */
+static void heat_page_merge_numa(struct heat_page_numa *page,
+                                 const struct heat_page_numa *from) {
+    if (page->node == 0) {
+        page->node = from->node;
+    }
+    page->local_heat += from->local_heat;
+    page->remote_heat += from->remote_heat;
+    page->remote_samples += from->remote_samples;
+    if (page->access_node == from->access_node) {
+        page->access_votes += from->access_votes;
+    } else if (from->access_votes > page->access_votes) {
+        page->access_node = from->access_node;
+        page->access_votes = from->access_votes - page->access_votes;
     } else {
-        fprintf(out,
-                "summary percentiles hot_top=%.2f%% cold_bottom=%.2f%%\n",
-                options->hot_percent, options->cold_percent);
-    }
-    fprintf(out,
-            "%-8s %-12s %-18s %-16s %-12s\n",
-            "class", "pages", "bytes", "metric_value", "ratio");
-    fprintf(out, "%-8s %-12" PRIu64 " %-18" PRIu64 " %-16.2f %8.2f%%\n",
-            "hot", summary->hot_pages, summary->hot_bytes, hot_metric,
-            metric_total ? (100.0 * hot_metric / metric_total) : 0.0);
-    fprintf(out, "%-8s %-12" PRIu64 " %-18" PRIu64 " %-16.2f %8.2f%%\n",
-            "warm", summary->warm_pages, summary->warm_bytes, warm_metric,
-            metric_total ? (100.0 * warm_metric / metric_total) : 0.0);
-    fprintf(out, "%-8s %-12" PRIu64 " %-18" PRIu64 " %-16.2f %8.2f%%\n",
-            "cold", summary->cold_pages, summary->cold_bytes, cold_metric,
-            metric_total ? (100.0 * cold_metric / metric_total) : 0.0);
-}
-
-static void report_csv_summary(const struct overall_summary *summary,
-                               const struct profiler_options *options,
-                               FILE *out) {
-    double metric_total = summary_metric_total(summary, options->summary_metric);
-    double hot_metric = summary_metric_value(summary, options->summary_metric, "hot");
-    double warm_metric = summary_metric_value(summary, options->summary_metric, "warm");
-    double cold_metric = summary_metric_value(summary, options->summary_metric, "cold");
-
-    fprintf(out,
-            "summary_policy=%s,summary_metric=%s,total_pages=%" PRIu64
-            ",total_bytes=%" PRIu64 ",total_heat=%.2f,total_samples=%" PRIu64,
-            heat_policy_name(options->heat_policy),
-            summary_metric_name(options->summary_metric), summary->total_pages,
-            summary->total_bytes, summary->total_heat, summary->total_samples);
-    if (options->heat_policy == HEAT_POLICY_ABSOLUTE) {
-        fprintf(out, ",hot_threshold=%.2f,cold_threshold=%.2f\n",
-                options->hot_threshold, options->cold_threshold);
-    } else {
-        fprintf(out, ",hot_percent=%.2f,cold_percent=%.2f\n",
-                options->hot_percent, options->cold_percent);
-    }
-    fprintf(out, "summary_class,pages,bytes,metric_value,ratio\n");
-    fprintf(out, "hot,%" PRIu64 ",%" PRIu64 ",%.2f,%.2f\n",
-            summary->hot_pages, summary->hot_bytes, hot_metric,
-            metric_total ? (100.0 * hot_metric / metric_total) : 0.0);
-    fprintf(out, "warm,%" PRIu64 ",%" PRIu64 ",%.2f,%.2f\n",
-            summary->warm_pages, summary->warm_bytes, warm_metric,
-            metric_total ? (100.0 * warm_metric / metric_total) : 0.0);
-    fprintf(out, "cold,%" PRIu64 ",%" PRIu64 ",%.2f,%.2f\n",
-            summary->cold_pages, summary->cold_bytes, cold_metric,
-            metric_total ? (100.0 * cold_metric / metric_total) : 0.0);
-}
-
-static void heatmap_report_text(const struct heatmap *heatmap,
-                                const struct profiler_options *options,
-                                const struct profiler_backend *backend,
-                                uint64_t lost_samples,
-                                struct heat_page **ordered,
-                                size_t count,
-                                FILE *out) {
-    size_t i;
-    size_t limit = options->top_n < count ? options->top_n : count;
-    struct process_summary *summaries;
-    size_t summary_count = 0;
-    size_t summary_limit;
-    struct overall_summary overall_summary;
-
-    summaries = build_process_summaries(ordered, count, options, &summary_count);
-    overall_summary = build_overall_summary(ordered, count, options,
-                                            heatmap->page_shift);
-
-    fprintf(out,
-            "backend=%s pages=%zu dropped_pages=%zu dropped_samples=%zu lost_samples=%" PRIu64 " report_mode=%s summary_metric=%s heat_policy=%s addr_mode=%s output=%s cooling=%s interval_ms=%.2f\n",
-            backend->name, heatmap->count, heatmap->dropped_pages,
-            heatmap->dropped_samples, lost_samples,
-            report_mode_name(options->report_mode),
-            summary_metric_name(options->summary_metric),
-            heat_policy_name(options->heat_policy),
-            stats_address_mode_name(options->stats_address_mode),
-            output_format_name(options->output_format),
-            cooling_mode_name(options->cooling_mode),
-            options->cooling_interval_ns / 1000000.0);
-    if (options->stats_address_mode == STATS_ADDR_PHYSICAL ||
-        options->stats_address_mode == STATS_ADDR_AUTO) {
-        fprintf(out,
-                "phys_translate_attempts=%zu phys_translate_failures=%zu\n",
-                heatmap->phys_translate_attempts,
-                heatmap->phys_translate_failures);
-    }
-    report_text_summary(&overall_summary, options, out);
-
-    if (options->report_mode == REPORT_SUMMARY) {
-        free(summaries);
-        return;
+        page->access_votes -= from->access_votes;
     }
+}
 
-    fprintf(out, "\n");
-    fprintf(out,
-            "%-6s %-18s %-18s %-10s %-12s %-12s %-12s %-12s %-14s %-18s\n",
-            "rank", "kind", "page_base", "state", "heat",
-            "avg_weight", "owner_pid", "owner_tid", "owner_samples",
-            "last_ip");
-
-    for (i = 0; i < limit; i++) {
-        const struct heat_page *page = ordered[i];
-        uint64_t base = page->page << heatmap->page_shift;
-        double avg_weight = page->samples ?
-                            page->total_weight / (double)page->samples : 0.0;
-
-        fprintf(out,
-                "%-6zu %-18s 0x%016" PRIx64 " %-10s %-12.2f %-12.2f %-12u %-12u %-14" PRIu64
-                " 0x%016" PRIx64 "\n",
-                i + 1,
-                page->kind == ADDR_KIND_PHYSICAL ? "physical" : "virtual",
-                base, classify_page_state(page, options, i, count), page->heat, avg_weight,
-                page->owner_pid, page->owner_tid, page->owner_samples,
-                page->last_ip);
-    }
-
-    if (summaries) {
-        summary_limit = options->process_top_n < summary_count ?
-                        options->process_top_n : summary_count;
-        fprintf(out,
-                "\n%-6s %-12s %-12s %-12s %-12s %-12s %-12s %-12s\n",
-                "rank", "pid", "heat", "pages", "samples",
-                "hot_pages", "warm_pages", "cold_pages");
-        for (i = 0; i < summary_limit; i++) {
-            fprintf(out,
-                    "%-6zu %-12u %-12.2f %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 "\n",
-                    i + 1, summaries[i].pid, summaries[i].heat,
-                    summaries[i].pages, summaries[i].samples,
-                    summaries[i].hot_pages, summaries[i].warm_pages,
-                    summaries[i].cold_pages);
-        }
-        free(summaries);
-    }
-}
-
-static void heatmap_report_csv(const struct heatmap *heatmap,
-                               const struct profiler_options *options,
-                               const struct profiler_backend *backend,
-                               uint64_t lost_samples,
-                               struct heat_page **ordered,
-                               size_t count,
-                               FILE *out) {
+static void heatmap_merge_regions(struct heatmap *dst,
+                                  struct heatmap *src,
+                                  const struct profiler_options *options,
+                                  size_t level) {
+    struct region_table *to = &dst->regions[level];
+    struct region_table *from = &src->regions[level];
     size_t i;
-    size_t limit = options->top_n < count ? options->top_n : count;
-    struct process_summary *summaries;
-    size_t summary_count = 0;
-    size_t summary_limit;
-    struct overall_summary overall_summary;
-
-    summaries = build_process_summaries(ordered, count, options, &summary_count);
-    overall_summary = build_overall_summary(ordered, count, options,
-                                            heatmap->page_shift);
-
-    fprintf(out,
-            "backend=%s,pages=%zu,dropped_pages=%zu,dropped_samples=%zu,lost_samples=%" PRIu64 ",report_mode=%s,summary_metric=%s,heat_policy=%s,addr_mode=%s,output=%s,cooling=%s,interval_ms=%.2f\n",
-            backend->name, heatmap->count, heatmap->dropped_pages,
-            heatmap->dropped_samples, lost_samples,
-            report_mode_name(options->report_mode),
-            summary_metric_name(options->summary_metric),
-            heat_policy_name(options->heat_policy),
-            stats_address_mode_name(options->stats_address_mode),
-            output_format_name(options->output_format),
-            cooling_mode_name(options->cooling_mode),
-            options->cooling_interval_ns / 1000000.0);
-    if (options->stats_address_mode == STATS_ADDR_PHYSICAL ||
-        options->stats_address_mode == STATS_ADDR_AUTO) {
-        fprintf(out, "phys_translate_attempts=%zu,phys_translate_failures=%zu\n",
-                heatmap->phys_translate_attempts,
-                heatmap->phys_translate_failures);
-    }
-    report_csv_summary(&overall_summary, options, out);
-
-    if (options->report_mode == REPORT_SUMMARY) {
-        free(summaries);
-        return;
-    }
+    size_t w;
 
-    fprintf(out, "\n");
-    fprintf(out,
-            "rank,kind,page_base,state,heat,avg_weight,owner_pid,owner_tid,owner_samples,samples,last_ip\n");
-    for (i = 0; i < limit; i++) {
-        const struct heat_page *page = ordered[i];
-        uint64_t base = page->page << heatmap->page_shift;
-        double avg_weight = page->samples ?
-                            page->total_weight / (double)page->samples : 0.0;
+    for (i = 0; i < from->count; i++) {
+        struct heat_region *source = &from->regions[i];
+        struct heat_region *region = region_table_get(to, source->region,
+                                                      source->kind,
+                                                      options->max_pages);
 
-        fprintf(out,
-                "%zu,%s,0x%016" PRIx64 ",%s,%.2f,%.2f,%u,%u,%" PRIu64 ",%" PRIu64 ",0x%016" PRIx64 "\n",
-                i + 1,
-                page->kind == ADDR_KIND_PHYSICAL ? "physical" : "virtual",
-                base, classify_page_state(page, options, i, count), page->heat, avg_weight,
-                page->owner_pid, page->owner_tid, page->owner_samples,
-                page->samples, page->last_ip);
+        if (!region) {
+            to->dropped_samples += source->samples;
+            continue;
+        }
+        if (region->samples == 0) {
+            region->cool_epoch = dst->cooling_epoch;
+        }
+        heat_value_cool(src, options, &source->heat, &source->cool_epoch);
+        heat_value_cool(dst, options, &region->heat, &region->cool_epoch);
+        region->heat += source->heat;
+        region->samples += source->samples;
+        latency_hist_merge(&region->latency, &source->latency);
+        region->touched = 0;
+        for (w = 0; w < REGION_CHILD_WORDS; w++) {
+            region->children[w] |= source->children[w];
+            region->touched += (uint32_t)__builtin_popcountll(region->children[w]);
+        }
     }
+    to->dropped_samples += from->dropped_samples;
+}
+
+static void heatmap_merge_sites(struct heatmap *dst,
+                                struct heatmap *src,
+                                const struct profiler_options *options) {
+    struct site_table *to = &dst->sites;
+    struct site_table *from = &src->sites;
+    size_t i;
+
+    for (i = 0; i < from->count; i++) {
+        struct heat_site *source = &from->sites[i];
+        struct heat_site *site = site_table_get(to, source->pid, source->ip,
+                                                options->max_pages);
 
-    if (summaries) {
-        summary_limit = options->process_top_n < summary_count ?
-                        options->process_top_n : summary_count;
-        fprintf(out,
-                "\nprocess_rank,pid,heat,pages,samples,hot_pages,warm_pages,cold_pages\n");
-        for (i = 0; i < summary_limit; i++) {
-            fprintf(out,
-                    "%zu,%u,%.2f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
-                    i + 1, summaries[i].pid, summaries[i].heat,
-                    summaries[i].pages, summaries[i].samples,
-                    summaries[i].hot_pages, summaries[i].warm_pages,
-                    summaries[i].cold_pages);
+        if (!site) {
+            to->dropped_samples += source->samples;
+            continue;
+        }
+        if (site->samples == 0) {
+            site->cool_epoch = dst->cooling_epoch;
         }
-        free(summaries);
+        if (site->vma == 0) {
+            site->vma = source->vma;
+        }
+        heat_value_cool(src, options, &source->heat, &source->cool_epoch);
+        heat_value_cool(dst, options, &site->heat, &site->cool_epoch);
+        site->heat += source->heat;
+        site->samples += source->samples;
     }
+    to->dropped_samples += from->dropped_samples;
 }
 
-static void heatmap_report_json(const struct heatmap *heatmap,
-                                const struct profiler_options *options,
-                                const struct profiler_backend *backend,
-                                uint64_t lost_samples,
-                                struct heat_page **ordered,
-                                size_t count,
-                                FILE *out) {
+void heatmap_merge(struct heatmap *dst,
+                   struct heatmap *src,
+                   const struct profiler_options *options) {
+    uint64_t now_ns = dst->last_time_ns > src->last_time_ns ?
+                      dst->last_time_ns : src->last_time_ns;
     size_t i;
-    size_t limit = options->top_n < count ? options->top_n : count;
-    struct process_summary *summaries;
-    size_t summary_count = 0;
-    size_t summary_limit;
-    struct overall_summary overall_summary;
-
-    summaries = build_process_summaries(ordered, count, options, &summary_count);
-    overall_summary = build_overall_summary(ordered, count, options,
-                                            heatmap->page_shift);
-    summary_limit = options->process_top_n < summary_count ?
-                    options->process_top_n : summary_count;
-
-    fprintf(out,
-            "{\n  \"backend\": \"%s\",\n  \"pages\": %zu,\n  \"dropped_pages\": %zu,\n  \"dropped_samples\": %zu,\n  \"lost_samples\": %" PRIu64 ",\n  \"report_mode\": \"%s\",\n  \"summary_metric\": \"%s\",\n  \"heat_policy\": \"%s\",\n  \"addr_mode\": \"%s\",\n  \"output\": \"%s\",\n  \"cooling\": \"%s\",\n  \"interval_ms\": %.2f,\n  \"phys_translate_attempts\": %zu,\n  \"phys_translate_failures\": %zu,\n  \"summary\": {\n    \"total_pages\": %" PRIu64 ",\n    \"total_bytes\": %" PRIu64 ",\n    \"total_heat\": %.2f,\n    \"total_samples\": %" PRIu64 ",\n    \"hot_pages\": %" PRIu64 ",\n    \"hot_bytes\": %" PRIu64 ",\n    \"hot_heat\": %.2f,\n    \"hot_samples\": %" PRIu64 ",\n    \"warm_pages\": %" PRIu64 ",\n    \"warm_bytes\": %" PRIu64 ",\n    \"warm_heat\": %.2f,\n    \"warm_samples\": %" PRIu64 ",\n    \"cold_pages\": %" PRIu64 ",\n    \"cold_bytes\": %" PRIu64 ",\n    \"cold_heat\": %.2f,\n    \"cold_samples\": %" PRIu64 ",\n    \"hot_ratio\": %.2f,\n    \"warm_ratio\": %.2f,\n    \"cold_ratio\": %.2f",
-            backend->name, heatmap->count, heatmap->dropped_pages,
-            heatmap->dropped_samples, lost_samples,
-            report_mode_name(options->report_mode),
-            summary_metric_name(options->summary_metric),
-            heat_policy_name(options->heat_policy),
-            stats_address_mode_name(options->stats_address_mode),
-            output_format_name(options->output_format),
-            cooling_mode_name(options->cooling_mode),
-            options->cooling_interval_ns / 1000000.0,
-            heatmap->phys_translate_attempts,
-            heatmap->phys_translate_failures,
-            overall_summary.total_pages, overall_summary.total_bytes,
-            overall_summary.total_heat, overall_summary.total_samples,
-            overall_summary.hot_pages, overall_summary.hot_bytes,
-            overall_summary.hot_heat, overall_summary.hot_samples,
-            overall_summary.warm_pages, overall_summary.warm_bytes,
-            overall_summary.warm_heat, overall_summary.warm_samples,
-            overall_summary.cold_pages, overall_summary.cold_bytes,
-            overall_summary.cold_heat, overall_summary.cold_samples,
-            summary_metric_total(&overall_summary, options->summary_metric) ?
-            (100.0 * summary_metric_value(&overall_summary, options->summary_metric, "hot") /
-             summary_metric_total(&overall_summary, options->summary_metric)) : 0.0,
-            summary_metric_total(&overall_summary, options->summary_metric) ?
-            (100.0 * summary_metric_value(&overall_summary, options->summary_metric, "warm") /
-             summary_metric_total(&overall_summary, options->summary_metric)) : 0.0,
-            summary_metric_total(&overall_summary, options->summary_metric) ?
-            (100.0 * summary_metric_value(&overall_summary, options->summary_metric, "cold") /
-             summary_metric_total(&overall_summary, options->summary_metric)) : 0.0);
-    if (options->heat_policy == HEAT_POLICY_ABSOLUTE) {
-        fprintf(out,
-                ",\n    \"hot_threshold\": %.2f,\n    \"cold_threshold\": %.2f\n  }",
-                options->hot_threshold, options->cold_threshold);
-    } else {
-        fprintf(out,
-                ",\n    \"hot_percent\": %.2f,\n    \"cold_percent\": %.2f\n  }",
-                options->hot_percent, options->cold_percent);
-    }
 
-    if (options->report_mode == REPORT_SUMMARY) {
-        fprintf(out, "\n}\n");
-        free(summaries);
-        return;
-    }
+    /*
+     * Shards cool independently as their own samples arrive. Bring both
+     * sides up to the newest timestamp seen by either of them so the heat
+     * values being summed describe the same point in time.
+     */
+    heatmap_apply_cooling(dst, options, now_ns);
+    heatmap_apply_cooling(src, options, now_ns);
+    heatmap_finish_resize(src);
+
+    for (i = 0; i < src->capacity; i++) {
+        struct heat_page *from = &src->pages[i];
+        struct heat_page *page;
+        struct heat_page_numa *numa;
+        const struct heat_page_numa *from_numa;
+        struct heat_page_sites *sites;
+        const struct heat_page_sites *from_sites;
+        struct heat_page_mem *mem;
+        const struct heat_page_mem *from_mem;
+        size_t j;
 
-    fprintf(out, ",\n  \"results\": [\n");
+        if (!heatmap_slot_used(src, i)) {
+            continue;
+        }
 
-    for (i = 0; i < limit; i++) {
-        const struct heat_page *page = ordered[i];
-        uint64_t base = page->page << heatmap->page_shift;
-        double avg_weight = page->samples ?
-                            page->total_weight / (double)page->samples : 0.0;
+        /* A full table has counted the page in dropped_pages. */
+        page = heatmap_lookup(dst, from->page, from->kind, options);
+        if (!page) {
+            continue;
+        }
 
-        fprintf(out,
-                "    {\"rank\": %zu, \"kind\": \"%s\", \"page_base\": \"0x%016" PRIx64 "\", \"state\": \"%s\", \"heat\": %.2f, \"avg_weight\": %.2f, \"owner_pid\": %u, \"owner_tid\": %u, \"owner_samples\": %" PRIu64 ", \"samples\": %" PRIu64 ", \"last_ip\": \"0x%016" PRIx64 "\"}%s\n",
-                i + 1,
-                page->kind == ADDR_KIND_PHYSICAL ? "physical" : "virtual",
-                base, classify_page_state(page, options, i, count), page->heat, avg_weight,
-                page->owner_pid, page->owner_tid, page->owner_samples,
-                page->samples, page->last_ip,
-                i + 1 == limit ? "" : ",");
+        heat_page_cool(src, options, from);
+        heat_page_cool(dst, options, page);
+        page->heat += from->heat;
+        page->total_weight += from->total_weight;
+        page->samples += from->samples;
+        if (page->vma == 0) {
+            page->vma = from->vma;
+        }
+        numa = heatmap_page_numa(dst, page);
+        from_numa = heatmap_page_numa(src, from);
+        if (numa && from_numa) {
+            heat_page_merge_numa(numa, from_numa);
+        }
+        sites = heatmap_page_sites(dst, page);
+        from_sites = heatmap_page_sites(src, from);
+        if (sites && from_sites) {
+            for (j = 0; j < PAGE_SITE_SLOTS; j++) {
+                if (from_sites->slots[j].samples) {
+                    heat_page_merge_site(sites, &from_sites->slots[j]);
+                }
+            }
+        }
+        mem = heatmap_page_mem(dst, page);
+        from_mem = heatmap_page_mem(src, from);
+        if (mem && from_mem) {
+            for (j = 0; j < MEM_TIERS; j++) {
+                mem->tier_samples[j] += from_mem->tier_samples[j];
+            }
+            latency_hist_merge(&mem->latency, &from_mem->latency);
+        }
+        if (from->last_time_ns >= page->last_time_ns) {
+            page->last_ip = from->last_ip;
+            page->last_time_ns = from->last_time_ns;
+            page->last_data_src = from->last_data_src;
+            page->last_cpu = from->last_cpu;
+        }
+        for (j = 0; j < ARRAY_SIZE(from->owners); j++) {
+            if (from->owners[j].used) {
+                heat_page_merge_owner(page, &from->owners[j]);
+            }
+        }
+        heat_page_refresh_owner(page);
     }
 
-    fprintf(out, "  ],\n  \"process_results\": [\n");
-    for (i = 0; i < summary_limit; i++) {
-        fprintf(out,
-                "    {\"rank\": %zu, \"pid\": %u, \"heat\": %.2f, \"pages\": %" PRIu64 ", \"samples\": %" PRIu64 ", \"hot_pages\": %" PRIu64 ", \"warm_pages\": %" PRIu64 ", \"cold_pages\": %" PRIu64 "}%s\n",
-                i + 1, summaries[i].pid, summaries[i].heat,
-                summaries[i].pages, summaries[i].samples,
-                summaries[i].hot_pages, summaries[i].warm_pages,
-                summaries[i].cold_pages,
-                i + 1 == summary_limit ? "" : ",");
+    for (i = 0; i < REGION_LEVELS; i++) {
+        heatmap_merge_regions(dst, src, options, i);
     }
+    heatmap_merge_sites(dst, src, options);
 
-    fprintf(out, "  ]\n}\n");
-    free(summaries);
+    dst->dropped_pages += src->dropped_pages;
+    dst->dropped_samples += src->dropped_samples;
+    dst->evicted_pages += src->evicted_pages;
+    dst->phys_translate_attempts += src->phys_translate_attempts;
+    dst->phys_translate_failures += src->phys_translate_failures;
+    dst->last_time_ns = now_ns;
 }
 
-void heatmap_report(const struct heatmap *heatmap,
-                    const struct profiler_options *options,
-                    const struct profiler_backend *backend,
-                    uint64_t lost_samples,
-                    FILE *out) {
-    struct heat_page **ordered;
-    size_t count = 0;
-
-    ordered = heatmap_build_sorted_pages(heatmap, &count);
-    if (!ordered) {
-        fprintf(out, "failed to allocate report buffer\n");
-        return;
+/*
+ * Make dst an independent copy of src, for --interval snapshots. This runs
+ * on the drain thread, so a pending resize is copied as it is instead of
+ * being finished here: only the old slots the migration has not reached
+ * yet are copied, and whoever walks dst finishes the resize on its own
+ * copy. dst's arrays are reused when the capacity has not changed, so a
+ * steady state snapshot is two memcpy()s. dst never inherits src's pagemap
+ * fds.
+ */
+int heatmap_copy(struct heatmap *dst, const struct heatmap *src) {
+    uint8_t *ctrl = dst->ctrl;
+    struct heat_page *pages = dst->pages;
+    struct region_table regions[REGION_LEVELS];
+    struct site_table sites = dst->sites;
+    struct page_ext_pool ext = dst->ext;
+    uint8_t *old_ctrl = NULL;
+    struct heat_page *old_pages = NULL;
+    size_t i;
+
+    if (src->old_ctrl) {
+        old_ctrl = malloc(src->old_capacity);
+        old_pages = malloc(src->old_capacity * sizeof(*old_pages));
+        if (!old_ctrl || !old_pages) {
+            free(old_ctrl);
+            free(old_pages);
+            heatmap_destroy(dst);
+            return -ENOMEM;
+        }
+        memset(old_ctrl, HEATMAP_CTRL_DELETED, src->migrate_cursor);
+        memcpy(old_ctrl + src->migrate_cursor,
+               src->old_ctrl + src->migrate_cursor,
+               src->old_capacity - src->migrate_cursor);
+        memcpy(old_pages + src->migrate_cursor,
+               src->old_pages + src->migrate_cursor,
+               (src->old_capacity - src->migrate_cursor) * sizeof(*old_pages));
+    }
+
+    if (dst->capacity != src->capacity) {
+        free(dst->ctrl);
+        free(dst->pages);
+        dst->ctrl = NULL;
+        dst->pages = NULL;
+        ctrl = malloc(src->capacity);
+        pages = malloc(src->capacity * sizeof(*pages));
+        if (!ctrl || !pages) {
+            free(ctrl);
+            free(pages);
+            free(old_ctrl);
+            free(old_pages);
+            heatmap_destroy(dst);
+            return -ENOMEM;
+        }
     }
 
-    switch (options->output_format) {
-    case OUTPUT_JSON:
-        heatmap_report_json(heatmap, options, backend, lost_samples, ordered,
-                            count, out);
-        break;
-    case OUTPUT_CSV:
-        heatmap_report_csv(heatmap, options, backend, lost_samples, ordered,
-                           count, out);
-        break;
-    case OUTPUT_TEXT:
-    default:
-        heatmap_report_text(heatmap, options, backend, lost_samples, ordered,
-                            count, out);
-        break;
+    for (i = 0; i < ARRAY_SIZE(dst->pagemap_cache); i++) {
+        if (dst->pagemap_cache[i].used && dst->pagemap_cache[i].fd >= 0) {
+            close(dst->pagemap_cache[i].fd);
+        }
     }
 
-    free(ordered);
+    free(dst->old_ctrl);
+    free(dst->old_pages);
+    memcpy(regions, dst->regions, sizeof(regions));
+    memcpy(ctrl, src->ctrl, src->capacity);
+    memcpy(pages, src->pages, src->capacity * sizeof(*pages));
+    *dst = *src;
+    dst->ctrl = ctrl;
+    dst->pages = pages;
+    dst->old_ctrl = old_ctrl;
+    dst->old_pages = old_pages;
+    memset(dst->pagemap_cache, 0, sizeof(dst->pagemap_cache));
+    dst->pagemap_cache_victim = 0;
+
+    memcpy(dst->regions, regions, sizeof(regions));
+    dst->sites = sites;
+    dst->ext = ext;
+    for (i = 0; i < REGION_LEVELS; i++) {
+        if (region_table_copy(&dst->regions[i], &src->regions[i]) != 0) {
+            heatmap_destroy(dst);
+            return -ENOMEM;
+        }
+    }
+    if (site_table_copy(&dst->sites, &src->sites) != 0 ||
+        page_ext_copy(&dst->ext, &src->ext) != 0) {
+        heatmap_destroy(dst);
+        return -ENOMEM;
+    }
+    return 0;
 }
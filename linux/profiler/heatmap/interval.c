@@ -0,0 +1,526 @@
+#include "profiler.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+
+
+/*
+ * Per drain worker hand-off area. The worker copies its heatmap here when
+ * asked to; the reporter only reads it once every worker has answered the
+ * same request, and only asks again after it is done with it, so the copy is
+ * never contended.
+ */
+struct interval_slot {
+    int wake_fd;
+    struct heatmap snapshot;
+    bool failed;
+    uint64_t lost_samples;
+};
+
+struct interval_reporter {
+    const struct profiler_options *options;
+    const struct profiler_backend *backend;
+    FILE *out;
+    struct tier_engine *tier;
+    struct interval_slot *slots;
+    size_t nr_slots;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t arrived;
+    bool stopping;
+    uint64_t start_ns;
+    uint64_t reports;
+    uint64_t skipped;
+    struct heatmap current;
+    struct heatmap previous;
+    uint64_t previous_lost;
+    pthread_t thread;
+};
+
+static uint64_t interval_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static struct timespec interval_deadline(uint64_t ns) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(ns / 1000000000ULL);
+    ts.tv_nsec = (long)(ns % 1000000000ULL);
+    return ts;
+}
+
+/* interval_build_delta() for one level of --regions tables. */
+static void interval_build_region_delta(struct region_table *delta,
+                                        const struct region_table *current,
+                                        const struct region_table *previous,
+                                        const struct profiler_options *options) {
+    size_t i;
+
+    for (i = 0; i < current->count; i++) {
+        const struct heat_region *now = &current->regions[i];
+        const struct heat_region *before;
+        struct heat_region *region;
+
+        before = region_table_find(previous, now->region, now->kind);
+        if (before && before->samples == now->samples) {
+            continue;
+        }
+
+        region = region_table_get(delta, now->region, now->kind,
+                                  options->max_pages);
+        if (!region) {
+            continue;
+        }
+        *region = *now;
+        if (before) {
+            region->samples -= before->samples;
+            latency_hist_delta(&region->latency, &now->latency,
+                               &before->latency);
+            region->heat = now->heat > before->heat ?
+                           now->heat - before->heat : 0.0;
+        }
+    }
+    delta->dropped_samples = current->dropped_samples -
+                             previous->dropped_samples;
+}
+
+/* interval_build_delta() for the --sites table. */
+static void interval_build_site_delta(struct site_table *delta,
+                                      const struct site_table *current,
+                                      const struct site_table *previous,
+                                      const struct profiler_options *options) {
+    size_t i;
+
+    for (i = 0; i < current->count; i++) {
+        const struct heat_site *now = &current->sites[i];
+        const struct heat_site *before;
+        struct heat_site *site;
+
+        before = site_table_find(previous, now->pid, now->ip);
+        if (before && before->samples == now->samples) {
+            continue;
+        }
+
+        site = site_table_get(delta, now->pid, now->ip, options->max_pages);
+        if (!site) {
+            continue;
+        }
+        *site = *now;
+        if (before) {
+            site->samples -= before->samples;
+            site->heat = now->heat > before->heat ? now->heat - before->heat :
+                         0.0;
+        }
+    }
+    delta->dropped_samples = current->dropped_samples -
+                             previous->dropped_samples;
+}
+
+/*
+ * --sites: a page's slots less what the same sites held in the previous
+ * snapshot. A site that took over a slot since then keeps all it has.
+ */
+static void interval_build_page_sites_delta(
+    struct heat_page_sites *sites, const struct heat_page_sites *now,
+    const struct heat_page_sites *before) {
+    size_t i;
+    size_t j;
+
+    *sites = *now;
+    if (!before) {
+        return;
+    }
+    for (i = 0; i < PAGE_SITE_SLOTS; i++) {
+        struct heat_page_site *slot = &sites->slots[i];
+
+        for (j = 0; j < PAGE_SITE_SLOTS; j++) {
+            const struct heat_page_site *old = &before->slots[j];
+
+            if (!slot->samples || !old->samples || old->pid != slot->pid ||
+                old->ip != slot->ip) {
+                continue;
+            }
+            slot->samples = slot->samples > old->samples ?
+                            slot->samples - old->samples : 0;
+            slot->heat = slot->heat > old->heat ? slot->heat - old->heat :
+                         0.0;
+            break;
+        }
+    }
+}
+
+/*
+ * Build in `delta` the activity between the cumulative snapshots `previous`
+ * and `current`: only pages sampled in between are kept, with the samples,
+ * weight and latency histogram of the interval and the heat they gained on
+ * top of the previous heat cooled to the same point in time. Owner and
+ * last_* fields are those of the current snapshot.
+ */
+static int interval_build_delta(struct heatmap *delta,
+                                struct heatmap *current,
+                                struct heatmap *previous,
+                                const struct profiler_options *options) {
+    size_t i;
+
+    heatmap_settle_cooling(current, options);
+    previous->cooling_epoch = current->cooling_epoch;
+    heatmap_settle_cooling(previous, options);
+
+    heatmap_init(delta, options->max_pages, current->page_shift);
+    if (!delta->pages) {
+        return -ENOMEM;
+    }
+    delta->vmas = current->vmas;
+    delta->numa = current->numa;
+    delta->mem_info = current->mem_info;
+    delta->cooling_epoch = current->cooling_epoch;
+    delta->last_cooling_ns = current->last_cooling_ns;
+    delta->last_time_ns = current->last_time_ns;
+
+    for (i = 0; i < current->capacity; i++) {
+        const struct heat_page *now = &current->pages[i];
+        const struct heat_page *before;
+        const struct heat_page_numa *now_numa;
+        const struct heat_page_sites *now_sites;
+        struct heat_page_numa *numa;
+        struct heat_page_sites *sites;
+        const struct heat_page_mem *now_mem;
+        struct heat_page_mem *mem;
+        struct heat_page *page;
+        uint32_t ext;
+
+        if (!heatmap_slot_used(current, i)) {
+            continue;
+        }
+        before = heatmap_find(previous, now->page, now->kind);
+        if (before && before->samples == now->samples) {
+            continue;
+        }
+
+        page = heatmap_lookup(delta, now->page, now->kind, options);
+        if (!page) {
+            continue;
+        }
+        ext = page->ext;
+        *page = *now;
+        page->ext = ext;
+        numa = heatmap_page_numa(delta, page);
+        now_numa = heatmap_page_numa(current, now);
+        if (numa && now_numa) {
+            *numa = *now_numa;
+        }
+        sites = heatmap_page_sites(delta, page);
+        now_sites = heatmap_page_sites(current, now);
+        if (sites && now_sites) {
+            interval_build_page_sites_delta(
+                sites, now_sites,
+                before ? heatmap_page_sites(previous, before) : NULL);
+        }
+        mem = heatmap_page_mem(delta, page);
+        now_mem = heatmap_page_mem(current, now);
+        if (mem && now_mem) {
+            *mem = *now_mem;
+        }
+        if (before) {
+            const struct heat_page_numa *before_numa =
+                heatmap_page_numa(previous, before);
+            const struct heat_page_mem *before_mem =
+                heatmap_page_mem(previous, before);
+            size_t tier;
+
+            if (mem && now_mem && before_mem) {
+                for (tier = 0; tier < MEM_TIERS; tier++) {
+                    mem->tier_samples[tier] -= before_mem->tier_samples[tier];
+                }
+                latency_hist_delta(&mem->latency, &now_mem->latency,
+                                   &before_mem->latency);
+            }
+            page->samples -= before->samples;
+            page->total_weight -= before->total_weight;
+            if (numa && now_numa && before_numa) {
+                numa->remote_samples -= before_numa->remote_samples;
+                numa->local_heat = now_numa->local_heat >
+                                   before_numa->local_heat ?
+                                   now_numa->local_heat -
+                                   before_numa->local_heat : 0.0;
+                numa->remote_heat = now_numa->remote_heat >
+                                    before_numa->remote_heat ?
+                                    now_numa->remote_heat -
+                                    before_numa->remote_heat : 0.0;
+            }
+            page->heat = now->heat > before->heat ? now->heat - before->heat :
+                         0.0;
+        }
+    }
+
+    for (i = 0; i < REGION_LEVELS; i++) {
+        interval_build_region_delta(&delta->regions[i], &current->regions[i],
+                                    &previous->regions[i], options);
+    }
+    interval_build_site_delta(&delta->sites, &current->sites,
+                              &previous->sites, options);
+
+    delta->dropped_pages = current->dropped_pages - previous->dropped_pages;
+    delta->dropped_samples = current->dropped_samples -
+                             previous->dropped_samples;
+    delta->evicted_pages = current->evicted_pages - previous->evicted_pages;
+    delta->phys_translate_attempts = current->phys_translate_attempts -
+                                     previous->phys_translate_attempts;
+    delta->phys_translate_failures = current->phys_translate_failures -
+                                     previous->phys_translate_failures;
+    return 0;
+}
+
+/*
+ * Merge the worker slots into `current` and write one report. `current` and
+ * `previous` are swapped afterwards so the next copy reuses the older
+ * buffer; in delta mode `previous` is also the baseline of the next delta.
+ */
+static void interval_emit(struct interval_reporter *reporter, uint64_t now_ns) {
+    const struct profiler_options *options = reporter->options;
+    struct report_snapshot snapshot;
+    struct heatmap delta;
+    struct heatmap swap;
+    uint64_t lost = reporter->slots[0].lost_samples;
+    size_t i;
+
+    /* A report missing a worker's pages would look like they went cold. */
+    for (i = 0; i < reporter->nr_slots; i++) {
+        if (reporter->slots[i].failed) {
+            reporter->skipped++;
+            return;
+        }
+    }
+    if (heatmap_copy(&reporter->current, &reporter->slots[0].snapshot) != 0) {
+        reporter->skipped++;
+        return;
+    }
+    for (i = 1; i < reporter->nr_slots; i++) {
+        heatmap_merge(&reporter->current, &reporter->slots[i].snapshot,
+                      options);
+        lost += reporter->slots[i].lost_samples;
+    }
+    /* The copies may carry a worker's unfinished resize. */
+    heatmap_finish_resize(&reporter->current);
+
+    snapshot.seq = reporter->reports + 1;
+    snapshot.elapsed_sec = (double)(now_ns - reporter->start_ns) / 1e9;
+    snapshot.delta = options->interval_mode == INTERVAL_DELTA;
+    if (snapshot.delta) {
+        if (!reporter->previous.pages) {
+            heatmap_init(&reporter->previous, options->max_pages,
+                         reporter->current.page_shift);
+        }
+        if (!reporter->previous.pages ||
+            interval_build_delta(&delta, &reporter->current,
+                                 &reporter->previous, options) != 0) {
+            reporter->skipped++;
+            return;
+        }
+        heatmap_report_snapshot(&delta, options, reporter->backend,
+                                lost - reporter->previous_lost, &snapshot,
+                                reporter->out);
+        heatmap_destroy(&delta);
+        reporter->previous_lost = lost;
+    } else {
+        heatmap_report_snapshot(&reporter->current, options,
+                                reporter->backend, lost, &snapshot,
+                                reporter->out);
+    }
+    fflush(reporter->out);
+    reporter->reports++;
+
+    if (reporter->tier) {
+        tier_engine_run(reporter->tier, &reporter->current, options,
+                        snapshot.seq);
+    }
+
+    swap = reporter->previous;
+    reporter->previous = reporter->current;
+    reporter->current = swap;
+}
+
+/*
+ * Reporter thread: every --interval it asks all drain workers for a copy of
+ * their heatmap, waits for the copies and formats them. Draining only pauses
+ * for each worker's own copy; merging, sorting and printing happen here. An
+ * interval that cannot be served on time (a slow reporter, or workers busy
+ * draining) is skipped rather than queued.
+ */
+static void *interval_reporter_main(void *arg) {
+    struct interval_reporter *reporter = arg;
+    uint64_t interval_ns = (uint64_t)reporter->options->report_interval_ms *
+                           1000000ULL;
+    uint64_t next_ns = reporter->start_ns + interval_ns;
+    uint64_t one = 1;
+    size_t i;
+
+    pthread_mutex_lock(&reporter->lock);
+    while (!reporter->stopping) {
+        struct timespec deadline = interval_deadline(next_ns);
+
+        if (pthread_cond_timedwait(&reporter->cond, &reporter->lock,
+                                   &deadline) != ETIMEDOUT) {
+            continue;
+        }
+
+        reporter->arrived = 0;
+        pthread_mutex_unlock(&reporter->lock);
+        for (i = 0; i < reporter->nr_slots; i++) {
+            if (write(reporter->slots[i].wake_fd, &one, sizeof(one)) < 0) {
+                break;
+            }
+        }
+        pthread_mutex_lock(&reporter->lock);
+
+        while (!reporter->stopping && reporter->arrived < reporter->nr_slots) {
+            pthread_cond_wait(&reporter->cond, &reporter->lock);
+        }
+        if (reporter->stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&reporter->lock);
+
+        interval_emit(reporter, interval_now_ns());
+
+        next_ns += interval_ns;
+        while (next_ns <= interval_now_ns()) {
+            next_ns += interval_ns;
+            reporter->skipped++;
+        }
+        pthread_mutex_lock(&reporter->lock);
+    }
+    pthread_mutex_unlock(&reporter->lock);
+    return NULL;
+}
+
+int interval_reporter_start(struct interval_reporter **reporter_out,
+                            const struct profiler_options *options,
+                            const struct profiler_backend *backend,
+                            size_t nr_workers,
+                            FILE *out,
+                            struct tier_engine *tier,
+                            char *reason,
+                            size_t reason_len) {
+    struct interval_reporter *reporter;
+    pthread_condattr_t attr;
+    size_t i;
+    int err;
+
+    reporter = calloc(1, sizeof(*reporter));
+    if (reporter) {
+        reporter->slots = calloc(nr_workers, sizeof(*reporter->slots));
+    }
+    if (!reporter || !reporter->slots) {
+        free(reporter);
+        snprintf(reason, reason_len, "failed to allocate interval reporter");
+        return -ENOMEM;
+    }
+
+    reporter->options = options;
+    reporter->backend = backend;
+    reporter->out = out;
+    reporter->tier = tier;
+    reporter->nr_slots = nr_workers;
+    for (i = 0; i < nr_workers; i++) {
+        reporter->slots[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reporter->slots[i].wake_fd < 0) {
+            err = -errno;
+            snprintf(reason, reason_len, "eventfd failed: %s", strerror(errno));
+            while (i-- > 0) {
+                close(reporter->slots[i].wake_fd);
+            }
+            free(reporter->slots);
+            free(reporter);
+            return err;
+        }
+    }
+
+    pthread_mutex_init(&reporter->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reporter->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    reporter->start_ns = interval_now_ns();
+
+    err = pthread_create(&reporter->thread, NULL, interval_reporter_main,
+                         reporter);
+    if (err != 0) {
+        snprintf(reason, reason_len, "failed to start interval reporter: %s",
+                 strerror(err));
+        reporter->thread = 0;
+        interval_reporter_stop(reporter, NULL, NULL);
+        return -err;
+    }
+
+    *reporter_out = reporter;
+    return 0;
+}
+
+int interval_reporter_wake_fd(const struct interval_reporter *reporter,
+                              size_t worker) {
+    return reporter->slots[worker].wake_fd;
+}
+
+/*
+ * Called by drain worker `worker` when its wake fd fires: copy its heatmap
+ * into its slot and tell the reporter.
+ */
+void interval_reporter_snapshot(struct interval_reporter *reporter,
+                                size_t worker, struct heatmap *heatmap,
+                                uint64_t lost_samples) {
+    struct interval_slot *slot = &reporter->slots[worker];
+    uint64_t pending;
+
+    if (read(slot->wake_fd, &pending, sizeof(pending)) != sizeof(pending)) {
+        return;
+    }
+
+    slot->failed = heatmap_copy(&slot->snapshot, heatmap) != 0;
+    slot->lost_samples = lost_samples;
+
+    pthread_mutex_lock(&reporter->lock);
+    reporter->arrived++;
+    pthread_cond_broadcast(&reporter->cond);
+    pthread_mutex_unlock(&reporter->lock);
+}
+
+void interval_reporter_stop(struct interval_reporter *reporter,
+                            uint64_t *reports_out, uint64_t *skipped_out) {
+    size_t i;
+
+    if (!reporter) {
+        return;
+    }
+
+    pthread_mutex_lock(&reporter->lock);
+    reporter->stopping = true;
+    pthread_cond_broadcast(&reporter->cond);
+    pthread_mutex_unlock(&reporter->lock);
+    if (reporter->thread) {
+        pthread_join(reporter->thread, NULL);
+    }
+
+    if (reports_out) {
+        *reports_out = reporter->reports;
+    }
+    if (skipped_out) {
+        *skipped_out = reporter->skipped;
+    }
+
+    for (i = 0; i < reporter->nr_slots; i++) {
+        close(reporter->slots[i].wake_fd);
+        heatmap_destroy(&reporter->slots[i].snapshot);
+    }
+    heatmap_destroy(&reporter->current);
+    heatmap_destroy(&reporter->previous);
+    pthread_cond_destroy(&reporter->cond);
+    pthread_mutex_destroy(&reporter->lock);
+    free(reporter->slots);
+    free(reporter);
+}
@@ -0,0 +1,105 @@
+#include "profiler.h"
+
+
+/* Bucket b holds latencies in [2^b, 2^(b+1)); the last one is open ended. */
+static unsigned latency_bucket(uint64_t weight) {
+    unsigned bucket = weight > 1 ? 63U - (unsigned)__builtin_clzll(weight) : 0;
+
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/*
+ * Buckets are 16 bits. When one is about to overflow every bucket is
+ * halved, which keeps the shape of the histogram (and so its percentiles)
+ * while the absolute counts stop meaning anything: they are not reported.
+ */
+static void latency_hist_halve(struct latency_hist *hist) {
+    size_t i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        hist->buckets[i] = (uint16_t)((hist->buckets[i] + 1U) / 2U);
+    }
+}
+
+void latency_hist_add(struct latency_hist *hist, uint64_t weight) {
+    unsigned bucket = latency_bucket(weight);
+
+    if (hist->buckets[bucket] == UINT16_MAX) {
+        latency_hist_halve(hist);
+    }
+    hist->buckets[bucket]++;
+}
+
+void latency_hist_merge(struct latency_hist *dst,
+                        const struct latency_hist *src) {
+    uint32_t sums[LATENCY_BUCKETS];
+    uint32_t max = 0;
+    unsigned shift = 0;
+    size_t i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        sums[i] = (uint32_t)dst->buckets[i] + src->buckets[i];
+        if (sums[i] > max) {
+            max = sums[i];
+        }
+    }
+    while ((max >> shift) > UINT16_MAX) {
+        shift++;
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        dst->buckets[i] = (uint16_t)((sums[i] + (1U << shift) - 1) >> shift);
+    }
+}
+
+/*
+ * Latencies recorded between two snapshots of the same histogram. Once the
+ * newer one has been halved the counts no longer line up, and the newer
+ * histogram is kept whole as the best estimate of the interval's shape.
+ */
+void latency_hist_delta(struct latency_hist *dst,
+                        const struct latency_hist *now,
+                        const struct latency_hist *before) {
+    size_t i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        if (now->buckets[i] < before->buckets[i]) {
+            *dst = *now;
+            return;
+        }
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        dst->buckets[i] = (uint16_t)(now->buckets[i] - before->buckets[i]);
+    }
+}
+
+/*
+ * Latency below which `fraction` of the recorded samples fall, interpolated
+ * linearly inside the bucket. 0 when nothing was recorded.
+ */
+double latency_hist_percentile(const struct latency_hist *hist,
+                               double fraction) {
+    uint64_t total = 0;
+    double target;
+    double below = 0.0;
+    size_t i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        total += hist->buckets[i];
+    }
+    if (total == 0) {
+        return 0.0;
+    }
+
+    target = fraction * (double)total;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        double count = hist->buckets[i];
+        double lo = (double)(1ULL << i);
+        double hi = (double)(1ULL << (i + 1));
+
+        if (count > 0 && below + count >= target) {
+            return lo + (hi - lo) * ((target - below) / count);
+        }
+        below += count;
+    }
+    return (double)(1ULL << LATENCY_BUCKETS);
+}
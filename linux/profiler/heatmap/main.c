@@ -1,20 +1,31 @@
 #include "backend.h"
 
 #include <getopt.h>
+#include <sys/resource.h>
+#include <time.h>
 
 
 static void set_default_options(struct profiler_options *options) {
     memset(options, 0, sizeof(*options));
     options->pid = -1;
     options->system_wide = true;
+    options->target_mode = TARGET_THREADS;
     options->user_only = false;
     options->duration_sec = 5;
     options->poll_timeout_ms = 250;
+    options->drain_threads = 1;
+    options->wakeup_bytes = 0;
     options->sample_period = 4000;
+    options->adaptive_period = false;
+    options->min_period = 0;
+    options->max_period = 0;
+    options->target_overhead = 2.0;
     options->mmap_pages = 128;
     options->max_pages = 65536;
+    options->evict_policy = EVICT_NONE;
     options->top_n = 20;
     options->process_top_n = 10;
+    options->group_by = GROUP_BY_PID;
     options->report_mode = REPORT_BOTH;
     options->summary_metric = SUMMARY_PAGES;
     options->cooling_mode = COOLING_EXP;
@@ -30,6 +41,29 @@ static void set_default_options(struct profiler_options *options) {
     options->output_format = OUTPUT_TEXT;
     options->output_path = NULL;
     options->backend_name = "auto";
+    options->record_path = NULL;
+    options->replay_path = NULL;
+    options->replay_threads = 0;
+    options->report_interval_ms = 0;
+    options->interval_mode = INTERVAL_FULL;
+    options->track_regions = false;
+    options->track_vmas = false;
+    options->track_sites = false;
+    options->track_numa = false;
+    options->sort_by = PAGE_SORT_HEAT;
+    options->heat_score = HEAT_SCORE_SAMPLES;
+    options->latency_unit = 100;
+    options->tier_node = -1;
+    options->tier_cold = TIER_COLD_OFF;
+    options->tier_cold_rounds = 2;
+    options->tier_rate = 256;
+    options->tier_dry_run = false;
+    options->scan_interval_ms = 100;
+    options->scan_budget = 131072;
+    options->fault_type = FAULT_ALL;
+    options->synth_dist = SYNTH_ZIPF;
+    options->synth_pages = 65536;
+    options->synth_rate = 1000000;
 }
 
 static enum cooling_mode parse_cooling_mode(const char *text) {
@@ -42,6 +76,23 @@ static enum cooling_mode parse_cooling_mode(const char *text) {
     return COOLING_EXP;
 }
 
+static enum target_mode parse_target_mode(const char *text) {
+    if (strcmp(text, "cpus") == 0) {
+        return TARGET_CPUS;
+    }
+    return TARGET_THREADS;
+}
+
+static enum eviction_policy parse_eviction_policy(const char *text) {
+    if (strcmp(text, "clock") == 0) {
+        return EVICT_CLOCK;
+    }
+    if (strcmp(text, "coldest") == 0) {
+        return EVICT_COLDEST;
+    }
+    return EVICT_NONE;
+}
+
 static enum stats_address_mode parse_stats_address_mode(const char *text) {
     if (strcmp(text, "virtual") == 0) {
         return STATS_ADDR_VIRTUAL;
@@ -79,6 +130,72 @@ static enum heat_classification_policy parse_heat_policy(const char *text) {
     return HEAT_POLICY_ABSOLUTE;
 }
 
+static enum interval_mode parse_interval_mode(const char *text) {
+    if (strcmp(text, "delta") == 0) {
+        return INTERVAL_DELTA;
+    }
+    return INTERVAL_FULL;
+}
+
+static enum page_sort parse_page_sort(const char *text) {
+    if (strcmp(text, "samples") == 0) {
+        return PAGE_SORT_SAMPLES;
+    }
+    if (strcmp(text, "dram") == 0) {
+        return PAGE_SORT_DRAM;
+    }
+    if (strcmp(text, "remote") == 0) {
+        return PAGE_SORT_REMOTE;
+    }
+    return PAGE_SORT_HEAT;
+}
+
+static enum heat_score parse_heat_score(const char *text) {
+    if (strcmp(text, "latency") == 0) {
+        return HEAT_SCORE_LATENCY;
+    }
+    if (strcmp(text, "log-latency") == 0) {
+        return HEAT_SCORE_LOG_LATENCY;
+    }
+    return HEAT_SCORE_SAMPLES;
+}
+
+static enum fault_type parse_fault_type(const char *text) {
+    if (strcmp(text, "minor") == 0) {
+        return FAULT_MINOR;
+    }
+    if (strcmp(text, "major") == 0) {
+        return FAULT_MAJOR;
+    }
+    return FAULT_ALL;
+}
+
+static enum synth_dist parse_synth_dist(const char *text) {
+    if (strcmp(text, "uniform") == 0) {
+        return SYNTH_UNIFORM;
+    }
+    if (strcmp(text, "hotset") == 0) {
+        return SYNTH_HOTSET;
+    }
+    if (strcmp(text, "phase") == 0) {
+        return SYNTH_PHASE;
+    }
+    if (strcmp(text, "multipid") == 0) {
+        return SYNTH_MULTIPID;
+    }
+    return SYNTH_ZIPF;
+}
+
+static enum tier_cold_action parse_tier_cold_action(const char *text) {
+    if (strcmp(text, "cold") == 0) {
+        return TIER_COLD_COLD;
+    }
+    if (strcmp(text, "pageout") == 0) {
+        return TIER_COLD_PAGEOUT;
+    }
+    return TIER_COLD_OFF;
+}
+
 static enum summary_metric parse_summary_metric(const char *text) {
     if (strcmp(text, "heat") == 0) {
         return SUMMARY_HEAT;
@@ -89,18 +206,286 @@ static enum summary_metric parse_summary_metric(const char *text) {
     return SUMMARY_PAGES;
 }
 
+static enum group_dimension parse_group_dimension(const char *text) {
+    if (strcmp(text, "tid") == 0) {
+        return GROUP_BY_TID;
+    }
+    if (strcmp(text, "cpu") == 0) {
+        return GROUP_BY_CPU;
+    }
+    if (strcmp(text, "node") == 0) {
+        return GROUP_BY_NODE;
+    }
+    if (strcmp(text, "kind") == 0) {
+        return GROUP_BY_KIND;
+    }
+    return GROUP_BY_PID;
+}
+
+static double timeval_sec(const struct timeval *tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1000000.0;
+}
+
+static double monotonic_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Print how much CPU the profiler itself burned while sampling, so the cost
+ * of a wakeup policy can be compared directly.
+ */
+static void report_overhead(const struct profiler_options *options,
+                            const struct perf_session *session,
+                            const struct rusage *before,
+                            const struct rusage *after,
+                            double wall_sec) {
+    double user = timeval_sec(&after->ru_utime) - timeval_sec(&before->ru_utime);
+    double sys = timeval_sec(&after->ru_stime) - timeval_sec(&before->ru_stime);
+
+    fprintf(stderr,
+            "profiler overhead wakeup_bytes=%" PRIu64 " wakeups=%" PRIu64
+            " user=%.3fs sys=%.3fs cpu=%.2f%% ctx_switches=%ld\n",
+            options->wakeup_bytes, session->wakeups, user, sys,
+            wall_sec > 0.0 ? 100.0 * (user + sys) / wall_sec : 0.0,
+            (after->ru_nvcsw - before->ru_nvcsw) +
+            (after->ru_nivcsw - before->ru_nivcsw));
+    if (options->adaptive_period) {
+        fprintf(stderr,
+                "adaptive period base=%" PRIu64 " low=%" PRIu64 " high=%" PRIu64
+                " changes=%" PRIu64 " target_overhead=%.2f%%\n",
+                options->sample_period, session->period_low,
+                session->period_high, session->period_changes,
+                options->target_overhead);
+    }
+}
+
+static FILE *open_report_output(const struct profiler_options *options) {
+    FILE *report_out;
+
+    if (!options->output_path) {
+        return stdout;
+    }
+    report_out = fopen(options->output_path, "w");
+    if (!report_out) {
+        fprintf(stderr, "failed to open output file %s: %s\n",
+                options->output_path, strerror(errno));
+    }
+    return report_out;
+}
+
+static void close_report_output(const struct profiler_options *options,
+                                FILE *report_out) {
+    if (report_out != stdout) {
+        fclose(report_out);
+        fprintf(stderr, "report written to %s\n", options->output_path);
+    }
+}
+
+/*
+ * --vma and --sites: the index is shared by every shard of the heatmap and
+ * lives until release_heatmap(). Without it the profile still runs, just
+ * without mappings or symbols.
+ */
+static void attach_vma_index(const struct profiler_options *options,
+                             struct heatmap *heatmap) {
+    if ((options->track_vmas || options->track_sites) &&
+        vma_index_create(&heatmap->vmas) != 0) {
+        fprintf(stderr, "warning: no memory for the mapping index, mappings and symbols not reported\n");
+        heatmap->vmas = NULL;
+    }
+}
+
+/* --numa: the CPU and memory block maps are read once, here. */
+static void attach_numa_topology(const struct profiler_options *options,
+                                 struct heatmap *heatmap) {
+    if (options->track_numa &&
+        numa_topology_create(&heatmap->numa) != 0) {
+        fprintf(stderr, "warning: no memory for the NUMA topology, local and remote heat not reported\n");
+        heatmap->numa = NULL;
+    }
+}
+
+static void release_heatmap(struct heatmap *heatmap) {
+    struct vma_index *vmas = heatmap->vmas;
+    struct numa_topology *numa = heatmap->numa;
+
+    heatmap_destroy(heatmap);
+    if (vmas) {
+        vma_index_destroy(vmas);
+    }
+    numa_topology_destroy(numa);
+}
+
+/*
+ * --tier-node and --tier-cold act on the pages of one live process, once per
+ * --interval, so they need all three, and pages keyed by virtual address.
+ */
+static bool check_tier_options(const struct profiler_options *options) {
+    if (options->tier_node < 0 && options->tier_cold == TIER_COLD_OFF) {
+        return true;
+    }
+    if (options->record_path || options->replay_path) {
+        fprintf(stderr, "--tier-node and --tier-cold need a live profile, not --record or --replay\n");
+        return false;
+    }
+    if (options->system_wide || options->pid <= 0) {
+        fprintf(stderr, "--tier-node and --tier-cold act on one process, give it with --pid\n");
+        return false;
+    }
+    if (options->report_interval_ms == 0) {
+        fprintf(stderr, "--tier-node and --tier-cold run every --interval, give one\n");
+        return false;
+    }
+    if (options->stats_address_mode != STATS_ADDR_VIRTUAL) {
+        fprintf(stderr, "--tier-node and --tier-cold act on virtual pages, give --addr-mode virtual\n");
+        return false;
+    }
+    return true;
+}
+
+static int write_report(const struct profiler_options *options,
+                        struct heatmap *heatmap,
+                        const struct profiler_backend *backend,
+                        uint64_t lost_samples) {
+    FILE *report_out = open_report_output(options);
+
+    if (!report_out) {
+        return -EIO;
+    }
+    heatmap_report(heatmap, options, backend, lost_samples, report_out);
+    close_report_output(options, report_out);
+    return 0;
+}
+
+/*
+ * --replay: rebuild the heatmap from a --record file instead of the PMU. The
+ * recording decides the backend, the base sample period and the page size;
+ * everything that only shapes aggregation and reporting comes from the
+ * command line as usual.
+ */
+static int replay_main(struct profiler_options *options) {
+    struct replay_file file;
+    struct heatmap heatmap;
+    const struct profiler_backend *backend;
+    char reason[REASON_BUFFER_SIZE];
+    double start;
+    double elapsed;
+    int ret;
+
+    ret = replay_open(&file, options->replay_path, reason, sizeof(reason));
+    if (ret != 0) {
+        fprintf(stderr, "replay failed: %s\n", reason);
+        return 1;
+    }
+
+    backend = profiler_find_backend(file.backend);
+    if (!backend) {
+        fprintf(stderr, "replay failed: %s was recorded with unknown backend '%s'\n",
+                options->replay_path, file.backend);
+        replay_close(&file);
+        return 1;
+    }
+    options->sample_period = file.sample_period;
+
+    heatmap_init(&heatmap, options->max_pages, file.page_shift);
+    heatmap.replay = true;
+    heatmap.mem_info = backend->mem_info;
+
+    fprintf(stderr,
+            "replaying file=%s backend=%s period=%" PRIu64 " page_shift=%zu evict_policy=%s group_by=%s report_mode=%s sort_by=%s heat_score=%s summary_metric=%s heat_policy=%s addr_mode=%s output=%s cooling=%s\n",
+            options->replay_path, backend->name, file.sample_period,
+            file.page_shift,
+            eviction_policy_name(options->evict_policy),
+            group_dimension_name(options->group_by),
+            report_mode_name(options->report_mode),
+            page_sort_name(options->sort_by),
+            heat_score_name(options->heat_score),
+            summary_metric_name(options->summary_metric),
+            heat_policy_name(options->heat_policy),
+            stats_address_mode_name(options->stats_address_mode),
+            output_format_name(options->output_format),
+            cooling_mode_name(options->cooling_mode));
+
+    start = monotonic_sec();
+    replay_run(&file, options, backend, &heatmap);
+    elapsed = monotonic_sec() - start;
+
+    fprintf(stderr,
+            "replayed samples=%" PRIu64 " lost_samples=%" PRIu64
+            " bytes=%zu threads=%zu in %.3fs (%.1f Msamples/s)\n",
+            file.samples, file.lost_samples, file.data_len,
+            file.replay_threads, elapsed,
+            elapsed > 0.0 ? (double)file.samples / elapsed / 1e6 : 0.0);
+    if (file.serial_fallback) {
+        fprintf(stderr,
+                "note: more than max_pages=%zu distinct pages, replayed serially\n",
+                options->max_pages);
+    }
+    if (!file.complete || file.truncated_bytes != 0) {
+        fprintf(stderr,
+                "warning: %s was not closed cleanly, %zu trailing bytes ignored\n",
+                options->replay_path, file.truncated_bytes);
+    }
+
+    ret = write_report(options, &heatmap, backend, file.lost_samples);
+    replay_close(&file);
+    release_heatmap(&heatmap);
+    return ret == 0 ? 0 : 1;
+}
+
 static void usage(const char *prog) {
     fprintf(stderr,
             "Usage: %s [options]\n"
             "  -p, --pid <pid>          profile a specific process\n"
             "  -s, --system             profile system-wide on all online CPUs (default)\n"
-            "  -b, --backend <auto|pebs|ibs>\n"
+            "  --target-mode <threads|cpus>\n"
+            "                           with --pid: one event per thread, or per CPU\n"
+            "  -b, --backend <auto|pebs|ibs|faults|scan|synth>\n"
+            "  --fault-type <all|minor|major>\n"
+            "                           faults backend: page faults sampled, default all\n"
+            "  --scan-interval <ms>     scan backend: fastest rescan of a region,\n"
+            "                           default 100\n"
+            "  --scan-budget <pages>    scan backend: pages read per pass, default\n"
+            "                           131072, 0 for no limit\n"
+            "  --synth-dist <uniform|zipf|hotset|phase|multipid>\n"
+            "                           synth backend: page distribution, default zipf\n"
+            "  --synth-pages <n>        synth backend: working set in pages, default 65536\n"
+            "  --synth-rate <n>         synth backend: samples per second, default\n"
+            "                           1000000, 0 for as fast as possible\n"
             "  -d, --duration <sec>     profiling duration, default 5\n"
             "  -P, --sample-period <n>  PMU sample period, default 4000\n"
+            "  --adaptive-period        retune the period from ring pressure and loss\n"
+            "  --target-overhead <f>    adaptive mode CPU budget in %%, default 2.0\n"
+            "  --min-period <n>         adaptive mode lower bound, default period/8\n"
+            "  --max-period <n>         adaptive mode upper bound, default period*64\n"
             "  -m, --mmap-pages <n>     perf ring pages, default 128\n"
+            "  --drain-threads <n>      drain rings with N pinned threads, default 1\n"
+            "  --wakeup-bytes <n>       wake up once N bytes are pending instead of\n"
+            "                           after every sample, default 0 (every sample)\n"
             "  -M, --max-pages <n>      max tracked pages, default 65536\n"
+            "  --evict-policy <none|clock|coldest>\n"
+            "                           replacement policy once max-pages is reached\n"
             "  -t, --top <n>            report top N pages, default 20\n"
-            "  -T, --process-top <n>    report top N processes, default 10\n"
+            "  -T, --process-top <n>    report top N processes (or groups), default 10\n"
+            "  --group-by <pid|tid|cpu|node|kind>\n"
+            "                           dimension of the group summary, default pid\n"
+            "  --regions                also report heat per 2M and 1G region\n"
+            "  --vma                    also report heat per mapping and backing file\n"
+            "  --sites                  also report the code sites (pid, ip) adding\n"
+            "                           the most heat, with their symbols\n"
+            "  --numa                   also report local and remote heat per page and\n"
+            "                           process, and hot remote pages worth migrating\n"
+            "  --sort-by <heat|samples|dram|remote>\n"
+            "                           rank detail rows by heat (default), samples,\n"
+            "                           DRAM-served or remote-served accesses\n"
+            "  --heat-score <samples|latency|log-latency>\n"
+            "                           heat per sample: 1, or scaled by its load\n"
+            "                           latency (linearly or log2), default samples\n"
+            "  --latency-unit <cycles>  latency worth one sample in the latency\n"
+            "                           scores, default 100\n"
             "  -r, --report-mode <detail|summary|both>\n"
             "  -S, --summary-metric <pages|heat|samples>\n"
             "  -u, --user-only          exclude kernel samples\n"
@@ -110,6 +495,22 @@ static void usage(const char *prog) {
             "  -a, --addr-mode <auto|virtual|physical>\n"
             "  -o, --output <text|json|csv>\n"
             "  -f, --output-file <path> write report to file instead of stdout\n"
+            "  --record <path>          write raw samples to a file instead of a report\n"
+            "  --replay <path>          build the report from a --record file\n"
+            "  --replay-threads <n>     replay worker threads, default 0 (all CPUs)\n"
+            "  --interval <ms>          also report every N ms while profiling\n"
+            "  --interval-mode <full|delta>\n"
+            "                           cumulative reports, or activity since the last\n"
+            "                           one, default full\n"
+            "  --tier-node <n>          every interval, move the hot pages of --pid to\n"
+            "                           NUMA node N\n"
+            "  --tier-cold <off|cold|pageout>\n"
+            "                           every interval, apply MADV_COLD or MADV_PAGEOUT\n"
+            "                           to the pages of --pid that stayed cold\n"
+            "  --tier-cold-rounds <n>   intervals a page must stay cold, default 2\n"
+            "  --tier-rate <n>          pages moved or advised per interval, default\n"
+            "                           256, 0 for no limit\n"
+            "  --tier-dry-run           count what the tiering actions would do\n"
             "  -c, --cooling <none|step|exp>\n"
             "  -I, --cooling-interval-ms <n>\n"
             "  --cooling-decay <f>      exp cooling factor, default 0.80\n"
@@ -128,17 +529,30 @@ int main(int argc, char **argv) {
     int ret;
     int opt;
     size_t page_shift;
-    FILE *report_out = stdout;
+    struct rusage usage_before;
+    struct rusage usage_after;
+    double run_start;
+    FILE *interval_out = NULL;
+    struct tier_engine *tier = NULL;
     static const struct option long_options[] = {
         {"pid", required_argument, NULL, 'p'},
         {"system", no_argument, NULL, 's'},
+        {"target-mode", required_argument, NULL, 1022},
         {"backend", required_argument, NULL, 'b'},
         {"duration", required_argument, NULL, 'd'},
         {"sample-period", required_argument, NULL, 'P'},
+        {"adaptive-period", no_argument, NULL, 1018},
+        {"target-overhead", required_argument, NULL, 1019},
+        {"min-period", required_argument, NULL, 1020},
+        {"max-period", required_argument, NULL, 1021},
         {"mmap-pages", required_argument, NULL, 'm'},
         {"max-pages", required_argument, NULL, 'M'},
+        {"drain-threads", required_argument, NULL, 1014},
+        {"wakeup-bytes", required_argument, NULL, 1017},
+        {"evict-policy", required_argument, NULL, 1015},
         {"top", required_argument, NULL, 't'},
         {"process-top", required_argument, NULL, 'T'},
+        {"group-by", required_argument, NULL, 1016},
         {"report-mode", required_argument, NULL, 'r'},
         {"summary-metric", required_argument, NULL, 'S'},
         {"user-only", no_argument, NULL, 'u'},
@@ -148,6 +562,29 @@ int main(int argc, char **argv) {
         {"addr-mode", required_argument, NULL, 'a'},
         {"output", required_argument, NULL, 'o'},
         {"output-file", required_argument, NULL, 'f'},
+        {"record", required_argument, NULL, 1023},
+        {"replay", required_argument, NULL, 1024},
+        {"replay-threads", required_argument, NULL, 1025},
+        {"interval", required_argument, NULL, 1026},
+        {"interval-mode", required_argument, NULL, 1027},
+        {"regions", no_argument, NULL, 1028},
+        {"vma", no_argument, NULL, 1029},
+        {"sites", no_argument, NULL, 1030},
+        {"sort-by", required_argument, NULL, 1031},
+        {"heat-score", required_argument, NULL, 1032},
+        {"latency-unit", required_argument, NULL, 1033},
+        {"numa", no_argument, NULL, 1034},
+        {"tier-node", required_argument, NULL, 1035},
+        {"tier-cold", required_argument, NULL, 1036},
+        {"tier-cold-rounds", required_argument, NULL, 1037},
+        {"tier-rate", required_argument, NULL, 1038},
+        {"tier-dry-run", no_argument, NULL, 1039},
+        {"scan-interval", required_argument, NULL, 1040},
+        {"scan-budget", required_argument, NULL, 1041},
+        {"fault-type", required_argument, NULL, 1042},
+        {"synth-dist", required_argument, NULL, 1043},
+        {"synth-pages", required_argument, NULL, 1044},
+        {"synth-rate", required_argument, NULL, 1045},
         {"cooling", required_argument, NULL, 'c'},
         {"cooling-interval-ms", required_argument, NULL, 'I'},
         {"cooling-decay", required_argument, NULL, 1002},
@@ -171,6 +608,9 @@ int main(int argc, char **argv) {
             options.system_wide = true;
             options.pid = -1;
             break;
+        case 1022:
+            options.target_mode = parse_target_mode(optarg);
+            break;
         case 'b':
             options.backend_name = optarg;
             break;
@@ -180,18 +620,45 @@ int main(int argc, char **argv) {
         case 'P':
             options.sample_period = strtoull(optarg, NULL, 0);
             break;
+        case 1018:
+            options.adaptive_period = true;
+            break;
+        case 1019:
+            options.target_overhead = strtod(optarg, NULL);
+            break;
+        case 1020:
+            options.min_period = strtoull(optarg, NULL, 0);
+            break;
+        case 1021:
+            options.max_period = strtoull(optarg, NULL, 0);
+            break;
         case 'm':
             options.mmap_pages = strtoull(optarg, NULL, 0);
             break;
         case 'M':
             options.max_pages = strtoull(optarg, NULL, 0);
             break;
+        case 1014:
+            options.drain_threads = (unsigned)strtoul(optarg, NULL, 0);
+            if (options.drain_threads == 0) {
+                options.drain_threads = 1;
+            }
+            break;
+        case 1017:
+            options.wakeup_bytes = strtoull(optarg, NULL, 0);
+            break;
+        case 1015:
+            options.evict_policy = parse_eviction_policy(optarg);
+            break;
         case 't':
             options.top_n = (unsigned)strtoul(optarg, NULL, 0);
             break;
         case 'T':
             options.process_top_n = (unsigned)strtoul(optarg, NULL, 0);
             break;
+        case 1016:
+            options.group_by = parse_group_dimension(optarg);
+            break;
         case 'r':
             options.report_mode = parse_report_mode(optarg);
             break;
@@ -219,6 +686,75 @@ int main(int argc, char **argv) {
         case 'f':
             options.output_path = optarg;
             break;
+        case 1023:
+            options.record_path = optarg;
+            break;
+        case 1024:
+            options.replay_path = optarg;
+            break;
+        case 1025:
+            options.replay_threads = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 1026:
+            options.report_interval_ms = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 1027:
+            options.interval_mode = parse_interval_mode(optarg);
+            break;
+        case 1028:
+            options.track_regions = true;
+            break;
+        case 1029:
+            options.track_vmas = true;
+            break;
+        case 1030:
+            options.track_sites = true;
+            break;
+        case 1031:
+            options.sort_by = parse_page_sort(optarg);
+            break;
+        case 1032:
+            options.heat_score = parse_heat_score(optarg);
+            break;
+        case 1033:
+            options.latency_unit = strtoull(optarg, NULL, 0);
+            break;
+        case 1034:
+            options.track_numa = true;
+            break;
+        case 1035:
+            options.tier_node = atoi(optarg);
+            break;
+        case 1036:
+            options.tier_cold = parse_tier_cold_action(optarg);
+            break;
+        case 1037:
+            options.tier_cold_rounds = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 1038:
+            options.tier_rate = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 1039:
+            options.tier_dry_run = true;
+            break;
+        case 1040:
+            options.scan_interval_ms = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 1041:
+            options.scan_budget = strtoull(optarg, NULL, 0);
+            break;
+        case 1042:
+            options.fault_type = parse_fault_type(optarg);
+            break;
+        case 1043:
+            options.synth_dist = parse_synth_dist(optarg);
+            break;
+        case 1044:
+            options.synth_pages = strtoull(optarg, NULL, 0);
+            break;
+        case 1045:
+            options.synth_rate = strtoull(optarg, NULL, 0);
+            break;
         case 'c':
             options.cooling_mode = parse_cooling_mode(optarg);
             break;
@@ -247,6 +783,36 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (options.min_period == 0) {
+        options.min_period = options.sample_period / 8 ? options.sample_period / 8 : 1;
+    }
+    if (options.max_period == 0) {
+        options.max_period = options.sample_period * 64;
+    }
+    if (options.max_period < options.min_period) {
+        options.max_period = options.min_period;
+    }
+    if (options.target_overhead <= 0.0) {
+        options.target_overhead = 2.0;
+    }
+
+    if (options.record_path && options.replay_path) {
+        fprintf(stderr, "--record and --replay are mutually exclusive\n");
+        return 1;
+    }
+    /* Their mappings, binaries and topology would be this host's. */
+    if (options.replay_path &&
+        (options.track_vmas || options.track_sites || options.track_numa)) {
+        fprintf(stderr, "--vma, --sites and --numa read the live system and cannot be used with --replay\n");
+        return 1;
+    }
+    if (!check_tier_options(&options)) {
+        return 1;
+    }
+    if (options.replay_path) {
+        return replay_main(&options);
+    }
+
     backend = profiler_select_backend(options.backend_name, reason,
                                       sizeof(reason));
     if (!backend) {
@@ -256,21 +822,66 @@ int main(int argc, char **argv) {
 
     page_shift = (size_t)__builtin_ctzl((unsigned long)sysconf(_SC_PAGESIZE));
     heatmap_init(&heatmap, options.max_pages, page_shift);
+    heatmap.mem_info = backend->mem_info;
+    attach_vma_index(&options, &heatmap);
+    attach_numa_topology(&options, &heatmap);
 
     ret = perf_session_open(&session, &options, backend, reason, sizeof(reason));
     if (ret != 0) {
         fprintf(stderr, "open session failed: %s\n", reason);
-        heatmap_destroy(&heatmap);
+        release_heatmap(&heatmap);
         return 1;
     }
 
+    if (options.record_path) {
+        ret = record_writer_open(&session.record, options.record_path,
+                                 &session, &options, backend, page_shift,
+                                 reason, sizeof(reason));
+        if (ret != 0) {
+            fprintf(stderr, "record failed: %s\n", reason);
+            perf_session_close(&session);
+            release_heatmap(&heatmap);
+            return 1;
+        }
+    } else if (options.report_interval_ms > 0) {
+        interval_out = open_report_output(&options);
+        if (!interval_out) {
+            perf_session_close(&session);
+            release_heatmap(&heatmap);
+            return 1;
+        }
+        session.interval_out = interval_out;
+    }
+
+    if (interval_out &&
+        (options.tier_node >= 0 || options.tier_cold != TIER_COLD_OFF)) {
+        ret = tier_engine_create(&tier, &options, reason, sizeof(reason));
+        if (ret != 0) {
+            fprintf(stderr, "tiering failed: %s\n", reason);
+            close_report_output(&options, interval_out);
+            perf_session_close(&session);
+            release_heatmap(&heatmap);
+            return 1;
+        }
+        session.tier = tier;
+    }
+
     fprintf(stderr,
-            "profiling backend=%s vendor=%s target=%s duration=%us period=%" PRIu64
-            " report_mode=%s summary_metric=%s heat_policy=%s addr_mode=%s output=%s cooling=%s\n",
+            "profiling backend=%s vendor=%s target=%s scope=%s events=%zu duration=%us period=%" PRIu64
+            " adaptive_period=%s drain_threads=%u wakeup_bytes=%" PRIu64 " report_interval_ms=%u interval_mode=%s evict_policy=%s group_by=%s report_mode=%s sort_by=%s heat_score=%s summary_metric=%s heat_policy=%s addr_mode=%s output=%s cooling=%s\n",
             backend->name, detect_cpu_vendor(),
-            options.system_wide ? "system" : "process", options.duration_sec,
+            options.system_wide ? "system" : "process", session.scope,
+            session.nr_opened, options.duration_sec,
             options.sample_period,
+            options.adaptive_period ? "on" : "off", options.drain_threads,
+            options.wakeup_bytes,
+            interval_out ? options.report_interval_ms : 0,
+            interval_mode_name(options.interval_mode),
+            eviction_policy_name(options.evict_policy),
+            group_dimension_name(options.group_by),
             report_mode_name(options.report_mode),
+            page_sort_name(options.sort_by),
+            heat_score_name(options.heat_score),
             summary_metric_name(options.summary_metric),
             heat_policy_name(options.heat_policy),
             stats_address_mode_name(options.stats_address_mode),
@@ -278,34 +889,55 @@ int main(int argc, char **argv) {
             cooling_mode_name(options.cooling_mode));
     fflush(stderr);
 
+    getrusage(RUSAGE_SELF, &usage_before);
+    run_start = monotonic_sec();
     ret = perf_session_run(&session, &options, backend, &heatmap, reason,
                            sizeof(reason));
+    getrusage(RUSAGE_SELF, &usage_after);
+    report_overhead(&options, &session, &usage_before, &usage_after,
+                    monotonic_sec() - run_start);
     if (ret != 0) {
         fprintf(stderr, "profiling failed: %s\n", reason);
+        record_writer_close(session.record, NULL, reason, sizeof(reason));
+        if (interval_out) {
+            close_report_output(&options, interval_out);
+        }
+        tier_engine_destroy(tier);
         perf_session_close(&session);
-        heatmap_destroy(&heatmap);
+        release_heatmap(&heatmap);
         return 1;
     }
 
-    if (options.output_path) {
-        report_out = fopen(options.output_path, "w");
-        if (!report_out) {
-            fprintf(stderr, "failed to open output file %s: %s\n",
-                    options.output_path, strerror(errno));
-            perf_session_close(&session);
-            heatmap_destroy(&heatmap);
-            return 1;
-        }
-    }
-
-    heatmap_report(&heatmap, &options, backend, session.lost_samples, report_out);
+    if (options.record_path) {
+        uint64_t record_bytes = 0;
 
-    if (report_out != stdout) {
-        fclose(report_out);
-        fprintf(stderr, "report written to %s\n", options.output_path);
+        ret = record_writer_close(session.record, &record_bytes, reason,
+                                  sizeof(reason));
+        session.record = NULL;
+        if (ret != 0) {
+            fprintf(stderr, "record failed: %s\n", reason);
+        } else {
+            fprintf(stderr,
+                    "recorded %" PRIu64 " bytes lost_samples=%" PRIu64 " to %s\n",
+                    record_bytes, session.lost_samples, options.record_path);
+        }
+    } else if (interval_out) {
+        /* The final report closes the stream of interval reports. */
+        fprintf(stderr,
+                "interval reports=%" PRIu64 " skipped=%" PRIu64 "\n",
+                session.interval_reports, session.interval_skipped);
+        if (tier) {
+            tier_engine_summary(tier, &options, stderr);
+        }
+        heatmap_report(&heatmap, &options, backend, session.lost_samples,
+                       interval_out);
+        close_report_output(&options, interval_out);
+    } else {
+        ret = write_report(&options, &heatmap, backend, session.lost_samples);
     }
 
+    tier_engine_destroy(tier);
     perf_session_close(&session);
-    heatmap_destroy(&heatmap);
-    return 0;
+    release_heatmap(&heatmap);
+    return ret == 0 ? 0 : 1;
 }
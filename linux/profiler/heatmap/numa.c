@@ -0,0 +1,258 @@
+#include "profiler.h"
+
+#include <ctype.h>
+#include <dirent.h>
+
+
+#define NUMA_SYSFS_NODE "/sys/devices/system/node"
+#define NUMA_SYSFS_MEMORY "/sys/devices/system/memory"
+
+/*
+ * Read once at startup: which node each CPU belongs to, and which node each
+ * memory block (block_size bytes of physical memory) was onlined to. Memory
+ * hotplug after startup is not followed.
+ */
+struct numa_topology {
+    int *cpu_node;
+    size_t nr_cpus;
+    int16_t *block_node;
+    size_t nr_blocks;
+    uint64_t block_size;
+};
+
+/* Mark every CPU in a sysfs cpulist such as "0-3,8,10-11" as living on node. */
+static void cpu_node_apply_list(int *cpu_node, size_t nr_cpus,
+                                const char *list, int node) {
+    const char *cursor = list;
+
+    while (*cursor && *cursor != '\n') {
+        char *endptr;
+        unsigned long first = strtoul(cursor, &endptr, 10);
+        unsigned long last = first;
+        unsigned long cpu;
+
+        if (endptr == cursor) {
+            return;
+        }
+        if (*endptr == '-') {
+            cursor = endptr + 1;
+            last = strtoul(cursor, &endptr, 10);
+            if (endptr == cursor) {
+                return;
+            }
+        }
+        for (cpu = first; cpu <= last && cpu < nr_cpus; cpu++) {
+            cpu_node[cpu] = node;
+        }
+        cursor = *endptr == ',' ? endptr + 1 : endptr;
+    }
+}
+
+/* "nodeN" directory entries of /sys/devices/system/node, else -1. */
+static int numa_node_entry(const struct dirent *entry) {
+    if (strncmp(entry->d_name, "node", 4) != 0 ||
+        !isdigit((unsigned char)entry->d_name[4])) {
+        return -1;
+    }
+    return atoi(entry->d_name + 4);
+}
+
+/*
+ * Build a cpu -> NUMA node map from /sys/devices/system/node. A machine
+ * without that directory (or a CPU not listed under any node) maps to -1.
+ */
+int cpu_node_map_load(int **map_out, size_t *count_out) {
+    long configured = sysconf(_SC_NPROCESSORS_CONF);
+    size_t nr_cpus = configured > 0 ? (size_t)configured : 1;
+    struct dirent *entry;
+    int *cpu_node;
+    DIR *dir;
+    size_t i;
+
+    cpu_node = malloc(nr_cpus * sizeof(*cpu_node));
+    if (!cpu_node) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < nr_cpus; i++) {
+        cpu_node[i] = -1;
+    }
+    *map_out = cpu_node;
+    *count_out = nr_cpus;
+
+    dir = opendir(NUMA_SYSFS_NODE);
+    if (!dir) {
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        char path[PATH_BUFFER_SIZE];
+        char list[4096];
+        int node = numa_node_entry(entry);
+        FILE *fp;
+
+        if (node < 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s/cpulist", NUMA_SYSFS_NODE,
+                 entry->d_name);
+        fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), fp)) {
+            cpu_node_apply_list(cpu_node, nr_cpus, list, node);
+        }
+        fclose(fp);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/* Record node for every memoryM link under one nodeN directory. */
+static int numa_load_node_blocks(struct numa_topology *numa, const char *name,
+                                 int node) {
+    char path[PATH_BUFFER_SIZE];
+    struct dirent *entry;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s/%s", NUMA_SYSFS_NODE, name);
+    dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long block;
+        char *endptr;
+
+        if (strncmp(entry->d_name, "memory", 6) != 0 ||
+            !isdigit((unsigned char)entry->d_name[6])) {
+            continue;
+        }
+        block = strtoul(entry->d_name + 6, &endptr, 10);
+        if (*endptr != '\0') {
+            continue;
+        }
+        if (block >= numa->nr_blocks) {
+            size_t count = numa->nr_blocks ? numa->nr_blocks : 256;
+            int16_t *blocks;
+            size_t i;
+
+            while (count <= block) {
+                count *= 2;
+            }
+            blocks = realloc(numa->block_node, count * sizeof(*blocks));
+            if (!blocks) {
+                closedir(dir);
+                return -ENOMEM;
+            }
+            for (i = numa->nr_blocks; i < count; i++) {
+                blocks[i] = -1;
+            }
+            numa->block_node = blocks;
+            numa->nr_blocks = count;
+        }
+        numa->block_node[block] = (int16_t)node;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/*
+ * Memory blocks of each node, for physical addresses. A kernel without
+ * memory block devices leaves the map empty and physical pages unresolved.
+ */
+static int numa_load_blocks(struct numa_topology *numa) {
+    char text[64];
+    struct dirent *entry;
+    FILE *fp;
+    DIR *dir;
+    int ret = 0;
+
+    fp = fopen(NUMA_SYSFS_MEMORY "/block_size_bytes", "r");
+    if (!fp) {
+        return 0;
+    }
+    if (fgets(text, sizeof(text), fp)) {
+        numa->block_size = strtoull(text, NULL, 16);
+    }
+    fclose(fp);
+    if (numa->block_size == 0) {
+        return 0;
+    }
+
+    dir = opendir(NUMA_SYSFS_NODE);
+    if (!dir) {
+        return 0;
+    }
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        int node = numa_node_entry(entry);
+
+        if (node < 0) {
+            continue;
+        }
+        ret = numa_load_node_blocks(numa, entry->d_name, node);
+    }
+    closedir(dir);
+    return ret;
+}
+
+int numa_topology_create(struct numa_topology **numa_out) {
+    struct numa_topology *numa = calloc(1, sizeof(*numa));
+    int ret;
+
+    if (!numa) {
+        return -ENOMEM;
+    }
+    ret = cpu_node_map_load(&numa->cpu_node, &numa->nr_cpus);
+    if (ret == 0) {
+        ret = numa_load_blocks(numa);
+    }
+    if (ret != 0) {
+        numa_topology_destroy(numa);
+        return ret;
+    }
+    *numa_out = numa;
+    return 0;
+}
+
+void numa_topology_destroy(struct numa_topology *numa) {
+    if (!numa) {
+        return;
+    }
+    free(numa->cpu_node);
+    free(numa->block_node);
+    free(numa);
+}
+
+int numa_cpu_node(const struct numa_topology *numa, uint32_t cpu) {
+    return cpu < numa->nr_cpus ? numa->cpu_node[cpu] : -1;
+}
+
+int numa_phys_node(const struct numa_topology *numa, uint64_t phys_addr) {
+    uint64_t block;
+
+    if (numa->block_size == 0) {
+        return -1;
+    }
+    block = phys_addr / numa->block_size;
+    return block < numa->nr_blocks ? numa->block_node[block] : -1;
+}
+
+/*
+ * Node currently backing a virtual address of pid, from move_pages() with no
+ * target nodes, which only queries. -1 for unmapped or never faulted pages,
+ * or when the caller may not inspect pid.
+ */
+int numa_vaddr_node(pid_t pid, uint64_t addr) {
+    void *page = (void *)(uintptr_t)addr;
+    int status = -1;
+
+    if (syscall(__NR_move_pages, pid, 1UL, &page, NULL, &status, 0) != 0 ||
+        status < 0) {
+        return -1;
+    }
+    return status;
+}
@@ -1,13 +1,19 @@
 #include "profiler.h"
 
 #include <dirent.h>
-#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sched.h>
 
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <time.h>
 
+#define ADAPTIVE_PERIOD_TICK_NS (250ULL * 1000ULL * 1000ULL)
+/* epoll token of the --interval wake fd; ring tokens are handle indexes. */
+#define DRAIN_WAKE_TOKEN UINT64_MAX
+
 static void perf_rmb(void) {
     __sync_synchronize();
 }
@@ -49,69 +55,92 @@ static uint64_t ring_read_u64(const struct perf_event_mmap_page *metadata,
     return value;
 }
 
-static void ring_read_pid_tid(const struct perf_event_mmap_page *metadata,
-                              uint64_t *cursor, uint32_t *pid,
-                              uint32_t *tid) {
-    struct {
-        uint32_t pid;
-        uint32_t tid;
-    } value;
+/*
+ * Perf lays the requested fields out in a fixed order, each one u64 sized
+ * for the fields we ask for (pid/tid and cpu/res are two u32 halves).
+ */
+void sample_layout_init(struct sample_layout *layout, uint64_t sample_type) {
+    int16_t offset = 0;
+
+    memset(layout, 0xff, sizeof(*layout));
+
+#define LAYOUT_FIELD(bit, field)        \
+    do {                                \
+        if (sample_type & (bit)) {      \
+            layout->field = offset;     \
+            offset += sizeof(uint64_t); \
+        }                               \
+    } while (0)
+
+    LAYOUT_FIELD(PERF_SAMPLE_IP, ip);
+    LAYOUT_FIELD(PERF_SAMPLE_TID, tid);
+    LAYOUT_FIELD(PERF_SAMPLE_TIME, time);
+    LAYOUT_FIELD(PERF_SAMPLE_ADDR, addr);
+    LAYOUT_FIELD(PERF_SAMPLE_CPU, cpu);
+    LAYOUT_FIELD(PERF_SAMPLE_PERIOD, period);
+    LAYOUT_FIELD(PERF_SAMPLE_WEIGHT, weight);
+    LAYOUT_FIELD(PERF_SAMPLE_DATA_SRC, data_src);
+#ifdef PERF_SAMPLE_PHYS_ADDR
+    LAYOUT_FIELD(PERF_SAMPLE_PHYS_ADDR, phys_addr);
+#endif
 
-    ring_copy(metadata, *cursor, &value, sizeof(value));
-    *cursor += sizeof(value);
-    *pid = value.pid;
-    *tid = value.tid;
+#undef LAYOUT_FIELD
+
+    layout->size = (uint16_t)offset;
 }
 
-static void ring_read_cpu(const struct perf_event_mmap_page *metadata,
-                          uint64_t *cursor, uint32_t *cpu) {
-    struct {
-        uint32_t cpu;
-        uint32_t reserved;
-    } value;
+static uint64_t payload_u64(const unsigned char *payload, int16_t offset) {
+    uint64_t value;
 
-    ring_copy(metadata, *cursor, &value, sizeof(value));
-    *cursor += sizeof(value);
-    *cpu = value.cpu;
+    memcpy(&value, payload + offset, sizeof(value));
+    return value;
 }
 
-static void parse_sample(const struct perf_event_mmap_page *metadata,
-                         uint64_t payload_offset, uint64_t sample_type,
-                         struct sample_record *sample) {
-    uint64_t cursor = payload_offset;
+static uint32_t payload_u32(const unsigned char *payload, int16_t offset) {
+    uint32_t value;
+
+    memcpy(&value, payload + offset, sizeof(value));
+    return value;
+}
 
+/* Decode a contiguous sample payload using the precomputed layout. */
+void decode_sample(const struct sample_layout *layout,
+                   const unsigned char *payload,
+                   struct sample_record *sample) {
     memset(sample, 0, sizeof(*sample));
 
-    if (sample_type & PERF_SAMPLE_IP) {
-        sample->ip = ring_read_u64(metadata, &cursor);
+    if (layout->ip >= 0) {
+        sample->ip = payload_u64(payload, layout->ip);
     }
-    if (sample_type & PERF_SAMPLE_TID) {
-        ring_read_pid_tid(metadata, &cursor, &sample->pid, &sample->tid);
+    if (layout->tid >= 0) {
+        sample->pid = payload_u32(payload, layout->tid);
+        sample->tid = payload_u32(payload, layout->tid + 4);
     }
-    if (sample_type & PERF_SAMPLE_TIME) {
-        sample->time_ns = ring_read_u64(metadata, &cursor);
+    if (layout->time >= 0) {
+        sample->time_ns = payload_u64(payload, layout->time);
     }
-    if (sample_type & PERF_SAMPLE_ADDR) {
-        sample->addr = ring_read_u64(metadata, &cursor);
+    if (layout->addr >= 0) {
+        sample->addr = payload_u64(payload, layout->addr);
         sample->has_addr = true;
     }
-    if (sample_type & PERF_SAMPLE_CPU) {
-        ring_read_cpu(metadata, &cursor, &sample->cpu);
+    if (layout->cpu >= 0) {
+        sample->cpu = payload_u32(payload, layout->cpu);
+    }
+    if (layout->period >= 0) {
+        sample->period = payload_u64(payload, layout->period);
     }
-    if (sample_type & PERF_SAMPLE_WEIGHT) {
-        sample->weight = ring_read_u64(metadata, &cursor);
+    if (layout->weight >= 0) {
+        sample->weight = payload_u64(payload, layout->weight);
         sample->has_weight = true;
     }
-    if (sample_type & PERF_SAMPLE_DATA_SRC) {
-        sample->data_src = ring_read_u64(metadata, &cursor);
+    if (layout->data_src >= 0) {
+        sample->data_src = payload_u64(payload, layout->data_src);
         sample->has_data_src = true;
     }
-#ifdef PERF_SAMPLE_PHYS_ADDR
-    if (sample_type & PERF_SAMPLE_PHYS_ADDR) {
-        sample->phys_addr = ring_read_u64(metadata, &cursor);
+    if (layout->phys_addr >= 0) {
+        sample->phys_addr = payload_u64(payload, layout->phys_addr);
         sample->has_phys_addr = true;
     }
-#endif
 }
 
 static int count_online_cpus(void) {
@@ -179,12 +208,18 @@ static int list_thread_ids(pid_t pid, int **tids_out, size_t *count_out,
 static int perf_enable_all(struct perf_session *session) {
     size_t i;
 
-    for (i = 0; i < session->nr_opened; i++) {
+    for (i = 0; i < session->nr_handles; i++) {
+        if (session->handles[i].fd < 0) {
+            continue;
+        }
         if (ioctl(session->handles[i].fd, PERF_EVENT_IOC_RESET, 0) != 0) {
             return -errno;
         }
     }
-    for (i = 0; i < session->nr_opened; i++) {
+    for (i = 0; i < session->nr_handles; i++) {
+        if (session->handles[i].fd < 0) {
+            continue;
+        }
         if (ioctl(session->handles[i].fd, PERF_EVENT_IOC_ENABLE, 0) != 0) {
             return -errno;
         }
@@ -195,13 +230,191 @@ static int perf_enable_all(struct perf_session *session) {
 static void perf_disable_all(struct perf_session *session) {
     size_t i;
 
-    for (i = 0; i < session->nr_opened; i++) {
+    for (i = 0; i < session->nr_handles; i++) {
         if (session->handles[i].fd >= 0) {
             ioctl(session->handles[i].fd, PERF_EVENT_IOC_DISABLE, 0);
         }
     }
 }
 
+/*
+ * Find the mount point of the cgroup hierarchy that owns perf events: a v1
+ * hierarchy with the perf_event controller if one is mounted (hybrid
+ * setups), otherwise the cgroup2 mount.
+ */
+static bool find_perf_cgroup_mount(char *mount_out, size_t mount_len,
+                                   bool *v1_out) {
+    char line[PATH_BUFFER_SIZE];
+    char v2_mount[PATH_BUFFER_SIZE] = "";
+    FILE *fp = fopen("/proc/mounts", "r");
+
+    if (!fp) {
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char dir[PATH_BUFFER_SIZE];
+        char type[64];
+        char opts[PATH_BUFFER_SIZE];
+
+        if (sscanf(line, "%*s %511s %63s %511s", dir, type, opts) != 3) {
+            continue;
+        }
+        if (strcmp(type, "cgroup") == 0 && strstr(opts, "perf_event")) {
+            snprintf(mount_out, mount_len, "%s", dir);
+            *v1_out = true;
+            fclose(fp);
+            return true;
+        }
+        if (strcmp(type, "cgroup2") == 0 && !v2_mount[0]) {
+            snprintf(v2_mount, sizeof(v2_mount), "%s", dir);
+        }
+    }
+
+    fclose(fp);
+    if (!v2_mount[0]) {
+        return false;
+    }
+    snprintf(mount_out, mount_len, "%s", v2_mount);
+    *v1_out = false;
+    return true;
+}
+
+/*
+ * True when no process but pid is in the cgroup open at cgroup_fd or in any
+ * of its descendants, all of which a PERF_FLAG_PID_CGROUP event samples.
+ */
+static bool cgroup_holds_only(int cgroup_fd, pid_t pid) {
+    char line[32];
+    struct dirent *entry;
+    DIR *dir;
+    FILE *fp;
+    bool only = true;
+    int fd;
+
+    fd = openat(cgroup_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+    fp = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (!fp) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    while (only && fgets(line, sizeof(line), fp)) {
+        only = strtol(line, NULL, 10) == pid;
+    }
+    fclose(fp);
+    if (!only) {
+        return false;
+    }
+
+    fd = openat(cgroup_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    while (only && (entry = readdir(dir)) != NULL) {
+        int child;
+
+        if (entry->d_type != DT_DIR || entry->d_name[0] == '.') {
+            continue;
+        }
+        child = openat(fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        only = child >= 0 && cgroup_holds_only(child, pid);
+        if (child >= 0) {
+            close(child);
+        }
+    }
+    closedir(dir);
+    return only;
+}
+
+/*
+ * Open the perf_event cgroup directory that contains pid, for
+ * PERF_FLAG_PID_CGROUP events. Returns the directory fd, -EBUSY when other
+ * processes share the cgroup (it may well be the root one), or -errno.
+ */
+static int open_target_cgroup(pid_t pid) {
+    char mount_dir[PATH_BUFFER_SIZE];
+    char path[PATH_BUFFER_SIZE * 2];
+    char line[PATH_BUFFER_SIZE];
+    bool v1 = false;
+    FILE *fp;
+    int fd = -ENOENT;
+
+    if (!find_perf_cgroup_mount(mount_dir, sizeof(mount_dir), &v1)) {
+        return -ENOENT;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return -errno;
+    }
+
+    /* Lines look like "0::/path" (v2) or "7:perf_event:/path" (v1). */
+    while (fgets(line, sizeof(line), fp)) {
+        char *controllers = strchr(line, ':');
+        char *cgroup_path = controllers ? strchr(controllers + 1, ':') : NULL;
+
+        if (!cgroup_path) {
+            continue;
+        }
+        *cgroup_path++ = '\0';
+        *controllers++ = '\0';
+        if (v1 ? !strstr(controllers, "perf_event") :
+                 strcmp(line, "0") != 0) {
+            continue;
+        }
+
+        cgroup_path[strcspn(cgroup_path, "\n")] = '\0';
+        snprintf(path, sizeof(path), "%s%s", mount_dir, cgroup_path);
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            fd = -errno;
+        } else if (!cgroup_holds_only(fd, pid)) {
+            close(fd);
+            fd = -EBUSY;
+        }
+        break;
+    }
+
+    fclose(fp);
+    return fd;
+}
+
+/*
+ * Per-CPU event for process mode. The preferred form counts everything in
+ * the target's cgroup on this CPU, which holds only the target: that covers
+ * every thread, including ones that existed before startup, and samples
+ * from processes that join the cgroup later are filtered out by pid while
+ * draining. If the kernel refuses cgroup events, *cgroup_fd is closed and
+ * the (pid, cpu, inherit=1) form is used from then on; it follows the
+ * target's main thread and the threads it creates, and perf_session_open()
+ * adds a per-thread event for each of the other existing threads.
+ */
+static int open_cpu_target_event(struct perf_event_attr *attr, pid_t pid,
+                                 int cpu, int *cgroup_fd) {
+    int fd;
+
+    if (*cgroup_fd >= 0) {
+        attr->inherit = 0;
+        fd = perf_event_open_syscall(attr, *cgroup_fd, cpu, -1,
+                                     PERF_FLAG_PID_CGROUP);
+        if (fd >= 0 || errno == ENODEV || errno == ENOENT) {
+            return fd;
+        }
+        close(*cgroup_fd);
+        *cgroup_fd = -1;
+    }
+
+    attr->inherit = 1;
+    return perf_event_open_syscall(attr, pid, cpu, -1, 0);
+}
+
 int perf_session_open(struct perf_session *session,
                       const struct profiler_options *options,
                       const struct profiler_backend *backend,
@@ -210,12 +423,18 @@ int perf_session_open(struct perf_session *session,
     struct perf_event_attr attr;
     int *tids = NULL;
     pid_t target_pid = options->pid > 0 ? options->pid : getpid();
+    bool per_cpu = options->system_wide || options->target_mode == TARGET_CPUS;
+    int cgroup_fd = -1;
     int ret;
+    int nr_cpus = 0;
     int nr_targets;
     int i;
 
     memset(session, 0, sizeof(*session));
     session->page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if (backend->session_open) {
+        return backend->session_open(session, options, reason, reason_len);
+    }
 
     ret = backend->prepare_attr(options, &attr, reason, reason_len);
     if (ret != 0) {
@@ -223,26 +442,54 @@ int perf_session_open(struct perf_session *session,
     }
 
     session->sample_type = attr.sample_type;
+    sample_layout_init(&session->layout, attr.sample_type);
     if (options->system_wide) {
+        session->scope = "system";
         nr_targets = count_online_cpus();
     } else {
         size_t tid_count = 0;
+
+        /*
+         * In cpus mode the threads are only needed if cgroup events turn
+         * out to be unusable; the slots after the per-CPU events are then
+         * used for the existing threads.
+         */
+        if (options->target_mode == TARGET_CPUS) {
+            cgroup_fd = open_target_cgroup(target_pid);
+            if (cgroup_fd == -EBUSY) {
+                fprintf(stderr, "warning: the cgroup of pid %d holds other processes, following its threads instead\n",
+                        target_pid);
+            }
+            session->filter_pid = target_pid;
+            nr_cpus = count_online_cpus();
+        } else {
+            session->scope = "threads";
+        }
         ret = list_thread_ids(target_pid, &tids, &tid_count, reason, reason_len);
         if (ret != 0) {
+            if (cgroup_fd >= 0) {
+                close(cgroup_fd);
+            }
             return ret;
         }
         if (tid_count == 0) {
             free(tids);
+            if (cgroup_fd >= 0) {
+                close(cgroup_fd);
+            }
             snprintf(reason, reason_len,
                      "no threads found under /proc/%d/task", target_pid);
             return -ESRCH;
         }
-        nr_targets = (int)tid_count;
+        nr_targets = nr_cpus + (int)tid_count;
     }
     session->nr_handles = (size_t)nr_targets;
     session->handles = calloc(session->nr_handles, sizeof(*session->handles));
     if (!session->handles) {
         free(tids);
+        if (cgroup_fd >= 0) {
+            close(cgroup_fd);
+        }
         snprintf(reason, reason_len, "failed to allocate perf handles");
         return -ENOMEM;
     }
@@ -253,27 +500,44 @@ int perf_session_open(struct perf_session *session,
 
     for (i = 0; i < nr_targets; i++) {
         struct perf_handle *handle = &session->handles[i];
-        pid_t pid = options->system_wide ? -1 : tids[i];
-        int cpu = options->system_wide ? i : -1;
+        bool thread_event = !options->system_wide && i >= nr_cpus;
+        pid_t pid = options->system_wide ? -1 :
+                    (thread_event ? tids[i - nr_cpus] : target_pid);
+        int cpu = thread_event ? -1 : i;
 
         /*
          * perf_event_open target selection convention:
-         * - system-wide profiling: pid=-1 and cpu=<online cpu index>
-         * - per-thread profiling : pid=<tid> and cpu=-1
+         * - system-wide profiling  : pid=-1 and cpu=<online cpu index>
+         * - per-thread profiling   : pid=<tid> and cpu=-1
+         * - per-CPU process target : pid=<cgroup fd or pid> and cpu=<cpu>,
+         *   plus pid=<tid> and cpu=-1 for the existing threads other than
+         *   the main one when the pid form is used
          *
-         * The code never mixes pid>=0 with cpu>=0 because the profiler chooses
-         * either "one event per CPU" or "one event per thread".
+         * Per-thread mode needs one event and ring per thread; the per-CPU
+         * modes need one per CPU regardless of how many threads there are.
          */
         handle->cpu = cpu;
         handle->map_len = (options->mmap_pages + 1) * session->page_size;
 
         /*
          * group_fd=-1 means this event is opened standalone rather than as part
-         * of a perf event group. flags=0 keeps the default perf semantics.
+         * of a perf event group.
          */
-        handle->fd = perf_event_open_syscall(&attr, pid, cpu, -1, 0);
+        if (per_cpu && !thread_event) {
+            handle->fd = open_cpu_target_event(&attr, target_pid, cpu,
+                                               &cgroup_fd);
+        } else if (per_cpu && !options->system_wide) {
+            /* perf cannot mmap an inherited event that has no CPU. */
+            if (cgroup_fd >= 0 || pid == target_pid) {
+                continue;
+            }
+            attr.inherit = 0;
+            handle->fd = perf_event_open_syscall(&attr, pid, cpu, -1, 0);
+        } else {
+            handle->fd = perf_event_open_syscall(&attr, pid, cpu, -1, 0);
+        }
         if (handle->fd < 0) {
-            if (!options->system_wide) {
+            if (!per_cpu) {
                 snprintf(reason, reason_len,
                          "perf_event_open failed for backend=%s pid=%d: %s. "
                          "Check CAP_PERFMON or /proc/sys/kernel/perf_event_paranoid",
@@ -290,7 +554,7 @@ int perf_session_open(struct perf_session *session,
             close(handle->fd);
             handle->fd = -1;
             handle->base = NULL;
-            if (!options->system_wide) {
+            if (!per_cpu) {
                 snprintf(reason, reason_len, "mmap perf ring failed: %s",
                          strerror(errno));
                 free(tids);
@@ -302,6 +566,13 @@ int perf_session_open(struct perf_session *session,
         session->nr_opened++;
     }
 
+    if (!session->scope) {
+        session->scope = cgroup_fd >= 0 ? "cgroup" : "inherit";
+    }
+    if (cgroup_fd >= 0) {
+        close(cgroup_fd);
+    }
+
     if (session->nr_opened == 0) {
         free(tids);
         snprintf(reason, reason_len,
@@ -323,101 +594,632 @@ int perf_session_open(struct perf_session *session,
     return 0;
 }
 
-static void drain_perf_ring(struct perf_session *session,
-                            struct perf_handle *handle,
-                            const struct profiler_options *options,
-                            const struct profiler_backend *backend,
-                            struct heatmap *heatmap) {
+struct drain_worker {
+    struct perf_session *session;
+    const struct profiler_options *options;
+    const struct profiler_backend *backend;
+    struct heatmap *heatmap;
+    struct heatmap shard;
+    struct interval_reporter *reporter;
+    size_t index;
+    size_t first_handle;
+    size_t end_handle;
+    int cpu;
+    uint64_t start_ns;
+    uint64_t lost_samples;
+    uint64_t wakeups;
+    uint64_t period;
+    uint64_t period_low;
+    uint64_t period_high;
+    uint64_t period_changes;
+    uint64_t tick_ns;
+    uint64_t tick_cpu_ns;
+    uint64_t tick_lost;
+    double tick_fill;
+    double target_overhead;
+    int ret;
+    char reason[REASON_BUFFER_SIZE];
+    pthread_t thread;
+    bool started;
+};
+
+/*
+ * --record counterpart of drain_perf_ring(): the pending span of the ring is
+ * appended to the record file as is, with no decoding. Only the record
+ * headers are walked, to keep lost_samples (and with it the adaptive period
+ * controller) working.
+ */
+static double record_perf_ring(struct perf_session *session,
+                               struct perf_handle *handle,
+                               uint64_t *lost_samples) {
     struct perf_event_mmap_page *metadata = handle->base;
+    const unsigned char *data;
+    uint64_t data_mask;
     uint64_t head;
     uint64_t tail;
+    uint64_t cursor;
+    size_t begin;
+    size_t len;
+    size_t first;
 
     if (!metadata) {
-        return;
+        return 0.0;
+    }
+
+    data = (const unsigned char *)metadata + metadata->data_offset;
+    data_mask = metadata->data_size - 1;
+    head = metadata->data_head;
+    perf_rmb();
+    tail = metadata->data_tail;
+    if (head == tail) {
+        return 0.0;
     }
 
+    for (cursor = tail; cursor < head;) {
+        const struct perf_event_header *header =
+            (const struct perf_event_header *)(data + (cursor & data_mask));
+
+        if (header->size < sizeof(*header)) {
+            break;
+        }
+        if (header->type == PERF_RECORD_LOST) {
+            uint64_t lost_cursor = cursor + sizeof(*header) + sizeof(uint64_t);
+
+            *lost_samples += ring_read_u64(metadata, &lost_cursor);
+        }
+        cursor += header->size;
+    }
+
+    begin = (size_t)(tail & data_mask);
+    len = (size_t)(head - tail);
+    first = len;
+    if (begin + len > metadata->data_size) {
+        first = metadata->data_size - begin;
+    }
+    record_writer_append(session->record, data + begin, first, data,
+                         len - first);
+
+    metadata->data_tail = head;
+    perf_mbw();
+    return (double)len / (double)metadata->data_size;
+}
+
+/*
+ * Records are 8-byte aligned and the data area is a power-of-two multiple of
+ * the page size, so a header never straddles the wrap point and can be read
+ * in place. Sample payloads are decoded straight out of the mapping; only a
+ * record that wraps is first gathered into a small bounce buffer. Decoded
+ * samples are handed to the heatmap HEATMAP_RECORD_BATCH at a time.
+ *
+ * Returns how full the ring was when draining started, as a fraction of its
+ * size, which the adaptive period controller uses as its pressure signal.
+ */
+static double drain_perf_ring(struct perf_session *session,
+                              struct perf_handle *handle,
+                              const struct profiler_options *options,
+                              const struct profiler_backend *backend,
+                              struct heatmap *heatmap,
+                              uint64_t *lost_samples) {
+    struct perf_event_mmap_page *metadata = handle->base;
+    const struct sample_layout *layout = &session->layout;
+    const unsigned char *data;
+    uint64_t data_mask;
+    uint64_t head;
+    uint64_t tail;
+    double fill;
+    uint64_t bounce[32];
+    struct sample_record batch[HEATMAP_RECORD_BATCH];
+    size_t nr_batch = 0;
+
+    if (session->record) {
+        return record_perf_ring(session, handle, lost_samples);
+    }
+    if (!metadata) {
+        return 0.0;
+    }
+
+    data = (const unsigned char *)metadata + metadata->data_offset;
+    data_mask = metadata->data_size - 1;
     head = metadata->data_head;
     perf_rmb();
     tail = metadata->data_tail;
+    fill = (double)(head - tail) / (double)metadata->data_size;
 
     while (tail < head) {
-        struct perf_event_header header;
+        size_t begin = (size_t)(tail & data_mask);
+        const struct perf_event_header *header =
+            (const struct perf_event_header *)(data + begin);
+        size_t size = header->size;
 
-        ring_copy(metadata, tail, &header, sizeof(header));
-        if (header.size < sizeof(header)) {
+        if (size < sizeof(*header)) {
             break;
         }
 
-        if (header.type == PERF_RECORD_SAMPLE) {
-            struct sample_record sample;
+        if (header->type == PERF_RECORD_SAMPLE &&
+            size - sizeof(*header) >= layout->size &&
+            layout->size <= sizeof(bounce)) {
+            const unsigned char *payload = data + begin + sizeof(*header);
 
-            parse_sample(metadata, tail + sizeof(header), session->sample_type,
-                         &sample);
-            heatmap_record(heatmap, options, backend, &sample);
-        } else if (header.type == PERF_RECORD_LOST) {
-            uint64_t cursor = tail + sizeof(header);
+            if (begin + sizeof(*header) + layout->size > metadata->data_size) {
+                ring_copy(metadata, tail + sizeof(*header), bounce,
+                          layout->size);
+                payload = (const unsigned char *)bounce;
+            }
+            decode_sample(layout, payload, &batch[nr_batch]);
+            if (!session->filter_pid ||
+                batch[nr_batch].pid == (uint32_t)session->filter_pid) {
+                nr_batch++;
+            }
+            if (nr_batch == ARRAY_SIZE(batch)) {
+                heatmap_record_batch(heatmap, options, backend, batch,
+                                     nr_batch);
+                nr_batch = 0;
+            }
+        } else if (header->type == PERF_RECORD_LOST) {
+            uint64_t cursor = tail + sizeof(*header);
             (void)ring_read_u64(metadata, &cursor);
-            session->lost_samples += ring_read_u64(metadata, &cursor);
+            *lost_samples += ring_read_u64(metadata, &cursor);
         }
 
-        tail += header.size;
+        tail += size;
     }
 
+    heatmap_record_batch(heatmap, options, backend, batch, nr_batch);
     metadata->data_tail = tail;
     perf_mbw();
+    return fill;
 }
 
-int perf_session_run(struct perf_session *session,
-                     const struct profiler_options *options,
-                     const struct profiler_backend *backend,
-                     struct heatmap *heatmap,
-                     char *reason,
-                     size_t reason_len) {
-    struct pollfd *pfds;
-    uint64_t start_ns = monotonic_time_ns();
-    int ret = 0;
+static void drain_worker_flush(struct drain_worker *worker) {
+    size_t i;
+
+    for (i = worker->first_handle; i < worker->end_handle; i++) {
+        double fill = drain_perf_ring(worker->session,
+                                      &worker->session->handles[i],
+                                      worker->options, worker->backend,
+                                      worker->heatmap, &worker->lost_samples);
+
+        if (fill > worker->tick_fill) {
+            worker->tick_fill = fill;
+        }
+    }
+}
+
+static uint64_t thread_cpu_time_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void adaptive_period_start(struct drain_worker *worker,
+                                  uint64_t now_ns) {
+    worker->period = worker->options->sample_period;
+    worker->period_low = worker->period;
+    worker->period_high = worker->period;
+    worker->tick_ns = now_ns;
+    worker->tick_cpu_ns = thread_cpu_time_ns();
+    worker->tick_lost = worker->lost_samples;
+    worker->tick_fill = 0.0;
+}
+
+/*
+ * One step of the --adaptive-period controller for the rings this worker
+ * owns. Lost records or a ring found more than half full mean the period is
+ * far too short, so it doubles. Otherwise the period is scaled so that the
+ * worker's CPU time tracks its share of --target-overhead, and it is only
+ * lowered again when there is clear headroom on both signals.
+ */
+static void adaptive_period_tick(struct drain_worker *worker, uint64_t now_ns) {
+    const struct profiler_options *options = worker->options;
+    uint64_t cpu_ns = thread_cpu_time_ns();
+    double overhead = 100.0 * (double)(cpu_ns - worker->tick_cpu_ns) /
+                      (double)(now_ns - worker->tick_ns);
+    uint64_t lost = worker->lost_samples - worker->tick_lost;
+    double scale = 1.0;
+    uint64_t next;
+    size_t i;
+
+    if (lost > 0 || worker->tick_fill > 0.5) {
+        scale = 2.0;
+    } else if (overhead > worker->target_overhead) {
+        scale = overhead / worker->target_overhead;
+        if (scale > 4.0) {
+            scale = 4.0;
+        }
+    } else if (overhead < worker->target_overhead / 2.0 &&
+               worker->tick_fill < 0.125) {
+        scale = 0.75;
+    }
+
+    next = (uint64_t)((double)worker->period * scale);
+    if (next < options->min_period) {
+        next = options->min_period;
+    }
+    if (next > options->max_period) {
+        next = options->max_period;
+    }
+
+    if (next != worker->period) {
+        for (i = worker->first_handle; i < worker->end_handle; i++) {
+            if (worker->session->handles[i].fd >= 0) {
+                ioctl(worker->session->handles[i].fd, PERF_EVENT_IOC_PERIOD,
+                      &next);
+            }
+        }
+        worker->period = next;
+        worker->period_changes++;
+        if (next < worker->period_low) {
+            worker->period_low = next;
+        }
+        if (next > worker->period_high) {
+            worker->period_high = next;
+        }
+    }
+
+    worker->tick_ns = now_ns;
+    worker->tick_cpu_ns = cpu_ns;
+    worker->tick_lost = worker->lost_samples;
+    worker->tick_fill = 0.0;
+}
+
+static void drain_worker_collect(struct perf_session *session,
+                                 const struct drain_worker *worker) {
+    session->lost_samples += worker->lost_samples;
+    session->wakeups += worker->wakeups;
+    if (!worker->options->adaptive_period) {
+        return;
+    }
+    if (session->period_low == 0 || worker->period_low < session->period_low) {
+        session->period_low = worker->period_low;
+    }
+    if (worker->period_high > session->period_high) {
+        session->period_high = worker->period_high;
+    }
+    session->period_changes += worker->period_changes;
+}
+
+/*
+ * Start the --interval reporter, if one was asked for. Recording sessions do
+ * not build a heatmap worth reporting, so they never get one.
+ */
+static int interval_reporter_open(struct perf_session *session,
+                                  const struct profiler_options *options,
+                                  const struct profiler_backend *backend,
+                                  size_t nr_workers,
+                                  struct interval_reporter **reporter_out,
+                                  char *reason,
+                                  size_t reason_len) {
+    *reporter_out = NULL;
+    if (options->report_interval_ms == 0 || !session->interval_out ||
+        session->record) {
+        return 0;
+    }
+    return interval_reporter_start(reporter_out, options, backend, nr_workers,
+                                   session->interval_out, session->tier,
+                                   reason, reason_len);
+}
+
+static void interval_reporter_close(struct perf_session *session,
+                                    struct interval_reporter *reporter) {
+    if (reporter) {
+        interval_reporter_stop(reporter, &session->interval_reports,
+                               &session->interval_skipped);
+    }
+}
+
+/*
+ * Wait for rings on an epoll set and drain only the ones reported ready.
+ * Every ring is swept once poll_timeout_ms has passed since the last sweep,
+ * whether or not the wait timed out, so with --wakeup-bytes one busy ring
+ * cannot keep samples below the watermark in the quiet ones. With
+ * --interval the reporter's wake fd sits in the same set: the worker then
+ * drains all its rings and hands over a copy of its heatmap, which is the only
+ * time draining pauses for a report.
+ */
+static int drain_worker_loop(struct drain_worker *worker) {
+    const struct profiler_options *options = worker->options;
+    struct perf_session *session = worker->session;
+    struct epoll_event *events;
+    size_t nr_fds = 0;
     size_t i;
+    uint64_t sweep_ns;
+    int epfd;
+    int ret = 0;
 
-    pfds = calloc(session->nr_opened, sizeof(*pfds));
-    if (!pfds) {
-        snprintf(reason, reason_len, "failed to allocate pollfd array");
+    events = calloc(worker->end_handle - worker->first_handle + 2,
+                    sizeof(*events));
+    if (!events) {
+        snprintf(worker->reason, sizeof(worker->reason),
+                 "failed to allocate epoll event array");
         return -ENOMEM;
     }
 
-    for (i = 0; i < session->nr_opened; i++) {
-        pfds[i].fd = session->handles[i].fd;
-        pfds[i].events = POLLIN;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        ret = -errno;
+        snprintf(worker->reason, sizeof(worker->reason),
+                 "epoll_create1 failed: %s", strerror(errno));
+        free(events);
+        return ret;
+    }
+
+    for (i = worker->first_handle; i < worker->end_handle; i++) {
+        struct epoll_event event;
+
+        if (session->handles[i].fd < 0) {
+            continue;
+        }
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, session->handles[i].fd,
+                      &event) != 0) {
+            ret = -errno;
+            snprintf(worker->reason, sizeof(worker->reason),
+                     "epoll_ctl failed: %s", strerror(errno));
+            close(epfd);
+            free(events);
+            return ret;
+        }
+        nr_fds++;
+    }
+
+    if (worker->reporter) {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = DRAIN_WAKE_TOKEN;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD,
+                      interval_reporter_wake_fd(worker->reporter,
+                                                worker->index),
+                      &event) != 0) {
+            ret = -errno;
+            snprintf(worker->reason, sizeof(worker->reason),
+                     "epoll_ctl failed: %s", strerror(errno));
+            close(epfd);
+            free(events);
+            return ret;
+        }
+        nr_fds++;
     }
 
-    while ((monotonic_time_ns() - start_ns) <
+    sweep_ns = monotonic_time_ns();
+    adaptive_period_start(worker, sweep_ns);
+    while ((monotonic_time_ns() - worker->start_ns) <
            (uint64_t)options->duration_sec * 1000000000ULL) {
-        int ready = poll(pfds, session->nr_opened, options->poll_timeout_ms);
+        int ready = epoll_wait(epfd, events, nr_fds ? (int)nr_fds : 1,
+                               (int)options->poll_timeout_ms);
+        bool snapshot = false;
+        uint64_t now_ns;
 
         if (ready < 0) {
             if (errno == EINTR) {
                 continue;
             }
-            snprintf(reason, reason_len, "poll failed: %s", strerror(errno));
+            snprintf(worker->reason, sizeof(worker->reason),
+                     "epoll_wait failed: %s", strerror(errno));
             ret = -errno;
             break;
         }
 
-        for (i = 0; i < session->nr_opened; i++) {
-            if (pfds[i].revents & (POLLIN | POLLHUP)) {
-                drain_perf_ring(session, &session->handles[i], options, backend,
-                                heatmap);
+        for (i = 0; i < (size_t)ready; i++) {
+            double fill;
+
+            if (events[i].data.u64 == DRAIN_WAKE_TOKEN) {
+                snapshot = true;
+                continue;
+            }
+            fill = drain_perf_ring(session,
+                                   &session->handles[events[i].data.u64],
+                                   options, worker->backend, worker->heatmap,
+                                   &worker->lost_samples);
+            if (fill > worker->tick_fill) {
+                worker->tick_fill = fill;
+            }
+        }
+        if (ready > (snapshot ? 1 : 0)) {
+            worker->wakeups++;
+        }
+        now_ns = monotonic_time_ns();
+        if (snapshot || ready == 0 ||
+            now_ns - sweep_ns >= options->poll_timeout_ms * 1000000ULL) {
+            drain_worker_flush(worker);
+            sweep_ns = now_ns;
+        }
+        if (snapshot) {
+            interval_reporter_snapshot(worker->reporter, worker->index,
+                                       worker->heatmap, worker->lost_samples);
+        }
+
+        if (options->adaptive_period &&
+            now_ns - worker->tick_ns >= ADAPTIVE_PERIOD_TICK_NS) {
+            adaptive_period_tick(worker, now_ns);
+        }
+    }
+
+    close(epfd);
+    free(events);
+    return ret;
+}
+
+static void *drain_worker_main(void *arg) {
+    struct drain_worker *worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+
+        /*
+         * Pin each drain thread next to the rings it owns. A failure here is
+         * not fatal: the thread still drains correctly, just without the
+         * locality benefit.
+         */
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    worker->ret = drain_worker_loop(worker);
+    return NULL;
+}
+
+static int perf_session_run_threaded(struct perf_session *session,
+                                     const struct profiler_options *options,
+                                     const struct profiler_backend *backend,
+                                     struct heatmap *heatmap,
+                                     char *reason,
+                                     size_t reason_len) {
+    struct drain_worker *workers;
+    struct interval_reporter *reporter = NULL;
+    size_t nr_workers = options->drain_threads;
+    size_t i;
+    int ret = 0;
+    uint64_t start_ns = monotonic_time_ns();
+
+    if (nr_workers > session->nr_handles) {
+        nr_workers = session->nr_handles;
+    }
+
+    workers = calloc(nr_workers, sizeof(*workers));
+    if (!workers) {
+        snprintf(reason, reason_len, "failed to allocate drain workers");
+        return -ENOMEM;
+    }
+
+    /*
+     * Rings are split into contiguous blocks so that a drain thread owns the
+     * rings of neighbouring CPUs. Worker 0 feeds the caller's heatmap, every
+     * other worker feeds a private shard that is merged once draining stops,
+     * so the hot path never shares a cache line between threads.
+     */
+    for (i = 0; i < nr_workers; i++) {
+        struct drain_worker *worker = &workers[i];
+
+        worker->session = session;
+        worker->options = options;
+        worker->backend = backend;
+        worker->index = i;
+        worker->start_ns = start_ns;
+        worker->target_overhead = options->target_overhead / (double)nr_workers;
+        worker->first_handle = session->nr_handles * i / nr_workers;
+        worker->end_handle = session->nr_handles * (i + 1) / nr_workers;
+        worker->cpu = session->handles[worker->first_handle].cpu;
+        if (worker->cpu < 0) {
+            worker->cpu = (int)(i % (size_t)count_online_cpus());
+        }
+        if (i == 0) {
+            worker->heatmap = heatmap;
+        } else {
+            heatmap_init(&worker->shard, options->max_pages, heatmap->page_shift);
+            worker->shard.vmas = heatmap->vmas;
+            worker->shard.numa = heatmap->numa;
+            worker->shard.mem_info = heatmap->mem_info;
+            if (!worker->shard.pages) {
+                snprintf(reason, reason_len,
+                         "failed to allocate heatmap shard %zu", i);
+                ret = -ENOMEM;
+                break;
             }
+            worker->heatmap = &worker->shard;
+        }
+    }
+
+    if (ret == 0) {
+        ret = interval_reporter_open(session, options, backend, nr_workers,
+                                     &reporter, reason, reason_len);
+    }
+    for (i = 0; ret == 0 && i < nr_workers; i++) {
+        workers[i].reporter = reporter;
+    }
+
+    for (i = 0; ret == 0 && i < nr_workers; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, drain_worker_main,
+                                 &workers[i]);
+
+        if (err != 0) {
+            snprintf(reason, reason_len, "failed to start drain thread %zu: %s",
+                     i, strerror(err));
+            ret = -err;
+            break;
+        }
+        workers[i].started = true;
+    }
+
+    for (i = 0; i < nr_workers; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
         }
     }
+    interval_reporter_close(session, reporter);
 
     perf_disable_all(session);
 
-    for (i = 0; i < session->nr_opened; i++) {
-        drain_perf_ring(session, &session->handles[i], options, backend,
-                        heatmap);
+    for (i = 0; i < nr_workers; i++) {
+        struct drain_worker *worker = &workers[i];
+
+        if (worker->heatmap) {
+            drain_worker_flush(worker);
+        }
+        if (ret == 0 && worker->ret != 0) {
+            snprintf(reason, reason_len, "drain thread %zu: %s", i,
+                     worker->reason);
+            ret = worker->ret;
+        }
+        drain_worker_collect(session, worker);
+        if (worker->heatmap == &worker->shard) {
+            heatmap_merge(heatmap, &worker->shard, options);
+        }
+        if (i != 0) {
+            heatmap_destroy(&worker->shard);
+        }
+    }
+
+    free(workers);
+    return ret;
+}
+
+int perf_session_run(struct perf_session *session,
+                     const struct profiler_options *options,
+                     const struct profiler_backend *backend,
+                     struct heatmap *heatmap,
+                     char *reason,
+                     size_t reason_len) {
+    struct drain_worker worker;
+    int ret;
+
+    if (backend->session_run) {
+        return backend->session_run(session, options, backend, heatmap,
+                                    reason, reason_len);
     }
+    if (options->drain_threads > 1 && session->nr_handles > 1) {
+        return perf_session_run_threaded(session, options, backend, heatmap,
+                                         reason, reason_len);
+    }
+
+    memset(&worker, 0, sizeof(worker));
+    worker.session = session;
+    worker.options = options;
+    worker.backend = backend;
+    worker.heatmap = heatmap;
+    worker.end_handle = session->nr_handles;
+    worker.start_ns = monotonic_time_ns();
+    worker.target_overhead = options->target_overhead;
+
+    ret = interval_reporter_open(session, options, backend, 1,
+                                 &worker.reporter, reason, reason_len);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = drain_worker_loop(&worker);
+    if (ret != 0) {
+        snprintf(reason, reason_len, "%s", worker.reason);
+    }
+    interval_reporter_close(session, worker.reporter);
 
-    free(pfds);
+    perf_disable_all(session);
+    drain_worker_flush(&worker);
+    drain_worker_collect(session, &worker);
     return ret;
 }
 
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/perf_event.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -18,6 +19,8 @@
 #include <unistd.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+/* Largest element select_nth() can partition. */
+#define SELECT_MAX_SIZE 128
 #define PATH_BUFFER_SIZE 512
 #define REASON_BUFFER_SIZE 256
 
@@ -32,6 +35,17 @@ enum cooling_mode {
     COOLING_EXP = 2,
 };
 
+enum eviction_policy {
+    EVICT_NONE = 0,
+    EVICT_CLOCK = 1,
+    EVICT_COLDEST = 2,
+};
+
+enum target_mode {
+    TARGET_THREADS = 0,
+    TARGET_CPUS = 1,
+};
+
 enum stats_address_mode {
     STATS_ADDR_AUTO = 0,
     STATS_ADDR_VIRTUAL = 1,
@@ -50,6 +64,84 @@ enum report_mode {
     REPORT_BOTH = 2,
 };
 
+enum vma_kind {
+    VMA_ANON,
+    VMA_HEAP,
+    VMA_STACK,
+    VMA_FILE,
+    VMA_SHM,
+    VMA_SPECIAL,
+};
+
+/*
+ * Where a sampled access was served from, decoded from PERF_SAMPLE_DATA_SRC.
+ * MEM_TIER_OTHER covers line fill buffers, PMEM/CXL, I/O, uncached and
+ * accesses the PMU could not attribute.
+ */
+enum mem_tier {
+    MEM_TIER_L1,
+    MEM_TIER_L2,
+    MEM_TIER_LLC,
+    MEM_TIER_DRAM,
+    MEM_TIER_REMOTE_DRAM,
+    MEM_TIER_REMOTE_CACHE,
+    MEM_TIER_OTHER,
+    MEM_TIERS,
+};
+
+/* Ranking of the detail rows; classification always follows heat. */
+enum page_sort {
+    PAGE_SORT_HEAT,
+    PAGE_SORT_SAMPLES,
+    PAGE_SORT_DRAM,
+    PAGE_SORT_REMOTE,
+};
+
+/*
+ * How much heat one sample adds. The latency modes scale it by the sample's
+ * load latency (PERF_SAMPLE_WEIGHT) in units of --latency-unit cycles, so a
+ * page that misses to DRAM outranks one that is hit in L1 equally often.
+ */
+enum heat_score {
+    HEAT_SCORE_SAMPLES,
+    HEAT_SCORE_LATENCY,
+    HEAT_SCORE_LOG_LATENCY,
+};
+
+/*
+ * --tier-cold: advice given to the target's pages that stayed cold, either
+ * MADV_COLD (deactivate, reclaim them first) or MADV_PAGEOUT (reclaim now).
+ */
+enum tier_cold_action {
+    TIER_COLD_OFF,
+    TIER_COLD_COLD,
+    TIER_COLD_PAGEOUT,
+};
+
+/* --fault-type: which software page-fault event the faults backend samples. */
+enum fault_type {
+    FAULT_ALL,
+    FAULT_MINOR,
+    FAULT_MAJOR,
+};
+
+/*
+ * --synth-dist: how the synth backend and bench_ingest pick the page of
+ * each generated sample (see synth.c).
+ */
+enum synth_dist {
+    SYNTH_UNIFORM,
+    SYNTH_ZIPF,
+    SYNTH_HOTSET,
+    SYNTH_PHASE,
+    SYNTH_MULTIPID,
+};
+
+enum interval_mode {
+    INTERVAL_FULL,
+    INTERVAL_DELTA,
+};
+
 enum heat_classification_policy {
     HEAT_POLICY_ABSOLUTE = 0,
     HEAT_POLICY_PERCENTILE = 1,
@@ -61,20 +153,75 @@ enum summary_metric {
     SUMMARY_SAMPLES = 2,
 };
 
+enum group_dimension {
+    GROUP_BY_PID = 0,
+    GROUP_BY_TID = 1,
+    GROUP_BY_CPU = 2,
+    GROUP_BY_NODE = 3,
+    GROUP_BY_KIND = 4,
+};
+
+enum page_state {
+    PAGE_HOT = 0,
+    PAGE_WARM = 1,
+    PAGE_COLD = 2,
+};
+
 #define PAGEMAP_CACHE_SIZE 32
 #define PAGE_OWNER_SLOTS 4
+#define PAGE_SITE_SLOTS 4
+#define COOLING_FACTOR_SLOTS 64
+#define EVICT_SAMPLE_PAGES 16
+
+/*
+ * The page table is a Swiss table: one control byte per slot, kept apart
+ * from the large heat_page payloads and probed HEATMAP_GROUP_WIDTH slots at a
+ * time. A full slot stores the low 7 bits of the hash, so most probes are
+ * resolved without touching the payload array at all.
+ */
+#define HEATMAP_GROUP_WIDTH 16
+#define HEATMAP_CTRL_EMPTY 0x80
+#define HEATMAP_CTRL_DELETED 0xfe
+#define HEATMAP_INITIAL_CAPACITY 1024
+#define HEATMAP_MIGRATE_SLOTS 64
+#define HEATMAP_RECORD_BATCH 32
+
+/*
+ * --regions: every sample is also folded into its 2M and its 1G region. The
+ * children of a 2M region are base pages, those of a 1G region are 2M
+ * regions; both fit in 512 bits for any base page of 4K or more.
+ */
+#define REGION_LEVELS 2
+#define REGION_2M_SHIFT 21
+#define REGION_1G_SHIFT 30
+#define REGION_CHILD_WORDS 8
+
+/*
+ * Load latencies of a page or region in log2 buckets: bucket b counts
+ * latencies of [2^b, 2^(b+1)) cycles, the last bucket everything above.
+ */
+#define LATENCY_BUCKETS 16
 
 struct profiler_options {
     pid_t pid;
     bool system_wide;
+    enum target_mode target_mode;
     bool user_only;
     unsigned duration_sec;
     unsigned poll_timeout_ms;
+    unsigned drain_threads;
+    uint64_t wakeup_bytes;
     uint64_t sample_period;
+    bool adaptive_period;
+    uint64_t min_period;
+    uint64_t max_period;
+    double target_overhead;
     size_t mmap_pages;
     size_t max_pages;
+    enum eviction_policy evict_policy;
     unsigned top_n;
     unsigned process_top_n;
+    enum group_dimension group_by;
     enum report_mode report_mode;
     enum summary_metric summary_metric;
     enum cooling_mode cooling_mode;
@@ -90,6 +237,29 @@ struct profiler_options {
     enum output_format output_format;
     const char *output_path;
     const char *backend_name;
+    const char *record_path;
+    const char *replay_path;
+    unsigned replay_threads;
+    unsigned report_interval_ms;
+    enum interval_mode interval_mode;
+    bool track_regions;
+    bool track_vmas;
+    bool track_sites;
+    bool track_numa;
+    enum page_sort sort_by;
+    enum heat_score heat_score;
+    uint64_t latency_unit;
+    int tier_node;
+    enum tier_cold_action tier_cold;
+    unsigned tier_cold_rounds;
+    unsigned tier_rate;
+    bool tier_dry_run;
+    unsigned scan_interval_ms;
+    uint64_t scan_budget;
+    enum fault_type fault_type;
+    enum synth_dist synth_dist;
+    uint64_t synth_pages;
+    uint64_t synth_rate;
 };
 
 struct heat_owner {
@@ -106,6 +276,7 @@ struct sample_record {
     uint64_t time_ns;
     uint64_t data_src;
     uint64_t weight;
+    uint64_t period;
     uint32_t pid;
     uint32_t tid;
     uint32_t cpu;
@@ -115,6 +286,17 @@ struct sample_record {
     bool has_data_src;
 };
 
+/*
+ * A sample whose page key was resolved up front with heatmap_sample_key(),
+ * plus the cooling clock it is to be applied at (see heatmap_record_keyed()).
+ */
+struct keyed_sample {
+    struct sample_record sample;
+    uint64_t page;
+    uint64_t clock_ns;
+    enum address_kind kind;
+};
+
 struct format_field {
     char name[64];
     int reg_index;
@@ -122,43 +304,303 @@ struct format_field {
     unsigned hi;
 };
 
+struct latency_hist {
+    uint16_t buckets[LATENCY_BUCKETS];
+};
+
 struct heat_page {
     uint64_t page;
+    enum address_kind kind;
+    uint32_t ext;
     double heat;
     double total_weight;
     uint64_t samples;
     uint64_t last_ip;
     uint64_t last_time_ns;
     uint64_t last_data_src;
+    uint64_t cool_epoch;
+    uint32_t last_cpu;
     uint32_t owner_pid;
     uint32_t owner_tid;
+    bool referenced;
     uint64_t owner_samples;
-    enum address_kind kind;
     struct heat_owner owners[PAGE_OWNER_SLOTS];
-    bool used;
+    uint32_t vma;
+};
+
+/*
+ * --numa: the memory node of a page and the node whose CPUs access it most
+ * (a majority vote), both + 1 so that 0 means unknown, and the heat of
+ * accesses from the page's own node and from other nodes.
+ */
+struct heat_page_numa {
+    uint16_t node;
+    uint16_t access_node;
+    uint32_t access_votes;
+    uint32_t remote_samples;
+    double local_heat;
+    double remote_heat;
+};
+
+/*
+ * --sites: the code sites that added the most heat to a page. A slot is
+ * taken over by a new site once all of them are in use, like owners[], and
+ * the slot heat cools along with the page.
+ */
+struct heat_page_site {
+    uint64_t ip;
+    uint32_t pid;
+    uint32_t samples;
+    double heat;
+};
+
+struct heat_page_sites {
+    struct heat_page_site slots[PAGE_SITE_SLOTS];
+};
+
+/*
+ * Where a page's loads were served from and how long they took, kept when
+ * the backend's samples carry a data source and a load latency.
+ */
+struct heat_page_mem {
+    uint32_t tier_samples[MEM_TIERS];
+    struct latency_hist latency;
+};
+
+/*
+ * Per-page data only some options or backends need lives outside
+ * heat_page, in arrays allocated when they are in use. A page holds its entry id in
+ * heat_page.ext (0: none), which moves with it through resizes and copies
+ * and is recycled when the page is evicted.
+ */
+struct page_ext_pool {
+    struct heat_page_numa *numa;
+    struct heat_page_sites *sites;
+    struct heat_page_mem *mem;
+    uint32_t *free_ids;
+    size_t nr_free;
+    size_t count;
+    size_t capacity;
+};
+
+/*
+ * Heat of one 2M or 1G region, cooled as a single page of that size would
+ * be, plus which of its children were ever sampled. It is updated from the
+ * samples themselves, so it stays complete when the page table has dropped
+ * or evicted the base pages underneath.
+ */
+struct heat_region {
+    uint64_t region;
+    enum address_kind kind;
+    double heat;
+    uint64_t samples;
+    uint64_t cool_epoch;
+    uint32_t touched;
+    uint64_t children[REGION_CHILD_WORDS];
+    struct latency_hist latency;
+};
+
+/*
+ * --vma: one line of /proc/<pid>/maps. A page is attributed to the mapping
+ * holding its virtual address when the page is first sampled; pages keep
+ * the record id (0: unknown) in heat_page.vma.
+ */
+struct vma_record {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    const char *path;
+    uint32_t path_id;
+    pid_t pid;
+    enum vma_kind kind;
+    char perms[5];
+};
+
+struct vma_index;
+struct numa_topology;
+
+/*
+ * Open-addressed index over a dense array of entries: maps a key's hash to
+ * the position of its entry, probing linearly. The owner keeps the entries
+ * in insertion order, compares keys, and sizes the index to twice its array
+ * capacity so that it stays at most half full.
+ */
+#define HASH_INDEX_EMPTY UINT32_MAX
+
+struct hash_index {
+    uint32_t *slots;
+    size_t mask;
+};
+
+/* The murmur3 64-bit finalizer: spreads every key bit over the hash. */
+static inline uint64_t hash_u64(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static inline size_t hash_index_slot(const struct hash_index *index,
+                                     uint64_t hash) {
+    return (size_t)hash & index->mask;
+}
+
+static inline size_t hash_index_next(const struct hash_index *index,
+                                     size_t slot) {
+    return (slot + 1) & index->mask;
+}
+
+/*
+ * --sites: heat added by one instruction of one process, whichever pages it
+ * touched. `vma` is the mapping of the instruction, resolved when the site
+ * is first sampled so it can be symbolized after the process has exited.
+ */
+struct heat_site {
+    uint64_t ip;
+    uint32_t pid;
+    uint32_t vma;
+    double heat;
+    uint64_t samples;
+    uint64_t cool_epoch;
+};
+
+struct site_table {
+    struct heat_site *sites;
+    size_t count;
+    size_t capacity;
+    struct hash_index index;
+    size_t dropped_samples;
+};
+
+/* Function symbols and PT_LOAD segments of one ELF binary. */
+struct elf_symbols;
+
+/* Regions of one size, in a dense array behind a linear-probing index. */
+struct region_table {
+    struct heat_region *regions;
+    size_t count;
+    size_t capacity;
+    struct hash_index index;
+    size_t dropped_samples;
+    unsigned shift;
+    unsigned child_shift;
 };
 
 struct heatmap {
+    uint8_t *ctrl;
     struct heat_page *pages;
     size_t capacity;
+    size_t max_capacity;
     size_t count;
+    size_t tombstones;
+    uint8_t *old_ctrl;
+    struct heat_page *old_pages;
+    size_t old_capacity;
+    size_t old_count;
+    size_t migrate_cursor;
     size_t dropped_pages;
     size_t dropped_samples;
+    size_t evicted_pages;
+    size_t evict_hand;
     size_t phys_translate_attempts;
     size_t phys_translate_failures;
     size_t page_shift;
     uint64_t last_cooling_ns;
+    uint64_t last_time_ns;
+    uint64_t cooling_epoch;
+    double cooling_factor_decay;
+    double cooling_factors[COOLING_FACTOR_SLOTS];
     struct {
         pid_t pid;
         int fd;
         bool used;
     } pagemap_cache[PAGEMAP_CACHE_SIZE];
     size_t pagemap_cache_victim;
+    /*
+     * Set for --replay: the recorded pids may be gone or reused, so
+     * /proc/<pid>/pagemap is never consulted and a recording gives the
+     * same result on any host.
+     */
+    bool replay;
+    /* The backend's samples carry a data source and a load latency. */
+    bool mem_info;
+    struct region_table regions[REGION_LEVELS];
+    struct vma_index *vmas;
+    struct site_table sites;
+    struct numa_topology *numa;
+    struct page_ext_pool ext;
+};
+
+/* Group key for pages whose dimension value is unknown, e.g. a CPU with no node. */
+#define GROUP_KEY_UNKNOWN UINT64_MAX
+
+struct group_summary {
+    uint64_t key;
+    double heat;
+    double total_weight;
+    double local_heat;
+    double remote_heat;
+    uint64_t samples;
+    uint64_t pages;
+    uint64_t hot_pages;
+    uint64_t warm_pages;
+    uint64_t cold_pages;
 };
 
+/*
+ * Hash aggregation of pages by one dimension. Groups live in a dense array
+ * (so they can be sorted and printed in place); an open-addressed index of
+ * group positions, kept at most half full, maps keys to them.
+ */
+struct group_table {
+    enum group_dimension dimension;
+    struct group_summary *groups;
+    size_t count;
+    size_t groups_capacity;
+    struct hash_index index;
+    int *cpu_node;
+    size_t nr_cpu_node;
+};
+
+/*
+ * Parameters of a synthetic sample stream. `pages` distinct pages are
+ * spread over `pids` processes (SYNTH_MULTIPID only, 1 otherwise); the hot
+ * set is the first `hot_fraction` of them and receives `hot_share` of the
+ * samples, moving on by its own size every `phase_samples` for SYNTH_PHASE.
+ */
+struct synth_spec {
+    enum synth_dist dist;
+    uint64_t pages;
+    unsigned pids;
+    double skew;
+    double hot_fraction;
+    double hot_share;
+    uint64_t phase_samples;
+    uint64_t period;
+    uint64_t seed;
+};
+
+struct synth_generator {
+    struct synth_spec spec;
+    uint64_t state;
+    uint64_t stride;
+    uint64_t hot_pages;
+    uint64_t emitted;
+    double zipf_span;
+    size_t page_shift;
+};
+
+struct perf_session;
+
 struct profiler_backend {
     const char *name;
     const char *pmu_name;
+    /* Only used when named with --backend, never picked by auto. */
+    bool explicit_only;
+    /* Samples carry a load latency and a data source. */
+    bool mem_info;
     bool (*supported)(char *reason, size_t reason_len);
     int (*prepare_attr)(const struct profiler_options *options,
                         struct perf_event_attr *attr,
@@ -166,6 +608,39 @@ struct profiler_backend {
                         size_t reason_len);
     uint64_t (*page_key)(const struct sample_record *sample, size_t page_shift,
                          enum address_kind *kind);
+    /*
+     * Backends that do not sample through perf_event_open() (no pmu_name)
+     * open and run the session themselves, feeding the heatmap with
+     * synthetic samples; prepare_attr is then unused.
+     */
+    int (*session_open)(struct perf_session *session,
+                        const struct profiler_options *options,
+                        char *reason,
+                        size_t reason_len);
+    int (*session_run)(struct perf_session *session,
+                       const struct profiler_options *options,
+                       const struct profiler_backend *backend,
+                       struct heatmap *heatmap,
+                       char *reason,
+                       size_t reason_len);
+};
+
+/*
+ * Byte offsets of the fields this tool reads inside a PERF_RECORD_SAMPLE
+ * payload, derived once from the session's sample_type. -1 marks a field
+ * that is not present; `size` covers every fixed-size field we decode.
+ */
+struct sample_layout {
+    int16_t ip;
+    int16_t tid;
+    int16_t time;
+    int16_t addr;
+    int16_t cpu;
+    int16_t period;
+    int16_t weight;
+    int16_t data_src;
+    int16_t phys_addr;
+    uint16_t size;
 };
 
 struct perf_handle {
@@ -175,18 +650,64 @@ struct perf_handle {
     size_t map_len;
 };
 
+struct record_writer;
+struct interval_reporter;
+struct tier_engine;
+
+/* Identifies one of the periodic --interval reports. */
+struct report_snapshot {
+    uint64_t seq;
+    double elapsed_sec;
+    bool delta;
+};
+
+/*
+ * A --record file mapped for replay. The fields up to `backend` come from the
+ * file header; the rest is filled in by replay_run().
+ */
+struct replay_file {
+    void *map;
+    size_t map_len;
+    const unsigned char *data;
+    size_t data_len;
+    bool complete;
+    uint64_t sample_type;
+    uint64_t sample_period;
+    size_t page_shift;
+    pid_t filter_pid;
+    char backend[32];
+    uint64_t samples;
+    uint64_t lost_samples;
+    size_t truncated_bytes;
+    size_t replay_threads;
+    bool serial_fallback;
+};
+
 struct perf_session {
     struct perf_handle *handles;
     size_t nr_handles;
     size_t nr_opened;
     size_t page_size;
     uint64_t sample_type;
+    struct sample_layout layout;
+    const char *scope;
+    pid_t filter_pid;
+    struct record_writer *record;
+    FILE *interval_out;
+    struct tier_engine *tier;
+    uint64_t interval_reports;
+    uint64_t interval_skipped;
     uint64_t lost_samples;
+    uint64_t wakeups;
+    uint64_t period_low;
+    uint64_t period_high;
+    uint64_t period_changes;
 };
 
 const struct profiler_backend *profiler_select_backend(const char *name,
                                                        char *reason,
                                                        size_t reason_len);
+const struct profiler_backend *profiler_find_backend(const char *name);
 const char *detect_cpu_vendor(void);
 
 bool pmu_exists(const char *pmu_name);
@@ -201,11 +722,125 @@ void heatmap_record(struct heatmap *heatmap,
                     const struct profiler_options *options,
                     const struct profiler_backend *backend,
                     const struct sample_record *sample);
-void heatmap_report(const struct heatmap *heatmap,
+void heatmap_record_batch(struct heatmap *heatmap,
+                          const struct profiler_options *options,
+                          const struct profiler_backend *backend,
+                          const struct sample_record *samples,
+                          size_t count);
+void heatmap_record_keyed(struct heatmap *heatmap,
+                          const struct profiler_options *options,
+                          const struct keyed_sample *samples,
+                          size_t count);
+uint64_t heatmap_sample_key(struct heatmap *heatmap,
+                            const struct profiler_options *options,
+                            const struct profiler_backend *backend,
+                            const struct sample_record *sample,
+                            enum address_kind *kind);
+void heatmap_advance_time(struct heatmap *heatmap,
+                          const struct profiler_options *options,
+                          uint64_t time_ns);
+struct heat_page *heatmap_find(const struct heatmap *heatmap, uint64_t page,
+                               enum address_kind kind);
+int heatmap_copy(struct heatmap *dst, const struct heatmap *src);
+struct heat_page *heatmap_lookup(struct heatmap *heatmap, uint64_t page,
+                                 enum address_kind kind,
+                                 const struct profiler_options *options);
+void heatmap_finish_resize(struct heatmap *heatmap);
+void heatmap_settle_cooling(struct heatmap *heatmap,
+                            const struct profiler_options *options);
+void heatmap_merge(struct heatmap *dst,
+                   struct heatmap *src,
+                   const struct profiler_options *options);
+void heatmap_report(struct heatmap *heatmap,
                     const struct profiler_options *options,
                     const struct profiler_backend *backend,
                     uint64_t lost_samples,
                     FILE *out);
+void heatmap_report_snapshot(struct heatmap *heatmap,
+                             const struct profiler_options *options,
+                             const struct profiler_backend *backend,
+                             uint64_t lost_samples,
+                             const struct report_snapshot *snapshot,
+                             FILE *out);
+enum page_state page_state_of(const struct heat_page *page,
+                              const struct profiler_options *options);
+void select_nth(void *base, size_t size, size_t lo, size_t hi, size_t k,
+                int (*compare)(const void *, const void *));
+void percentile_cutoffs(const struct profiler_options *options,
+                        size_t total_count,
+                        size_t *hot_cutoff_out,
+                        size_t *cold_start_out);
+
+int hash_index_resize(struct hash_index *index, size_t size, size_t count,
+                      uint64_t (*hash_at)(const void *entries, size_t i),
+                      const void *entries);
+void hash_index_insert(struct hash_index *index, uint64_t hash,
+                       uint32_t position);
+int hash_index_copy(struct hash_index *dst, const struct hash_index *src);
+void hash_index_destroy(struct hash_index *index);
+
+void region_table_init(struct region_table *table, unsigned shift,
+                       unsigned child_shift);
+void region_table_destroy(struct region_table *table);
+int region_table_copy(struct region_table *dst,
+                      const struct region_table *src);
+struct heat_region *region_table_get(struct region_table *table,
+                                     uint64_t region, enum address_kind kind,
+                                     size_t max_regions);
+struct heat_region *region_table_find(const struct region_table *table,
+                                      uint64_t region,
+                                      enum address_kind kind);
+uint32_t region_children(const struct region_table *table);
+bool region_mark_child(struct heat_region *region,
+                       const struct region_table *table, uint64_t addr);
+
+void latency_hist_add(struct latency_hist *hist, uint64_t weight);
+void latency_hist_merge(struct latency_hist *dst,
+                        const struct latency_hist *src);
+void latency_hist_delta(struct latency_hist *dst,
+                        const struct latency_hist *now,
+                        const struct latency_hist *before);
+double latency_hist_percentile(const struct latency_hist *hist,
+                               double fraction);
+
+int vma_index_create(struct vma_index **index_out);
+void vma_index_destroy(struct vma_index *index);
+uint32_t vma_index_resolve(struct vma_index *index, pid_t pid, uint64_t addr);
+int vma_index_snapshot(struct vma_index *index, struct vma_record **records_out,
+                       size_t *count_out, size_t *nr_paths_out);
+int vma_index_symbolize(struct vma_index *index, uint32_t id, uint64_t addr,
+                        char *symbol, size_t symbol_len,
+                        const char **path_out);
+
+int numa_topology_create(struct numa_topology **numa_out);
+void numa_topology_destroy(struct numa_topology *numa);
+int numa_cpu_node(const struct numa_topology *numa, uint32_t cpu);
+int numa_phys_node(const struct numa_topology *numa, uint64_t phys_addr);
+int numa_vaddr_node(pid_t pid, uint64_t addr);
+int cpu_node_map_load(int **map_out, size_t *count_out);
+
+void site_table_destroy(struct site_table *table);
+int site_table_copy(struct site_table *dst, const struct site_table *src);
+struct heat_site *site_table_get(struct site_table *table, uint32_t pid,
+                                 uint64_t ip, size_t max_sites);
+struct heat_site *site_table_find(const struct site_table *table,
+                                  uint32_t pid, uint64_t ip);
+
+int elf_symbols_load(const char *path, struct elf_symbols **symbols_out);
+void elf_symbols_destroy(struct elf_symbols *symbols);
+bool elf_symbols_lookup(const struct elf_symbols *symbols, uint64_t offset,
+                        const char **name_out, uint64_t *delta_out);
+
+int group_table_init(struct group_table *table,
+                     enum group_dimension dimension);
+void group_table_destroy(struct group_table *table);
+uint64_t group_table_key(const struct group_table *table,
+                         const struct heat_page *page);
+int group_table_add(struct group_table *table, const struct heatmap *heatmap,
+                    const struct heat_page *page, enum page_state state);
+void group_table_sort(struct group_table *table);
+void group_key_format(enum group_dimension dimension, uint64_t key,
+                      char *buf, size_t len);
 
 int perf_session_open(struct perf_session *session,
                       const struct profiler_options *options,
@@ -219,6 +854,62 @@ int perf_session_run(struct perf_session *session,
                      char *reason,
                      size_t reason_len);
 void perf_session_close(struct perf_session *session);
+void sample_layout_init(struct sample_layout *layout, uint64_t sample_type);
+void decode_sample(const struct sample_layout *layout,
+                   const unsigned char *payload,
+                   struct sample_record *sample);
+
+int record_writer_open(struct record_writer **writer_out, const char *path,
+                       const struct perf_session *session,
+                       const struct profiler_options *options,
+                       const struct profiler_backend *backend,
+                       size_t page_shift,
+                       char *reason,
+                       size_t reason_len);
+void record_writer_append(struct record_writer *writer,
+                          const void *first, size_t first_len,
+                          const void *second, size_t second_len);
+int record_writer_close(struct record_writer *writer, uint64_t *bytes_out,
+                        char *reason, size_t reason_len);
+int replay_open(struct replay_file *file, const char *path,
+                char *reason, size_t reason_len);
+void replay_run(struct replay_file *file,
+                const struct profiler_options *options,
+                const struct profiler_backend *backend,
+                struct heatmap *heatmap);
+void replay_close(struct replay_file *file);
+
+int interval_reporter_start(struct interval_reporter **reporter_out,
+                            const struct profiler_options *options,
+                            const struct profiler_backend *backend,
+                            size_t nr_workers,
+                            FILE *out,
+                            struct tier_engine *tier,
+                            char *reason,
+                            size_t reason_len);
+int interval_reporter_wake_fd(const struct interval_reporter *reporter,
+                              size_t worker);
+void interval_reporter_snapshot(struct interval_reporter *reporter,
+                                size_t worker, struct heatmap *heatmap,
+                                uint64_t lost_samples);
+void interval_reporter_stop(struct interval_reporter *reporter,
+                            uint64_t *reports_out, uint64_t *skipped_out);
+
+void synth_spec_init(struct synth_spec *spec);
+int synth_generator_init(struct synth_generator *gen,
+                         const struct synth_spec *spec, size_t page_shift,
+                         char *reason, size_t reason_len);
+void synth_generator_next(struct synth_generator *gen, uint64_t time_ns,
+                          struct sample_record *sample);
+
+int tier_engine_create(struct tier_engine **engine_out,
+                       const struct profiler_options *options,
+                       char *reason, size_t reason_len);
+void tier_engine_destroy(struct tier_engine *engine);
+void tier_engine_run(struct tier_engine *engine, struct heatmap *heatmap,
+                     const struct profiler_options *options, uint64_t seq);
+void tier_engine_summary(const struct tier_engine *engine,
+                         const struct profiler_options *options, FILE *out);
 
 static inline int perf_event_open_syscall(struct perf_event_attr *attr,
                                           pid_t pid, int cpu, int group_fd,
@@ -226,14 +917,100 @@ static inline int perf_event_open_syscall(struct perf_event_attr *attr,
     /*
      * perf_event_open arguments used by this project:
      * - attr: event definition and sample payload layout.
-     * - pid : target task/TID when profiling per-thread; -1 in system-wide mode.
-     * - cpu : target CPU in system-wide mode; -1 in per-thread mode.
+     * - pid : target task/TID when profiling per-thread, the target process
+     *         or a cgroup fd in per-CPU process mode; -1 in system-wide mode.
+     * - cpu : target CPU in system-wide and per-CPU process mode; -1 in
+     *         per-thread mode.
      * - group_fd: always -1 here, meaning no event grouping.
-     * - flags: currently 0, so we rely on the default perf behavior.
+     * - flags: PERF_FLAG_PID_CGROUP when pid is a cgroup fd, otherwise 0.
      */
     return (int)syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
 }
 
+/*
+ * Sample period shared by the backends. In --adaptive-period mode the drain
+ * loop retunes the period at run time, so every sample also carries the
+ * period it was taken with (PERF_SAMPLE_PERIOD) for heat normalization.
+ */
+static inline void profiler_set_period(struct perf_event_attr *attr,
+                                       const struct profiler_options *options) {
+    attr->sample_period = options->sample_period;
+    if (options->adaptive_period) {
+        attr->sample_type |= PERF_SAMPLE_PERIOD;
+    }
+}
+
+/*
+ * Heat contributed by one sample: 1.0 at the base --sample-period, scaled by
+ * the period actually in effect, so pages sampled while the controller had
+ * the period raised are not undercounted. --heat-score latency modes then
+ * weight it by the load latency; samples without one count as one unit.
+ */
+static inline double sample_heat(const struct profiler_options *options,
+                                 const struct sample_record *sample) {
+    double heat = 1.0;
+    double latency;
+
+    if (sample->period != 0 && options->sample_period != 0) {
+        heat = (double)sample->period / (double)options->sample_period;
+    }
+    if (options->heat_score == HEAT_SCORE_SAMPLES || !sample->has_weight ||
+        sample->weight == 0 || options->latency_unit == 0) {
+        return heat;
+    }
+
+    latency = (double)sample->weight / (double)options->latency_unit;
+    if (options->heat_score == HEAT_SCORE_LOG_LATENCY) {
+        return heat * log2(1.0 + latency);
+    }
+    return heat * latency;
+}
+
+/*
+ * Wakeup policy shared by the backends. By default perf wakes the consumer
+ * after every sample (wakeup_events=1). With --wakeup-bytes it only wakes
+ * once that many bytes are pending in the ring (the kernel caps the value at
+ * the ring size), trading a little latency for far fewer wakeups.
+ */
+static inline void profiler_set_wakeup(struct perf_event_attr *attr,
+                                       const struct profiler_options *options) {
+    if (options->wakeup_bytes == 0) {
+        attr->watermark = 0;
+        attr->wakeup_events = 1;
+        return;
+    }
+
+    attr->watermark = 1;
+    attr->wakeup_watermark = options->wakeup_bytes > UINT32_MAX ?
+                             UINT32_MAX : (uint32_t)options->wakeup_bytes;
+}
+
+static inline bool heatmap_slot_used(const struct heatmap *heatmap,
+                                     size_t index) {
+    return heatmap->ctrl[index] < HEATMAP_CTRL_EMPTY;
+}
+
+/* The --numa data of a page, NULL when --numa is off or had no memory. */
+static inline struct heat_page_numa *heatmap_page_numa(
+    const struct heatmap *heatmap, const struct heat_page *page) {
+    return heatmap->ext.numa && page->ext ? &heatmap->ext.numa[page->ext] :
+           NULL;
+}
+
+/* The --sites slots of a page, NULL when --sites is off or had no memory. */
+static inline struct heat_page_sites *heatmap_page_sites(
+    const struct heatmap *heatmap, const struct heat_page *page) {
+    return heatmap->ext.sites && page->ext ? &heatmap->ext.sites[page->ext] :
+           NULL;
+}
+
+/* The tier counts and latencies of a page, NULL without backend support. */
+static inline struct heat_page_mem *heatmap_page_mem(
+    const struct heatmap *heatmap, const struct heat_page *page) {
+    return heatmap->ext.mem && page->ext ? &heatmap->ext.mem[page->ext] :
+           NULL;
+}
+
 static inline uint64_t read_u64_file(const char *path, int *err) {
     FILE *fp = fopen(path, "r");
     uint64_t value = 0;
@@ -273,6 +1050,30 @@ static inline const char *cooling_mode_name(enum cooling_mode mode) {
     }
 }
 
+static inline const char *eviction_policy_name(enum eviction_policy policy) {
+    switch (policy) {
+    case EVICT_NONE:
+        return "none";
+    case EVICT_CLOCK:
+        return "clock";
+    case EVICT_COLDEST:
+        return "coldest";
+    default:
+        return "unknown";
+    }
+}
+
+static inline const char *target_mode_name(enum target_mode mode) {
+    switch (mode) {
+    case TARGET_THREADS:
+        return "threads";
+    case TARGET_CPUS:
+        return "cpus";
+    default:
+        return "unknown";
+    }
+}
+
 static inline const char *stats_address_mode_name(enum stats_address_mode mode) {
     switch (mode) {
     case STATS_ADDR_AUTO:
@@ -323,6 +1124,130 @@ static inline const char *heat_policy_name(enum heat_classification_policy polic
     }
 }
 
+static inline const char *vma_kind_name(enum vma_kind kind) {
+    switch (kind) {
+    case VMA_ANON:
+        return "anon";
+    case VMA_HEAP:
+        return "heap";
+    case VMA_STACK:
+        return "stack";
+    case VMA_FILE:
+        return "file";
+    case VMA_SHM:
+        return "shm";
+    case VMA_SPECIAL:
+    default:
+        return "special";
+    }
+}
+
+static inline const char *mem_tier_name(enum mem_tier tier) {
+    switch (tier) {
+    case MEM_TIER_L1:
+        return "l1";
+    case MEM_TIER_L2:
+        return "l2";
+    case MEM_TIER_LLC:
+        return "llc";
+    case MEM_TIER_DRAM:
+        return "dram";
+    case MEM_TIER_REMOTE_DRAM:
+        return "remote_dram";
+    case MEM_TIER_REMOTE_CACHE:
+        return "remote_cache";
+    case MEM_TIER_OTHER:
+    default:
+        return "other";
+    }
+}
+
+static inline const char *page_sort_name(enum page_sort sort) {
+    switch (sort) {
+    case PAGE_SORT_HEAT:
+        return "heat";
+    case PAGE_SORT_SAMPLES:
+        return "samples";
+    case PAGE_SORT_DRAM:
+        return "dram";
+    case PAGE_SORT_REMOTE:
+        return "remote";
+    default:
+        return "unknown";
+    }
+}
+
+static inline const char *synth_dist_name(enum synth_dist dist) {
+    switch (dist) {
+    case SYNTH_UNIFORM:
+        return "uniform";
+    case SYNTH_ZIPF:
+        return "zipf";
+    case SYNTH_HOTSET:
+        return "hotset";
+    case SYNTH_PHASE:
+        return "phase";
+    case SYNTH_MULTIPID:
+        return "multipid";
+    default:
+        return "unknown";
+    }
+}
+
+static inline const char *tier_cold_action_name(enum tier_cold_action action) {
+    switch (action) {
+    case TIER_COLD_OFF:
+        return "off";
+    case TIER_COLD_COLD:
+        return "cold";
+    case TIER_COLD_PAGEOUT:
+        return "pageout";
+    default:
+        return "unknown";
+    }
+}
+
+static inline const char *heat_score_name(enum heat_score score) {
+    switch (score) {
+    case HEAT_SCORE_SAMPLES:
+        return "samples";
+    case HEAT_SCORE_LATENCY:
+        return "latency";
+    case HEAT_SCORE_LOG_LATENCY:
+        return "log-latency";
+    default:
+        return "unknown";
+    }
+}
+
+static inline const char *interval_mode_name(enum interval_mode mode) {
+    switch (mode) {
+    case INTERVAL_FULL:
+        return "full";
+    case INTERVAL_DELTA:
+        return "delta";
+    default:
+        return "unknown";
+    }
+}
+
+static inline const char *group_dimension_name(enum group_dimension dimension) {
+    switch (dimension) {
+    case GROUP_BY_PID:
+        return "pid";
+    case GROUP_BY_TID:
+        return "tid";
+    case GROUP_BY_CPU:
+        return "cpu";
+    case GROUP_BY_NODE:
+        return "node";
+    case GROUP_BY_KIND:
+        return "kind";
+    default:
+        return "unknown";
+    }
+}
+
 static inline const char *summary_metric_name(enum summary_metric metric) {
     switch (metric) {
     case SUMMARY_PAGES:
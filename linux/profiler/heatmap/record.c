@@ -0,0 +1,762 @@
+#include "profiler.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+#define RECORD_FILE_MAGIC "MEMHEAT\x01"
+#define RECORD_FILE_VERSION 1
+#define RECORD_BACKEND_NAME_LEN 16
+#define REPLAY_CHUNK_BYTES (4UL << 20)
+
+/*
+ * On-disk layout of a --record file, in the byte order of the recording
+ * host:
+ *
+ *   struct record_file_header
+ *   perf records (struct perf_event_header + payload), exactly as perf wrote
+ *   them into the rings, concatenated ring drain by ring drain
+ *
+ * header_size lets later versions append fields without breaking older
+ * readers of the fields they know. data_bytes is patched in when recording
+ * finishes cleanly; 0 means the recorder did not get that far, and replay
+ * then takes every complete record up to the end of the file.
+ */
+struct record_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t sample_type;
+    uint64_t sample_period;
+    uint64_t data_bytes;
+    uint32_t page_shift;
+    int32_t filter_pid;
+    char backend[RECORD_BACKEND_NAME_LEN];
+};
+
+struct record_writer {
+    int fd;
+    pthread_mutex_t lock;
+    uint64_t bytes;
+    int err;
+};
+
+int record_writer_open(struct record_writer **writer_out, const char *path,
+                       const struct perf_session *session,
+                       const struct profiler_options *options,
+                       const struct profiler_backend *backend,
+                       size_t page_shift,
+                       char *reason,
+                       size_t reason_len) {
+    struct record_file_header header;
+    struct record_writer *writer;
+    int ret;
+
+    writer = calloc(1, sizeof(*writer));
+    if (!writer) {
+        snprintf(reason, reason_len, "failed to allocate record writer");
+        return -ENOMEM;
+    }
+
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        ret = -errno;
+        snprintf(reason, reason_len, "failed to create %s: %s", path,
+                 strerror(errno));
+        free(writer);
+        return ret;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORD_FILE_MAGIC, sizeof(header.magic));
+    header.version = RECORD_FILE_VERSION;
+    header.header_size = sizeof(header);
+    header.sample_type = session->sample_type;
+    header.sample_period = options->sample_period;
+    header.page_shift = (uint32_t)page_shift;
+    header.filter_pid = session->filter_pid;
+    snprintf(header.backend, sizeof(header.backend), "%s", backend->name);
+
+    if (write(writer->fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        ret = errno ? -errno : -EIO;
+        snprintf(reason, reason_len, "failed to write %s: %s", path,
+                 strerror(-ret));
+        close(writer->fd);
+        free(writer);
+        return ret;
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    *writer_out = writer;
+    return 0;
+}
+
+/*
+ * Append one drained span of a ring. The ring contents are handed to the
+ * kernel straight from the perf mapping (two iovecs when the span wraps),
+ * so recording adds no user-space copy. The first error is kept and
+ * reported by record_writer_close(); draining carries on regardless so the
+ * rings never stall.
+ */
+void record_writer_append(struct record_writer *writer,
+                          const void *first, size_t first_len,
+                          const void *second, size_t second_len) {
+    struct iovec iov[2];
+    struct iovec *cursor = iov;
+    int nr_iov = 0;
+
+    iov[nr_iov].iov_base = (void *)first;
+    iov[nr_iov++].iov_len = first_len;
+    if (second_len > 0) {
+        iov[nr_iov].iov_base = (void *)second;
+        iov[nr_iov++].iov_len = second_len;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->err == 0 && nr_iov > 0) {
+        ssize_t written = writev(writer->fd, cursor, nr_iov);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            writer->err = errno;
+            break;
+        }
+
+        writer->bytes += (uint64_t)written;
+        while (nr_iov > 0 && (size_t)written >= cursor->iov_len) {
+            written -= (ssize_t)cursor->iov_len;
+            cursor++;
+            nr_iov--;
+        }
+        if (nr_iov > 0) {
+            cursor->iov_base = (char *)cursor->iov_base + written;
+            cursor->iov_len -= (size_t)written;
+        }
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+int record_writer_close(struct record_writer *writer, uint64_t *bytes_out,
+                        char *reason, size_t reason_len) {
+    uint64_t data_bytes;
+    int ret = 0;
+
+    if (!writer) {
+        return 0;
+    }
+
+    data_bytes = writer->bytes;
+    if (writer->err != 0) {
+        ret = -writer->err;
+        snprintf(reason, reason_len, "failed to write record data: %s",
+                 strerror(writer->err));
+    } else if (pwrite(writer->fd, &data_bytes, sizeof(data_bytes),
+                      offsetof(struct record_file_header, data_bytes)) !=
+               (ssize_t)sizeof(data_bytes)) {
+        ret = errno ? -errno : -EIO;
+        snprintf(reason, reason_len, "failed to finalize record header: %s",
+                 strerror(-ret));
+    }
+
+    if (close(writer->fd) != 0 && ret == 0) {
+        ret = -errno;
+        snprintf(reason, reason_len, "failed to close record file: %s",
+                 strerror(errno));
+    }
+
+    if (bytes_out) {
+        *bytes_out = data_bytes;
+    }
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+    return ret;
+}
+
+int replay_open(struct replay_file *file, const char *path,
+                char *reason, size_t reason_len) {
+    const struct record_file_header *header;
+    struct stat st;
+    void *map;
+    int fd;
+    int ret;
+
+    memset(file, 0, sizeof(*file));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ret = -errno;
+        snprintf(reason, reason_len, "failed to open %s: %s", path,
+                 strerror(errno));
+        return ret;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        ret = -errno;
+        snprintf(reason, reason_len, "failed to stat %s: %s", path,
+                 strerror(errno));
+        close(fd);
+        return ret;
+    }
+
+    if ((size_t)st.st_size < sizeof(*header)) {
+        snprintf(reason, reason_len, "%s is too short for a record header",
+                 path);
+        close(fd);
+        return -EINVAL;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ret = map == MAP_FAILED ? -errno : 0;
+    close(fd);
+    if (ret != 0) {
+        snprintf(reason, reason_len, "failed to map %s: %s", path,
+                 strerror(-ret));
+        return ret;
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    file->map = map;
+    file->map_len = (size_t)st.st_size;
+    header = map;
+
+    if (memcmp(header->magic, RECORD_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        snprintf(reason, reason_len, "%s is not a memheat record file", path);
+        replay_close(file);
+        return -EINVAL;
+    }
+    if (header->version != RECORD_FILE_VERSION ||
+        header->header_size < sizeof(*header) ||
+        header->header_size > file->map_len ||
+        header->header_size % sizeof(uint64_t) != 0) {
+        snprintf(reason, reason_len,
+                 "%s: unsupported record file version %u (header %u bytes)",
+                 path, header->version, header->header_size);
+        replay_close(file);
+        return -EINVAL;
+    }
+
+    file->data = (const unsigned char *)map + header->header_size;
+    file->data_len = file->map_len - header->header_size;
+    if (header->data_bytes != 0 && header->data_bytes <= file->data_len) {
+        file->data_len = (size_t)header->data_bytes;
+        file->complete = true;
+    }
+    file->sample_type = header->sample_type;
+    file->sample_period = header->sample_period;
+    file->page_shift = header->page_shift;
+    file->filter_pid = header->filter_pid;
+    snprintf(file->backend, sizeof(file->backend), "%.*s",
+             RECORD_BACKEND_NAME_LEN, header->backend);
+    return 0;
+}
+
+/*
+ * Feed every recorded sample through the heatmap in file order, which is the
+ * order the live session drained them in. Records are decoded in place from
+ * the mapping with the same layout code as the live path.
+ */
+static void replay_run_serial(struct replay_file *file,
+                              const struct profiler_options *options,
+                              const struct profiler_backend *backend,
+                              struct heatmap *heatmap) {
+    struct sample_layout layout;
+    struct sample_record batch[HEATMAP_RECORD_BATCH];
+    size_t nr_batch = 0;
+    size_t offset = 0;
+
+    sample_layout_init(&layout, file->sample_type);
+
+    while (offset + sizeof(struct perf_event_header) <= file->data_len) {
+        const struct perf_event_header *header =
+            (const struct perf_event_header *)(file->data + offset);
+        const unsigned char *payload = file->data + offset + sizeof(*header);
+        size_t size = header->size;
+
+        if (size < sizeof(*header) || size > file->data_len - offset) {
+            break;
+        }
+
+        if (header->type == PERF_RECORD_SAMPLE &&
+            size - sizeof(*header) >= layout.size) {
+            decode_sample(&layout, payload, &batch[nr_batch]);
+            file->samples++;
+            if (!file->filter_pid ||
+                batch[nr_batch].pid == (uint32_t)file->filter_pid) {
+                nr_batch++;
+            }
+            if (nr_batch == ARRAY_SIZE(batch)) {
+                heatmap_record_batch(heatmap, options, backend, batch,
+                                     nr_batch);
+                nr_batch = 0;
+            }
+        } else if (header->type == PERF_RECORD_LOST &&
+                   size - sizeof(*header) >= 2 * sizeof(uint64_t)) {
+            uint64_t lost;
+
+            memcpy(&lost, payload + sizeof(uint64_t), sizeof(lost));
+            file->lost_samples += lost;
+        }
+
+        offset += size;
+    }
+
+    heatmap_record_batch(heatmap, options, backend, batch, nr_batch);
+    file->truncated_bytes = file->data_len - offset;
+}
+
+struct replay_bucket {
+    struct keyed_sample *samples;
+    size_t count;
+    size_t capacity;
+};
+
+/*
+ * One slice of the recording, cut at record boundaries. Times are the
+ * cooling clock inputs: the first non-zero sample time, the largest one in
+ * the chunk, and the largest one in every earlier chunk of the file.
+ */
+struct replay_chunk {
+    size_t begin;
+    size_t end;
+    uint64_t first_time_ns;
+    uint64_t max_time_ns;
+    uint64_t base_time_ns;
+    uint64_t samples;
+    uint64_t lost_samples;
+    struct replay_bucket *buckets;
+};
+
+struct replay_engine;
+
+struct replay_worker {
+    struct replay_engine *engine;
+    size_t index;
+    struct heatmap *heatmap;
+    struct heatmap shard;
+    int ret;
+    pthread_t thread;
+    bool started;
+};
+
+struct replay_engine {
+    struct replay_file *file;
+    const struct profiler_options *options;
+    const struct profiler_backend *backend;
+    struct sample_layout layout;
+    struct replay_chunk *chunks;
+    size_t nr_chunks;
+    struct replay_worker *workers;
+    size_t nr_workers;
+    bool split_phase;
+};
+
+static size_t replay_partition(uint64_t page, enum address_kind kind,
+                               size_t nr_workers) {
+    uint64_t x = page ^ ((uint64_t)kind << 61);
+
+    x ^= x >> 31;
+    x *= 0x9e3779b97f4a7c15ULL;
+    return (size_t)((x >> 32) % nr_workers);
+}
+
+static int replay_bucket_push(struct replay_bucket *bucket,
+                              const struct keyed_sample *sample) {
+    if (bucket->count == bucket->capacity) {
+        size_t capacity = bucket->capacity ? bucket->capacity * 2 : 1024;
+        struct keyed_sample *samples = realloc(bucket->samples,
+                                               capacity * sizeof(*samples));
+
+        if (!samples) {
+            return -ENOMEM;
+        }
+        bucket->samples = samples;
+        bucket->capacity = capacity;
+    }
+    bucket->samples[bucket->count++] = *sample;
+    return 0;
+}
+
+/*
+ * Phase 1, one chunk per worker: decode, apply the pid filter, resolve the
+ * page key and route the sample to the partition that owns its page. Each
+ * sample carries the largest timestamp seen so far in the chunk; phase 2
+ * raises that to the file-wide value once every earlier chunk is known.
+ */
+static int replay_split_chunk(struct replay_engine *engine,
+                              struct replay_worker *worker,
+                              struct replay_chunk *chunk) {
+    const struct replay_file *file = engine->file;
+    size_t offset = chunk->begin;
+    uint64_t clock_ns = 0;
+
+    chunk->first_time_ns = 0;
+    chunk->samples = 0;
+    chunk->lost_samples = 0;
+
+    while (offset < chunk->end) {
+        const struct perf_event_header *header =
+            (const struct perf_event_header *)(file->data + offset);
+        const unsigned char *payload = file->data + offset + sizeof(*header);
+        size_t size = header->size;
+
+        if (header->type == PERF_RECORD_SAMPLE &&
+            size - sizeof(*header) >= engine->layout.size) {
+            struct keyed_sample keyed;
+
+            decode_sample(&engine->layout, payload, &keyed.sample);
+            chunk->samples++;
+            if (file->filter_pid &&
+                keyed.sample.pid != (uint32_t)file->filter_pid) {
+                offset += size;
+                continue;
+            }
+
+            if (keyed.sample.time_ns != 0 && chunk->first_time_ns == 0) {
+                chunk->first_time_ns = keyed.sample.time_ns;
+            }
+            if (keyed.sample.time_ns > clock_ns) {
+                clock_ns = keyed.sample.time_ns;
+            }
+
+            keyed.kind = ADDR_KIND_VIRTUAL;
+            keyed.page = heatmap_sample_key(worker->heatmap, engine->options,
+                                            engine->backend, &keyed.sample,
+                                            &keyed.kind);
+            if (keyed.page != UINT64_MAX) {
+                size_t owner = replay_partition(keyed.page, keyed.kind,
+                                                engine->nr_workers);
+
+                keyed.clock_ns = clock_ns;
+                if (replay_bucket_push(&chunk->buckets[owner], &keyed) != 0) {
+                    return -ENOMEM;
+                }
+            }
+        } else if (header->type == PERF_RECORD_LOST &&
+                   size - sizeof(*header) >= 2 * sizeof(uint64_t)) {
+            uint64_t lost;
+
+            memcpy(&lost, payload + sizeof(uint64_t), sizeof(lost));
+            chunk->lost_samples += lost;
+        }
+
+        offset += size;
+    }
+
+    chunk->max_time_ns = clock_ns;
+    return 0;
+}
+
+/*
+ * Phase 2, one partition per worker: apply the partition's samples chunk by
+ * chunk, i.e. in file order, at the clock a serial replay would have been at.
+ */
+static void replay_apply_partition(struct replay_engine *engine,
+                                   struct replay_worker *worker) {
+    size_t c;
+    size_t i;
+
+    for (c = 0; c < engine->nr_chunks; c++) {
+        const struct replay_chunk *chunk = &engine->chunks[c];
+        struct replay_bucket *bucket = &chunk->buckets[worker->index];
+
+        for (i = 0; i < bucket->count; i++) {
+            if (bucket->samples[i].clock_ns < chunk->base_time_ns) {
+                bucket->samples[i].clock_ns = chunk->base_time_ns;
+            }
+        }
+        heatmap_record_keyed(worker->heatmap, engine->options,
+                             bucket->samples, bucket->count);
+        bucket->count = 0;
+    }
+}
+
+static void *replay_phase_main(void *arg) {
+    struct replay_worker *worker = arg;
+    struct replay_engine *engine = worker->engine;
+
+    if (!engine->split_phase) {
+        replay_apply_partition(engine, worker);
+    } else if (worker->index < engine->nr_chunks && worker->ret == 0) {
+        worker->ret = replay_split_chunk(engine, worker,
+                                         &engine->chunks[worker->index]);
+    }
+    return NULL;
+}
+
+/*
+ * Run one phase on every worker. The caller's thread acts as worker 0, and a
+ * worker whose thread cannot be started runs inline instead.
+ */
+static void replay_run_phase(struct replay_engine *engine, bool split) {
+    size_t i;
+
+    engine->split_phase = split;
+    for (i = 1; i < engine->nr_workers; i++) {
+        struct replay_worker *worker = &engine->workers[i];
+
+        worker->started = pthread_create(&worker->thread, NULL,
+                                         replay_phase_main, worker) == 0;
+        if (!worker->started) {
+            replay_phase_main(worker);
+        }
+    }
+    replay_phase_main(&engine->workers[0]);
+    for (i = 1; i < engine->nr_workers; i++) {
+        if (engine->workers[i].started) {
+            pthread_join(engine->workers[i].thread, NULL);
+        }
+    }
+}
+
+/*
+ * Cut up to nr_workers chunks of about REPLAY_CHUNK_BYTES starting at
+ * *offset. Only record headers are read here. Returns false once the data
+ * ends or a record is malformed (a truncated tail).
+ */
+static bool replay_cut_chunks(struct replay_engine *engine, size_t *offset) {
+    const struct replay_file *file = engine->file;
+    bool more = true;
+
+    engine->nr_chunks = 0;
+    while (more && engine->nr_chunks < engine->nr_workers) {
+        struct replay_chunk *chunk = &engine->chunks[engine->nr_chunks];
+
+        chunk->begin = *offset;
+        while (*offset - chunk->begin < REPLAY_CHUNK_BYTES) {
+            const struct perf_event_header *header;
+
+            if (*offset + sizeof(*header) > file->data_len) {
+                more = false;
+                break;
+            }
+            header = (const struct perf_event_header *)(file->data + *offset);
+            if (header->size < sizeof(*header) ||
+                header->size > file->data_len - *offset) {
+                more = false;
+                break;
+            }
+            *offset += header->size;
+        }
+        chunk->end = *offset;
+        if (chunk->end > chunk->begin) {
+            engine->nr_chunks++;
+        }
+    }
+    return more;
+}
+
+/*
+ * True while the partitions together stay within --max-pages, i.e. while a
+ * serial replay would not have had to drop or evict anything yet.
+ */
+static bool replay_partitions_fit(const struct replay_engine *engine) {
+    size_t total_pages = 0;
+    size_t i;
+
+    for (i = 0; i < engine->nr_workers; i++) {
+        const struct heatmap *part = engine->workers[i].heatmap;
+
+        if (part->dropped_pages != 0 || part->evicted_pages != 0) {
+            return false;
+        }
+        total_pages += part->count + part->old_count;
+    }
+    return total_pages <= engine->options->max_pages;
+}
+
+static void replay_engine_destroy(struct replay_engine *engine) {
+    size_t i;
+    size_t j;
+
+    for (i = 0; engine->chunks && i < engine->nr_workers; i++) {
+        for (j = 0; engine->chunks[i].buckets && j < engine->nr_workers; j++) {
+            free(engine->chunks[i].buckets[j].samples);
+        }
+        free(engine->chunks[i].buckets);
+    }
+    for (i = 1; engine->workers && i < engine->nr_workers; i++) {
+        heatmap_destroy(&engine->workers[i].shard);
+    }
+    free(engine->chunks);
+    free(engine->workers);
+}
+
+/*
+ * Parallel replay. Every round cuts one chunk per worker; phase 1 decodes
+ * the chunks in parallel and routes each sample to the partition owning its
+ * page (a hash of the page key), phase 2 has every worker apply its own
+ * partition in file order. A page only ever lives in one partition and sees
+ * its samples in the serial order, and every partition's cooling clock starts
+ * at the file's first timestamp and advances by the running maximum of all
+ * samples before it, so cooling epochs, eviction-free insertion and owner
+ * tracking of every page match a serial replay exactly. The disjoint
+ * partitions are then merged in index order. Heat summed over many pages
+ * (regions, sites) is added up per partition first, so those totals can
+ * differ from a serial replay in the last bits of the floating-point sum.
+ *
+ * The only thing partitions cannot reproduce is a shared --max-pages budget:
+ * as soon as the partitions together hold more pages than that (so a serial
+ * replay would have dropped or evicted pages, depending on arrival order),
+ * -E2BIG tells the caller to replay serially instead.
+ */
+static int replay_run_parallel(struct replay_file *file,
+                               const struct profiler_options *options,
+                               const struct profiler_backend *backend,
+                               struct heatmap *heatmap,
+                               size_t nr_workers) {
+    struct replay_engine engine;
+    uint64_t cooling_origin_ns = 0;
+    uint64_t max_time_ns = 0;
+    size_t offset = 0;
+    bool more = true;
+    size_t i;
+    size_t c;
+    int ret = 0;
+
+    memset(&engine, 0, sizeof(engine));
+    engine.file = file;
+    engine.options = options;
+    engine.backend = backend;
+    engine.nr_workers = nr_workers;
+    sample_layout_init(&engine.layout, file->sample_type);
+
+    engine.chunks = calloc(nr_workers, sizeof(*engine.chunks));
+    engine.workers = calloc(nr_workers, sizeof(*engine.workers));
+    if (!engine.chunks || !engine.workers) {
+        replay_engine_destroy(&engine);
+        return -ENOMEM;
+    }
+    for (i = 0; i < nr_workers; i++) {
+        struct replay_worker *worker = &engine.workers[i];
+
+        engine.chunks[i].buckets = calloc(nr_workers,
+                                          sizeof(*engine.chunks[i].buckets));
+        worker->engine = &engine;
+        worker->index = i;
+        worker->heatmap = heatmap;
+        if (i > 0) {
+            heatmap_init(&worker->shard, options->max_pages, heatmap->page_shift);
+            worker->shard.replay = heatmap->replay;
+            worker->shard.mem_info = heatmap->mem_info;
+            worker->heatmap = &worker->shard;
+        }
+        if (!engine.chunks[i].buckets || !worker->heatmap->pages) {
+            replay_engine_destroy(&engine);
+            return -ENOMEM;
+        }
+    }
+
+    while (more && ret == 0) {
+        more = replay_cut_chunks(&engine, &offset);
+        if (engine.nr_chunks == 0) {
+            break;
+        }
+
+        replay_run_phase(&engine, true);
+
+        for (c = 0; c < engine.nr_chunks; c++) {
+            struct replay_chunk *chunk = &engine.chunks[c];
+
+            file->samples += chunk->samples;
+            file->lost_samples += chunk->lost_samples;
+            chunk->base_time_ns = max_time_ns;
+            if (chunk->max_time_ns > max_time_ns) {
+                max_time_ns = chunk->max_time_ns;
+            }
+            if (cooling_origin_ns == 0 && chunk->first_time_ns != 0) {
+                cooling_origin_ns = chunk->first_time_ns;
+                for (i = 0; i < nr_workers; i++) {
+                    heatmap_advance_time(engine.workers[i].heatmap, options,
+                                         cooling_origin_ns);
+                }
+            }
+        }
+        for (i = 0; i < nr_workers; i++) {
+            if (engine.workers[i].ret != 0) {
+                ret = engine.workers[i].ret;
+            }
+        }
+        if (ret != 0) {
+            break;
+        }
+
+        replay_run_phase(&engine, false);
+        if (!replay_partitions_fit(&engine)) {
+            ret = -E2BIG;
+        }
+    }
+    file->truncated_bytes = file->data_len - offset;
+
+    for (i = 1; ret == 0 && i < nr_workers; i++) {
+        heatmap_merge(heatmap, &engine.workers[i].shard, options);
+    }
+    if (ret == 0) {
+        heatmap_advance_time(heatmap, options, max_time_ns);
+    }
+
+    replay_engine_destroy(&engine);
+    return ret;
+}
+
+/*
+ * Replay with options->replay_threads workers (0: one per online CPU). The
+ * parallel engine produces the same heatmap as the serial loop; when it
+ * cannot (a --max-pages budget that serial replay would hit, or no memory for
+ * its buffers) the heatmap is rebuilt with the serial loop.
+ */
+void replay_run(struct replay_file *file,
+                const struct profiler_options *options,
+                const struct profiler_backend *backend,
+                struct heatmap *heatmap) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nr_workers = options->replay_threads ? options->replay_threads :
+                        (online > 0 ? (size_t)online : 1);
+    size_t nr_chunks = file->data_len / REPLAY_CHUNK_BYTES + 1;
+    size_t page_shift = heatmap->page_shift;
+
+    if (nr_workers > nr_chunks) {
+        nr_workers = nr_chunks;
+    }
+    /*
+     * A region spans partitions, and step cooling of a region is not the sum
+     * of step cooling its parts, so such a replay can only be serial.
+     */
+    if (options->track_regions && options->cooling_mode == COOLING_STEP) {
+        nr_workers = 1;
+    }
+
+    file->replay_threads = 1;
+    file->serial_fallback = false;
+    if (nr_workers > 1) {
+        int ret = replay_run_parallel(file, options, backend, heatmap,
+                                      nr_workers);
+
+        if (ret == 0) {
+            file->replay_threads = nr_workers;
+            return;
+        }
+
+        file->serial_fallback = true;
+        file->samples = 0;
+        file->lost_samples = 0;
+        heatmap_destroy(heatmap);
+        heatmap_init(heatmap, options->max_pages, page_shift);
+        heatmap->replay = true;
+        heatmap->mem_info = backend->mem_info;
+    }
+
+    replay_run_serial(file, options, backend, heatmap);
+}
+
+void replay_close(struct replay_file *file) {
+    if (file->map) {
+        munmap(file->map, file->map_len);
+    }
+    memset(file, 0, sizeof(*file));
+}
@@ -0,0 +1,162 @@
+#include "profiler.h"
+
+
+#define REGION_INITIAL_CAPACITY 64
+
+static uint64_t region_hash(uint64_t region, enum address_kind kind) {
+    return hash_u64(region ^ ((uint64_t)kind << 61));
+}
+
+static uint64_t region_hash_at(const void *entries, size_t i) {
+    const struct heat_region *regions = entries;
+
+    return region_hash(regions[i].region, regions[i].kind);
+}
+
+/*
+ * A table is only live when its regions are larger than its children. The
+ * child size is raised if needed so that a region never has more children
+ * than the bitmap holds.
+ */
+void region_table_init(struct region_table *table, unsigned shift,
+                       unsigned child_shift) {
+    memset(table, 0, sizeof(*table));
+    if (shift <= child_shift) {
+        return;
+    }
+    if (shift - child_shift > 9) {
+        child_shift = shift - 9;
+    }
+    table->shift = shift;
+    table->child_shift = child_shift;
+}
+
+void region_table_destroy(struct region_table *table) {
+    unsigned shift = table->shift;
+    unsigned child_shift = table->child_shift;
+
+    free(table->regions);
+    hash_index_destroy(&table->index);
+    memset(table, 0, sizeof(*table));
+    table->shift = shift;
+    table->child_shift = child_shift;
+}
+
+uint32_t region_children(const struct region_table *table) {
+    return table->shift ? 1U << (table->shift - table->child_shift) : 0;
+}
+
+static int region_table_grow(struct region_table *table) {
+    size_t capacity = table->capacity ? table->capacity * 2 :
+                      REGION_INITIAL_CAPACITY;
+    struct heat_region *regions = realloc(table->regions,
+                                          capacity * sizeof(*regions));
+
+    if (!regions) {
+        return -ENOMEM;
+    }
+    table->regions = regions;
+    if (hash_index_resize(&table->index, capacity * 2, table->count,
+                          region_hash_at, table->regions) != 0) {
+        return -ENOMEM;
+    }
+    table->capacity = capacity;
+    return 0;
+}
+
+struct heat_region *region_table_find(const struct region_table *table,
+                                      uint64_t region,
+                                      enum address_kind kind) {
+    size_t slot;
+
+    if (!table->index.slots) {
+        return NULL;
+    }
+
+    slot = hash_index_slot(&table->index, region_hash(region, kind));
+    while (table->index.slots[slot] != HASH_INDEX_EMPTY) {
+        struct heat_region *entry = &table->regions[table->index.slots[slot]];
+
+        if (entry->region == region && entry->kind == kind) {
+            return entry;
+        }
+        slot = hash_index_next(&table->index, slot);
+    }
+    return NULL;
+}
+
+/*
+ * Find or insert a region. A new region is zeroed; the caller sets its
+ * cooling epoch. NULL once max_regions are tracked or memory runs out.
+ */
+struct heat_region *region_table_get(struct region_table *table,
+                                     uint64_t region, enum address_kind kind,
+                                     size_t max_regions) {
+    struct heat_region *entry = region_table_find(table, region, kind);
+
+    if (entry) {
+        return entry;
+    }
+    if (table->count >= max_regions) {
+        return NULL;
+    }
+    if (table->count == table->capacity && region_table_grow(table) != 0) {
+        return NULL;
+    }
+
+    entry = &table->regions[table->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->region = region;
+    entry->kind = kind;
+
+    hash_index_insert(&table->index, region_hash(region, kind),
+                      (uint32_t)table->count++);
+    return entry;
+}
+
+/* Mark the child holding addr as sampled. True if it was not yet marked. */
+bool region_mark_child(struct heat_region *region,
+                       const struct region_table *table, uint64_t addr) {
+    uint64_t child = (addr >> table->child_shift) &
+                     (region_children(table) - 1);
+    uint64_t bit = 1ULL << (child % 64);
+
+    if (region->children[child / 64] & bit) {
+        return false;
+    }
+    region->children[child / 64] |= bit;
+    region->touched++;
+    return true;
+}
+
+/* Make dst an independent copy of src, reusing dst's arrays when they fit. */
+int region_table_copy(struct region_table *dst,
+                      const struct region_table *src) {
+    if (dst->capacity != src->capacity) {
+        free(dst->regions);
+        dst->regions = NULL;
+        dst->capacity = 0;
+        if (src->capacity) {
+            dst->regions = malloc(src->capacity * sizeof(*dst->regions));
+            if (!dst->regions) {
+                region_table_destroy(dst);
+                return -ENOMEM;
+            }
+        }
+    }
+    if (hash_index_copy(&dst->index, &src->index) != 0) {
+        region_table_destroy(dst);
+        return -ENOMEM;
+    }
+
+    if (src->capacity) {
+        memcpy(dst->regions, src->regions,
+               src->count * sizeof(*dst->regions));
+    }
+    dst->count = src->count;
+    dst->capacity = src->capacity;
+    dst->dropped_samples = src->dropped_samples;
+    dst->shift = src->shift;
+    dst->child_shift = src->child_shift;
+    return 0;
+}
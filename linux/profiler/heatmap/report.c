@@ -0,0 +1,2259 @@
+#include "profiler.h"
+
+
+static const char *page_state_label(enum page_state state) {
+    switch (state) {
+    case PAGE_HOT:
+        return "hot";
+    case PAGE_COLD:
+        return "cold";
+    case PAGE_WARM:
+    default:
+        return "warm";
+    }
+}
+
+enum page_state page_state_of(const struct heat_page *page,
+                              const struct profiler_options *options) {
+    if (page->heat >= options->hot_threshold) {
+        return PAGE_HOT;
+    }
+    if (page->heat < options->cold_threshold) {
+        return PAGE_COLD;
+    }
+    return PAGE_WARM;
+}
+
+struct overall_summary {
+    uint64_t total_pages;
+    uint64_t hot_pages;
+    uint64_t warm_pages;
+    uint64_t cold_pages;
+    uint64_t total_bytes;
+    uint64_t hot_bytes;
+    uint64_t warm_bytes;
+    uint64_t cold_bytes;
+    double total_heat;
+    double hot_heat;
+    double warm_heat;
+    double cold_heat;
+    uint64_t total_samples;
+    uint64_t hot_samples;
+    uint64_t warm_samples;
+    uint64_t cold_samples;
+    uint64_t tier_samples[MEM_TIERS];
+    uint64_t tiered_samples;
+};
+
+/* --regions: one region size, ranked, with the classes of its base pages. */
+struct region_class_counts {
+    uint64_t hot_pages;
+    uint64_t warm_pages;
+    uint64_t cold_pages;
+};
+
+struct region_view {
+    const struct region_table *table;
+    const struct heat_region **ordered;
+    struct region_class_counts *counts;
+    size_t limit;
+};
+
+/*
+ * --vma: heat folded per mapping (indexed by record id) and per backing file
+ * (indexed by path id), over a snapshot of the index taken for this report.
+ */
+struct vma_summary {
+    const struct vma_record *record;
+    double heat;
+    uint64_t samples;
+    uint64_t pages;
+    uint64_t hot_bytes;
+    uint64_t warm_bytes;
+    uint64_t cold_bytes;
+};
+
+struct vma_view {
+    struct vma_record *records;
+    size_t nr_records;
+    struct vma_summary *mappings;
+    struct vma_summary *files;
+    size_t nr_files;
+    const struct vma_summary **ordered_mappings;
+    size_t mapping_count;
+    size_t mapping_limit;
+    const struct vma_summary **ordered_files;
+    size_t file_count;
+    size_t file_limit;
+    uint64_t unattributed_pages;
+    double unattributed_heat;
+};
+
+/* --sort-by other than heat: a detail row and its heat-based class. */
+struct report_row {
+    const struct heat_page *page;
+    uint64_t key;
+    enum page_state state;
+};
+
+/*
+ * --numa: local and remote heat per process, and the hot pages mostly
+ * accessed from another node, ranked by their remote heat.
+ */
+struct numa_candidate {
+    const struct heat_page *page;
+    const struct heat_page_numa *numa;
+};
+
+struct numa_view {
+    struct group_table processes;
+    size_t process_limit;
+    struct numa_candidate *candidates;
+    size_t nr_candidates;
+    size_t candidate_limit;
+    uint64_t candidate_bytes;
+    uint64_t remote_bytes;
+    double candidate_remote_heat;
+    double local_heat;
+    double remote_heat;
+    uint64_t unresolved_pages;
+    uint64_t sample_period;
+};
+
+/* --sites: code sites ranked by the heat they added. */
+struct site_view {
+    const struct heat_site **ordered;
+    size_t limit;
+    double total_heat;
+};
+
+/*
+ * Everything the formatters need, computed once per report.
+ *
+ * Only the first `limit` entries of `ordered` are fully sorted. Under the
+ * percentile policy the array is additionally partitioned at `hot_cutoff` and
+ * `cold_start`, so a page's class follows from its index alone.
+ */
+struct report_view {
+    struct heat_page **ordered;
+    size_t count;
+    size_t limit;
+    size_t hot_cutoff;
+    size_t cold_start;
+    struct overall_summary overall;
+    struct group_table groups;
+    bool has_groups;
+    struct region_view regions[REGION_LEVELS];
+    bool has_regions;
+    struct vma_view vmas;
+    bool has_vmas;
+    struct site_view sites;
+    bool has_sites;
+    struct numa_view numa;
+    bool has_numa;
+    struct report_row *rows;
+};
+
+static double summary_metric_total(const struct overall_summary *summary,
+                                   enum summary_metric metric) {
+    switch (metric) {
+    case SUMMARY_HEAT:
+        return summary->total_heat;
+    case SUMMARY_SAMPLES:
+        return (double)summary->total_samples;
+    case SUMMARY_PAGES:
+    default:
+        return (double)summary->total_pages;
+    }
+}
+
+static double summary_metric_value(const struct overall_summary *summary,
+                                   enum summary_metric metric,
+                                   enum page_state state) {
+    if (metric == SUMMARY_HEAT) {
+        if (state == PAGE_HOT) {
+            return summary->hot_heat;
+        }
+        if (state == PAGE_COLD) {
+            return summary->cold_heat;
+        }
+        return summary->warm_heat;
+    }
+
+    if (metric == SUMMARY_SAMPLES) {
+        if (state == PAGE_HOT) {
+            return (double)summary->hot_samples;
+        }
+        if (state == PAGE_COLD) {
+            return (double)summary->cold_samples;
+        }
+        return (double)summary->warm_samples;
+    }
+
+    if (state == PAGE_HOT) {
+        return (double)summary->hot_pages;
+    }
+    if (state == PAGE_COLD) {
+        return (double)summary->cold_pages;
+    }
+    return (double)summary->warm_pages;
+}
+
+void percentile_cutoffs(const struct profiler_options *options,
+                        size_t total_count,
+                        size_t *hot_cutoff_out,
+                        size_t *cold_start_out) {
+    size_t hot_cutoff;
+    size_t cold_cutoff;
+    size_t cold_start;
+
+    hot_cutoff = (size_t)((options->hot_percent / 100.0) * (double)total_count);
+    cold_cutoff = (size_t)((options->cold_percent / 100.0) * (double)total_count);
+    if (options->hot_percent > 0.0 && hot_cutoff == 0 && total_count > 0) {
+        hot_cutoff = 1;
+    }
+    if (options->cold_percent > 0.0 && cold_cutoff == 0 && total_count > 0) {
+        cold_cutoff = 1;
+    }
+    if (hot_cutoff > total_count) {
+        hot_cutoff = total_count;
+    }
+    if (cold_cutoff > total_count) {
+        cold_cutoff = total_count;
+    }
+
+    cold_start = cold_cutoff >= total_count ? 0 : total_count - cold_cutoff;
+    if (cold_start < hot_cutoff) {
+        cold_start = hot_cutoff;
+    }
+
+    *hot_cutoff_out = hot_cutoff;
+    *cold_start_out = cold_start;
+}
+
+static enum page_state classify_page_state(const struct report_view *view,
+                                           const struct profiler_options *options,
+                                           size_t rank) {
+    if (options->heat_policy == HEAT_POLICY_PERCENTILE) {
+        if (rank < view->hot_cutoff) {
+            return PAGE_HOT;
+        }
+        if (rank >= view->cold_start) {
+            return PAGE_COLD;
+        }
+        return PAGE_WARM;
+    }
+
+    return page_state_of(view->ordered[rank], options);
+}
+
+static int compare_heat_page_desc(const void *lhs, const void *rhs) {
+    const struct heat_page *const *a = lhs;
+    const struct heat_page *const *b = rhs;
+
+    if ((*a)->heat < (*b)->heat) {
+        return 1;
+    }
+    if ((*a)->heat > (*b)->heat) {
+        return -1;
+    }
+    if ((*a)->samples < (*b)->samples) {
+        return 1;
+    }
+    if ((*a)->samples > (*b)->samples) {
+        return -1;
+    }
+    if ((*a)->kind != (*b)->kind) {
+        return (*a)->kind < (*b)->kind ? -1 : 1;
+    }
+    if ((*a)->page != (*b)->page) {
+        return (*a)->page < (*b)->page ? -1 : 1;
+    }
+    return 0;
+}
+
+static void swap_items(unsigned char *items, size_t size, size_t a,
+                       size_t b) {
+    unsigned char tmp[SELECT_MAX_SIZE];
+
+    memcpy(tmp, items + a * size, size);
+    memcpy(items + a * size, items + b * size, size);
+    memcpy(items + b * size, tmp, size);
+}
+
+/*
+ * Rearrange items[lo, hi) so that items[k] holds the element that sorting
+ * with `compare` would put there, everything before it ranks no lower and
+ * everything after it ranks no higher (nth_element). Three-way partitioning
+ * keeps long runs of equal keys, which cooled tables produce a lot of, from
+ * degrading to quadratic time. Elements are at most SELECT_MAX_SIZE bytes.
+ */
+void select_nth(void *base, size_t size, size_t lo, size_t hi, size_t k,
+                int (*compare)(const void *, const void *)) {
+    unsigned char *items = base;
+    unsigned char pivot[SELECT_MAX_SIZE];
+
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t lt = lo;
+        size_t gt = hi;
+        size_t i = lo;
+
+        /* Median of three as the pivot. */
+        if (compare(items + mid * size, items + lo * size) < 0) {
+            swap_items(items, size, mid, lo);
+        }
+        if (compare(items + (hi - 1) * size, items + lo * size) < 0) {
+            swap_items(items, size, hi - 1, lo);
+        }
+        if (compare(items + (hi - 1) * size, items + mid * size) < 0) {
+            swap_items(items, size, hi - 1, mid);
+        }
+        memcpy(pivot, items + mid * size, size);
+
+        /* [lo, lt) ranks above the pivot, [lt, i) ties it, [gt, hi) below. */
+        while (i < gt) {
+            int cmp = compare(items + i * size, pivot);
+
+            if (cmp < 0) {
+                swap_items(items, size, lt++, i++);
+            } else if (cmp > 0) {
+                swap_items(items, size, i, --gt);
+            } else {
+                i++;
+            }
+        }
+
+        if (k < lt) {
+            hi = lt;
+        } else if (k >= gt) {
+            lo = gt;
+        } else {
+            return;
+        }
+    }
+}
+
+/*
+ * Partition `ordered` at every rank boundary the report depends on: the
+ * percentile cutoffs and the --top limit. Each boundary is selected inside
+ * the part left over by the previous one, so the total work stays linear.
+ * Only the first `limit` entries are then sorted for printing.
+ */
+static void report_view_order(struct report_view *view,
+                              const struct profiler_options *options) {
+    size_t bounds[3];
+    size_t nr_bounds = 0;
+    size_t lo = 0;
+    size_t i;
+
+    if (options->heat_policy == HEAT_POLICY_PERCENTILE) {
+        bounds[nr_bounds++] = view->hot_cutoff;
+        bounds[nr_bounds++] = view->cold_start;
+    }
+    if (options->report_mode != REPORT_SUMMARY) {
+        bounds[nr_bounds++] = view->limit;
+    }
+
+    /* At most three entries: insertion sort into ascending order. */
+    for (i = 1; i < nr_bounds; i++) {
+        size_t value = bounds[i];
+        size_t j = i;
+
+        while (j > 0 && bounds[j - 1] > value) {
+            bounds[j] = bounds[j - 1];
+            j--;
+        }
+        bounds[j] = value;
+    }
+
+    for (i = 0; i < nr_bounds; i++) {
+        if (bounds[i] <= lo || bounds[i] >= view->count) {
+            continue;
+        }
+        select_nth(view->ordered, sizeof(*view->ordered), lo, view->count,
+                   bounds[i], compare_heat_page_desc);
+        lo = bounds[i];
+    }
+
+    if (options->report_mode != REPORT_SUMMARY) {
+        qsort(view->ordered, view->limit, sizeof(*view->ordered),
+              compare_heat_page_desc);
+    }
+}
+
+static int compare_heat_region_desc(const void *lhs, const void *rhs) {
+    const struct heat_region *const *a = lhs;
+    const struct heat_region *const *b = rhs;
+
+    if ((*a)->heat < (*b)->heat) {
+        return 1;
+    }
+    if ((*a)->heat > (*b)->heat) {
+        return -1;
+    }
+    if ((*a)->samples < (*b)->samples) {
+        return 1;
+    }
+    if ((*a)->samples > (*b)->samples) {
+        return -1;
+    }
+    if ((*a)->kind != (*b)->kind) {
+        return (*a)->kind < (*b)->kind ? -1 : 1;
+    }
+    if ((*a)->region != (*b)->region) {
+        return (*a)->region < (*b)->region ? -1 : 1;
+    }
+    return 0;
+}
+
+static void region_views_destroy(struct report_view *view) {
+    size_t level;
+
+    for (level = 0; level < REGION_LEVELS; level++) {
+        free(view->regions[level].ordered);
+        free(view->regions[level].counts);
+    }
+    memset(view->regions, 0, sizeof(view->regions));
+    view->has_regions = false;
+}
+
+static int region_views_init(struct report_view *view,
+                             const struct heatmap *heatmap) {
+    size_t level;
+
+    for (level = 0; level < REGION_LEVELS; level++) {
+        struct region_view *regions = &view->regions[level];
+        const struct region_table *table = &heatmap->regions[level];
+        size_t slots = table->count ? table->count : 1;
+
+        regions->table = table;
+        regions->ordered = calloc(slots, sizeof(*regions->ordered));
+        regions->counts = calloc(slots, sizeof(*regions->counts));
+        if (!regions->ordered || !regions->counts) {
+            region_views_destroy(view);
+            return -ENOMEM;
+        }
+    }
+    view->has_regions = true;
+    return 0;
+}
+
+/* Count a classified base page against the regions that contain it. */
+static void region_views_add(struct report_view *view,
+                             const struct heat_page *page,
+                             enum page_state state,
+                             size_t page_shift) {
+    uint64_t addr = page->page << page_shift;
+    size_t level;
+
+    for (level = 0; level < REGION_LEVELS; level++) {
+        struct region_view *regions = &view->regions[level];
+        const struct heat_region *region;
+        struct region_class_counts *counts;
+
+        if (!regions->table->shift) {
+            continue;
+        }
+        region = region_table_find(regions->table,
+                                   addr >> regions->table->shift, page->kind);
+        if (!region) {
+            continue;
+        }
+        counts = &regions->counts[region - regions->table->regions];
+        if (state == PAGE_HOT) {
+            counts->hot_pages++;
+        } else if (state == PAGE_COLD) {
+            counts->cold_pages++;
+        } else {
+            counts->warm_pages++;
+        }
+    }
+}
+
+static void region_views_sort(struct report_view *view,
+                              const struct profiler_options *options) {
+    size_t level;
+    size_t i;
+
+    for (level = 0; level < REGION_LEVELS; level++) {
+        struct region_view *regions = &view->regions[level];
+        size_t count = regions->table->count;
+
+        for (i = 0; i < count; i++) {
+            regions->ordered[i] = &regions->table->regions[i];
+        }
+        regions->limit = options->top_n < count ? options->top_n : count;
+        /* Only the --top regions are printed: select, then sort those. */
+        if (regions->limit < count) {
+            select_nth(regions->ordered, sizeof(*regions->ordered), 0, count,
+                       regions->limit, compare_heat_region_desc);
+        }
+        qsort(regions->ordered, regions->limit, sizeof(*regions->ordered),
+              compare_heat_region_desc);
+    }
+}
+
+static const struct region_class_counts *region_view_counts(
+    const struct region_view *regions, size_t rank) {
+    return &regions->counts[regions->ordered[rank] - regions->table->regions];
+}
+
+static int compare_vma_summary_desc(const void *lhs, const void *rhs) {
+    const struct vma_summary *const *a = lhs;
+    const struct vma_summary *const *b = rhs;
+    int ret;
+
+    if ((*a)->heat < (*b)->heat) {
+        return 1;
+    }
+    if ((*a)->heat > (*b)->heat) {
+        return -1;
+    }
+    if ((*a)->samples < (*b)->samples) {
+        return 1;
+    }
+    if ((*a)->samples > (*b)->samples) {
+        return -1;
+    }
+    ret = strcmp((*a)->record->path, (*b)->record->path);
+    if (ret != 0) {
+        return ret;
+    }
+    if ((*a)->record->pid != (*b)->record->pid) {
+        return (*a)->record->pid < (*b)->record->pid ? -1 : 1;
+    }
+    if ((*a)->record->start != (*b)->record->start) {
+        return (*a)->record->start < (*b)->record->start ? -1 : 1;
+    }
+    return 0;
+}
+
+static void vma_view_destroy(struct report_view *view) {
+    free(view->vmas.records);
+    free(view->vmas.mappings);
+    free(view->vmas.files);
+    free(view->vmas.ordered_mappings);
+    free(view->vmas.ordered_files);
+    memset(&view->vmas, 0, sizeof(view->vmas));
+    view->has_vmas = false;
+}
+
+static int vma_view_init(struct report_view *view,
+                         const struct heatmap *heatmap) {
+    struct vma_view *vmas = &view->vmas;
+
+    if (vma_index_snapshot(heatmap->vmas, &vmas->records, &vmas->nr_records,
+                           &vmas->nr_files) != 0) {
+        return -ENOMEM;
+    }
+    vmas->mappings = calloc(vmas->nr_records ? vmas->nr_records : 1,
+                            sizeof(*vmas->mappings));
+    vmas->files = calloc(vmas->nr_files ? vmas->nr_files : 1,
+                         sizeof(*vmas->files));
+    vmas->ordered_mappings = calloc(vmas->nr_records ? vmas->nr_records : 1,
+                                    sizeof(*vmas->ordered_mappings));
+    vmas->ordered_files = calloc(vmas->nr_files ? vmas->nr_files : 1,
+                                 sizeof(*vmas->ordered_files));
+    if (!vmas->mappings || !vmas->files || !vmas->ordered_mappings ||
+        !vmas->ordered_files) {
+        vma_view_destroy(view);
+        return -ENOMEM;
+    }
+    view->has_vmas = true;
+    return 0;
+}
+
+static void vma_summary_add(struct vma_summary *summary,
+                            const struct vma_record *record,
+                            const struct heat_page *page,
+                            enum page_state state, uint64_t page_bytes) {
+    if (!summary->record) {
+        summary->record = record;
+    }
+    summary->heat += page->heat;
+    summary->samples += page->samples;
+    summary->pages++;
+    if (state == PAGE_HOT) {
+        summary->hot_bytes += page_bytes;
+    } else if (state == PAGE_COLD) {
+        summary->cold_bytes += page_bytes;
+    } else {
+        summary->warm_bytes += page_bytes;
+    }
+}
+
+/*
+ * Fold a classified page into its mapping and, for file and shared memory
+ * mappings, into its backing file. Pages resolved after the snapshot was
+ * taken count as unattributed.
+ */
+static void vma_view_add(struct report_view *view,
+                         const struct heat_page *page,
+                         enum page_state state, uint64_t page_bytes) {
+    struct vma_view *vmas = &view->vmas;
+    const struct vma_record *record;
+
+    if (page->vma == 0 || page->vma >= vmas->nr_records) {
+        vmas->unattributed_pages++;
+        vmas->unattributed_heat += page->heat;
+        return;
+    }
+    record = &vmas->records[page->vma];
+    vma_summary_add(&vmas->mappings[page->vma], record, page, state,
+                    page_bytes);
+    if ((record->kind == VMA_FILE || record->kind == VMA_SHM) &&
+        record->path[0] && record->path_id < vmas->nr_files) {
+        vma_summary_add(&vmas->files[record->path_id], record, page, state,
+                        page_bytes);
+    }
+}
+
+/*
+ * Collect the summaries that saw a page into `ordered` and return how many
+ * there are. Only the first `top_n` are printed: those are selected and
+ * sorted, and *limit_out says how many that is.
+ */
+static size_t vma_summaries_sort(const struct vma_summary **ordered,
+                                 const struct vma_summary *summaries,
+                                 size_t count, size_t top_n,
+                                 size_t *limit_out) {
+    size_t used = 0;
+    size_t limit;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (summaries[i].pages) {
+            ordered[used++] = &summaries[i];
+        }
+    }
+    limit = top_n < used ? top_n : used;
+    if (limit < used) {
+        select_nth(ordered, sizeof(*ordered), 0, used, limit,
+                   compare_vma_summary_desc);
+    }
+    qsort(ordered, limit, sizeof(*ordered), compare_vma_summary_desc);
+    *limit_out = limit;
+    return used;
+}
+
+static void vma_view_sort(struct report_view *view,
+                          const struct profiler_options *options) {
+    struct vma_view *vmas = &view->vmas;
+
+    vmas->mapping_count = vma_summaries_sort(vmas->ordered_mappings,
+                                             vmas->mappings, vmas->nr_records,
+                                             options->process_top_n,
+                                             &vmas->mapping_limit);
+    vmas->file_count = vma_summaries_sort(vmas->ordered_files, vmas->files,
+                                          vmas->nr_files,
+                                          options->process_top_n,
+                                          &vmas->file_limit);
+}
+
+static int compare_heat_site_desc(const void *lhs, const void *rhs) {
+    const struct heat_site *const *a = lhs;
+    const struct heat_site *const *b = rhs;
+
+    if ((*a)->heat < (*b)->heat) {
+        return 1;
+    }
+    if ((*a)->heat > (*b)->heat) {
+        return -1;
+    }
+    if ((*a)->samples < (*b)->samples) {
+        return 1;
+    }
+    if ((*a)->samples > (*b)->samples) {
+        return -1;
+    }
+    if ((*a)->pid != (*b)->pid) {
+        return (*a)->pid < (*b)->pid ? -1 : 1;
+    }
+    if ((*a)->ip != (*b)->ip) {
+        return (*a)->ip < (*b)->ip ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Each remote sample stands for sample_period loads of one cache line, which
+ * is the traffic moving the page to its accessors' node would keep local.
+ */
+#define NUMA_LINE_BYTES 64
+
+static void numa_view_destroy(struct report_view *view) {
+    if (view->has_numa) {
+        group_table_destroy(&view->numa.processes);
+    }
+    free(view->numa.candidates);
+    memset(&view->numa, 0, sizeof(view->numa));
+    view->has_numa = false;
+}
+
+static int numa_view_init(struct report_view *view,
+                          const struct profiler_options *options) {
+    struct numa_view *numa = &view->numa;
+
+    if (group_table_init(&numa->processes, GROUP_BY_PID) != 0) {
+        return -ENOMEM;
+    }
+    view->has_numa = true;
+    numa->sample_period = options->sample_period;
+    numa->candidates = calloc(view->count ? view->count : 1,
+                              sizeof(*numa->candidates));
+    if (!numa->candidates) {
+        numa_view_destroy(view);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static const struct heat_page_numa numa_unknown;
+
+/* A page's --numa data, all unknown when it has none. */
+static const struct heat_page_numa *report_page_numa(
+    const struct heatmap *heatmap, const struct heat_page *page) {
+    const struct heat_page_numa *numa = heatmap_page_numa(heatmap, page);
+
+    return numa ? numa : &numa_unknown;
+}
+
+/* A hot page whose accesses come mostly from the node it is not on. */
+static bool numa_page_misplaced(const struct heat_page_numa *page_numa,
+                                enum page_state state) {
+    return state == PAGE_HOT && page_numa->node != 0 &&
+           page_numa->access_node != 0 &&
+           page_numa->access_node != page_numa->node &&
+           page_numa->remote_heat > page_numa->local_heat;
+}
+
+static void numa_view_add(struct report_view *view,
+                          const struct heatmap *heatmap,
+                          const struct heat_page *page, enum page_state state,
+                          uint64_t page_bytes) {
+    struct numa_view *numa = &view->numa;
+    const struct heat_page_numa *page_numa = report_page_numa(heatmap, page);
+
+    numa->local_heat += page_numa->local_heat;
+    numa->remote_heat += page_numa->remote_heat;
+    if (page_numa->node == 0) {
+        numa->unresolved_pages++;
+    }
+    if (group_table_add(&numa->processes, heatmap, page, state) != 0) {
+        numa_view_destroy(view);
+        return;
+    }
+    if (numa_page_misplaced(page_numa, state)) {
+        numa->candidates[numa->nr_candidates].page = page;
+        numa->candidates[numa->nr_candidates].numa = page_numa;
+        numa->nr_candidates++;
+        numa->candidate_bytes += page_bytes;
+        numa->candidate_remote_heat += page_numa->remote_heat;
+        numa->remote_bytes += (uint64_t)page_numa->remote_samples *
+                              numa->sample_period * NUMA_LINE_BYTES;
+    }
+}
+
+static int compare_numa_candidate_desc(const void *lhs, const void *rhs) {
+    const struct numa_candidate *a = lhs;
+    const struct numa_candidate *b = rhs;
+
+    if (a->numa->remote_heat != b->numa->remote_heat) {
+        return a->numa->remote_heat < b->numa->remote_heat ? 1 : -1;
+    }
+    return compare_heat_page_desc(&a->page, &b->page);
+}
+
+static int compare_numa_process_desc(const void *lhs, const void *rhs) {
+    const struct group_summary *a = lhs;
+    const struct group_summary *b = rhs;
+
+    if (a->remote_heat != b->remote_heat) {
+        return a->remote_heat < b->remote_heat ? 1 : -1;
+    }
+    if (a->local_heat != b->local_heat) {
+        return a->local_heat < b->local_heat ? 1 : -1;
+    }
+    if (a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+    return 0;
+}
+
+static void numa_view_sort(struct report_view *view,
+                           const struct profiler_options *options) {
+    struct numa_view *numa = &view->numa;
+    struct group_table *processes = &numa->processes;
+
+    /* Only the --top candidates and --process-top processes are printed. */
+    numa->candidate_limit = options->top_n < numa->nr_candidates ?
+                            options->top_n : numa->nr_candidates;
+    if (numa->candidate_limit < numa->nr_candidates) {
+        select_nth(numa->candidates, sizeof(*numa->candidates), 0,
+                   numa->nr_candidates, numa->candidate_limit,
+                   compare_numa_candidate_desc);
+    }
+    qsort(numa->candidates, numa->candidate_limit, sizeof(*numa->candidates),
+          compare_numa_candidate_desc);
+
+    numa->process_limit = options->process_top_n < processes->count ?
+                          options->process_top_n : processes->count;
+    if (numa->process_limit < processes->count) {
+        select_nth(processes->groups, sizeof(*processes->groups), 0,
+                   processes->count, numa->process_limit,
+                   compare_numa_process_desc);
+    }
+    qsort(processes->groups, numa->process_limit, sizeof(*processes->groups),
+          compare_numa_process_desc);
+}
+
+/* "-" for an unknown --numa node, else the node number. */
+static void format_numa_node(uint16_t node, char *buf, size_t len) {
+    if (node == 0) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    snprintf(buf, len, "%u", node - 1U);
+}
+
+static void site_view_build(struct report_view *view,
+                            const struct heatmap *heatmap,
+                            const struct profiler_options *options) {
+    const struct site_table *table = &heatmap->sites;
+    struct site_view *sites = &view->sites;
+    size_t i;
+
+    sites->ordered = calloc(table->count ? table->count : 1,
+                            sizeof(*sites->ordered));
+    if (!sites->ordered) {
+        return;
+    }
+    for (i = 0; i < table->count; i++) {
+        sites->ordered[i] = &table->sites[i];
+        sites->total_heat += table->sites[i].heat;
+    }
+    sites->limit = options->top_n < table->count ? options->top_n :
+                   table->count;
+    /* Only the --top sites are printed: select them, then sort just those. */
+    if (sites->limit < table->count) {
+        select_nth(sites->ordered, sizeof(*sites->ordered), 0, table->count,
+                   sites->limit, compare_heat_site_desc);
+    }
+    qsort(sites->ordered, sites->limit, sizeof(*sites->ordered),
+          compare_heat_site_desc);
+    view->has_sites = true;
+}
+
+/*
+ * "func+0x1f" and the binary for a site, or "?" and "-" when the mapping or
+ * its symbols are unknown.
+ */
+static void site_symbol(const struct heatmap *heatmap,
+                        const struct heat_site *site, char *symbol,
+                        size_t symbol_len, const char **path) {
+    *path = "";
+    if (!heatmap->vmas ||
+        vma_index_symbolize(heatmap->vmas, site->vma, site->ip, symbol,
+                            symbol_len, path) != 0) {
+        snprintf(symbol, symbol_len, "?");
+    }
+}
+
+/* Hottest first; ties by pid and ip so merged shards print the same. */
+static int compare_page_site_desc(const struct heat_page_site *a,
+                                  const struct heat_page_site *b) {
+    if (a->heat != b->heat) {
+        return a->heat < b->heat ? 1 : -1;
+    }
+    if (a->pid != b->pid) {
+        return a->pid < b->pid ? -1 : 1;
+    }
+    if (a->ip != b->ip) {
+        return a->ip < b->ip ? -1 : 1;
+    }
+    return 0;
+}
+
+/* The used --sites slots of a page in report order; returns how many. */
+static size_t page_sites_order(const struct heatmap *heatmap,
+                               const struct heat_page *page,
+                               const struct heat_page_site **order) {
+    const struct heat_page_sites *sites = heatmap_page_sites(heatmap, page);
+    size_t count = 0;
+    size_t i;
+
+    if (!sites) {
+        return 0;
+    }
+    for (i = 0; i < PAGE_SITE_SLOTS; i++) {
+        const struct heat_page_site *slot = &sites->slots[i];
+        size_t j;
+
+        if (!slot->samples) {
+            continue;
+        }
+        for (j = count; j > 0 && compare_page_site_desc(order[j - 1], slot) > 0;
+             j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = slot;
+        count++;
+    }
+    return count;
+}
+
+/* site_symbol() for a page's slot, through its entry in the site table. */
+static void page_site_symbol(const struct heatmap *heatmap,
+                             const struct heat_page_site *slot, char *symbol,
+                             size_t symbol_len, const char **path) {
+    const struct heat_site *site = site_table_find(&heatmap->sites, slot->pid,
+                                                   slot->ip);
+
+    if (site) {
+        site_symbol(heatmap, site, symbol, symbol_len, path);
+    } else {
+        *path = "";
+        snprintf(symbol, symbol_len, "?");
+    }
+}
+
+static double page_site_share(const struct heat_page *page,
+                              const struct heat_page_site *slot) {
+    return page->heat > 0.0 ? 100.0 * slot->heat / page->heat : 0.0;
+}
+
+/* "4K", "2M", "1G": the power-of-two size 1 << shift. */
+static void format_region_size(unsigned shift, char *buf, size_t len) {
+    static const char units[] = "KMGT";
+    unsigned unit = shift / 10 > 4 ? 4 : shift / 10;
+
+    if (unit == 0) {
+        snprintf(buf, len, "%llu", 1ULL << shift);
+    } else {
+        snprintf(buf, len, "%llu%c", 1ULL << (shift - unit * 10),
+                 units[unit - 1]);
+    }
+}
+
+static const struct heat_page_mem mem_unknown;
+
+/* A page's tier counts and latencies, all zero when it has none. */
+static const struct heat_page_mem *report_page_mem(
+    const struct heatmap *heatmap, const struct heat_page *page) {
+    const struct heat_page_mem *mem = heatmap_page_mem(heatmap, page);
+
+    return mem ? mem : &mem_unknown;
+}
+
+static void overall_summary_add(struct overall_summary *summary,
+                                const struct heat_page *page,
+                                const struct heat_page_mem *mem,
+                                enum page_state state,
+                                uint64_t page_bytes) {
+    size_t tier;
+
+    summary->total_heat += page->heat;
+    summary->total_samples += page->samples;
+    for (tier = 0; tier < MEM_TIERS; tier++) {
+        summary->tier_samples[tier] += mem->tier_samples[tier];
+        summary->tiered_samples += mem->tier_samples[tier];
+    }
+
+    if (state == PAGE_HOT) {
+        summary->hot_pages++;
+        summary->hot_bytes += page_bytes;
+        summary->hot_heat += page->heat;
+        summary->hot_samples += page->samples;
+    } else if (state == PAGE_COLD) {
+        summary->cold_pages++;
+        summary->cold_bytes += page_bytes;
+        summary->cold_heat += page->heat;
+        summary->cold_samples += page->samples;
+    } else {
+        summary->warm_pages++;
+        summary->warm_bytes += page_bytes;
+        summary->warm_heat += page->heat;
+        summary->warm_samples += page->samples;
+    }
+}
+
+static uint64_t page_sort_key(const struct heat_page *page,
+                              const struct heat_page_mem *mem,
+                              enum page_sort sort) {
+    switch (sort) {
+    case PAGE_SORT_SAMPLES:
+        return page->samples;
+    case PAGE_SORT_DRAM:
+        return (uint64_t)mem->tier_samples[MEM_TIER_DRAM] +
+               mem->tier_samples[MEM_TIER_REMOTE_DRAM];
+    case PAGE_SORT_REMOTE:
+        return (uint64_t)mem->tier_samples[MEM_TIER_REMOTE_DRAM] +
+               mem->tier_samples[MEM_TIER_REMOTE_CACHE];
+    case PAGE_SORT_HEAT:
+    default:
+        return 0;
+    }
+}
+
+static int compare_report_row_desc(const void *lhs, const void *rhs) {
+    const struct report_row *a = lhs;
+    const struct report_row *b = rhs;
+
+    if (a->key != b->key) {
+        return a->key < b->key ? 1 : -1;
+    }
+    return compare_heat_page_desc(&a->page, &b->page);
+}
+
+/* The page printed at detail rank i, and its class. */
+static const struct heat_page *report_row_page(const struct report_view *view,
+                                               size_t rank) {
+    return view->rows ? view->rows[rank].page : view->ordered[rank];
+}
+
+static enum page_state report_row_state(const struct report_view *view,
+                                        const struct profiler_options *options,
+                                        size_t rank) {
+    return view->rows ? view->rows[rank].state :
+           classify_page_state(view, options, rank);
+}
+
+/* "l1/l2/llc/dram/remote_dram/remote_cache/other" sample counts. */
+static void format_page_tiers(const struct heat_page_mem *mem, char *buf,
+                              size_t len) {
+    snprintf(buf, len, "%u/%u/%u/%u/%u/%u/%u",
+             mem->tier_samples[MEM_TIER_L1], mem->tier_samples[MEM_TIER_L2],
+             mem->tier_samples[MEM_TIER_LLC],
+             mem->tier_samples[MEM_TIER_DRAM],
+             mem->tier_samples[MEM_TIER_REMOTE_DRAM],
+             mem->tier_samples[MEM_TIER_REMOTE_CACHE],
+             mem->tier_samples[MEM_TIER_OTHER]);
+}
+
+/*
+ * One pass over every page: classify it and fold it into the overall summary
+ * and its --group-by group. If the group table cannot be allocated the report
+ * still goes out, just without the group section.
+ */
+static void report_view_summarise(struct report_view *view,
+                                  const struct heatmap *heatmap,
+                                  const struct profiler_options *options) {
+    size_t page_shift = heatmap->page_shift;
+    uint64_t page_bytes = 1ULL << page_shift;
+    size_t i;
+
+    memset(&view->overall, 0, sizeof(view->overall));
+    view->overall.total_pages = view->count;
+    view->overall.total_bytes = view->count * page_bytes;
+    view->has_groups = group_table_init(&view->groups, options->group_by) == 0;
+    if (options->track_regions) {
+        region_views_init(view, heatmap);
+    }
+    /*
+     * Ranking by anything but heat cannot reuse `ordered`, whose positions
+     * carry the percentile classes, so the rows get their own array.
+     */
+    if (options->sort_by != PAGE_SORT_HEAT &&
+        options->report_mode != REPORT_SUMMARY) {
+        view->rows = calloc(view->count ? view->count : 1,
+                            sizeof(*view->rows));
+    }
+    if (options->track_vmas && heatmap->vmas) {
+        vma_view_init(view, heatmap);
+    }
+    if (options->track_numa && heatmap->numa) {
+        numa_view_init(view, options);
+    }
+
+    for (i = 0; i < view->count; i++) {
+        const struct heat_page *page = view->ordered[i];
+        const struct heat_page_mem *mem = report_page_mem(heatmap, page);
+        enum page_state state = classify_page_state(view, options, i);
+
+        overall_summary_add(&view->overall, page, mem, state, page_bytes);
+        if (view->rows) {
+            view->rows[i].page = page;
+            view->rows[i].key = page_sort_key(page, mem, options->sort_by);
+            view->rows[i].state = state;
+        }
+        if (view->has_groups &&
+            group_table_add(&view->groups, heatmap, page, state) != 0) {
+            group_table_destroy(&view->groups);
+            view->has_groups = false;
+        }
+        if (view->has_regions) {
+            region_views_add(view, page, state, page_shift);
+        }
+        if (view->has_vmas) {
+            vma_view_add(view, page, state, page_bytes);
+        }
+        if (view->has_numa) {
+            numa_view_add(view, heatmap, page, state, page_bytes);
+        }
+    }
+
+    if (view->has_groups) {
+        group_table_sort(&view->groups);
+    }
+    if (view->has_regions) {
+        region_views_sort(view, options);
+    }
+    if (view->has_vmas) {
+        vma_view_sort(view, options);
+    }
+    if (view->has_numa) {
+        numa_view_sort(view, options);
+    }
+    if (options->track_sites) {
+        site_view_build(view, heatmap, options);
+    }
+    /* Only the --top rows are printed: select them, then sort just those. */
+    if (view->rows) {
+        if (view->limit < view->count) {
+            select_nth(view->rows, sizeof(*view->rows), 0, view->count,
+                       view->limit, compare_report_row_desc);
+        }
+        qsort(view->rows, view->limit, sizeof(*view->rows),
+              compare_report_row_desc);
+    }
+}
+
+static int report_view_build(struct report_view *view,
+                             const struct heatmap *heatmap,
+                             const struct profiler_options *options) {
+    size_t i;
+    size_t count = 0;
+
+    memset(view, 0, sizeof(*view));
+    view->ordered = calloc(heatmap->count ? heatmap->count : 1,
+                           sizeof(*view->ordered));
+    if (!view->ordered) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < heatmap->capacity; i++) {
+        if (heatmap_slot_used(heatmap, i)) {
+            view->ordered[count++] = &heatmap->pages[i];
+        }
+    }
+
+    view->count = count;
+    view->limit = options->top_n < count ? options->top_n : count;
+    if (options->heat_policy == HEAT_POLICY_PERCENTILE) {
+        percentile_cutoffs(options, count, &view->hot_cutoff,
+                           &view->cold_start);
+    }
+
+    report_view_order(view, options);
+    report_view_summarise(view, heatmap, options);
+    return 0;
+}
+
+static void report_view_destroy(struct report_view *view) {
+    if (view->has_groups) {
+        group_table_destroy(&view->groups);
+    }
+    region_views_destroy(view);
+    vma_view_destroy(view);
+    numa_view_destroy(view);
+    free(view->sites.ordered);
+    free(view->rows);
+    free(view->ordered);
+}
+
+static void report_text_summary(const struct overall_summary *summary,
+                                const struct profiler_options *options,
+                                FILE *out) {
+    double metric_total = summary_metric_total(summary, options->summary_metric);
+    double hot_metric = summary_metric_value(summary, options->summary_metric, PAGE_HOT);
+    double warm_metric = summary_metric_value(summary, options->summary_metric, PAGE_WARM);
+    double cold_metric = summary_metric_value(summary, options->summary_metric, PAGE_COLD);
+
+    fprintf(out,
+            "summary policy=%s metric=%s total_pages=%" PRIu64
+            " total_bytes=%" PRIu64 " total_heat=%.2f total_samples=%" PRIu64 "\n",
+            heat_policy_name(options->heat_policy),
+            summary_metric_name(options->summary_metric), summary->total_pages,
+            summary->total_bytes, summary->total_heat, summary->total_samples);
+    if (options->heat_policy == HEAT_POLICY_ABSOLUTE) {
+        fprintf(out,
+                "summary thresholds hot>=%.2f cold<%.2f\n",
+                options->hot_threshold, options->cold_threshold);
+    } else {
+        fprintf(out,
+                "summary percentiles hot_top=%.2f%% cold_bottom=%.2f%%\n",
+                options->hot_percent, options->cold_percent);
+    }
+    fprintf(out,
+            "%-8s %-12s %-18s %-16s %-12s\n",
+            "class", "pages", "bytes", "metric_value", "ratio");
+    fprintf(out, "%-8s %-12" PRIu64 " %-18" PRIu64 " %-16.2f %8.2f%%\n",
+            "hot", summary->hot_pages, summary->hot_bytes, hot_metric,
+            metric_total ? (100.0 * hot_metric / metric_total) : 0.0);
+    fprintf(out, "%-8s %-12" PRIu64 " %-18" PRIu64 " %-16.2f %8.2f%%\n",
+            "warm", summary->warm_pages, summary->warm_bytes, warm_metric,
+            metric_total ? (100.0 * warm_metric / metric_total) : 0.0);
+    fprintf(out, "%-8s %-12" PRIu64 " %-18" PRIu64 " %-16.2f %8.2f%%\n",
+            "cold", summary->cold_pages, summary->cold_bytes, cold_metric,
+            metric_total ? (100.0 * cold_metric / metric_total) : 0.0);
+    if (summary->tiered_samples) {
+        size_t tier;
+
+        fprintf(out, "summary tiers");
+        for (tier = 0; tier < MEM_TIERS; tier++) {
+            fprintf(out, " %s=%" PRIu64, mem_tier_name(tier),
+                    summary->tier_samples[tier]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+static void report_csv_summary(const struct overall_summary *summary,
+                               const struct profiler_options *options,
+                               FILE *out) {
+    double metric_total = summary_metric_total(summary, options->summary_metric);
+    double hot_metric = summary_metric_value(summary, options->summary_metric, PAGE_HOT);
+    double warm_metric = summary_metric_value(summary, options->summary_metric, PAGE_WARM);
+    double cold_metric = summary_metric_value(summary, options->summary_metric, PAGE_COLD);
+
+    fprintf(out,
+            "summary_policy=%s,summary_metric=%s,total_pages=%" PRIu64
+            ",total_bytes=%" PRIu64 ",total_heat=%.2f,total_samples=%" PRIu64,
+            heat_policy_name(options->heat_policy),
+            summary_metric_name(options->summary_metric), summary->total_pages,
+            summary->total_bytes, summary->total_heat, summary->total_samples);
+    if (options->heat_policy == HEAT_POLICY_ABSOLUTE) {
+        fprintf(out, ",hot_threshold=%.2f,cold_threshold=%.2f\n",
+                options->hot_threshold, options->cold_threshold);
+    } else {
+        fprintf(out, ",hot_percent=%.2f,cold_percent=%.2f\n",
+                options->hot_percent, options->cold_percent);
+    }
+    fprintf(out, "summary_class,pages,bytes,metric_value,ratio\n");
+    fprintf(out, "hot,%" PRIu64 ",%" PRIu64 ",%.2f,%.2f\n",
+            summary->hot_pages, summary->hot_bytes, hot_metric,
+            metric_total ? (100.0 * hot_metric / metric_total) : 0.0);
+    fprintf(out, "warm,%" PRIu64 ",%" PRIu64 ",%.2f,%.2f\n",
+            summary->warm_pages, summary->warm_bytes, warm_metric,
+            metric_total ? (100.0 * warm_metric / metric_total) : 0.0);
+    fprintf(out, "cold,%" PRIu64 ",%" PRIu64 ",%.2f,%.2f\n",
+            summary->cold_pages, summary->cold_bytes, cold_metric,
+            metric_total ? (100.0 * cold_metric / metric_total) : 0.0);
+    if (summary->tiered_samples) {
+        size_t tier;
+
+        for (tier = 0; tier < MEM_TIERS; tier++) {
+            fprintf(out, "%stier_%s=%" PRIu64, tier ? "," : "",
+                    mem_tier_name(tier), summary->tier_samples[tier]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+static void report_text_regions(const struct report_view *view, FILE *out) {
+    char size[32];
+    char child_size[32];
+    size_t level;
+    size_t i;
+
+    for (level = 0; level < REGION_LEVELS; level++) {
+        const struct region_view *regions = &view->regions[level];
+        const struct region_table *table = regions->table;
+
+        if (!table->shift) {
+            continue;
+        }
+        format_region_size(table->shift, size, sizeof(size));
+        format_region_size(table->child_shift, child_size, sizeof(child_size));
+        fprintf(out,
+                "\nregions size=%s children=%u child_size=%s tracked=%zu dropped_samples=%zu\n",
+                size, region_children(table), child_size, table->count,
+                table->dropped_samples);
+        fprintf(out,
+                "%-6s %-10s %-18s %-12s %-12s %-10s %-10s %-10s %-10s %-10s %-10s\n",
+                "rank", "kind", "region_base", "heat", "samples", "touched",
+                "hot_pages", "warm_pages", "cold_pages", "p50_lat", "p99_lat");
+        for (i = 0; i < regions->limit; i++) {
+            const struct heat_region *region = regions->ordered[i];
+            const struct region_class_counts *counts =
+                region_view_counts(regions, i);
+
+            fprintf(out,
+                    "%-6zu %-10s 0x%016" PRIx64 " %-12.2f %-12" PRIu64 " %-10u %-10" PRIu64 " %-10" PRIu64 " %-10" PRIu64 " %-10.0f %-10.0f\n",
+                    i + 1,
+                    region->kind == ADDR_KIND_PHYSICAL ? "physical" : "virtual",
+                    region->region << table->shift, region->heat,
+                    region->samples, region->touched, counts->hot_pages,
+                    counts->warm_pages, counts->cold_pages,
+                    latency_hist_percentile(&region->latency, 0.50),
+                    latency_hist_percentile(&region->latency, 0.99));
+        }
+    }
+}
+
+static void report_csv_regions(const struct report_view *view, FILE *out) {
+    char size[32];
+    char child_size[32];
+    size_t level;
+    size_t i;
+
+    for (level = 0; level < REGION_LEVELS; level++) {
+        const struct region_view *regions = &view->regions[level];
+        const struct region_table *table = regions->table;
+
+        if (!table->shift) {
+            continue;
+        }
+        format_region_size(table->shift, size, sizeof(size));
+        format_region_size(table->child_shift, child_size, sizeof(child_size));
+        fprintf(out,
+                "\nregions_size=%s,children=%u,child_size=%s,tracked=%zu,dropped_samples=%zu\n",
+                size, region_children(table), child_size, table->count,
+                table->dropped_samples);
+        fprintf(out,
+                "region_rank,kind,region_base,heat,samples,touched,hot_pages,warm_pages,cold_pages,latency_p50,latency_p99\n");
+        for (i = 0; i < regions->limit; i++) {
+            const struct heat_region *region = regions->ordered[i];
+            const struct region_class_counts *counts =
+                region_view_counts(regions, i);
+
+            fprintf(out,
+                    "%zu,%s,0x%016" PRIx64 ",%.2f,%" PRIu64 ",%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.0f,%.0f\n",
+                    i + 1,
+                    region->kind == ADDR_KIND_PHYSICAL ? "physical" : "virtual",
+                    region->region << table->shift, region->heat,
+                    region->samples, region->touched, counts->hot_pages,
+                    counts->warm_pages, counts->cold_pages,
+                    latency_hist_percentile(&region->latency, 0.50),
+                    latency_hist_percentile(&region->latency, 0.99));
+        }
+    }
+}
+
+static void report_json_regions(const struct report_view *view, FILE *out) {
+    char size[32];
+    char child_size[32];
+    const char *separator = "";
+    size_t level;
+    size_t i;
+
+    fprintf(out, ",\n  \"regions\": [");
+    for (level = 0; level < REGION_LEVELS; level++) {
+        const struct region_view *regions = &view->regions[level];
+        const struct region_table *table = regions->table;
+
+        if (!table->shift) {
+            continue;
+        }
+        format_region_size(table->shift, size, sizeof(size));
+        format_region_size(table->child_shift, child_size, sizeof(child_size));
+        fprintf(out,
+                "%s\n    {\"size\": \"%s\", \"children\": %u, \"child_size\": \"%s\", \"tracked\": %zu, \"dropped_samples\": %zu, \"results\": [\n",
+                separator, size, region_children(table), child_size,
+                table->count, table->dropped_samples);
+        for (i = 0; i < regions->limit; i++) {
+            const struct heat_region *region = regions->ordered[i];
+            const struct region_class_counts *counts =
+                region_view_counts(regions, i);
+
+            fprintf(out,
+                    "      {\"rank\": %zu, \"kind\": \"%s\", \"region_base\": \"0x%016" PRIx64 "\", \"heat\": %.2f, \"samples\": %" PRIu64 ", \"touched\": %u, \"hot_pages\": %" PRIu64 ", \"warm_pages\": %" PRIu64 ", \"cold_pages\": %" PRIu64 ", \"latency\": {\"p50\": %.0f, \"p99\": %.0f}}%s\n",
+                    i + 1,
+                    region->kind == ADDR_KIND_PHYSICAL ? "physical" : "virtual",
+                    region->region << table->shift, region->heat,
+                    region->samples, region->touched, counts->hot_pages,
+                    counts->warm_pages, counts->cold_pages,
+                    latency_hist_percentile(&region->latency, 0.50),
+                    latency_hist_percentile(&region->latency, 0.99),
+                    i + 1 == regions->limit ? "" : ",");
+        }
+        fprintf(out, "    ]}");
+        separator = ",";
+    }
+    fprintf(out, "\n  ]");
+}
+
+static void report_text_vmas(const struct report_view *view, FILE *out) {
+    const struct vma_view *vmas = &view->vmas;
+    size_t i;
+
+    fprintf(out,
+            "\nmappings tracked=%zu unattributed_pages=%" PRIu64 " unattributed_heat=%.2f\n",
+            vmas->mapping_count, vmas->unattributed_pages,
+            vmas->unattributed_heat);
+    fprintf(out,
+            "%-6s %-8s %-33s %-5s %-8s %-12s %-12s %-10s %-12s %-12s %-12s %s\n",
+            "rank", "pid", "range", "perms", "kind", "heat", "samples",
+            "pages", "hot_bytes", "warm_bytes", "cold_bytes", "path");
+    for (i = 0; i < vmas->mapping_limit; i++) {
+        const struct vma_summary *summary = vmas->ordered_mappings[i];
+        const struct vma_record *record = summary->record;
+
+        fprintf(out,
+                "%-6zu %-8d %016" PRIx64 "-%016" PRIx64 " %-5s %-8s %-12.2f %-12" PRIu64 " %-10" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %s\n",
+                i + 1, (int)record->pid, record->start, record->end,
+                record->perms, vma_kind_name(record->kind), summary->heat,
+                summary->samples, summary->pages, summary->hot_bytes,
+                summary->warm_bytes, summary->cold_bytes,
+                record->path[0] ? record->path : "-");
+    }
+
+    fprintf(out, "\nfiles tracked=%zu\n", vmas->file_count);
+    fprintf(out, "%-6s %-8s %-12s %-12s %-10s %-12s %-12s %-12s %s\n",
+            "rank", "kind", "heat", "samples", "pages", "hot_bytes",
+            "warm_bytes", "cold_bytes", "path");
+    for (i = 0; i < vmas->file_limit; i++) {
+        const struct vma_summary *summary = vmas->ordered_files[i];
+
+        fprintf(out,
+                "%-6zu %-8s %-12.2f %-12" PRIu64 " %-10" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %s\n",
+                i + 1, vma_kind_name(summary->record->kind), summary->heat,
+                summary->samples, summary->pages, summary->hot_bytes,
+                summary->warm_bytes, summary->cold_bytes,
+                summary->record->path);
+    }
+}
+
+/* A CSV field, quoted when the path holds a comma, quote or newline. */
+static void report_csv_string(const char *text, FILE *out) {
+    if (!strpbrk(text, ",\"\n")) {
+        fputs(text, out);
+        return;
+    }
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"') {
+            fputc('"', out);
+        }
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+static void report_csv_vmas(const struct report_view *view, FILE *out) {
+    const struct vma_view *vmas = &view->vmas;
+    size_t i;
+
+    fprintf(out,
+            "\nmappings_tracked=%zu,unattributed_pages=%" PRIu64 ",unattributed_heat=%.2f\n",
+            vmas->mapping_count, vmas->unattributed_pages,
+            vmas->unattributed_heat);
+    fprintf(out,
+            "mapping_rank,pid,start,end,perms,kind,heat,samples,pages,hot_bytes,warm_bytes,cold_bytes,path\n");
+    for (i = 0; i < vmas->mapping_limit; i++) {
+        const struct vma_summary *summary = vmas->ordered_mappings[i];
+        const struct vma_record *record = summary->record;
+
+        fprintf(out,
+                "%zu,%d,0x%016" PRIx64 ",0x%016" PRIx64 ",%s,%s,%.2f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",",
+                i + 1, (int)record->pid, record->start, record->end,
+                record->perms, vma_kind_name(record->kind), summary->heat,
+                summary->samples, summary->pages, summary->hot_bytes,
+                summary->warm_bytes, summary->cold_bytes);
+        report_csv_string(record->path, out);
+        fputc('\n', out);
+    }
+
+    fprintf(out,
+            "\nfiles_tracked=%zu\nfile_rank,kind,heat,samples,pages,hot_bytes,warm_bytes,cold_bytes,path\n",
+            vmas->file_count);
+    for (i = 0; i < vmas->file_limit; i++) {
+        const struct vma_summary *summary = vmas->ordered_files[i];
+
+        fprintf(out,
+                "%zu,%s,%.2f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",",
+                i + 1, vma_kind_name(summary->record->kind), summary->heat,
+                summary->samples, summary->pages, summary->hot_bytes,
+                summary->warm_bytes, summary->cold_bytes);
+        report_csv_string(summary->record->path, out);
+        fputc('\n', out);
+    }
+}
+
+static void report_json_string(const char *text, FILE *out) {
+    fputc('"', out);
+    for (; *text; text++) {
+        unsigned char c = (unsigned char)*text;
+
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void report_json_vmas(const struct report_view *view, FILE *out) {
+    const struct vma_view *vmas = &view->vmas;
+    size_t i;
+
+    fprintf(out,
+            ",\n  \"mappings\": {\"tracked\": %zu, \"unattributed_pages\": %" PRIu64 ", \"unattributed_heat\": %.2f, \"results\": [\n",
+            vmas->mapping_count, vmas->unattributed_pages,
+            vmas->unattributed_heat);
+    for (i = 0; i < vmas->mapping_limit; i++) {
+        const struct vma_summary *summary = vmas->ordered_mappings[i];
+        const struct vma_record *record = summary->record;
+
+        fprintf(out,
+                "    {\"rank\": %zu, \"pid\": %d, \"start\": \"0x%016" PRIx64 "\", \"end\": \"0x%016" PRIx64 "\", \"perms\": \"%s\", \"kind\": \"%s\", \"heat\": %.2f, \"samples\": %" PRIu64 ", \"pages\": %" PRIu64 ", \"hot_bytes\": %" PRIu64 ", \"warm_bytes\": %" PRIu64 ", \"cold_bytes\": %" PRIu64 ", \"path\": ",
+                i + 1, (int)record->pid, record->start, record->end,
+                record->perms, vma_kind_name(record->kind), summary->heat,
+                summary->samples, summary->pages, summary->hot_bytes,
+                summary->warm_bytes, summary->cold_bytes);
+        report_json_string(record->path, out);
+        fprintf(out, "}%s\n", i + 1 == vmas->mapping_limit ? "" : ",");
+    }
+
+    fprintf(out,
+            "  ]},\n  \"files\": {\"tracked\": %zu, \"results\": [\n",
+            vmas->file_count);
+    for (i = 0; i < vmas->file_limit; i++) {
+        const struct vma_summary *summary = vmas->ordered_files[i];
+
+        fprintf(out,
+                "    {\"rank\": %zu, \"kind\": \"%s\", \"heat\": %.2f, \"samples\": %" PRIu64 ", \"pages\": %" PRIu64 ", \"hot_bytes\": %" PRIu64 ", \"warm_bytes\": %" PRIu64 ", \"cold_bytes\": %" PRIu64 ", \"path\": ",
+                i + 1, vma_kind_name(summary->record->kind), summary->heat,
+                summary->samples, summary->pages, summary->hot_bytes,
+                summary->warm_bytes, summary->cold_bytes);
+        report_json_string(summary->record->path, out);
+        fprintf(out, "}%s\n", i + 1 == vmas->file_limit ? "" : ",");
+    }
+    fprintf(out, "  ]}");
+}
+
+static void report_text_sites(const struct heatmap *heatmap,
+                              const struct report_view *view, FILE *out) {
+    const struct site_view *sites = &view->sites;
+    char symbol[256];
+    const char *path;
+    size_t i;
+
+    fprintf(out, "\nsites tracked=%zu dropped_samples=%zu total_heat=%.2f\n",
+            heatmap->sites.count, heatmap->sites.dropped_samples,
+            sites->total_heat);
+    fprintf(out, "%-6s %-8s %-18s %-12s %-12s %-8s %-40s %s\n",
+            "rank", "pid", "ip", "heat", "samples", "share", "symbol",
+            "binary");
+    for (i = 0; i < sites->limit; i++) {
+        const struct heat_site *site = sites->ordered[i];
+
+        site_symbol(heatmap, site, symbol, sizeof(symbol), &path);
+        fprintf(out,
+                "%-6zu %-8u 0x%016" PRIx64 " %-12.2f %-12" PRIu64 " %7.2f%% %-40s %s\n",
+                i + 1, site->pid, site->ip, site->heat, site->samples,
+                sites->total_heat ? 100.0 * site->heat / sites->total_heat :
+                0.0, symbol, path[0] ? path : "-");
+    }
+}
+
+/* --sites: the sites behind each printed page row, by the row's rank. */
+static void report_text_page_sites(const struct heatmap *heatmap,
+                                   const struct report_view *view, FILE *out) {
+    const struct heat_page_site *order[PAGE_SITE_SLOTS];
+    char symbol[256];
+    const char *path;
+    size_t i;
+    size_t j;
+
+    fprintf(out, "\n%-6s %-18s %-8s %-18s %-12s %-12s %-8s %-40s %s\n",
+            "rank", "page_base", "pid", "ip", "heat", "samples", "share",
+            "symbol", "binary");
+    for (i = 0; i < view->limit; i++) {
+        const struct heat_page *page = report_row_page(view, i);
+        size_t count = page_sites_order(heatmap, page, order);
+
+        for (j = 0; j < count; j++) {
+            page_site_symbol(heatmap, order[j], symbol, sizeof(symbol), &path);
+            fprintf(out,
+                    "%-6zu 0x%016" PRIx64 " %-8u 0x%016" PRIx64 " %-12.2f %-12u %7.2f%% %-40s %s\n",
+                    i + 1, page->page << heatmap->page_shift, order[j]->pid,
+                    order[j]->ip, order[j]->heat, order[j]->samples,
+                    page_site_share(page, order[j]), symbol,
+                    path[0] ? path : "-");
+        }
+    }
+}
+
+static double numa_remote_ratio(double local_heat, double remote_heat) {
+    double total = local_heat + remote_heat;
+
+    return total > 0.0 ? 100.0 * remote_heat / total : 0.0;
+}
+
+static void report_text_numa(const struct heatmap *heatmap,
+                             const struct report_view *view, FILE *out) {
+    const struct numa_view *numa = &view->numa;
+    char node[8];
+    char access_node[8];
+    size_t i;
+
+    fprintf(out,
+            "\nnuma local_heat=%.2f remote_heat=%.2f remote_ratio=%.2f%% unresolved_pages=%" PRIu64 "\n",
+            numa->local_heat, numa->remote_heat,
+            numa_remote_ratio(numa->local_heat, numa->remote_heat),
+            numa->unresolved_pages);
+    fprintf(out, "%-6s %-12s %-12s %-12s %-12s\n",
+            "rank", "pid", "local_heat", "remote_heat", "remote_ratio");
+    for (i = 0; i < numa->process_limit; i++) {
+        const struct group_summary *process = &numa->processes.groups[i];
+
+        fprintf(out, "%-6zu %-12" PRIu64 " %-12.2f %-12.2f %10.2f%%\n",
+                i + 1, process->key, process->local_heat,
+                process->remote_heat,
+                numa_remote_ratio(process->local_heat, process->remote_heat));
+    }
+
+    fprintf(out,
+            "\nnuma migrate candidates=%zu bytes=%" PRIu64 " remote_heat=%.2f remote_bytes=%" PRIu64 "\n",
+            numa->nr_candidates, numa->candidate_bytes,
+            numa->candidate_remote_heat, numa->remote_bytes);
+    fprintf(out, "%-6s %-18s %-6s %-8s %-12s %-12s %-12s %-14s %s\n",
+            "rank", "page_base", "node", "to_node", "heat", "local_heat",
+            "remote_heat", "remote_samples", "remote_bytes");
+    for (i = 0; i < numa->candidate_limit; i++) {
+        const struct heat_page *page = numa->candidates[i].page;
+        const struct heat_page_numa *page_numa = numa->candidates[i].numa;
+
+        format_numa_node(page_numa->node, node, sizeof(node));
+        format_numa_node(page_numa->access_node, access_node,
+                         sizeof(access_node));
+        fprintf(out,
+                "%-6zu 0x%016" PRIx64 " %-6s %-8s %-12.2f %-12.2f %-12.2f %-14u %" PRIu64 "\n",
+                i + 1, page->page << heatmap->page_shift, node, access_node,
+                page->heat, page_numa->local_heat, page_numa->remote_heat,
+                page_numa->remote_samples,
+                (uint64_t)page_numa->remote_samples * numa->sample_period *
+                NUMA_LINE_BYTES);
+    }
+}
+
+static void heatmap_report_text(const struct heatmap *heatmap,
+                                const struct profiler_options *options,
+                                const struct profiler_backend *backend,
+                                uint64_t lost_samples,
+                                const struct report_view *view,
+                                const struct report_snapshot *snapshot,
+                                FILE *out) {
+    const struct group_summary *groups = view->has_groups ?
+                                         view->groups.groups : NULL;
+    size_t group_count = view->has_groups ? view->groups.count : 0;
+    size_t group_limit = options->process_top_n < group_count ?
+                         options->process_top_n : group_count;
+    const char *group_name = group_dimension_name(options->group_by);
+    char key[32];
+    size_t i;
+
+    if (snapshot) {
+        fprintf(out, "snapshot seq=%" PRIu64 " elapsed_s=%.3f kind=%s\n",
+                snapshot->seq, snapshot->elapsed_sec,
+                snapshot->delta ? "delta" : "full");
+    }
+    fprintf(out,
+            "backend=%s pages=%zu dropped_pages=%zu evicted_pages=%zu evict_policy=%s dropped_samples=%zu lost_samples=%" PRIu64 " report_mode=%s summary_metric=%s heat_policy=%s addr_mode=%s output=%s cooling=%s interval_ms=%.2f\n",
+            backend->name, heatmap->count, heatmap->dropped_pages,
+            heatmap->evicted_pages, eviction_policy_name(options->evict_policy),
+            heatmap->dropped_samples, lost_samples,
+            report_mode_name(options->report_mode),
+            summary_metric_name(options->summary_metric),
+            heat_policy_name(options->heat_policy),
+            stats_address_mode_name(options->stats_address_mode),
+            output_format_name(options->output_format),
+            cooling_mode_name(options->cooling_mode),
+            options->cooling_interval_ns / 1000000.0);
+    if (options->stats_address_mode == STATS_ADDR_PHYSICAL ||
+        options->stats_address_mode == STATS_ADDR_AUTO) {
+        fprintf(out,
+                "phys_translate_attempts=%zu phys_translate_failures=%zu\n",
+                heatmap->phys_translate_attempts,
+                heatmap->phys_translate_failures);
+    }
+    report_text_summary(&view->overall, options, out);
+    if (view->has_regions) {
+        report_text_regions(view, out);
+    }
+    if (view->has_vmas) {
+        report_text_vmas(view, out);
+    }
+    if (view->has_sites) {
+        report_text_sites(heatmap, view, out);
+    }
+    if (view->has_numa) {
+        report_text_numa(heatmap, view, out);
+    }
+
+    if (options->report_mode == REPORT_SUMMARY) {
+        return;
+    }
+
+    fprintf(out, "\n");
+    fprintf(out,
+            "%-6s %-18s %-18s %-10s %-12s %-12s %-10s %-10s %-12s %-12s %-14s %-18s ",
+            "rank", "kind", "page_base", "state", "heat",
+            "avg_weight", "p50_lat", "p99_lat", "owner_pid", "owner_tid", "owner_samples",
+            "last_ip");
+    if (view->has_numa) {
+        fprintf(out, "%-6s %-12s %-12s ", "node", "local_heat", "remote_heat");
+    }
+    fprintf(out, "tiers(l1/l2/llc/dram/rdram/rcache/other)\n");
+
+    for (i = 0; i < view->limit; i++) {
+        const struct heat_page *page = report_row_page(view, i);
+        uint64_t base = page->page << heatmap->page_shift;
+        double avg_weight = page->samples ?
+                            page->total_weight / (double)page->samples : 0.0;
+        const struct heat_page_mem *mem = report_page_mem(heatmap, page);
+        char tiers[96];
+
+        format_page_tiers(mem, tiers, sizeof(tiers));
+        fprintf(out,
+                "%-6zu %-18s 0x%016" PRIx64 " %-10s %-12.2f %-12.2f %-10.0f %-10.0f %-12u %-12u %-14" PRIu64
+                " 0x%016" PRIx64 " ",
+                i + 1,
+                page->kind == ADDR_KIND_PHYSICAL ? "physical" : "virtual",
+                base, page_state_label(report_row_state(view, options, i)), page->heat, avg_weight,
+                latency_hist_percentile(&mem->latency, 0.50),
+                latency_hist_percentile(&mem->latency, 0.99),
+                page->owner_pid, page->owner_tid, page->owner_samples,
+                page->last_ip);
+        if (view->has_numa) {
+            const struct heat_page_numa *page_numa =
+                report_page_numa(heatmap, page);
+            char node[8];
+
+            format_numa_node(page_numa->node, node, sizeof(node));
+            fprintf(out, "%-6s %-12.2f %-12.2f ", node, page_numa->local_heat,
+                    page_numa->remote_heat);
+        }
+        fprintf(out, "%s\n", tiers);
+    }
+    if (view->has_sites) {
+        report_text_page_sites(heatmap, view, out);
+    }
+
+    if (groups) {
+        fprintf(out,
+                "\n%-6s %-12s %-12s %-12s %-12s %-12s %-12s %-12s\n",
+                "rank", group_name, "heat", "pages", "samples",
+                "hot_pages", "warm_pages", "cold_pages");
+        for (i = 0; i < group_limit; i++) {
+            group_key_format(options->group_by, groups[i].key, key,
+                             sizeof(key));
+            fprintf(out,
+                    "%-6zu %-12s %-12.2f %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 " %-12" PRIu64 "\n",
+                    i + 1, key, groups[i].heat,
+                    groups[i].pages, groups[i].samples,
+                    groups[i].hot_pages, groups[i].warm_pages,
+                    groups[i].cold_pages);
+        }
+    }
+}
+
+static void report_csv_sites(const struct heatmap *heatmap,
+                             const struct report_view *view, FILE *out) {
+    const struct site_view *sites = &view->sites;
+    char symbol[256];
+    const char *path;
+    size_t i;
+
+    fprintf(out,
+            "\nsites_tracked=%zu,dropped_samples=%zu,total_heat=%.2f\nsite_rank,pid,ip,heat,samples,share,symbol,binary\n",
+            heatmap->sites.count, heatmap->sites.dropped_samples,
+            sites->total_heat);
+    for (i = 0; i < sites->limit; i++) {
+        const struct heat_site *site = sites->ordered[i];
+
+        site_symbol(heatmap, site, symbol, sizeof(symbol), &path);
+        fprintf(out, "%zu,%u,0x%016" PRIx64 ",%.2f,%" PRIu64 ",%.2f,",
+                i + 1, site->pid, site->ip, site->heat, site->samples,
+                sites->total_heat ? 100.0 * site->heat / sites->total_heat :
+                0.0);
+        report_csv_string(symbol, out);
+        fputc(',', out);
+        report_csv_string(path, out);
+        fputc('\n', out);
+    }
+}
+
+static void report_csv_page_sites(const struct heatmap *heatmap,
+                                  const struct report_view *view, FILE *out) {
+    const struct heat_page_site *order[PAGE_SITE_SLOTS];
+    char symbol[256];
+    const char *path;
+    size_t i;
+    size_t j;
+
+    fprintf(out,
+            "\npage_rank,page_base,pid,ip,heat,samples,share,symbol,binary\n");
+    for (i = 0; i < view->limit; i++) {
+        const struct heat_page *page = report_row_page(view, i);
+        size_t count = page_sites_order(heatmap, page, order);
+
+        for (j = 0; j < count; j++) {
+            page_site_symbol(heatmap, order[j], symbol, sizeof(symbol), &path);
+            fprintf(out, "%zu,0x%016" PRIx64 ",%u,0x%016" PRIx64 ",%.2f,%u,%.2f,",
+                    i + 1, page->page << heatmap->page_shift, order[j]->pid,
+                    order[j]->ip, order[j]->heat, order[j]->samples,
+                    page_site_share(page, order[j]));
+            report_csv_string(symbol, out);
+            fputc(',', out);
+            report_csv_string(path, out);
+            fputc('\n', out);
+        }
+    }
+}
+
+/* The "sites" array of a JSON page row. */
+static void report_json_page_sites(const struct heatmap *heatmap,
+                                   const struct heat_page *page, FILE *out) {
+    const struct heat_page_site *order[PAGE_SITE_SLOTS];
+    size_t count = page_sites_order(heatmap, page, order);
+    char symbol[256];
+    const char *path;
+    size_t j;
+
+    fprintf(out, ", \"sites\": [");
+    for (j = 0; j < count; j++) {
+        page_site_symbol(heatmap, order[j], symbol, sizeof(symbol), &path);
+        fprintf(out,
+                "%s{\"pid\": %u, \"ip\": \"0x%016" PRIx64 "\", \"heat\": %.2f, \"samples\": %u, \"share\": %.2f, \"symbol\": ",
+                j ? ", " : "", order[j]->pid, order[j]->ip, order[j]->heat,
+                order[j]->samples, page_site_share(page, order[j]));
+        report_json_string(symbol, out);
+        fprintf(out, ", \"binary\": ");
+        report_json_string(path, out);
+        fputc('}', out);
+    }
+    fputc(']', out);
+}
+
+static void report_json_sites(const struct heatmap *heatmap,
+                              const struct report_view *view, FILE *out) {
+    const struct site_view *sites = &view->sites;
+    char symbol[256];
+    const char *path;
+    size_t i;
+
+    fprintf(out,
+            ",\n  \"sites\": {\"tracked\": %zu, \"dropped_samples\": %zu, \"total_heat\": %.2f, \"results\": [\n",
+            heatmap->sites.count, heatmap->sites.dropped_samples,
+            sites->total_heat);
+    for (i = 0; i < sites->limit; i++) {
+        const struct heat_site *site = sites->ordered[i];
+
+        site_symbol(heatmap, site, symbol, sizeof(symbol), &path);
+        fprintf(out,
+                "    {\"rank\": %zu, \"pid\": %u, \"ip\": \"0x%016" PRIx64 "\", \"heat\": %.2f, \"samples\": %" PRIu64 ", \"share\": %.2f, \"symbol\": ",
+                i + 1, site->pid, site->ip, site->heat, site->samples,
+                sites->total_heat ? 100.0 * site->heat / sites->total_heat :
+                0.0);
+        report_json_string(symbol, out);
+        fprintf(out, ", \"binary\": ");
+        report_json_string(path, out);
+        fprintf(out, "}%s\n", i + 1 == sites->limit ? "" : ",");
+    }
+    fprintf(out, "  ]}");
+}
+
+static void report_csv_numa(const struct heatmap *heatmap,
+                            const struct report_view *view, FILE *out) {
+    const struct numa_view *numa = &view->numa;
+    char node[8];
+    char access_node[8];
+    size_t i;
+
+    fprintf(out,
+            "\nnuma_local_heat=%.2f,remote_heat=%.2f,remote_ratio=%.2f,unresolved_pages=%" PRIu64 "\n",
+            numa->local_heat, numa->remote_heat,
+            numa_remote_ratio(numa->local_heat, numa->remote_heat),
+            numa->unresolved_pages);
+    fprintf(out, "numa_process_rank,pid,local_heat,remote_heat,remote_ratio\n");
+    for (i = 0; i < numa->process_limit; i++) {
+        const struct group_summary *process = &numa->processes.groups[i];
+
+        fprintf(out, "%zu,%" PRIu64 ",%.2f,%.2f,%.2f\n",
+                i + 1, process->key, process->local_heat,
+                process->remote_heat,
+                numa_remote_ratio(process->local_heat, process->remote_heat));
+    }
+
+    fprintf(out,
+            "\nmigrate_candidates=%zu,bytes=%" PRIu64 ",remote_heat=%.2f,remote_bytes=%" PRIu64 "\n",
+            numa->nr_candidates, numa->candidate_bytes,
+            numa->candidate_remote_heat, numa->remote_bytes);
+    fprintf(out,
+            "migrate_rank,page_base,node,to_node,heat,local_heat,remote_heat,remote_samples,remote_bytes\n");
+    for (i = 0; i < numa->candidate_limit; i++) {
+        const struct heat_page *page = numa->candidates[i].page;
+        const struct heat_page_numa *page_numa = numa->candidates[i].numa;
+
+        format_numa_node(page_numa->node, node, sizeof(node));
+        format_numa_node(page_numa->access_node, access_node,
+                         sizeof(access_node));
+        fprintf(out,
+                "%zu,0x%016" PRIx64 ",%s,%s,%.2f,%.2f,%.2f,%u,%" PRIu64 "\n",
+                i + 1, page->page << heatmap->page_shift, node, access_node,
+                page->heat, page_numa->local_heat, page_numa->remote_heat,
+                page_numa->remote_samples,
+                (uint64_t)page_numa->remote_samples * numa->sample_period *
+                NUMA_LINE_BYTES);
+    }
+}
+
+static void report_json_numa(const struct heatmap *heatmap,
+                             const struct report_view *view, FILE *out) {
+    const struct numa_view *numa = &view->numa;
+    size_t i;
+
+    fprintf(out,
+            ",\n  \"numa\": {\"local_heat\": %.2f, \"remote_heat\": %.2f, \"remote_ratio\": %.2f, \"unresolved_pages\": %" PRIu64 ", \"processes\": [\n",
+            numa->local_heat, numa->remote_heat,
+            numa_remote_ratio(numa->local_heat, numa->remote_heat),
+            numa->unresolved_pages);
+    for (i = 0; i < numa->process_limit; i++) {
+        const struct group_summary *process = &numa->processes.groups[i];
+
+        fprintf(out,
+                "    {\"rank\": %zu, \"pid\": %" PRIu64 ", \"local_heat\": %.2f, \"remote_heat\": %.2f, \"remote_ratio\": %.2f}%s\n",
+                i + 1, process->key, process->local_heat,
+                process->remote_heat,
+                numa_remote_ratio(process->local_heat, process->remote_heat),
+                i + 1 == numa->process_limit ? "" : ",");
+    }
+    fprintf(out,
+            "  ], \"migrate\": {\"candidates\": %zu, \"bytes\": %" PRIu64 ", \"remote_heat\": %.2f, \"remote_bytes\": %" PRIu64 ", \"results\": [\n",
+            numa->nr_candidates, numa->candidate_bytes,
+            numa->candidate_remote_heat, numa->remote_bytes);
+    for (i = 0; i < numa->candidate_limit; i++) {
+        const struct heat_page *page = numa->candidates[i].page;
+        const struct heat_page_numa *page_numa = numa->candidates[i].numa;
+
+        fprintf(out,
+                "    {\"rank\": %zu, \"page_base\": \"0x%016" PRIx64 "\", \"node\": %d, \"to_node\": %d, \"heat\": %.2f, \"local_heat\": %.2f, \"remote_heat\": %.2f, \"remote_samples\": %u, \"remote_bytes\": %" PRIu64 "}%s\n",
+                i + 1, page->page << heatmap->page_shift, page_numa->node - 1,
+                page_numa->access_node - 1, page->heat, page_numa->local_heat,
+                page_numa->remote_heat, page_numa->remote_samples,
+                (uint64_t)page_numa->remote_samples * numa->sample_period *
+                NUMA_LINE_BYTES,
+                i + 1 == numa->candidate_limit ? "" : ",");
+    }
+    fprintf(out, "  ]}}");
+}
+
+static void heatmap_report_csv(const struct heatmap *heatmap,
+                               const struct profiler_options *options,
+                               const struct profiler_backend *backend,
+                               uint64_t lost_samples,
+                               const struct report_view *view,
+                               const struct report_snapshot *snapshot,
+                               FILE *out) {
+    const struct group_summary *groups = view->has_groups ?
+                                         view->groups.groups : NULL;
+    size_t group_count = view->has_groups ? view->groups.count : 0;
+    size_t group_limit = options->process_top_n < group_count ?
+                         options->process_top_n : group_count;
+    const char *group_name = group_dimension_name(options->group_by);
+    char key[32];
+    size_t i;
+
+    if (snapshot) {
+        fprintf(out, "snapshot=%" PRIu64 ",elapsed_s=%.3f,kind=%s\n",
+                snapshot->seq, snapshot->elapsed_sec,
+                snapshot->delta ? "delta" : "full");
+    }
+    fprintf(out,
+            "backend=%s,pages=%zu,dropped_pages=%zu,evicted_pages=%zu,evict_policy=%s,dropped_samples=%zu,lost_samples=%" PRIu64 ",report_mode=%s,summary_metric=%s,heat_policy=%s,addr_mode=%s,output=%s,cooling=%s,interval_ms=%.2f\n",
+            backend->name, heatmap->count, heatmap->dropped_pages,
+            heatmap->evicted_pages, eviction_policy_name(options->evict_policy),
+            heatmap->dropped_samples, lost_samples,
+            report_mode_name(options->report_mode),
+            summary_metric_name(options->summary_metric),
+            heat_policy_name(options->heat_policy),
+            stats_address_mode_name(options->stats_address_mode),
+            output_format_name(options->output_format),
+            cooling_mode_name(options->cooling_mode),
+            options->cooling_interval_ns / 1000000.0);
+    if (options->stats_address_mode == STATS_ADDR_PHYSICAL ||
+        options->stats_address_mode == STATS_ADDR_AUTO) {
+        fprintf(out, "phys_translate_attempts=%zu,phys_translate_failures=%zu\n",
+                heatmap->phys_translate_attempts,
+                heatmap->phys_translate_failures);
+    }
+    report_csv_summary(&view->overall, options, out);
+    if (view->has_regions) {
+        report_csv_regions(view, out);
+    }
+    if (view->has_vmas) {
+        report_csv_vmas(view, out);
+    }
+    if (view->has_sites) {
+        report_csv_sites(heatmap, view, out);
+    }
+    if (view->has_numa) {
+        report_csv_numa(heatmap, view, out);
+    }
+
+    if (options->report_mode == REPORT_SUMMARY) {
+        return;
+    }
+
+    fprintf(out, "\n");
+    fprintf(out,
+            "rank,kind,page_base,state,heat,avg_weight,owner_pid,owner_tid,owner_samples,samples,last_ip,l1,l2,llc,dram,remote_dram,remote_cache,other,latency_p50,latency_p99%s\n",
+            view->has_numa ? ",node,local_heat,remote_heat" : "");
+    for (i = 0; i < view->limit; i++) {
+        const struct heat_page *page = report_row_page(view, i);
+        const struct heat_page_mem *mem = report_page_mem(heatmap, page);
+        uint64_t base = page->page << heatmap->page_shift;
+        double avg_weight = page->samples ?
+                            page->total_weight / (double)page->samples : 0.0;
+
+        fprintf(out,
+                "%zu,%s,0x%016" PRIx64 ",%s,%.2f,%.2f,%u,%u,%" PRIu64 ",%" PRIu64 ",0x%016" PRIx64 ",%u,%u,%u,%u,%u,%u,%u,%.0f,%.0f",
+                i + 1,
+                page->kind == ADDR_KIND_PHYSICAL ? "physical" : "virtual",
+                base, page_state_label(report_row_state(view, options, i)), page->heat, avg_weight,
+                page->owner_pid, page->owner_tid, page->owner_samples,
+                page->samples, page->last_ip,
+                mem->tier_samples[MEM_TIER_L1],
+                mem->tier_samples[MEM_TIER_L2],
+                mem->tier_samples[MEM_TIER_LLC],
+                mem->tier_samples[MEM_TIER_DRAM],
+                mem->tier_samples[MEM_TIER_REMOTE_DRAM],
+                mem->tier_samples[MEM_TIER_REMOTE_CACHE],
+                mem->tier_samples[MEM_TIER_OTHER],
+                latency_hist_percentile(&mem->latency, 0.50),
+                latency_hist_percentile(&mem->latency, 0.99));
+        if (view->has_numa) {
+            const struct heat_page_numa *page_numa =
+                report_page_numa(heatmap, page);
+            char node[8];
+
+            format_numa_node(page_numa->node, node, sizeof(node));
+            fprintf(out, ",%s,%.2f,%.2f", node, page_numa->local_heat,
+                    page_numa->remote_heat);
+        }
+        fprintf(out, "\n");
+    }
+    if (view->has_sites) {
+        report_csv_page_sites(heatmap, view, out);
+    }
+
+    if (groups) {
+        fprintf(out,
+                "\n%s_rank,%s,heat,pages,samples,hot_pages,warm_pages,cold_pages\n",
+                options->group_by == GROUP_BY_PID ? "process" : group_name,
+                group_name);
+        for (i = 0; i < group_limit; i++) {
+            group_key_format(options->group_by, groups[i].key, key,
+                             sizeof(key));
+            fprintf(out,
+                    "%zu,%s,%.2f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                    i + 1, key, groups[i].heat,
+                    groups[i].pages, groups[i].samples,
+                    groups[i].hot_pages, groups[i].warm_pages,
+                    groups[i].cold_pages);
+        }
+    }
+}
+
+static void heatmap_report_json(const struct heatmap *heatmap,
+                                const struct profiler_options *options,
+                                const struct profiler_backend *backend,
+                                uint64_t lost_samples,
+                                const struct report_view *view,
+                                const struct report_snapshot *snapshot,
+                                FILE *out) {
+    const struct group_summary *groups = view->has_groups ?
+                                         view->groups.groups : NULL;
+    size_t group_count = view->has_groups ? view->groups.count : 0;
+    size_t group_limit = options->process_top_n < group_count ?
+                         options->process_top_n : group_count;
+    const char *group_name = group_dimension_name(options->group_by);
+    char key[32];
+    size_t i;
+
+    fprintf(out, "{\n");
+    if (snapshot) {
+        fprintf(out,
+                "  \"snapshot\": %" PRIu64 ",\n  \"elapsed_s\": %.3f,\n  \"snapshot_kind\": \"%s\",\n",
+                snapshot->seq, snapshot->elapsed_sec,
+                snapshot->delta ? "delta" : "full");
+    }
+    fprintf(out,
+            "  \"backend\": \"%s\",\n  \"pages\": %zu,\n  \"dropped_pages\": %zu,\n  \"evicted_pages\": %zu,\n  \"evict_policy\": \"%s\",\n  \"dropped_samples\": %zu,\n  \"lost_samples\": %" PRIu64 ",\n  \"report_mode\": \"%s\",\n  \"summary_metric\": \"%s\",\n  \"heat_policy\": \"%s\",\n  \"addr_mode\": \"%s\",\n  \"output\": \"%s\",\n  \"cooling\": \"%s\",\n  \"interval_ms\": %.2f,\n  \"phys_translate_attempts\": %zu,\n  \"phys_translate_failures\": %zu,\n  \"summary\": {\n    \"total_pages\": %" PRIu64 ",\n    \"total_bytes\": %" PRIu64 ",\n    \"total_heat\": %.2f,\n    \"total_samples\": %" PRIu64 ",\n    \"hot_pages\": %" PRIu64 ",\n    \"hot_bytes\": %" PRIu64 ",\n    \"hot_heat\": %.2f,\n    \"hot_samples\": %" PRIu64 ",\n    \"warm_pages\": %" PRIu64 ",\n    \"warm_bytes\": %" PRIu64 ",\n    \"warm_heat\": %.2f,\n    \"warm_samples\": %" PRIu64 ",\n    \"cold_pages\": %" PRIu64 ",\n    \"cold_bytes\": %" PRIu64 ",\n    \"cold_heat\": %.2f,\n    \"cold_samples\": %" PRIu64 ",\n    \"hot_ratio\": %.2f,\n    \"warm_ratio\": %.2f,\n    \"cold_ratio\": %.2f",
+            backend->name, heatmap->count, heatmap->dropped_pages,
+            heatmap->evicted_pages, eviction_policy_name(options->evict_policy),
+            heatmap->dropped_samples, lost_samples,
+            report_mode_name(options->report_mode),
+            summary_metric_name(options->summary_metric),
+            heat_policy_name(options->heat_policy),
+            stats_address_mode_name(options->stats_address_mode),
+            output_format_name(options->output_format),
+            cooling_mode_name(options->cooling_mode),
+            options->cooling_interval_ns / 1000000.0,
+            heatmap->phys_translate_attempts,
+            heatmap->phys_translate_failures,
+            view->overall.total_pages, view->overall.total_bytes,
+            view->overall.total_heat, view->overall.total_samples,
+            view->overall.hot_pages, view->overall.hot_bytes,
+            view->overall.hot_heat, view->overall.hot_samples,
+            view->overall.warm_pages, view->overall.warm_bytes,
+            view->overall.warm_heat, view->overall.warm_samples,
+            view->overall.cold_pages, view->overall.cold_bytes,
+            view->overall.cold_heat, view->overall.cold_samples,
+            summary_metric_total(&view->overall, options->summary_metric) ?
+            (100.0 * summary_metric_value(&view->overall, options->summary_metric, PAGE_HOT) /
+             summary_metric_total(&view->overall, options->summary_metric)) : 0.0,
+            summary_metric_total(&view->overall, options->summary_metric) ?
+            (100.0 * summary_metric_value(&view->overall, options->summary_metric, PAGE_WARM) /
+             summary_metric_total(&view->overall, options->summary_metric)) : 0.0,
+            summary_metric_total(&view->overall, options->summary_metric) ?
+            (100.0 * summary_metric_value(&view->overall, options->summary_metric, PAGE_COLD) /
+             summary_metric_total(&view->overall, options->summary_metric)) : 0.0);
+    if (options->heat_policy == HEAT_POLICY_ABSOLUTE) {
+        fprintf(out,
+                ",\n    \"hot_threshold\": %.2f,\n    \"cold_threshold\": %.2f\n  }",
+                options->hot_threshold, options->cold_threshold);
+    } else {
+        fprintf(out,
+                ",\n    \"hot_percent\": %.2f,\n    \"cold_percent\": %.2f\n  }",
+                options->hot_percent, options->cold_percent);
+    }
+    if (view->overall.tiered_samples) {
+        size_t tier;
+
+        fprintf(out, ",\n  \"tiers\": {");
+        for (tier = 0; tier < MEM_TIERS; tier++) {
+            fprintf(out, "%s\"%s\": %" PRIu64, tier ? ", " : "",
+                    mem_tier_name(tier), view->overall.tier_samples[tier]);
+        }
+        fprintf(out, "}");
+    }
+    if (view->has_regions) {
+        report_json_regions(view, out);
+    }
+    if (view->has_vmas) {
+        report_json_vmas(view, out);
+    }
+    if (view->has_sites) {
+        report_json_sites(heatmap, view, out);
+    }
+    if (view->has_numa) {
+        report_json_numa(heatmap, view, out);
+    }
+
+    if (options->report_mode == REPORT_SUMMARY) {
+        fprintf(out, "\n}\n");
+        return;
+    }
+
+    fprintf(out, ",\n  \"results\": [\n");
+
+    for (i = 0; i < view->limit; i++) {
+        const struct heat_page *page = report_row_page(view, i);
+        const struct heat_page_mem *mem = report_page_mem(heatmap, page);
+        uint64_t base = page->page << heatmap->page_shift;
+        double avg_weight = page->samples ?
+                            page->total_weight / (double)page->samples : 0.0;
+
+        fprintf(out,
+                "    {\"rank\": %zu, \"kind\": \"%s\", \"page_base\": \"0x%016" PRIx64 "\", \"state\": \"%s\", \"heat\": %.2f, \"avg_weight\": %.2f, \"owner_pid\": %u, \"owner_tid\": %u, \"owner_samples\": %" PRIu64 ", \"samples\": %" PRIu64 ", \"last_ip\": \"0x%016" PRIx64 "\", \"tiers\": {\"l1\": %u, \"l2\": %u, \"llc\": %u, \"dram\": %u, \"remote_dram\": %u, \"remote_cache\": %u, \"other\": %u}, \"latency\": {\"p50\": %.0f, \"p99\": %.0f}",
+                i + 1,
+                page->kind == ADDR_KIND_PHYSICAL ? "physical" : "virtual",
+                base, page_state_label(report_row_state(view, options, i)), page->heat, avg_weight,
+                page->owner_pid, page->owner_tid, page->owner_samples,
+                page->samples, page->last_ip,
+                mem->tier_samples[MEM_TIER_L1],
+                mem->tier_samples[MEM_TIER_L2],
+                mem->tier_samples[MEM_TIER_LLC],
+                mem->tier_samples[MEM_TIER_DRAM],
+                mem->tier_samples[MEM_TIER_REMOTE_DRAM],
+                mem->tier_samples[MEM_TIER_REMOTE_CACHE],
+                mem->tier_samples[MEM_TIER_OTHER],
+                latency_hist_percentile(&mem->latency, 0.50),
+                latency_hist_percentile(&mem->latency, 0.99));
+        if (view->has_numa) {
+            const struct heat_page_numa *page_numa =
+                report_page_numa(heatmap, page);
+
+            fprintf(out,
+                    ", \"numa\": {\"node\": %d, \"local_heat\": %.2f, \"remote_heat\": %.2f}",
+                    page_numa->node - 1, page_numa->local_heat,
+                    page_numa->remote_heat);
+        }
+        if (view->has_sites) {
+            report_json_page_sites(heatmap, page, out);
+        }
+        fprintf(out, "}%s\n", i + 1 == view->limit ? "" : ",");
+    }
+
+    fprintf(out, "  ],\n  \"%s_results\": [\n",
+            options->group_by == GROUP_BY_PID ? "process" : group_name);
+    for (i = 0; i < group_limit; i++) {
+        group_key_format(options->group_by, groups[i].key, key, sizeof(key));
+        fprintf(out,
+                "    {\"rank\": %zu, \"%s\": %s%s%s, \"heat\": %.2f, \"pages\": %" PRIu64 ", \"samples\": %" PRIu64 ", \"hot_pages\": %" PRIu64 ", \"warm_pages\": %" PRIu64 ", \"cold_pages\": %" PRIu64 "}%s\n",
+                i + 1, group_name,
+                options->group_by == GROUP_BY_KIND ? "\"" : "", key,
+                options->group_by == GROUP_BY_KIND ? "\"" : "",
+                groups[i].heat,
+                groups[i].pages, groups[i].samples,
+                groups[i].hot_pages, groups[i].warm_pages,
+                groups[i].cold_pages,
+                i + 1 == group_limit ? "" : ",");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
+
+/*
+ * Report one --interval snapshot. The heatmap is a private copy (or a delta
+ * built from two copies), so it can be settled and sorted freely while
+ * sampling continues.
+ */
+void heatmap_report_snapshot(struct heatmap *heatmap,
+                             const struct profiler_options *options,
+                             const struct profiler_backend *backend,
+                             uint64_t lost_samples,
+                             const struct report_snapshot *snapshot,
+                             FILE *out) {
+    struct report_view view;
+
+    heatmap_finish_resize(heatmap);
+    heatmap_settle_cooling(heatmap, options);
+    if (report_view_build(&view, heatmap, options) != 0) {
+        fprintf(out, "failed to allocate report buffer\n");
+        return;
+    }
+
+    switch (options->output_format) {
+    case OUTPUT_JSON:
+        heatmap_report_json(heatmap, options, backend, lost_samples, &view,
+                            snapshot, out);
+        break;
+    case OUTPUT_CSV:
+        heatmap_report_csv(heatmap, options, backend, lost_samples, &view,
+                           snapshot, out);
+        break;
+    case OUTPUT_TEXT:
+    default:
+        heatmap_report_text(heatmap, options, backend, lost_samples, &view,
+                            snapshot, out);
+        break;
+    }
+
+    report_view_destroy(&view);
+}
+
+void heatmap_report(struct heatmap *heatmap,
+                    const struct profiler_options *options,
+                    const struct profiler_backend *backend,
+                    uint64_t lost_samples,
+                    FILE *out) {
+    heatmap_report_snapshot(heatmap, options, backend, lost_samples, NULL, out);
+}
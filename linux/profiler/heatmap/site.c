@@ -0,0 +1,113 @@
+#include "profiler.h"
+
+
+#define SITE_INITIAL_CAPACITY 256
+
+static uint64_t site_hash(uint32_t pid, uint64_t ip) {
+    return hash_u64(ip ^ ((uint64_t)pid << 40) ^ ((uint64_t)pid >> 24));
+}
+
+static uint64_t site_hash_at(const void *entries, size_t i) {
+    const struct heat_site *sites = entries;
+
+    return site_hash(sites[i].pid, sites[i].ip);
+}
+
+void site_table_destroy(struct site_table *table) {
+    free(table->sites);
+    hash_index_destroy(&table->index);
+    memset(table, 0, sizeof(*table));
+}
+
+static int site_table_grow(struct site_table *table) {
+    size_t capacity = table->capacity ? table->capacity * 2 :
+                      SITE_INITIAL_CAPACITY;
+    struct heat_site *sites = realloc(table->sites, capacity * sizeof(*sites));
+
+    if (!sites) {
+        return -ENOMEM;
+    }
+    table->sites = sites;
+    if (hash_index_resize(&table->index, capacity * 2, table->count,
+                          site_hash_at, table->sites) != 0) {
+        return -ENOMEM;
+    }
+    table->capacity = capacity;
+    return 0;
+}
+
+struct heat_site *site_table_find(const struct site_table *table,
+                                  uint32_t pid, uint64_t ip) {
+    size_t slot;
+
+    if (!table->index.slots) {
+        return NULL;
+    }
+
+    slot = hash_index_slot(&table->index, site_hash(pid, ip));
+    while (table->index.slots[slot] != HASH_INDEX_EMPTY) {
+        struct heat_site *entry = &table->sites[table->index.slots[slot]];
+
+        if (entry->ip == ip && entry->pid == pid) {
+            return entry;
+        }
+        slot = hash_index_next(&table->index, slot);
+    }
+    return NULL;
+}
+
+/*
+ * Find or insert a site. A new site is zeroed; the caller sets its cooling
+ * epoch and mapping. NULL once max_sites are tracked or memory runs out.
+ */
+struct heat_site *site_table_get(struct site_table *table, uint32_t pid,
+                                 uint64_t ip, size_t max_sites) {
+    struct heat_site *entry = site_table_find(table, pid, ip);
+
+    if (entry) {
+        return entry;
+    }
+    if (table->count >= max_sites) {
+        return NULL;
+    }
+    if (table->count == table->capacity && site_table_grow(table) != 0) {
+        return NULL;
+    }
+
+    entry = &table->sites[table->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->ip = ip;
+    entry->pid = pid;
+
+    hash_index_insert(&table->index, site_hash(pid, ip),
+                      (uint32_t)table->count++);
+    return entry;
+}
+
+/* Make dst an independent copy of src, reusing dst's arrays when they fit. */
+int site_table_copy(struct site_table *dst, const struct site_table *src) {
+    if (dst->capacity != src->capacity) {
+        free(dst->sites);
+        dst->sites = NULL;
+        dst->capacity = 0;
+        if (src->capacity) {
+            dst->sites = malloc(src->capacity * sizeof(*dst->sites));
+            if (!dst->sites) {
+                site_table_destroy(dst);
+                return -ENOMEM;
+            }
+        }
+    }
+    if (hash_index_copy(&dst->index, &src->index) != 0) {
+        site_table_destroy(dst);
+        return -ENOMEM;
+    }
+
+    if (src->capacity) {
+        memcpy(dst->sites, src->sites, src->count * sizeof(*dst->sites));
+    }
+    dst->count = src->count;
+    dst->capacity = src->capacity;
+    dst->dropped_samples = src->dropped_samples;
+    return 0;
+}
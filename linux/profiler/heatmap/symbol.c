@@ -0,0 +1,267 @@
+#include "profiler.h"
+
+#include <elf.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+struct elf_symbol {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t name;
+};
+
+struct elf_segment {
+    uint64_t vaddr;
+    uint64_t offset;
+    uint64_t filesz;
+};
+
+/*
+ * Only what a lookup needs is kept: the function symbols sorted by address,
+ * their names in one pool, and the PT_LOAD segments that turn a file offset
+ * into a link-time address. The file itself is unmapped after loading.
+ */
+struct elf_symbols {
+    struct elf_symbol *symbols;
+    size_t count;
+    char *names;
+    struct elf_segment *segments;
+    size_t nr_segments;
+};
+
+static int compare_elf_symbol(const void *lhs, const void *rhs) {
+    const struct elf_symbol *a = lhs;
+    const struct elf_symbol *b = rhs;
+
+    if (a->addr != b->addr) {
+        return a->addr < b->addr ? -1 : 1;
+    }
+    /* Prefer the sized symbol when aliases share an address. */
+    if (a->size != b->size) {
+        return a->size > b->size ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool elf_range_ok(size_t len, uint64_t offset, uint64_t size) {
+    return offset <= len && size <= len - offset;
+}
+
+static int elf_load_segments(struct elf_symbols *symbols,
+                             const uint8_t *image, size_t len) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+    size_t i;
+
+    if (ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+        !elf_range_ok(len, ehdr->e_phoff,
+                      (uint64_t)ehdr->e_phnum * sizeof(Elf64_Phdr))) {
+        return -EINVAL;
+    }
+    symbols->segments = calloc(ehdr->e_phnum ? ehdr->e_phnum : 1,
+                               sizeof(*symbols->segments));
+    if (!symbols->segments) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        const Elf64_Phdr *phdr = (const Elf64_Phdr *)(image + ehdr->e_phoff) + i;
+
+        if (phdr->p_type != PT_LOAD) {
+            continue;
+        }
+        symbols->segments[symbols->nr_segments].vaddr = phdr->p_vaddr;
+        symbols->segments[symbols->nr_segments].offset = phdr->p_offset;
+        symbols->segments[symbols->nr_segments].filesz = phdr->p_filesz;
+        symbols->nr_segments++;
+    }
+    return 0;
+}
+
+/* Copy the defined function symbols of one SHT_SYMTAB or SHT_DYNSYM. */
+static int elf_load_table(struct elf_symbols *symbols, const uint8_t *image,
+                          size_t len, const Elf64_Shdr *table,
+                          const Elf64_Shdr *strings) {
+    size_t nr_syms = table->sh_size / sizeof(Elf64_Sym);
+    const Elf64_Sym *syms;
+    size_t i;
+
+    if (!elf_range_ok(len, table->sh_offset, table->sh_size) ||
+        !elf_range_ok(len, strings->sh_offset, strings->sh_size) ||
+        strings->sh_size == 0) {
+        return -EINVAL;
+    }
+    syms = (const Elf64_Sym *)(image + table->sh_offset);
+
+    symbols->symbols = calloc(nr_syms ? nr_syms : 1,
+                              sizeof(*symbols->symbols));
+    symbols->names = malloc(strings->sh_size);
+    if (!symbols->symbols || !symbols->names) {
+        return -ENOMEM;
+    }
+    memcpy(symbols->names, image + strings->sh_offset, strings->sh_size);
+    symbols->names[strings->sh_size - 1] = '\0';
+
+    for (i = 0; i < nr_syms; i++) {
+        const Elf64_Sym *sym = &syms[i];
+        unsigned type = ELF64_ST_TYPE(sym->st_info);
+
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+            sym->st_shndx == SHN_UNDEF || sym->st_value == 0 ||
+            sym->st_name == 0 || sym->st_name >= strings->sh_size) {
+            continue;
+        }
+        symbols->symbols[symbols->count].addr = sym->st_value;
+        symbols->symbols[symbols->count].size = sym->st_size;
+        symbols->symbols[symbols->count].name = sym->st_name;
+        symbols->count++;
+    }
+    qsort(symbols->symbols, symbols->count, sizeof(*symbols->symbols),
+          compare_elf_symbol);
+    return 0;
+}
+
+static int elf_load_image(struct elf_symbols *symbols, const uint8_t *image,
+                          size_t len) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+    const Elf64_Shdr *sections;
+    const Elf64_Shdr *table = NULL;
+    size_t i;
+    int ret;
+
+    if (len < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) {
+        return -ENOEXEC;
+    }
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+        return -ENOTSUP;
+    }
+    if (ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+        !elf_range_ok(len, ehdr->e_shoff,
+                      (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr))) {
+        return -EINVAL;
+    }
+
+    ret = elf_load_segments(symbols, image, len);
+    if (ret != 0) {
+        return ret;
+    }
+
+    /* The full symtab when the binary is not stripped, else the dynsym. */
+    sections = (const Elf64_Shdr *)(image + ehdr->e_shoff);
+    for (i = 0; i < ehdr->e_shnum; i++) {
+        if (sections[i].sh_type == SHT_SYMTAB) {
+            table = &sections[i];
+            break;
+        }
+        if (sections[i].sh_type == SHT_DYNSYM && !table) {
+            table = &sections[i];
+        }
+    }
+    if (!table || table->sh_link >= ehdr->e_shnum) {
+        return -ENOENT;
+    }
+    return elf_load_table(symbols, image, len, table,
+                          &sections[table->sh_link]);
+}
+
+void elf_symbols_destroy(struct elf_symbols *symbols) {
+    if (!symbols) {
+        return;
+    }
+    free(symbols->symbols);
+    free(symbols->names);
+    free(symbols->segments);
+    free(symbols);
+}
+
+int elf_symbols_load(const char *path, struct elf_symbols **symbols_out) {
+    struct elf_symbols *symbols;
+    struct stat st;
+    void *image;
+    int fd;
+    int ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) != 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return -ENOEXEC;
+    }
+    image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return -errno;
+    }
+
+    symbols = calloc(1, sizeof(*symbols));
+    if (!symbols) {
+        munmap(image, (size_t)st.st_size);
+        return -ENOMEM;
+    }
+    ret = elf_load_image(symbols, image, (size_t)st.st_size);
+    munmap(image, (size_t)st.st_size);
+    if (ret != 0) {
+        elf_symbols_destroy(symbols);
+        return ret;
+    }
+    *symbols_out = symbols;
+    return 0;
+}
+
+/*
+ * Resolve a file offset (as computed from a mapping in /proc/<pid>/maps) to
+ * the function containing it and the distance from its start.
+ */
+bool elf_symbols_lookup(const struct elf_symbols *symbols, uint64_t offset,
+                        const char **name_out, uint64_t *delta_out) {
+    const struct elf_symbol *symbol;
+    uint64_t addr = 0;
+    size_t lo = 0;
+    size_t hi = symbols->count;
+    size_t i;
+
+    for (i = 0; i < symbols->nr_segments; i++) {
+        const struct elf_segment *segment = &symbols->segments[i];
+
+        if (offset >= segment->offset &&
+            offset - segment->offset < segment->filesz) {
+            addr = offset - segment->offset + segment->vaddr;
+            break;
+        }
+    }
+    if (i == symbols->nr_segments) {
+        return false;
+    }
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (symbols->symbols[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return false;
+    }
+    symbol = &symbols->symbols[lo - 1];
+    /* Aliases sort sized-first; step back to the first of them. */
+    while (symbol > symbols->symbols && symbol[-1].addr == symbol->addr) {
+        symbol--;
+    }
+    if (symbol->size && addr - symbol->addr >= symbol->size) {
+        return false;
+    }
+    *name_out = symbols->names + symbol->name;
+    *delta_out = addr - symbol->addr;
+    return true;
+}
@@ -0,0 +1,209 @@
+#include "profiler.h"
+
+
+/*
+ * Synthetic sample streams, for exercising the heatmap and the reports
+ * without a PMU: the synth backend feeds them to a live session, and
+ * bench_ingest measures the ingestion and report paths with them.
+ *
+ * Every sample first draws a rank, 0 being the hottest page, from the
+ * distribution. The rank is then scattered over the working set by a
+ * multiplication with a stride coprime to its size, so that hot pages do
+ * not sit next to each other, and the resulting page index picks the
+ * process (index % pids) and the page within it. Each process owns its
+ * own virtual range and every page its own frame, so virtual and physical
+ * keys see the same number of distinct pages.
+ */
+#define SYNTH_VADDR_BASE 0x7f0000000000ULL
+#define SYNTH_PID_SHIFT 36
+#define SYNTH_PFN_BASE 0x100000ULL
+#define SYNTH_PID_BASE 100000U
+#define SYNTH_IP_BASE 0x401000ULL
+#define SYNTH_SITES 64
+#define SYNTH_CPUS 4
+
+static uint64_t synth_random(struct synth_generator *gen) {
+    uint64_t z = (gen->state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in (0, 1]. */
+static double synth_unit(struct synth_generator *gen) {
+    return (double)((synth_random(gen) >> 11) + 1) * 0x1p-53;
+}
+
+static uint64_t gcd_u64(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t t = a % b;
+
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+void synth_spec_init(struct synth_spec *spec) {
+    memset(spec, 0, sizeof(*spec));
+    spec->dist = SYNTH_ZIPF;
+    spec->pages = 65536;
+    spec->pids = 8;
+    spec->skew = 0.99;
+    spec->hot_fraction = 0.05;
+    spec->hot_share = 0.9;
+    spec->phase_samples = 1000000;
+    spec->period = 1;
+    spec->seed = 42;
+}
+
+int synth_generator_init(struct synth_generator *gen,
+                         const struct synth_spec *spec, size_t page_shift,
+                         char *reason, size_t reason_len) {
+    uint64_t pages = spec->pages;
+
+    if (pages == 0) {
+        snprintf(reason, reason_len,
+                 "a synthetic stream needs at least one page");
+        return -EINVAL;
+    }
+
+    memset(gen, 0, sizeof(*gen));
+    gen->spec = *spec;
+    if (spec->dist != SYNTH_MULTIPID || spec->pids == 0) {
+        gen->spec.pids = 1;
+    } else if (spec->pids > pages) {
+        gen->spec.pids = (unsigned)pages;
+    }
+    if (gen->spec.phase_samples == 0) {
+        gen->spec.phase_samples = 1;
+    }
+    gen->state = spec->seed;
+    gen->page_shift = page_shift;
+
+    gen->hot_pages = (uint64_t)((double)pages * spec->hot_fraction);
+    if (gen->hot_pages == 0) {
+        gen->hot_pages = 1;
+    }
+    if (gen->hot_pages > pages) {
+        gen->hot_pages = pages;
+    }
+
+    gen->stride = (0x9e3779b97f4a7c15ULL % pages) | 1;
+    while (pages > 1 && gcd_u64(gen->stride, pages) != 1) {
+        gen->stride += 2;
+    }
+
+    /*
+     * Zipf ranks come from inverting the CDF of the continuous power law
+     * x^-skew over [1, pages + 1): exact enough for a load generator, and
+     * O(1) per sample without a table of pages entries.
+     */
+    if (fabs(1.0 - spec->skew) < 1e-9) {
+        gen->zipf_span = log((double)pages + 1.0);
+    } else {
+        gen->zipf_span = pow((double)pages + 1.0, 1.0 - spec->skew) - 1.0;
+    }
+    return 0;
+}
+
+static uint64_t synth_zipf_rank(struct synth_generator *gen) {
+    double u = synth_unit(gen);
+    double x;
+
+    if (fabs(1.0 - gen->spec.skew) < 1e-9) {
+        x = exp(u * gen->zipf_span);
+    } else {
+        x = pow(u * gen->zipf_span + 1.0, 1.0 / (1.0 - gen->spec.skew));
+    }
+    return x >= (double)gen->spec.pages + 1.0 ? gen->spec.pages - 1 :
+           (uint64_t)x - 1;
+}
+
+static uint64_t synth_hotset_rank(struct synth_generator *gen) {
+    uint64_t cold_pages = gen->spec.pages - gen->hot_pages;
+
+    if (cold_pages == 0 || synth_unit(gen) <= gen->spec.hot_share) {
+        return synth_random(gen) % gen->hot_pages;
+    }
+    return gen->hot_pages + synth_random(gen) % cold_pages;
+}
+
+static uint64_t synth_rank(struct synth_generator *gen) {
+    switch (gen->spec.dist) {
+    case SYNTH_UNIFORM:
+        return synth_random(gen) % gen->spec.pages;
+    case SYNTH_HOTSET:
+    case SYNTH_PHASE:
+        return synth_hotset_rank(gen);
+    case SYNTH_ZIPF:
+    case SYNTH_MULTIPID:
+    default:
+        return synth_zipf_rank(gen);
+    }
+}
+
+/*
+ * Hot ranks hit L1, the next quarter of the working set the LLC and the
+ * rest DRAM, with load latencies to match, so the tier counters and the
+ * latency heat scores have something to work on.
+ */
+static void synth_fill_memory(struct synth_generator *gen, uint64_t rank,
+                              struct sample_record *sample) {
+    union perf_mem_data_src src = { .val = 0 };
+
+    src.mem_op = PERF_MEM_OP_LOAD;
+    if (rank < gen->hot_pages) {
+        src.mem_lvl = PERF_MEM_LVL_HIT | PERF_MEM_LVL_L1;
+        src.mem_lvl_num = PERF_MEM_LVLNUM_L1;
+        sample->weight = 4 + (rank & 3);
+    } else if (rank < gen->spec.pages / 4) {
+        src.mem_lvl = PERF_MEM_LVL_HIT | PERF_MEM_LVL_L3;
+        src.mem_lvl_num = PERF_MEM_LVLNUM_L3;
+        sample->weight = 40 + (rank & 15);
+    } else {
+        src.mem_lvl = PERF_MEM_LVL_HIT | PERF_MEM_LVL_LOC_RAM;
+        src.mem_lvl_num = PERF_MEM_LVLNUM_RAM;
+        sample->weight = 200 + (rank & 127);
+    }
+    sample->data_src = src.val;
+    sample->has_weight = true;
+    sample->has_data_src = true;
+}
+
+void synth_generator_next(struct synth_generator *gen, uint64_t time_ns,
+                          struct sample_record *sample) {
+    uint64_t pages = gen->spec.pages;
+    uint64_t rank = synth_rank(gen);
+    uint64_t shifted = rank;
+    uint64_t index;
+    uint64_t slot;
+    uint64_t offset;
+    uint32_t pid_index;
+
+    if (gen->spec.dist == SYNTH_PHASE) {
+        uint64_t phase = gen->emitted / gen->spec.phase_samples;
+
+        shifted = (rank + phase % pages * gen->hot_pages) % pages;
+    }
+    index = (uint64_t)((unsigned __int128)shifted * gen->stride % pages);
+    pid_index = (uint32_t)(index % gen->spec.pids);
+    slot = index / gen->spec.pids;
+    offset = synth_random(gen) & ((1ULL << gen->page_shift) - 1) & ~7ULL;
+
+    memset(sample, 0, sizeof(*sample));
+    sample->ip = SYNTH_IP_BASE + (rank % SYNTH_SITES) * 16;
+    sample->addr = SYNTH_VADDR_BASE + ((uint64_t)pid_index << SYNTH_PID_SHIFT) +
+                   (slot << gen->page_shift) + offset;
+    sample->phys_addr = ((SYNTH_PFN_BASE + index) << gen->page_shift) + offset;
+    sample->time_ns = time_ns;
+    sample->period = gen->spec.period;
+    sample->pid = SYNTH_PID_BASE + pid_index;
+    sample->tid = sample->pid;
+    sample->cpu = (uint32_t)(gen->emitted % SYNTH_CPUS);
+    sample->has_addr = true;
+    sample->has_phys_addr = true;
+    synth_fill_memory(gen, rank, sample);
+    gen->emitted++;
+}
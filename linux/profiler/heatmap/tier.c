@@ -0,0 +1,559 @@
+#include "profiler.h"
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+
+/* Pages per move_pages() call, and ranges per process_madvise() call. */
+#define TIER_BATCH 256
+#define TIER_IOV_MAX 512
+
+/*
+ * A page of the target that was cold in the last round: for how many rounds
+ * in a row, and whether it was already advised. A page that warms up drops
+ * out of the table, so it is advised again if it cools down once more.
+ */
+struct tier_cold_entry {
+    uint64_t page;
+    uint32_t rounds;
+    bool advised;
+};
+
+struct tier_cold_table {
+    struct tier_cold_entry *entries;
+    size_t count;
+    struct hash_index index;
+};
+
+struct tier_stats {
+    uint64_t hot_pages;
+    uint64_t cold_pages;
+    uint64_t on_node;
+    uint64_t moved;
+    uint64_t move_failed;
+    uint64_t advised;
+    uint64_t advise_failed;
+    uint64_t deferred;
+};
+
+struct tier_engine {
+    pid_t pid;
+    int pidfd;
+    struct tier_cold_table cold;
+    const struct heat_page **ranked;
+    size_t ranked_capacity;
+    uint64_t *selected;
+    size_t selected_capacity;
+    void *addrs[TIER_BATCH];
+    int nodes[TIER_BATCH];
+    int status[TIER_BATCH];
+    struct iovec iov[TIER_IOV_MAX];
+    size_t page_shift;
+    uint64_t rounds;
+    struct tier_stats total;
+    bool warned_move;
+    bool warned_advise;
+};
+
+int tier_engine_create(struct tier_engine **engine_out,
+                       const struct profiler_options *options,
+                       char *reason, size_t reason_len) {
+    struct tier_engine *engine;
+    char path[PATH_BUFFER_SIZE];
+    int err;
+
+    if (options->tier_node >= 0) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+                 options->tier_node);
+        if (access(path, F_OK) != 0) {
+            snprintf(reason, reason_len, "NUMA node %d does not exist",
+                     options->tier_node);
+            return -ENODEV;
+        }
+    }
+
+    engine = calloc(1, sizeof(*engine));
+    if (!engine) {
+        snprintf(reason, reason_len, "failed to allocate tiering engine");
+        return -ENOMEM;
+    }
+    engine->pid = options->pid;
+    engine->pidfd = -1;
+    engine->page_shift = (size_t)__builtin_ctzl(
+        (unsigned long)sysconf(_SC_PAGESIZE));
+
+    /* Advising another process goes through process_madvise() on a pidfd. */
+    if (options->tier_cold != TIER_COLD_OFF && !options->tier_dry_run) {
+        engine->pidfd = (int)syscall(__NR_pidfd_open, options->pid, 0);
+        if (engine->pidfd < 0) {
+            err = -errno;
+            snprintf(reason, reason_len, "pidfd_open(%d) failed: %s",
+                     options->pid, strerror(errno));
+            free(engine);
+            return err;
+        }
+    }
+
+    *engine_out = engine;
+    return 0;
+}
+
+static struct tier_cold_entry *
+tier_cold_find(const struct tier_cold_table *table, uint64_t page) {
+    size_t slot;
+
+    if (!table->index.slots) {
+        return NULL;
+    }
+    slot = hash_index_slot(&table->index, hash_u64(page));
+    while (table->index.slots[slot] != HASH_INDEX_EMPTY) {
+        struct tier_cold_entry *entry =
+            &table->entries[table->index.slots[slot]];
+
+        if (entry->page == page) {
+            return entry;
+        }
+        slot = hash_index_next(&table->index, slot);
+    }
+    return NULL;
+}
+
+/* An empty table with room for `count` entries. */
+static int tier_cold_init(struct tier_cold_table *table, size_t count) {
+    size_t size = 64;
+
+    while (size < count * 2) {
+        size *= 2;
+    }
+    memset(table, 0, sizeof(*table));
+    table->entries = malloc(size / 2 * sizeof(*table->entries));
+    if (!table->entries ||
+        hash_index_resize(&table->index, size, 0, NULL, NULL) != 0) {
+        free(table->entries);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static struct tier_cold_entry *tier_cold_add(struct tier_cold_table *table,
+                                             uint64_t page) {
+    struct tier_cold_entry *entry = &table->entries[table->count];
+
+    entry->page = page;
+    hash_index_insert(&table->index, hash_u64(page), (uint32_t)table->count++);
+    return entry;
+}
+
+static void tier_cold_destroy(struct tier_cold_table *table) {
+    free(table->entries);
+    hash_index_destroy(&table->index);
+}
+
+void tier_engine_destroy(struct tier_engine *engine) {
+    if (!engine) {
+        return;
+    }
+    if (engine->pidfd >= 0) {
+        close(engine->pidfd);
+    }
+    tier_cold_destroy(&engine->cold);
+    free(engine->ranked);
+    free(engine->selected);
+    free(engine);
+}
+
+static int compare_ranked_heat_desc(const void *lhs, const void *rhs) {
+    const struct heat_page *const *a = lhs;
+    const struct heat_page *const *b = rhs;
+
+    if ((*a)->heat < (*b)->heat) {
+        return 1;
+    }
+    if ((*a)->heat > (*b)->heat) {
+        return -1;
+    }
+    return (*a)->page < (*b)->page ? -1 : (*a)->page > (*b)->page;
+}
+
+static int compare_u64(const void *lhs, const void *rhs) {
+    uint64_t a = *(const uint64_t *)lhs;
+    uint64_t b = *(const uint64_t *)rhs;
+
+    return a < b ? -1 : a > b;
+}
+
+/*
+ * Classify the target's virtual pages in the heatmap the way the report does
+ * (by threshold, or by percentile among the target's own pages). The hot
+ * pages come first, hottest first, then the warm ones, then from cold_start
+ * on the cold ones. Only the hot pages are sorted: promotion walks them in
+ * order, while warm and cold pages are used as sets.
+ */
+static int tier_rank_pages(struct tier_engine *engine,
+                           const struct heatmap *heatmap,
+                           const struct profiler_options *options,
+                           size_t *count_out, size_t *hot_count_out,
+                           size_t *cold_start_out) {
+    size_t count = 0;
+    size_t hot_count;
+    size_t cold_start;
+    size_t i;
+
+    if (engine->ranked_capacity < heatmap->count) {
+        const struct heat_page **ranked;
+
+        ranked = realloc(engine->ranked, heatmap->count * sizeof(*ranked));
+        if (!ranked) {
+            return -ENOMEM;
+        }
+        engine->ranked = ranked;
+        engine->ranked_capacity = heatmap->count;
+    }
+
+    for (i = 0; i < heatmap->capacity && count < engine->ranked_capacity; i++) {
+        const struct heat_page *page = &heatmap->pages[i];
+
+        if (heatmap_slot_used(heatmap, i) &&
+            page->kind == ADDR_KIND_VIRTUAL &&
+            page->owner_pid == (uint32_t)engine->pid) {
+            engine->ranked[count++] = page;
+        }
+    }
+
+    if (options->heat_policy == HEAT_POLICY_PERCENTILE) {
+        percentile_cutoffs(options, count, &hot_count, &cold_start);
+        if (hot_count < count) {
+            select_nth(engine->ranked, sizeof(*engine->ranked), 0, count,
+                       hot_count, compare_ranked_heat_desc);
+        }
+        if (cold_start > hot_count && cold_start < count) {
+            select_nth(engine->ranked, sizeof(*engine->ranked), hot_count,
+                       count, cold_start, compare_ranked_heat_desc);
+        }
+    } else {
+        /* Hot pages to the front, cold pages to the back. */
+        hot_count = 0;
+        cold_start = count;
+        i = 0;
+        while (i < cold_start) {
+            const struct heat_page *page = engine->ranked[i];
+            enum page_state state = page_state_of(page, options);
+
+            if (state == PAGE_HOT) {
+                engine->ranked[i++] = engine->ranked[hot_count];
+                engine->ranked[hot_count++] = page;
+            } else if (state == PAGE_COLD) {
+                engine->ranked[i] = engine->ranked[--cold_start];
+                engine->ranked[cold_start] = page;
+            } else {
+                i++;
+            }
+        }
+    }
+    qsort(engine->ranked, hot_count, sizeof(*engine->ranked),
+          compare_ranked_heat_desc);
+
+    *count_out = count;
+    *hot_count_out = hot_count;
+    *cold_start_out = cold_start;
+    return 0;
+}
+
+/*
+ * Move one batch of hot pages whose current node was queried as misplaced.
+ * move_pages() reports the node each page ended up on, or -errno.
+ */
+static void tier_move_batch(struct tier_engine *engine,
+                            const struct profiler_options *options,
+                            size_t count, struct tier_stats *stats) {
+    size_t i;
+
+    if (count == 0) {
+        return;
+    }
+    if (options->tier_dry_run) {
+        stats->moved += count;
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        engine->nodes[i] = options->tier_node;
+    }
+    if (syscall(__NR_move_pages, engine->pid, (unsigned long)count,
+                engine->addrs, engine->nodes, engine->status,
+                MPOL_MF_MOVE) < 0) {
+        if (!engine->warned_move) {
+            fprintf(stderr, "warning: move_pages(%d) failed: %s\n",
+                    engine->pid, strerror(errno));
+            engine->warned_move = true;
+        }
+        stats->move_failed += count;
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        if (engine->status[i] == options->tier_node) {
+            stats->moved++;
+        } else {
+            stats->move_failed++;
+        }
+    }
+}
+
+/*
+ * Promotion: query where the hot pages live, in batches, and move the ones
+ * off --tier-node there while the round's budget lasts. Pages that are not
+ * resident (never faulted, swapped out, or unmapped since) are left alone.
+ */
+static void tier_promote(struct tier_engine *engine,
+                         const struct heatmap *heatmap,
+                         const struct profiler_options *options,
+                         size_t hot_count, uint64_t *budget,
+                         struct tier_stats *stats) {
+    size_t next = 0;
+
+    while (next < hot_count) {
+        size_t batch = hot_count - next < TIER_BATCH ? hot_count - next
+                                                     : TIER_BATCH;
+        size_t moving = 0;
+        size_t i;
+
+        for (i = 0; i < batch; i++) {
+            engine->addrs[i] = (void *)(uintptr_t)
+                (engine->ranked[next + i]->page << heatmap->page_shift);
+        }
+        if (syscall(__NR_move_pages, engine->pid, (unsigned long)batch,
+                    engine->addrs, NULL, engine->status, 0) < 0) {
+            if (!engine->warned_move) {
+                fprintf(stderr, "warning: move_pages(%d) failed: %s\n",
+                        engine->pid, strerror(errno));
+                engine->warned_move = true;
+            }
+            return;
+        }
+
+        for (i = 0; i < batch; i++) {
+            if (engine->status[i] < 0) {
+                continue;
+            }
+            if (engine->status[i] == options->tier_node) {
+                stats->on_node++;
+            } else if (*budget == 0) {
+                stats->deferred++;
+            } else {
+                engine->addrs[moving++] = engine->addrs[i];
+                (*budget)--;
+            }
+        }
+        tier_move_batch(engine, options, moving, stats);
+        next += batch;
+    }
+}
+
+/* Advise the selected pages, sorted, as few contiguous ranges as possible. */
+static void tier_advise(struct tier_engine *engine,
+                        const struct heatmap *heatmap,
+                        const struct profiler_options *options,
+                        size_t count, struct tier_stats *stats) {
+    int advice = options->tier_cold == TIER_COLD_PAGEOUT ? MADV_PAGEOUT
+                                                         : MADV_COLD;
+    uint64_t page_bytes = 1ULL << heatmap->page_shift;
+    size_t next = 0;
+
+    if (options->tier_dry_run) {
+        stats->advised += count;
+        return;
+    }
+
+    qsort(engine->selected, count, sizeof(*engine->selected), compare_u64);
+    while (next < count) {
+        size_t nr_iov = 0;
+        size_t first = next;
+        uint64_t pages;
+        long advised;
+
+        while (next < count) {
+            uint64_t addr = engine->selected[next] << heatmap->page_shift;
+            struct iovec *last = nr_iov ? &engine->iov[nr_iov - 1] : NULL;
+
+            if (last && (uintptr_t)last->iov_base + last->iov_len == addr) {
+                last->iov_len += page_bytes;
+            } else if (nr_iov < TIER_IOV_MAX) {
+                engine->iov[nr_iov].iov_base = (void *)(uintptr_t)addr;
+                engine->iov[nr_iov].iov_len = page_bytes;
+                nr_iov++;
+            } else {
+                break;
+            }
+            next++;
+        }
+
+        pages = next - first;
+        advised = syscall(__NR_process_madvise, engine->pidfd, engine->iov,
+                          nr_iov, advice, 0U);
+        if (advised < 0) {
+            if (!engine->warned_advise) {
+                fprintf(stderr, "warning: process_madvise(%d, %s) failed: %s\n",
+                        engine->pid,
+                        tier_cold_action_name(options->tier_cold),
+                        strerror(errno));
+                engine->warned_advise = true;
+            }
+            stats->advise_failed += pages;
+            continue;
+        }
+        /* A short count means the ranges after it were not advised. */
+        if ((uint64_t)advised / page_bytes < pages) {
+            stats->advise_failed += pages - (uint64_t)advised / page_bytes;
+            pages = (uint64_t)advised / page_bytes;
+        }
+        stats->advised += pages;
+    }
+}
+
+/*
+ * Demotion: carry the cold streak of every cold page over from the last
+ * round and advise those cold for --tier-cold-rounds rounds in a row, the
+ * coldest of them when the budget does not cover them all. Each page is
+ * advised once per streak, failed or not, so a target that refuses the
+ * advice is not asked again every round.
+ */
+static int tier_demote(struct tier_engine *engine,
+                       const struct heatmap *heatmap,
+                       const struct profiler_options *options,
+                       size_t count, size_t cold_start, uint64_t *budget,
+                       struct tier_stats *stats) {
+    struct tier_cold_table next;
+    size_t due = cold_start;
+    size_t first;
+    size_t selected = 0;
+    size_t i;
+
+    if (tier_cold_init(&next, count - cold_start) != 0) {
+        return -ENOMEM;
+    }
+    if (engine->selected_capacity < count - cold_start) {
+        uint64_t *pages = realloc(engine->selected,
+                                  (count - cold_start) * sizeof(*pages));
+
+        if (!pages) {
+            tier_cold_destroy(&next);
+            return -ENOMEM;
+        }
+        engine->selected = pages;
+        engine->selected_capacity = count - cold_start;
+    }
+
+    /* Gather the pages due for advice in ranked[cold_start, due). */
+    for (i = cold_start; i < count; i++) {
+        const struct heat_page *page = engine->ranked[i];
+        const struct tier_cold_entry *before = tier_cold_find(&engine->cold,
+                                                              page->page);
+        struct tier_cold_entry *entry = tier_cold_add(&next, page->page);
+
+        entry->rounds = before ? before->rounds + 1 : 1;
+        entry->advised = before && before->advised;
+        if (entry->advised || entry->rounds < options->tier_cold_rounds) {
+            continue;
+        }
+        engine->ranked[i] = engine->ranked[due];
+        engine->ranked[due++] = page;
+    }
+
+    /* Over budget: advise the coldest pages, which sort last. */
+    first = cold_start;
+    if (due - cold_start > *budget) {
+        first = due - (size_t)*budget;
+        stats->deferred += first - cold_start;
+        if (first < due) {
+            select_nth(engine->ranked, sizeof(*engine->ranked), cold_start,
+                       due, first, compare_ranked_heat_desc);
+        }
+    }
+    for (i = first; i < due; i++) {
+        uint64_t page = engine->ranked[i]->page;
+
+        engine->selected[selected++] = page;
+        tier_cold_find(&next, page)->advised = true;
+    }
+    *budget -= selected;
+
+    tier_advise(engine, heatmap, options, selected, stats);
+    tier_cold_destroy(&engine->cold);
+    engine->cold = next;
+    return 0;
+}
+
+static void tier_stats_add(struct tier_stats *dst,
+                           const struct tier_stats *src) {
+    dst->hot_pages += src->hot_pages;
+    dst->cold_pages += src->cold_pages;
+    dst->on_node += src->on_node;
+    dst->moved += src->moved;
+    dst->move_failed += src->move_failed;
+    dst->advised += src->advised;
+    dst->advise_failed += src->advise_failed;
+    dst->deferred += src->deferred;
+}
+
+static void tier_stats_print(const struct tier_stats *stats,
+                             const struct profiler_options *options,
+                             size_t page_shift, FILE *out) {
+    fprintf(out,
+            " mode=%s hot=%" PRIu64 " on_node=%" PRIu64 " moved=%" PRIu64
+            " moved_bytes=%" PRIu64 " move_failed=%" PRIu64 " cold=%" PRIu64
+            " advised=%" PRIu64 " advised_bytes=%" PRIu64
+            " advise_failed=%" PRIu64 " deferred=%" PRIu64 "\n",
+            options->tier_dry_run ? "dry-run" : "apply", stats->hot_pages,
+            stats->on_node, stats->moved, stats->moved << page_shift,
+            stats->move_failed, stats->cold_pages, stats->advised,
+            stats->advised << page_shift, stats->advise_failed,
+            stats->deferred);
+}
+
+/*
+ * One round, run by the interval reporter on its merged snapshot: classify
+ * the target's pages the way the report does (by threshold, or by
+ * percentile among the target's own pages), promote the hot ones and demote
+ * the ones that stayed cold, at most --tier-rate pages in all, hot first.
+ * In --tier-dry-run mode the same pages are counted but left in place.
+ */
+void tier_engine_run(struct tier_engine *engine, struct heatmap *heatmap,
+                     const struct profiler_options *options, uint64_t seq) {
+    struct tier_stats stats;
+    uint64_t budget = options->tier_rate ? options->tier_rate : UINT64_MAX;
+    size_t count;
+    size_t hot_count;
+    size_t cold_start;
+
+    heatmap_settle_cooling(heatmap, options);
+    if (tier_rank_pages(engine, heatmap, options, &count, &hot_count,
+                        &cold_start) != 0) {
+        return;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    stats.hot_pages = hot_count;
+    stats.cold_pages = count - cold_start;
+    if (options->tier_node >= 0) {
+        tier_promote(engine, heatmap, options, hot_count, &budget, &stats);
+    }
+    if (options->tier_cold != TIER_COLD_OFF &&
+        tier_demote(engine, heatmap, options, count, cold_start, &budget,
+                    &stats) != 0) {
+        return;
+    }
+
+    engine->page_shift = heatmap->page_shift;
+    engine->rounds++;
+    tier_stats_add(&engine->total, &stats);
+    fprintf(stderr, "tier seq=%" PRIu64, seq);
+    tier_stats_print(&stats, options, heatmap->page_shift, stderr);
+}
+
+/* Totals over all rounds; hot, cold and on_node count page-rounds. */
+void tier_engine_summary(const struct tier_engine *engine,
+                         const struct profiler_options *options, FILE *out) {
+    fprintf(out, "tier rounds=%" PRIu64, engine->rounds);
+    tier_stats_print(&engine->total, options, engine->page_shift, out);
+}
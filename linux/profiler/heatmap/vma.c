@@ -0,0 +1,623 @@
+#include "profiler.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+
+#define VMA_INITIAL_CAPACITY 64
+/* A miss re-reads /proc/<pid>/maps at most this often per process. */
+#define VMA_REFRESH_NS (50ULL * 1000ULL * 1000ULL)
+/*
+ * Pages keep record ids, so records are never reused; a process that keeps
+ * creating new mappings stops getting new ones past this many.
+ */
+#define VMA_MAX_RECORDS (1U << 20)
+
+/* The sorted snapshot of one process' mappings, as record ids. */
+struct vma_process {
+    pid_t pid;
+    uint32_t *ids;
+    size_t count;
+    uint64_t loaded_ns;
+    bool gone;
+};
+
+/* --sites: the symbols of one interned path, loaded on first use. */
+struct vma_binary {
+    struct elf_symbols *symbols;
+    bool loaded;
+};
+
+/*
+ * Records are append-only and never move once handed out by
+ * vma_index_snapshot() (the array is copied), and interned paths live until
+ * the index is destroyed, so a report can work on a snapshot while sampling
+ * keeps resolving new pages. `lock` is taken by the drain workers, so
+ * neither /proc/<pid>/maps nor an ELF file is read while holding it; the
+ * report's symbol tables have their own `binaries_lock`.
+ */
+struct vma_index {
+    pthread_mutex_t lock;
+    struct vma_record *records;
+    size_t nr_records;
+    size_t records_capacity;
+    struct vma_process *processes;
+    size_t nr_processes;
+    size_t processes_capacity;
+    struct hash_index process_index;
+    char **paths;
+    size_t nr_paths;
+    size_t paths_capacity;
+    struct hash_index path_index;
+    pthread_mutex_t binaries_lock;
+    struct vma_binary *binaries;
+    size_t binaries_capacity;
+};
+
+static uint64_t vma_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t vma_hash_string(const char *text) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*text) {
+        hash ^= (unsigned char)*text++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t vma_process_hash_at(const void *entries, size_t i) {
+    const struct vma_process *processes = entries;
+
+    return hash_u64((uint64_t)processes[i].pid);
+}
+
+static uint64_t vma_path_hash_at(const void *entries, size_t i) {
+    char *const *paths = entries;
+
+    return vma_hash_string(paths[i]);
+}
+
+int vma_index_create(struct vma_index **index_out) {
+    struct vma_index *index = calloc(1, sizeof(*index));
+
+    if (!index) {
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&index->lock, NULL);
+    pthread_mutex_init(&index->binaries_lock, NULL);
+    /* Record id 0 means "no mapping". */
+    index->records = calloc(VMA_INITIAL_CAPACITY, sizeof(*index->records));
+    if (!index->records) {
+        vma_index_destroy(index);
+        return -ENOMEM;
+    }
+    index->records_capacity = VMA_INITIAL_CAPACITY;
+    index->nr_records = 1;
+    index->records[0].path = "";
+    *index_out = index;
+    return 0;
+}
+
+void vma_index_destroy(struct vma_index *index) {
+    size_t i;
+
+    if (!index) {
+        return;
+    }
+    for (i = 0; i < index->nr_processes; i++) {
+        free(index->processes[i].ids);
+    }
+    for (i = 0; i < index->nr_paths; i++) {
+        free(index->paths[i]);
+    }
+    for (i = 0; i < index->binaries_capacity; i++) {
+        elf_symbols_destroy(index->binaries[i].symbols);
+    }
+    free(index->binaries);
+    free(index->processes);
+    hash_index_destroy(&index->process_index);
+    free(index->paths);
+    hash_index_destroy(&index->path_index);
+    free(index->records);
+    pthread_mutex_destroy(&index->binaries_lock);
+    pthread_mutex_destroy(&index->lock);
+    free(index);
+}
+
+static struct vma_process *vma_find_process(struct vma_index *index,
+                                            pid_t pid) {
+    size_t slot;
+
+    if (!index->process_index.slots) {
+        return NULL;
+    }
+    slot = hash_index_slot(&index->process_index, hash_u64((uint64_t)pid));
+    while (index->process_index.slots[slot] != HASH_INDEX_EMPTY) {
+        struct vma_process *process =
+            &index->processes[index->process_index.slots[slot]];
+
+        if (process->pid == pid) {
+            return process;
+        }
+        slot = hash_index_next(&index->process_index, slot);
+    }
+    return NULL;
+}
+
+static struct vma_process *vma_add_process(struct vma_index *index,
+                                           pid_t pid) {
+    struct vma_process *process;
+    bool grown = false;
+
+    if (index->nr_processes == index->processes_capacity) {
+        size_t capacity = index->processes_capacity ?
+                          index->processes_capacity * 2 : VMA_INITIAL_CAPACITY;
+        struct vma_process *processes = realloc(index->processes,
+                                                capacity * sizeof(*processes));
+
+        if (!processes) {
+            return NULL;
+        }
+        index->processes = processes;
+        index->processes_capacity = capacity;
+        grown = true;
+    }
+
+    process = &index->processes[index->nr_processes++];
+    memset(process, 0, sizeof(*process));
+    process->pid = pid;
+    if (!grown) {
+        hash_index_insert(&index->process_index, hash_u64((uint64_t)pid),
+                          (uint32_t)(index->nr_processes - 1));
+    } else if (hash_index_resize(&index->process_index,
+                                 index->processes_capacity * 2,
+                                 index->nr_processes, vma_process_hash_at,
+                                 index->processes) != 0) {
+        /* Keep the old index consistent with the capacity it was sized for. */
+        index->nr_processes--;
+        index->processes_capacity /= 2;
+        return NULL;
+    }
+    return process;
+}
+
+/* Intern a path; returns its id or UINT32_MAX when out of memory. */
+static uint32_t vma_intern_path(struct vma_index *index, const char *path) {
+    size_t slot;
+    bool grown = false;
+    char *copy;
+
+    if (index->path_index.slots) {
+        slot = hash_index_slot(&index->path_index, vma_hash_string(path));
+        while (index->path_index.slots[slot] != HASH_INDEX_EMPTY) {
+            uint32_t id = index->path_index.slots[slot];
+
+            if (strcmp(index->paths[id], path) == 0) {
+                return id;
+            }
+            slot = hash_index_next(&index->path_index, slot);
+        }
+    }
+
+    if (index->nr_paths == index->paths_capacity) {
+        size_t capacity = index->paths_capacity ? index->paths_capacity * 2 :
+                          VMA_INITIAL_CAPACITY;
+        char **paths = realloc(index->paths, capacity * sizeof(*paths));
+
+        if (!paths) {
+            return UINT32_MAX;
+        }
+        index->paths = paths;
+        index->paths_capacity = capacity;
+        grown = true;
+    }
+
+    copy = strdup(path);
+    if (!copy) {
+        return UINT32_MAX;
+    }
+    index->paths[index->nr_paths++] = copy;
+    if (!grown) {
+        hash_index_insert(&index->path_index, vma_hash_string(copy),
+                          (uint32_t)(index->nr_paths - 1));
+    } else if (hash_index_resize(&index->path_index, index->paths_capacity * 2,
+                                 index->nr_paths, vma_path_hash_at,
+                                 index->paths) != 0) {
+        free(index->paths[--index->nr_paths]);
+        index->paths_capacity /= 2;
+        return UINT32_MAX;
+    }
+    return (uint32_t)(index->nr_paths - 1);
+}
+
+static enum vma_kind vma_classify(const char *path, const char *perms) {
+    if (path[0] == '\0' || strncmp(path, "[anon:", 6) == 0) {
+        return perms[3] == 's' ? VMA_SHM : VMA_ANON;
+    }
+    if (strcmp(path, "[heap]") == 0) {
+        return VMA_HEAP;
+    }
+    if (strncmp(path, "[stack", 6) == 0) {
+        return VMA_STACK;
+    }
+    if (strncmp(path, "/dev/shm/", 9) == 0 || strncmp(path, "/SYSV", 5) == 0 ||
+        strncmp(path, "/memfd:", 7) == 0 || strncmp(path, "/dev/zero", 9) == 0) {
+        return VMA_SHM;
+    }
+    if (path[0] == '/') {
+        return VMA_FILE;
+    }
+    return VMA_SPECIAL;
+}
+
+/*
+ * Reuse the record of an unchanged mapping from the previous snapshot so a
+ * page resolved before a refresh still points at the same mapping.
+ */
+static uint32_t vma_find_previous(const struct vma_index *index,
+                                  const struct vma_process *process,
+                                  const struct vma_record *candidate) {
+    size_t lo = 0;
+    size_t hi = process->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct vma_record *record = &index->records[process->ids[mid]];
+
+        if (record->start < candidate->start) {
+            lo = mid + 1;
+        } else if (record->start > candidate->start) {
+            hi = mid;
+        } else {
+            if (record->end == candidate->end &&
+                record->offset == candidate->offset &&
+                record->path_id == candidate->path_id &&
+                strcmp(record->perms, candidate->perms) == 0) {
+                return process->ids[mid];
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static uint32_t vma_append_record(struct vma_index *index,
+                                  const struct vma_record *record) {
+    if (index->nr_records == index->records_capacity) {
+        size_t capacity = index->records_capacity * 2;
+        struct vma_record *records = realloc(index->records,
+                                             capacity * sizeof(*records));
+
+        if (!records) {
+            return 0;
+        }
+        index->records = records;
+        index->records_capacity = capacity;
+    }
+    index->records[index->nr_records] = *record;
+    return (uint32_t)index->nr_records++;
+}
+
+/* Read all of /proc/<pid>/maps; -ENOENT once the process is gone. */
+static int vma_read_maps(pid_t pid, char **maps_out, size_t *len_out) {
+    char path[PATH_BUFFER_SIZE];
+    char *maps = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+    int fd;
+    int err;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", (int)pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    for (;;) {
+        ssize_t n;
+
+        if (capacity - len < PATH_BUFFER_SIZE) {
+            size_t grown = capacity ? capacity * 2 : 16384;
+            char *bigger = realloc(maps, grown);
+
+            if (!bigger) {
+                err = -ENOMEM;
+                goto fail;
+            }
+            maps = bigger;
+            capacity = grown;
+        }
+        n = read(fd, maps + len, capacity - len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err = -errno;
+            goto fail;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += (size_t)n;
+    }
+    close(fd);
+    maps[len] = '\0';
+    *maps_out = maps;
+    *len_out = len;
+    return 0;
+
+fail:
+    close(fd);
+    free(maps);
+    return err;
+}
+
+/*
+ * Turn the text of /proc/<pid>/maps into a sorted array of record ids. The
+ * kernel lists mappings in address order and they never overlap, so the
+ * file order is already the interval order.
+ */
+static void vma_load_process(struct vma_index *index,
+                             struct vma_process *process,
+                             char *maps, size_t maps_len) {
+    char *maps_end = maps + maps_len;
+    char *line;
+    char *next;
+    uint32_t *ids = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    for (line = maps; line < maps_end; line = next) {
+        struct vma_record record;
+        unsigned long long start;
+        unsigned long long end;
+        unsigned long long offset;
+        char perms[5];
+        char *name;
+        size_t len;
+        int consumed = 0;
+        uint32_t id;
+
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        } else {
+            next = maps_end;
+        }
+        if (sscanf(line, "%llx-%llx %4s %llx %*s %*s %n", &start, &end, perms,
+                   &offset, &consumed) < 4 || consumed == 0) {
+            continue;
+        }
+        name = line + consumed;
+        len = strlen(name);
+        while (len > 0 && name[len - 1] == ' ') {
+            name[--len] = '\0';
+        }
+
+        memset(&record, 0, sizeof(record));
+        record.start = start;
+        record.end = end;
+        record.offset = offset;
+        record.pid = process->pid;
+        memcpy(record.perms, perms, sizeof(record.perms));
+        record.path_id = vma_intern_path(index, name);
+        if (record.path_id == UINT32_MAX) {
+            break;
+        }
+        record.path = index->paths[record.path_id];
+        record.kind = vma_classify(record.path, record.perms);
+
+        id = vma_find_previous(index, process, &record);
+        if (id == 0) {
+            if (index->nr_records >= VMA_MAX_RECORDS) {
+                continue;
+            }
+            id = vma_append_record(index, &record);
+            if (id == 0) {
+                break;
+            }
+        }
+
+        if (count == capacity) {
+            size_t grown = capacity ? capacity * 2 : VMA_INITIAL_CAPACITY;
+            uint32_t *bigger = realloc(ids, grown * sizeof(*ids));
+
+            if (!bigger) {
+                break;
+            }
+            ids = bigger;
+            capacity = grown;
+        }
+        ids[count++] = id;
+    }
+
+    free(process->ids);
+    process->ids = ids;
+    process->count = count;
+}
+
+static uint32_t vma_search(const struct vma_index *index,
+                           const struct vma_process *process, uint64_t addr) {
+    size_t lo = 0;
+    size_t hi = process->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct vma_record *record = &index->records[process->ids[mid]];
+
+        if (addr < record->start) {
+            hi = mid;
+        } else if (addr >= record->end) {
+            lo = mid + 1;
+        } else {
+            return process->ids[mid];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Map (pid, virtual address) to a mapping record id, 0 if unknown. The
+ * process' maps are read on first use and re-read when an address falls
+ * outside the snapshot, so mappings created after the first sample are
+ * picked up, at most once per VMA_REFRESH_NS. The file is read with the
+ * lock dropped; the worker that claims a refresh does the reading, others
+ * keep using the current snapshot meanwhile. A process that is gone keeps
+ * its last snapshot.
+ */
+uint32_t vma_index_resolve(struct vma_index *index, pid_t pid, uint64_t addr) {
+    struct vma_process *process;
+    char *maps = NULL;
+    size_t maps_len = 0;
+    uint32_t id = 0;
+    bool load = false;
+    uint64_t now_ns;
+    int err;
+
+    if (pid <= 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&index->lock);
+    now_ns = vma_now_ns();
+    process = vma_find_process(index, pid);
+    if (!process) {
+        process = vma_add_process(index, pid);
+        load = process != NULL;
+    } else {
+        id = vma_search(index, process, addr);
+        load = id == 0 && !process->gone &&
+               now_ns - process->loaded_ns >= VMA_REFRESH_NS;
+    }
+    if (load) {
+        process->loaded_ns = now_ns;
+    }
+    pthread_mutex_unlock(&index->lock);
+    if (!load) {
+        return id;
+    }
+
+    err = vma_read_maps(pid, &maps, &maps_len);
+
+    pthread_mutex_lock(&index->lock);
+    process = vma_find_process(index, pid);
+    if (process) {
+        if (err == 0) {
+            vma_load_process(index, process, maps, maps_len);
+        } else if (err != -ENOMEM) {
+            process->gone = true;
+        }
+        id = vma_search(index, process, addr);
+    }
+    pthread_mutex_unlock(&index->lock);
+    free(maps);
+    return id;
+}
+
+/*
+ * Copy out the records (indexed by id, entry 0 unused) for a report. Path
+ * pointers in the copy stay valid until vma_index_destroy().
+ */
+int vma_index_snapshot(struct vma_index *index, struct vma_record **records_out,
+                       size_t *count_out, size_t *nr_paths_out) {
+    struct vma_record *records;
+
+    pthread_mutex_lock(&index->lock);
+    records = malloc(index->nr_records * sizeof(*records));
+    if (records) {
+        memcpy(records, index->records, index->nr_records * sizeof(*records));
+        *count_out = index->nr_records;
+        *nr_paths_out = index->nr_paths;
+    }
+    pthread_mutex_unlock(&index->lock);
+
+    if (!records) {
+        return -ENOMEM;
+    }
+    *records_out = records;
+    return 0;
+}
+
+/* Called with binaries_lock held, which no drain worker ever takes. */
+static struct vma_binary *vma_binary_get(struct vma_index *index,
+                                         uint32_t path_id, const char *path) {
+    struct vma_binary *binary;
+
+    if (path_id >= index->binaries_capacity) {
+        size_t capacity = index->binaries_capacity ?
+                          index->binaries_capacity : VMA_INITIAL_CAPACITY;
+        struct vma_binary *binaries;
+
+        while (capacity <= path_id) {
+            capacity *= 2;
+        }
+        binaries = realloc(index->binaries,
+                                              capacity * sizeof(*binaries));
+
+        if (!binaries) {
+            return NULL;
+        }
+        memset(binaries + index->binaries_capacity, 0,
+               (capacity - index->binaries_capacity) * sizeof(*binaries));
+        index->binaries = binaries;
+        index->binaries_capacity = capacity;
+    }
+
+    binary = &index->binaries[path_id];
+    if (!binary->loaded) {
+        binary->loaded = true;
+        if (elf_symbols_load(path, &binary->symbols) != 0) {
+            binary->symbols = NULL;
+        }
+    }
+    return binary;
+}
+
+/*
+ * --sites: name the function holding addr in mapping `id` as "name+0x1f".
+ * The binary's symbols are read once, on its first lookup; a binary that
+ * cannot be read (gone, stripped, not ELF64) is never retried. *path_out is
+ * the mapping's path ("" without one) and stays valid until
+ * vma_index_destroy(). Returns -ENOENT when no symbol covers addr.
+ */
+int vma_index_symbolize(struct vma_index *index, uint32_t id, uint64_t addr,
+                        char *symbol, size_t symbol_len,
+                        const char **path_out) {
+    struct vma_record record;
+    const struct vma_binary *binary;
+    const char *name;
+    uint64_t delta;
+    int ret = -ENOENT;
+
+    pthread_mutex_lock(&index->lock);
+    if (id == 0 || id >= index->nr_records) {
+        *path_out = "";
+        pthread_mutex_unlock(&index->lock);
+        return -ENOENT;
+    }
+    record = index->records[id];
+    pthread_mutex_unlock(&index->lock);
+
+    *path_out = record.path;
+    if (record.path[0] != '/' || addr < record.start || addr >= record.end) {
+        return -ENOENT;
+    }
+    pthread_mutex_lock(&index->binaries_lock);
+    binary = vma_binary_get(index, record.path_id, record.path);
+    if (binary && binary->symbols &&
+        elf_symbols_lookup(binary->symbols,
+                           addr - record.start + record.offset, &name,
+                           &delta)) {
+        snprintf(symbol, symbol_len, "%s+0x%" PRIx64, name, delta);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&index->binaries_lock);
+    return ret;
+}